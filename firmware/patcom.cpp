@@ -5,7 +5,22 @@
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
 #include <Preferences.h>
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h>
+#include <memory>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <esp_crt_bundle.h>
+#include <esp_sleep.h>
+#include <esp_heap_caps.h>
+#include <esp_ota_ops.h>
+#include <driver/gpio.h>
+#include <driver/rtc_io.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/version.h>
 
 // Configuration constants
 const char* DEVICE_NAME = "PATCOM";
@@ -14,19 +29,212 @@ const int CONFIG_SIZE = 8192;
 // Heartbeat removed for simplification
 const unsigned long BUTTON_DEBOUNCE = 50;   // Reduced for better responsiveness
 const unsigned long BUTTON_HOLD_TIME = 100; // Minimum hold time for reliable detection
+const unsigned long BUTTON_STUCK_TIME = 2000; // Stop tracking a press held this long past the long-press time
+const int BUTTON_EDGE_BUFFER_SIZE = 64;      // Edges captured by the GPIO ISR (power of two)
+const unsigned long LOOP_IDLE_TIMEOUT = 10;  // Max ms loop() sleeps waiting for button edges
+
+// Gesture configuration - presses keep slots 0-7, gestures add their own action slots after them
+const int MAX_GESTURES = 8;                        // Long-press, double-tap and chord bindings
+const int ACTION_SLOTS = 8 + MAX_GESTURES;
+const uint16_t GESTURE_DEFAULT_LONG_PRESS = 600;   // ms held before a press becomes a long-press
+const uint16_t GESTURE_DEFAULT_DOUBLE_TAP = 300;   // ms after the first tap in which a second one counts
+const uint16_t GESTURE_DEFAULT_CHORD_WINDOW = 80;  // ms in which every button of a chord must go down
 const unsigned long STATUS_LED_BLINK = 500;
 
+// Action worker configuration
+const int ACTION_QUEUE_LENGTH = 16;          // Pending presses buffered while an action is in flight
+const uint32_t ACTION_WORKER_STACK = 8192;   // mbedTLS handshakes need a generous stack
+const UBaseType_t ACTION_WORKER_PRIORITY = 1;
+const BaseType_t ACTION_WORKER_CORE = (ARDUINO_RUNNING_CORE == 0) ? 1 : 0;  // Opposite core to loop()
+const uint8_t ACTION_EVENT_POOL_WARMUP = 0xFF;  // Queue marker: pre-connect configured hosts
+
+// HTTP connection pool configuration
+const int HTTP_POOL_SIZE = 4;                              // Keep-alive sockets shared by all buttons
+const unsigned long HTTP_POOL_MAINTENANCE_INTERVAL = 15000; // How often idle sockets are checked
+const uint16_t HTTP_TIMEOUT = 5000;
+const int HTTP_ERROR_INVALID_ACTION = -100;               // Action failed to compile
+const int HTTP_ERROR_OFFLINE = -101;                      // WiFi down when the action ran
+const int HTTP_ERROR_SKIPPED = -102;                      // Earlier stage failed with stop_on_error
+const int ACTION_RESULT_BATCHED = 2;                      // Webhook event added to a pending batch
+const int ACTION_RESULT_SENT = 1;                         // MQTT/UDP result once delivered (PUBACK for QoS 1)
+const int MAX_CHAIN_ACTIONS = 4;                          // Targets per button, at most HTTP_POOL_SIZE so a stage fits the pool
+
+// Retry queue configuration - failed or offline sends are kept and retried with backoff
+const int RETRY_QUEUE_LENGTH = 16;                 // Oldest entry is dropped when full
+const int RETRY_MAX_ATTEMPTS = 8;                  // Failed sends before an entry is given up
+const unsigned long RETRY_INITIAL_DELAY = 2000;    // Doubled per failed attempt, plus up to 25% jitter
+const unsigned long RETRY_MAX_DELAY = 300000;
+const int RETRY_BATCH_SIZE = 4;                    // Entries sent together, at most HTTP_POOL_SIZE
+const unsigned long RETRY_BATCH_SPACING = 250;     // Gap between batches so a reconnect flush never floods the link
+const unsigned long RETRY_PERSIST_DELAY = 5000;    // Queue changes are batched into one flash write
+const uint32_t RETRY_QUEUE_MAGIC = 0x51525450;     // "PTRQ"
+const uint16_t RETRY_QUEUE_VERSION = 1;            // Bump whenever RetryEntry changes
+
+// Webhook batching configuration
+const int WEBHOOK_BATCH_SLOTS = 4;                   // Batched webhook targets buffered at once
+const size_t WEBHOOK_BATCH_BUFFER = 1536;            // One pending JSON array, closing bracket included
+const uint8_t WEBHOOK_BATCH_DEFAULT_EVENTS = 10;
+const uint16_t WEBHOOK_BATCH_DEFAULT_AGE = 30;       // Seconds before a partial batch is sent
+
+// Metrics configuration - latency histograms use fixed bounds, quantiles are read from the buckets
+const int METRIC_BUCKETS = 15;      // Finite bounds; one more bucket counts everything above
+const uint32_t METRIC_BUCKET_BOUNDS_US[METRIC_BUCKETS] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+const int METRIC_HOSTS = 8;         // Hosts tracked; the least used one is recycled when full
+
+// Benchmark and soak configuration - both run on the device over serial, against the live config
+const uint16_t BENCH_DEFAULT_RUNS = 100;
+const uint16_t BENCH_MAX_RUNS = 1000;              // Keeps BENCH from starving loop() for long
+const int BENCH_BOUNCES = 3;                       // Extra falling edges in one synthetic press
+const unsigned long SOAK_DRAIN_TIMEOUT = 30000;    // Wait for outstanding results after the last press
+const unsigned long SOAK_PROGRESS_INTERVAL = 10000;
+
+// MQTT action configuration
+const int MQTT_MAX_SESSIONS = 2;                   // Persistent broker connections shared by all buttons
+const uint16_t MQTT_KEEPALIVE = 60;                // Seconds, announced in CONNECT
+const unsigned long MQTT_PING_INTERVAL = 30000;    // Idle time before a PINGREQ keeps the session open
+const size_t MQTT_PACKET_MAX = 768;                // Largest CONNECT/PUBLISH built, topic + payload included
+const size_t MQTT_HEADER_MAX = 5;                  // Fixed header: type byte + up to 4 length bytes
+
+// TLS configuration for https:// and mqtts:// targets
+const int TLS_SESSION_CACHE_SIZE = HTTP_POOL_SIZE + MQTT_MAX_SESSIONS;  // One resumable session per pooled socket
+const size_t TLS_FINGERPRINT_SIZE = 32;            // SHA-256 of the server certificate (DER)
+
+// WiFi connection manager configuration
+const unsigned long WIFI_FAST_CONNECT_TIMEOUT = 3000;  // Attempt using cached BSSID/channel
+const unsigned long WIFI_CONNECT_TIMEOUT = 15000;      // Attempt with a full channel scan
+const unsigned long WIFI_RETRY_INITIAL = 1000;         // First backoff delay, doubled per failure
+const unsigned long WIFI_RETRY_MAX = 60000;
+const char* CONFIG_AP_SSID = "PATCOM-Config";
+const char* CONFIG_AP_PASSWORD = "patcom123";
+
+// UDP discovery/config protocol (see src/services/DiscoveryService.ts)
+const uint16_t DISCOVERY_PORT = 12345;              // discover_devices in, device_discovery/device_response out
+const uint16_t CONFIG_PORT = 12346;                 // get_config/set_config in, config_response/config_update_response out
+const unsigned long DISCOVERY_ANNOUNCE_INTERVAL = 60000;  // Unsolicited broadcast while discoverable
+const size_t UDP_PACKET_MAX = 1460;                 // Largest request accepted (one unfragmented datagram)
+const size_t UDP_CONFIG_DOC_SIZE = 4 * UDP_PACKET_MAX;  // Parsed request, or the config reply before it is measured
+
+// Serial command configuration
+const size_t SERIAL_LINE_MAX = 4096;         // Longest command line, SET_CONFIG payload included
+const size_t SERIAL_RX_BUFFER_SIZE = 4096;   // Driver buffer so a full config can land between loop() passes
+const int SERIAL_READ_BUDGET = 256;          // Max bytes consumed per loop() pass
+const unsigned long SERIAL_TEXT_BAUD = 115200;
+const unsigned long SERIAL_FRAMED_BAUD = 921600;       // Default once FRAMED is negotiated
+const unsigned long SERIAL_FRAME_TIMEOUT = 200;        // Inter-byte gap that abandons a partial frame
+const size_t CONSOLE_LINE_MAX = 2048;                  // Output line buffered per frame, longer lines are split
+
+// Framed serial protocol: SOF, type, id (u16 LE), length (u16 LE), payload, CRC32 (LE) over type..payload
+const uint8_t FRAME_SOF = 0xA5;
+const uint8_t FRAME_COMMAND = 0x01;   // Host -> device: one text command line
+const uint8_t FRAME_RESPONSE = 0x02;  // RESPONSE:/DEVICE_INFO:/IDENTIFY: line, id of the request
+const uint8_t FRAME_EVENT = 0x03;     // EVENT: line, id 0
+const uint8_t FRAME_LOG = 0x04;       // Any other output - debug channel
+const uint8_t FRAME_ACK = 0x05;       // Command with this id finished
+const uint8_t FRAME_NACK = 0x06;      // Frame rejected, payload is the reason
+const size_t FRAME_HEADER_SIZE = 5;   // type + id + length
+
+// Power governor configuration - boost for work, drop to the lowest clock the radio allows when idle
+const uint32_t CPU_FREQ_BOOST = 240;             // Action dispatch, TLS handshakes, config uploads
+const uint32_t CPU_FREQ_BOOST_LOW_POWER = 160;   // Boost ceiling while power is critical
+const uint32_t CPU_FREQ_IDLE = 80;               // Lowest clock WiFi runs at
+const uint32_t CPU_FREQ_RADIO_OFF = 40;          // Idle with the radio off (XTAL clock)
+const unsigned long POWER_BOOST_LINGER = 1500;   // Boost kept after the last hold, covers follow-up presses
+
+// Battery monitor configuration - 9V cell through a divider on BATTERY_PIN
+const unsigned long BATTERY_SAMPLE_INTERVAL = 2000;  // One burst per interval from the battery task
+const int BATTERY_OVERSAMPLE = 16;                   // ADC reads per burst
+const int BATTERY_TRIM = 4;                          // Lowest and highest reads dropped (WiFi/ADC2 glitches)
+const float BATTERY_DIVIDER_RATIO = 4.03f;           // (R1 + R2) / R2 of the sense divider, 100k/33k
+const float BATTERY_EMA_ALPHA = 0.1f;                // Per burst, ~20s time constant
+const float BATTERY_ABSENT_VOLTAGE = 3.0f;           // Below this no cell is fitted (USB powered)
+const uint8_t BATTERY_LOW_PERCENT = 20;              // LEDs at half brightness, telemetry every 4th interval
+const uint8_t BATTERY_CRITICAL_PERCENT = 5;          // Low power mode, LEDs at a quarter, telemetry every 12th
+const uint8_t BATTERY_HYSTERESIS_PERCENT = 5;        // Recovery needs this much above the threshold
+const uint32_t BATTERY_TASK_STACK = 3072;
+const int BATTERY_CURVE_POINTS = 7;
+const float BATTERY_CURVE_VOLTS[BATTERY_CURVE_POINTS] = {9.6f, 9.0f, 8.4f, 7.8f, 7.2f, 6.6f, 6.0f};  // 9V alkaline, light load
+const uint8_t BATTERY_CURVE_PERCENT[BATTERY_CURVE_POINTS] = {100, 85, 65, 45, 25, 10, 0};
+
+// LED engine configuration - each button LED owns one LEDC channel
+const uint32_t LED_PWM_FREQUENCY = 5000;  // Hz, above visible flicker
+const uint8_t LED_PWM_RESOLUTION = 10;    // Bits - gamma needs more than 8 to keep dim levels smooth
+const uint16_t LED_DUTY_MAX = (1 << LED_PWM_RESOLUTION) - 1;
+const float LED_GAMMA = 2.2f;             // Perceived brightness curve
+const int LED_FADE_TIME = 120;            // ms hardware fade for toggles and brightness changes
+const size_t LED_STATE_SCAN_SIZE = 128;   // Response body bytes searched for a "state" field
+
+// OTA configuration - images stream straight into the inactive app partition, nothing is buffered
+const unsigned long OTA_VERIFY_TIMEOUT = 90000;    // A new image that is not healthy by then is rolled back
+const unsigned long OTA_HEALTHY_UPTIME = 15000;    // and it must have stayed up at least this long
+const size_t OTA_SHA256_SIZE = 32;
+const char* OTA_IMAGE_KEY = "otaImage";            // NVS record of the last image written, until it confirms
+
+// Idle sleep configuration - only on battery, USB power keeps the device reachable
+const uint16_t SLEEP_DEFAULT_TIMEOUT = 300;          // Idle seconds before sleeping, 0 disables
+const unsigned long SLEEP_WAKE_NETWORK_WAIT = 4000;  // Wake press waits this long for WiFi before failing offline
+const unsigned long SLEEP_WIFI_SETTLE = 20;          // Lets the event task see the radio stop before sleeping
+
+// Event stream (SSE) configuration
+const int EVENT_STREAM_MAX_CLIENTS = 4;
+const unsigned long TELEMETRY_INTERVAL = 5000;  // Telemetry push, doubles as keep-alive for idle streams
+const size_t EVENT_BUFFER_SIZE = 768;           // One serialized event payload
+const unsigned long HEAP_SAMPLE_INTERVAL = 5000;  // Heap low-water marks are sampled this often
+const unsigned long NETWORK_RESTART_DELAY = 1000; // Lets the response reach the client first
+const size_t CONFIG_UPLOAD_MAX = 6144;            // Largest POST /api/config body accepted
+const size_t STATUS_MESSAGE_MAX = 96;             // Result message of a config upload or button update
+const size_t CONFIG_UPLOAD_DOC_SIZE = 12288;      // Parsed upload, room for every button and gesture carrying a chain
+const size_t CONFIG_JSON_PIECE_SIZE = 1024;       // One rendered /api/config piece (a button at most)
+const int CONFIG_JSON_PIECES = 10 + MAX_GESTURES;  // Header, 8 buttons, gestures, trailer
+
+// Config storage configuration
+const size_t ACTION_DATA_MAX = 512;               // Largest action config of one button or gesture
+const size_t API_KEY_VALUE_MAX = 128;             // Largest API key value
+const size_t CONFIG_STORE_SIZE = 6144;            // Action configs and API key values, packed back to back
+const int COMPILED_ACTION_POOL = 24;              // Compiled targets shared by every action slot
+const uint32_t CONFIG_BLOB_MAGIC = 0x4D4F4350;    // "PCOM"
+const uint16_t CONFIG_BLOB_VERSION = 1;           // Bump whenever the encoded layout changes
+const size_t CONFIG_BLOB_MAX_SIZE = CONFIG_STORE_SIZE + 2048;  // A full store plus every fixed-size field
+const char* CONFIG_BLOB_KEYS[2] = {"cfgA", "cfgB"};  // A/B slots, newest valid sequence wins
+
+// Dirty tracking bits - one per config section, one per action slot
+const uint32_t CONFIG_DIRTY_DEVICE = 1UL << 0;
+const uint32_t CONFIG_DIRTY_NETWORK = 1UL << 1;
+const uint32_t CONFIG_DIRTY_API_KEYS = 1UL << 2;
+const uint32_t CONFIG_DIRTY_BUTTONS = ((1UL << ACTION_SLOTS) - 1) << 8;
+#define CONFIG_DIRTY_BUTTON(i) (1UL << (8 + (i)))
+
 // Pin assignments
 const int buttonPins[8] = {2, 3, 4, 5, 6, 7, 8, 9};
 const int ledPins[8] = {A0, A1, A2, A3, A4, A5, A6, A7};
 const int BATTERY_PIN = 17;
 const int STATUS_LED_PIN = 13;
 
+// Gesture bound to action slot 8 + n
+enum GestureType {
+  GESTURE_NONE = 0,  // Unused slot
+  GESTURE_LONG,
+  GESTURE_DOUBLE,
+  GESTURE_CHORD,
+  GESTURE_TYPE_COUNT
+};
+#define GESTURE_BIT(type) (1 << (type))
+
 // Action types
 enum ActionType {
   ACTION_NONE = 0,
   ACTION_HTTP = 1,
-  ACTION_WEBHOOK = 2
+  ACTION_WEBHOOK = 2,
+  ACTION_MQTT = 3,
+  ACTION_UDP = 4
+};
+
+// HTTP methods supported by compiled actions
+enum ActionMethod {
+  METHOD_GET = 0,
+  METHOD_POST = 1,
+  METHOD_PUT = 2
 };
 
 // Device types for multi-device support
@@ -40,10 +248,16 @@ enum DeviceType {
 struct ButtonConfig {
   char name[32];
   ActionType action;
-  char actionData[256];  // JSON string for action parameters
+  const char* actionData;  // JSON for action parameters or an "actions" chain; in configStore, see storeConfigString()
   bool enabled;
 };
 
+// Which buttons trigger action slot 8 + n; the action itself is a ButtonConfig like any press
+struct GestureBinding {
+  GestureType type;
+  uint8_t buttons;  // Bit per button - exactly one for long/double, two or more for a chord
+};
+
 // Network configuration structure
 struct NetworkConfig {
   char ssid[64];
@@ -58,48 +272,580 @@ struct NetworkConfig {
 // Device configuration structure
 struct DeviceConfig {
   char deviceName[32];
-  char deviceId[16];
+  char deviceId[24];  // "PATCOM-" and the 48-bit eFuse MAC in hex
   DeviceType deviceType;
   int brightness;
   bool discoverable;
   char firmwareVersion[16];
   bool autoSync;
+  bool persistRetries;  // Keep the retry queue in flash across reboots
+  uint16_t sleepTimeout;  // Idle seconds on battery before sleeping, 0 = never
+  bool deepSleep;         // Deep instead of light sleep: lowest draw, but the wake press boots first
+  uint16_t longPressMs;   // Gesture timing, see GESTURE_DEFAULT_*
+  uint16_t doubleTapMs;
+  uint16_t chordWindowMs;
   char configServerUrl[128];
 };
 
 // API Keys configuration structure (universal key-value storage)
 struct ApiKeyEntry {
   char name[32];
-  char value[128];
+  const char* value;  // In configStore, like actionData
+  uint32_t hash;      // apiKeyHash() of name, for apiKeyIndex
+  bool active;
+};
+
+const int MAX_API_KEYS = 32;           // One bit each in CompiledAction::keyRefs
+const int API_KEY_INDEX_SIZE = 64;     // Open-addressed buckets, a power of two at least twice MAX_API_KEYS
+const size_t API_KEY_TEMPLATE_MAX = 256;  // A URL, header or credential after {{key:NAME}} expansion
+
+// WiFi connection manager states
+enum WiFiState {
+  WIFI_STATE_IDLE = 0,     // No credentials configured
+  WIFI_STATE_CONNECTING,
+  WIFI_STATE_CONNECTED,
+  WIFI_STATE_BACKOFF       // Waiting before the next attempt
+};
+
+// Last good access point, persisted so reconnects can skip the channel scan
+struct __attribute__((packed)) WiFiFastReconnect {
+  uint32_t ssidCrc;  // Cache only applies to the SSID it was recorded for
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+
+// Header in front of each config blob slot
+struct __attribute__((packed)) ConfigBlobHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length;    // Encoded payload bytes following the header
+  uint32_t sequence;  // Incremented on every commit
+  uint32_t crc;       // CRC32 of the payload
+};
+
+// Cursors used to encode/decode the config blob payload
+struct BlobWriter {
+  uint8_t* data;
+  size_t size;
+  size_t pos;
+  bool overflow;
+};
+
+struct BlobReader {
+  const uint8_t* data;
+  size_t size;
+  size_t pos;
+  bool error;
+};
+
+// Button edge captured by the GPIO interrupt
+struct ButtonEdge {
+  uint8_t buttonIndex;
+  bool level;            // Pin level after the edge (LOW = pressed with pullup)
+  int64_t timestampUs;   // esp_timer_get_time() when the edge fired
+};
+
+// Components of an action URL, used as the connection pool key
+struct UrlParts {
+  ActionType transport;  // ACTION_HTTP for http(s)://, ACTION_MQTT for mqtt(s)://, ACTION_UDP for udp://
+  bool secure;
+  char host[64];
+  uint16_t port;
+  const char* path;        // Points into the source URL
+  const char* pathPrefix;  // "/" when the URL goes straight to a query (host?x=1), else ""
+};
+
+// How a TLS target authenticates the server; neither check set means encrypted but unverified
+struct TlsPolicy {
+  bool verifyChain;           // Certificate chain checked against the built-in CA bundle
+  bool pinned;                // Server certificate must hash to fingerprint
+  uint8_t fingerprint[TLS_FINGERPRINT_SIZE];
+};
+
+// Button action pre-rendered from actionData so a press needs no JSON parsing
+struct CompiledAction {
+  ActionType type;
+  bool valid;                 // URL parsed and request rendered without truncation
+  uint8_t stage;              // Chain ordering: lower stages finish before higher ones start
+  ActionMethod method;
+  bool secure;
+  uint16_t port;
+  char host[64];
+  char url[128];              // Original URL, for logging
+  char requestHead[384];      // Request line + static headers, Content-Length appended per send;
+                              // MQTT: "topic\0username\0password"
+  uint16_t requestHeadLength;
+  char body[256];             // Static body (HTTP), payload prefix (webhook) or payload template (MQTT/UDP)
+  uint16_t bodyLength;
+  uint8_t qos;                // MQTT: 0 or 1
+  bool retain;                // MQTT retain flag
+  uint8_t batchEvents;        // Webhook: events per POST, 0 = one POST per press
+  uint16_t batchAge;          // Webhook: seconds the first event may wait
+  uint16_t batchBytes;        // Webhook: array size that triggers a flush
+  TlsPolicy tls;              // https:// and mqtts:// server authentication
+  uint32_t keyRefs;           // Bit per apiKeys slot baked in by {{key:NAME}}, recompiled when one changes
+  bool keyMissing;            // Referenced a key that does not exist yet - invalid until it is added
+};
+
+// All targets of one button; a plain action compiles to a chain of one
+struct CompiledButton {
+  uint8_t count;
+  bool stopOnError;           // Skip later stages once a target has failed
+  bool feedback;              // LED shows the outcome instead of toggling on the press
+  bool syncState;             // Toggle follows the "state" field of the HTTP response
+  uint16_t slowMs;            // A success slower than this plays the slow pattern, 0 = off
+  CompiledAction* actions[MAX_CHAIN_ACTIONS];  // Entries of compiledActionPool - most buttons use one
+};
+
+// Persistent keep-alive connection for one scheme+host+port
+struct PooledConnection {
+  bool assigned;
+  bool inUse;          // Holds a request of the stage in flight, never evicted
+  bool secure;
+  char host[64];
+  uint16_t port;
+  TlsPolicy tls;       // Part of the pool key, targets with different pins never share a socket
+  WiFiClient* client;  // TlsClient when secure
+  unsigned long lastUsed;
+  int64_t requestStartUs;  // esp_timer_get_time() when the current request started
+};
+
+// Persistent MQTT broker session, kept open by the action worker
+struct MqttSession {
+  bool assigned;
+  bool secure;
+  char host[64];
+  uint16_t port;
+  char username[32];
+  char password[64];
+  TlsPolicy tls;
+  WiFiClient* client;  // TlsClient when secure
+  unsigned long lastActivity;  // Last packet sent, drives the keep-alive ping
+  uint16_t nextPacketId;
+};
+
+// TLS session kept after a handshake so the next connection to the host can resume it
+struct TlsSessionEntry {
+  bool valid;
+  char host[64];
+  uint16_t port;
+  TlsPolicy policy;           // A session is only offered under the policy that verified it
+  mbedtls_ssl_session session;
+  unsigned long lastUsed;
+};
+
+// mbedTLS transport for pooled https:// and mqtts:// sockets. Unlike WiFiClientSecure it offers
+// the cached session of the host, so a reconnect costs an abbreviated handshake.
+class TlsClient : public WiFiClient {
+ public:
+  ~TlsClient();
+  int connectSocket(IPAddress address, uint16_t port, int32_t timeout);
+  bool handshake(const char* host, uint16_t port, const TlsPolicy& policy, int32_t timeout);
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t* buffer, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  
+ private:
+  static int sendCallback(void* context, const unsigned char* buffer, size_t length);
+  static int recvCallback(void* context, unsigned char* buffer, size_t length);
+  bool pull();
+  
+  WiFiClient tcp;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context drbg;
+  bool seeded = false;      // entropy/drbg set up, kept for the life of the client
+  bool active = false;      // ssl/conf set up, released by stop()
+  bool closed = false;      // Peer sent close_notify or the socket failed
+  int peeked = -1;          // Byte pulled out of mbedTLS by available()/peek()
+  int32_t ioTimeout = 0;
+};
+
+// Serial command table entry - name is matched case-insensitively, the argument is left untouched
+struct SerialCommand {
+  const char* name;
+  bool takesArgument;       // Invoked as NAME:<argument>
+  void (*handler)(char* argument);
+  const char* usage;
+  const char* help;
+};
+
+// Output line being assembled for the framed protocol
+struct ConsoleLine {
+  char data[CONSOLE_LINE_MAX];
+  size_t length;
+  uint8_t type;  // Frame type of a line already split across frames, 0 when not yet known
+};
+
+// Print target for all diagnostic/protocol output: plain Serial in text mode,
+// one frame per line once the framed protocol is negotiated
+class SerialConsole : public Print {
+ public:
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+};
+
+// Frame receive states
+enum FrameRxState {
+  FRAME_RX_SOF = 0,
+  FRAME_RX_HEADER,
+  FRAME_RX_PAYLOAD,
+  FRAME_RX_CRC
+};
+
+// Send kept for a later attempt; the body is stored as sent so a webhook keeps its original timestamp
+struct RetryEntry {
+  uint8_t buttonIndex;
+  uint8_t target;             // Index in the button's chain, resolved again on every attempt
+  uint8_t type;               // ActionType when queued, the entry is dropped if the target changed type
+  uint8_t attempts;
+  uint16_t bodyLength;
+  uint32_t nextAttempt;       // millis(), 0 = as soon as WiFi is up
+  char body[sizeof(CompiledAction::body) + 48];
+};
+
+// Instrumented hot paths
+enum MetricStage {
+  METRIC_EDGE = 0,       // Button edge/hold threshold to handleButtonPress()
+  METRIC_QUEUE_WAIT,     // queueAction() to the worker picking the press up
+  METRIC_DNS,
+  METRIC_CONNECT,        // TCP connect
+  METRIC_TLS,            // TLS handshake, abbreviated when a cached session is resumed
+  METRIC_REQUEST,        // Request written to status line received
+  METRIC_RESPONSE,       // Headers and body drained, socket released to the pool
+  METRIC_CONFIG_SAVE,
+  METRIC_CONFIG_LOAD,
+  METRIC_STAGE_COUNT
+};
+
+const char* METRIC_STAGE_NAMES[METRIC_STAGE_COUNT] = {  // Labels in /api/metrics and METRICS
+  "edge", "queue_wait", "dns", "connect", "tls", "request", "response", "config_save", "config_load"
+};
+
+// Battery state driving the power policy
+enum BatteryLevel {
+  BATTERY_EXTERNAL = 0,  // No cell sensed - powered over USB, policy stays off
+  BATTERY_OK,
+  BATTERY_LOW,
+  BATTERY_CRITICAL
+};
+
+// Reasons the CPU is boosted; holds nest, the clock drops once all are released
+enum PowerHold {
+  POWER_HOLD_PRESS = 0,  // A button is down, boosted before the hold threshold fires the action
+  POWER_HOLD_ACTION,     // Worker dispatching actions, retries or a TLS handshake
+  POWER_HOLD_CONFIG,     // Config upload, compile and flash commit
+  POWER_HOLD_OTA,        // Firmware image streaming into flash
+  POWER_HOLD_COUNT
+};
+
+// Latency histogram in microseconds
+struct LatencyHistogram {
+  uint32_t buckets[METRIC_BUCKETS + 1];
+  uint32_t count;
+  uint64_t sumUs;
+};
+
+// Heap low-water marks; a shrinking largest block with steady free space means fragmentation
+struct HeapStats {
+  uint32_t freeBytes;
+  uint32_t minFreeBytes;      // Lowest free heap since boot, tracked by the allocator
+  uint32_t largestBlock;      // Biggest single allocation that would succeed right now
+  uint32_t minLargestBlock;   // Lowest largestBlock seen by a sample
+  uint32_t allocFailures;     // Allocations that returned NULL, from the heap_caps callback
+  uint32_t lastFailedSize;
+  uint32_t reportedFailures;  // allocFailures already logged by sampleHeap()
+  unsigned long lastSample;
+};
+
+// Outcome counters and end-to-end latency of one button
+struct ButtonMetrics {
+  uint32_t presses;
+  uint32_t successes;
+  uint32_t failures;
+  LatencyHistogram action;  // Action start to result, per target
+};
+
+// Firmware upload in progress on POST /api/ota - only the async web task touches it
+struct OtaSession {
+  bool active;
+  bool begun;                      // esp_ota_begin() succeeded, the handle must be ended or aborted
+  bool done;                       // Image verified and set as the boot partition
+  AsyncWebServerRequest* owner;    // Only this request's body is written
+  const esp_partition_t* partition;
+  esp_ota_handle_t handle;
+  mbedtls_sha256_context sha;
+  uint8_t expected[OTA_SHA256_SIZE];
+  size_t total;
+  size_t written;
+  uint8_t progress;                // Last 10% step logged
+  unsigned long started;
+  int status;                      // HTTP status reported once the body is in, 0 while fine
+  char error[64];
+};
+
+// What was last flashed and where - a rollback only counts when the rejected image is this one
+struct OtaImage {
+  char partition[17];
+  char version[32];
+  uint8_t elfSha256[OTA_SHA256_SIZE];
+};
+
+// One BENCH line: cost of a single call in microseconds
+struct BenchResult {
+  const char* name;
+  uint32_t runs;
+  uint32_t minUs;
+  uint32_t maxUs;
+  uint64_t totalUs;
+};
+
+// Synthetic presses fired by SOAK; results are the metrics deltas since the start
+struct SoakRun {
+  bool active;
+  bool draining;                 // Every press fired, waiting for the worker to report them
+  int slot;
+  uint16_t intervalMs;
+  uint32_t remaining;
+  uint32_t fired;
+  unsigned long nextPress;
+  unsigned long started;
+  unsigned long drainStarted;
+  unsigned long lastProgress;
+  ButtonMetrics startButton;
+  LatencyHistogram startQueueWait;
+  uint32_t startOverflows;
+  uint32_t startFreeHeap;
+  uint32_t startLargestBlock;
+  uint32_t startAllocFailures;
+  uint32_t minFreeHeap;          // Lowest free heap seen while the soak ran
+};
+
+// Outcome counters and request latency of one target host
+struct HostMetrics {
+  bool used;
+  char host[64];
+  uint32_t successes;
+  uint32_t failures;
+  LatencyHistogram request;
+};
+
+// Webhook events collected into one JSON array POST
+struct WebhookBatch {
   bool active;
+  uint8_t buttonIndex;
+  uint8_t target;
+  uint8_t count;
+  uint8_t attempts;           // Failed flushes of this batch
+  uint16_t length;            // "[event,event" - the bracket is closed when sending
+  unsigned long flushAt;      // millis() when the age limit or the retry backoff expires
+  char data[WEBHOOK_BATCH_BUFFER];
+};
+
+// Stored in front of the persisted retry entries
+struct RetryQueueHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+};
+
+// Serialized GET /api/config body, shared with in-flight responses so a rebuild never pulls it from under them
+struct ConfigJsonCache {
+  std::shared_ptr<char> data;
+  size_t length;
+  uint32_t generation;
+};
+
+// Button event handed from loop() to the action worker
+struct ActionEvent {
+  uint8_t buttonIndex;
+  unsigned long timestamp;  // millis() at the time the press was detected
+  int64_t queuedUs;         // esp_timer_get_time() when it was queued
 };
 
-const int MAX_API_KEYS = 16;
+// One chain target in flight on the action worker
+struct ActionDispatch {
+  const CompiledAction* action;
+  uint8_t target;             // Index in the button's chain
+  PooledConnection* conn;
+  bool reused;                // Socket was already open when the request was written
+  int result;                 // 0 while pending, then HTTP status or negative error
+  uint8_t attempt;            // Earlier failed attempts, 0 for the press itself
+  unsigned long started;
+  const char* body;
+  size_t bodyLength;
+  char payload[sizeof(CompiledAction::body) + 48];  // Completed webhook payload
+  char response[LED_STATE_SCAN_SIZE];               // Start of the HTTP response body
+};
 
 // Global variables
-ButtonConfig buttonConfigs[8];
+ButtonConfig buttonConfigs[ACTION_SLOTS];      // 0-7 press of button n, then one per gesture binding
+CompiledButton compiledButtons[ACTION_SLOTS];
+CompiledAction compiledActionPool[COMPILED_ACTION_POOL];
+int8_t compiledActionOwner[COMPILED_ACTION_POOL];  // Action slot using the entry, -1 = free
 NetworkConfig networkConfig;
 DeviceConfig deviceConfig;
 ApiKeyEntry apiKeys[MAX_API_KEYS];
-Preferences preferences;
-WebServer server(80);
+int8_t apiKeyIndex[API_KEY_INDEX_SIZE];  // apiKeys slot per hash bucket, -1 = empty
+uint32_t apiKeysChanged = 0;             // apiKeys slots set or removed since the last commit
+char configStore[CONFIG_STORE_SIZE];  // Every actionData and API key value, sized by content instead of per slot
+size_t configStoreUsed = 0;           // Append position; replaced strings leave gaps until compactConfigStore()
+uint8_t configBlobBuffer[CONFIG_BLOB_MAX_SIZE];
+uint32_t configSequence = 0;  // Sequence of the newest committed blob
+int configSlot = -1;          // Slot holding it, -1 when nothing has been committed
+uint32_t configDirty = 0;     // CONFIG_DIRTY_* sections changed since the last commit
+uint32_t configCrc = 0;       // Payload CRC of the committed blob, reported as config_hash
+uint32_t configGeneration = 0;  // Bumped on every commit, part of the /api/config ETag
+ConfigJsonCache configJsonCache = {nullptr, 0, 0};
+AsyncWebServer server(80);
+AsyncEventSource events("/api/events");
+unsigned long restartAt = 0;         // millis() of a scheduled restart, 0 when none
+volatile uint8_t pendingTestPresses = 0;  // Buttons triggered over HTTP, run by loop()
+
+// Action worker state
+QueueHandle_t actionQueue = NULL;
+TaskHandle_t actionWorkerHandle = NULL;
+SemaphoreHandle_t configMutex = NULL;  // Guards config between loop(), the worker and the web task
+volatile uint32_t actionQueueOverflows = 0;
+
+// Event stream - every event is serialized once and fanned out by AsyncEventSource
+SemaphoreHandle_t eventMutex = NULL;  // Events are published from loop(), the worker and the web task
+char eventBuffer[EVENT_BUFFER_SIZE];
+unsigned long lastTelemetry = 0;
+
+// Serial line assembly - commands are parsed in place from this buffer
+char serialLine[SERIAL_LINE_MAX + 1];
+size_t serialLineLength = 0;
+bool serialLineOverflow = false;  // Discarding the rest of an over-long line
+
+// Framed serial protocol state
+SerialConsole Console;
+bool serialFramed = false;
+bool serialLeaveFramed = false;   // TEXT received - switch back once the command is acknowledged
+unsigned long serialFramedBaud = SERIAL_FRAMED_BAUD;
+uint16_t framedRequestId = 0;     // Id of the command frame being executed
+SemaphoreHandle_t consoleMutex = NULL;
+ConsoleLine consoleLines[2];      // [0] loop task, [1] every other task
+FrameRxState frameRxState = FRAME_RX_SOF;
+uint8_t frameRxHeader[FRAME_HEADER_SIZE];
+uint8_t frameRxCrc[4];
+size_t frameRxPos = 0;
+uint16_t frameRxLength = 0;
+unsigned long frameRxLastByte = 0;
+
+// UDP discovery/config state
+WiFiUDP discoveryUdp;
+WiFiUDP configUdp;
+bool discoveryStarted = false;
+bool discoveryAnnounceDue = false;  // Broadcast as soon as the station has an address
+unsigned long lastDiscoveryAnnounce = 0;
+char udpPacketBuffer[UDP_PACKET_MAX + 1];
+
+// HTTP connection pool (only touched by the action worker)
+PooledConnection httpPool[HTTP_POOL_SIZE];
+MqttSession mqttSessions[MQTT_MAX_SESSIONS];
+TlsSessionEntry tlsSessions[TLS_SESSION_CACHE_SIZE];
+LatencyHistogram stageMetrics[METRIC_STAGE_COUNT];
+ButtonMetrics buttonMetrics[8];
+HeapStats heapStats = {0};
+SoakRun soakRun = {0};  // Only loop() touches it
+OtaSession otaSession = {};
+bool otaPendingVerify = false;  // Running a new image the bootloader will roll back unless it is confirmed
+bool otaRolledBack = false;     // The image last uploaded was rejected and the previous one is running
+OtaImage otaRejected = {};      // That image, while otaRolledBack
+HostMetrics hostMetrics[METRIC_HOSTS];
+portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;  // Metrics are recorded from loop, worker and web tasks
+WebhookBatch webhookBatches[WEBHOOK_BATCH_SLOTS];  // Action worker only
+RetryEntry retryQueue[RETRY_QUEUE_LENGTH];  // Oldest first, only touched by the action worker after setup
+int retryCount = 0;
+bool retryQueueDirty = false;           // Changed since the last flash write
+unsigned long retryQueueChanged = 0;
+unsigned long lastRetryBatch = 0;
+uint32_t retryDrops = 0;
+WiFiUDP actionUdp;  // Only used by the action worker
+unsigned long lastPoolMaintenance = 0;
 
 // State tracking
 bool buttonStates[8] = {true, true, true, true, true, true, true, true};  // Start as released (HIGH)
 bool buttonPressed[8] = {false, false, false, false, false, false, false, false}; // Track if button is currently pressed
-unsigned long buttonPressStart[8] = {0}; // When button press started
+bool buttonHandled[8] = {false}; // Press already dispatched, wait for release
+int64_t buttonPressStartUs[8] = {0};     // esp_timer_get_time() of the falling edge that started the press
 bool ledStates[8] = {false};
+GestureBinding gestureBindings[MAX_GESTURES];
+uint8_t buttonGestures[8] = {0};        // GESTURE_BIT of every gesture bound to the button, 0 = plain press
+uint8_t tapCount[8] = {0};              // First tap waiting on the double-tap window
+unsigned long tapDeadline[8] = {0};     // The waiting tap fires as a press once this passes
+bool chordWaiting[8] = {false};         // Recognized press waiting for its chord partners
+unsigned long chordDeadline[8] = {0};
+bool awaitingRelease[8] = {false};      // Long-press bound: resolves at release or at longPressMs
 unsigned long lastButtonPress[8] = {0};
 unsigned long lastStatusBlink = 0;
 bool statusLedState = false;
-float batteryVoltage = 3.3;  // 3.3V power supply
-bool wifiConnected = false;
+float batteryVoltage = 0;    // Filtered cell voltage, written by the battery task
+volatile uint8_t batteryPercent = 0;
+BatteryLevel batteryLevel = BATTERY_EXTERNAL;  // Policy state, owned by loop()
+bool batterySampled = false;
+uint8_t ledPowerScale = 100;                   // Percent of the configured brightness the policy allows
+uint8_t telemetryStretch = 1;                  // TELEMETRY_INTERVAL multiplier
+TaskHandle_t batteryTaskHandle = NULL;
+volatile bool wifiConnected = false;  // Written from the WiFi event task
 bool configMode = false;
+
+// WiFi connection manager state
+WiFiState wifiState = WIFI_STATE_IDLE;
+unsigned long wifiStateSince = 0;
+unsigned long wifiRetryDelay = WIFI_RETRY_INITIAL;
+bool wifiFastAttempt = false;      // Current attempt uses the cached BSSID/channel
+bool wifiEverConnected = false;
+bool wifiScanPending = false;
+WiFiFastReconnect wifiCache;
+bool wifiCacheValid = false;
+
+// Set by the WiFi event callback, consumed by updateWiFi()
+volatile bool wifiEventGotIp = false;
+volatile bool wifiEventDisconnected = false;
+volatile uint8_t wifiDisconnectReason = 0;
+uint8_t wifiEventBssid[6];
+volatile uint8_t wifiEventChannel = 0;
 bool pinsStabilized = false;  // Flag to prevent early button detection
 
+// Interrupt-driven button input state
+ButtonEdge buttonEdgeBuffer[BUTTON_EDGE_BUFFER_SIZE];
+volatile uint16_t buttonEdgeHead = 0;  // Written by ISR
+volatile uint16_t buttonEdgeTail = 0;  // Written by loop()
+volatile bool buttonEdgeOverflow = false;
+volatile uint32_t buttonEdgeOverflows = 0;
+portMUX_TYPE buttonEdgeMux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t loopTaskHandle = NULL;
+
 // Power monitoring state (sleep management removed)
 bool criticalBattery = false;  // Keep name for compatibility but it's really critical power
-int bootCount = 0;  // Removed RTC_DATA_ATTR since no sleep
+
+// Power governor state
+SemaphoreHandle_t powerMutex = NULL;     // Holds are taken from loop(), the worker and the web task
+uint8_t powerHolds[POWER_HOLD_COUNT];
+unsigned long powerLastHold = 0;         // millis() of the last release, starts the linger
+uint32_t cpuFrequency = 0;               // Clock last set by the governor
+wifi_ps_type_t wifiPowerSave = WIFI_PS_MIN_MODEM;
+bool pressHoldActive = false;            // POWER_HOLD_PRESS taken by processButtonEdges()
+RTC_DATA_ATTR int bootCount = 0;  // Counts deep sleep wakes too
+
+// Sleep state - the RTC copies survive deep sleep so the wake path skips flash reads
+RTC_DATA_ATTR WiFiFastReconnect rtcWiFiCache;
+RTC_DATA_ATTR bool rtcWiFiCacheValid = false;
+bool wokeFromDeepSleep = false;
+uint8_t wakeButtonMask = 0;                      // Buttons that woke the device from deep sleep
+unsigned long lastActivity = 0;                  // Press, upload or command - starts the sleep timeout
+volatile unsigned long wakeNetworkDeadline = 0;  // Worker holds wake presses until WiFi is back or this passes
 
 // Status LED states
 enum StatusLedMode {
@@ -111,74 +857,389 @@ enum StatusLedMode {
 };
 StatusLedMode currentStatusMode = STATUS_OFF;
 
+// Button LED patterns for action status, played over the toggle state
+enum LedPattern {
+  LED_PATTERN_NONE = 0,
+  LED_PATTERN_PENDING,  // Breathes until replaced
+  LED_PATTERN_SUCCESS,
+  LED_PATTERN_FAILURE,
+  LED_PATTERN_SLOW,     // Landed, but slower than the button's slow_ms
+  LED_PATTERN_COUNT
+};
+
+struct LedStep {
+  uint8_t percent;    // Of the LED's current brightness
+  uint16_t duration;  // ms the step lasts
+  bool fade;          // Ramp to the level in hardware over the whole step
+};
+
+struct LedPatternDef {
+  const char* name;
+  const LedStep* steps;
+  uint8_t count;
+  bool repeat;
+};
+
+const LedStep LED_STEPS_PENDING[] = {{100, 350, true}, {10, 350, true}};
+const LedStep LED_STEPS_SUCCESS[] = {{100, 90, false}, {0, 90, false}, {100, 90, false}, {0, 90, false}};
+const LedStep LED_STEPS_FAILURE[] = {{100, 250, false}, {0, 150, false}, {100, 250, false}, {0, 150, false},
+                                     {100, 250, false}, {0, 400, false}};
+const LedStep LED_STEPS_SLOW[] = {{100, 600, true}, {0, 300, true}};
+const LedPatternDef ledPatterns[LED_PATTERN_COUNT] = {
+  {"none", NULL, 0, false},
+  {"pending", LED_STEPS_PENDING, 2, true},
+  {"success", LED_STEPS_SUCCESS, 4, false},
+  {"failure", LED_STEPS_FAILURE, 6, false},
+  {"slow", LED_STEPS_SLOW, 2, false},
+};
+
+// Toggle state posted with a pattern
+const int8_t LED_STATE_KEEP = -1;
+const int8_t LED_STATE_OFF = 0;
+const int8_t LED_STATE_ON = 1;
+const int8_t LED_STATE_TOGGLE = 2;
+
+struct LedChannel {
+  bool attached;             // LEDC channel assigned to the pin
+  uint16_t duty;             // Last duty handed to the hardware
+  unsigned long fadeUntil;   // A hardware fade runs until then - writes wait for it
+  LedPattern pattern;
+  uint8_t step;
+  bool stepStarted;
+  unsigned long stepEnds;
+};
+
+LedChannel leds[8];
+uint16_t ledGamma[256];                       // 8-bit brightness -> gamma corrected duty
+int8_t ledPatternRequests[8] = {-1, -1, -1, -1, -1, -1, -1, -1};  // Posted by any task, applied by loop()
+int8_t ledStateRequests[8] = {-1, -1, -1, -1, -1, -1, -1, -1};    // LED_STATE_*, applied with the pattern
+portMUX_TYPE ledMux = portMUX_INITIALIZER_UNLOCKED;
+
 // Forward declarations
 void setupPins();
+gpio_num_t buttonGpio(int button);
+void setupButtonInterrupts();
+void IRAM_ATTR buttonEdgeISR(void* arg);
+bool popButtonEdge(ButtonEdge& edge);
+void processButtonEdges();
+void applyButtonEdge(int buttonIndex, bool level, int64_t timestampUs);
+void fireButton(int buttonIndex, int64_t timestampUs);
+void resolvePress(int buttonIndex, unsigned long timestamp);
+void registerTap(int buttonIndex, unsigned long timestamp);
+bool fireChord(int buttonIndex);
+void clearGestureState(int buttonIndex);
+int findGestureSlot(GestureType type, uint8_t buttons);
+int slotButton(int slot);
+const char* gestureName(int slot);
+GestureType parseGestureType(const char* name);
+void rebuildGestureIndex();
+void resetGestureSlots();
+bool applyGestureUpdate(int id, JsonObject gesture);
+void renderGestureJson(int id, JsonObject gesture);
+void waitForButtonActivity();
 void loadConfiguration();
-void saveConfiguration();
+bool saveConfiguration();
+bool commitConfiguration();
+void markConfigDirty(uint32_t sections);
+bool updateConfigString(char* dest, size_t size, const char* value);
+bool storeConfigString(const char*& field, const char* value);
+const char* getApiKey(const char* keyName);
+void setApiKey(const char* keyName, const char* value);
+void removeApiKey(const char* keyName);
+uint32_t apiKeyHash(const char* name, size_t length);
+int findApiKey(const char* name, size_t length);
+void rebuildApiKeyIndex();
+bool isValidApiKeyName(const char* name);
+int expandKeyReferences(const char* source, char* output, size_t size, CompiledAction& action);
+bool usesChangedApiKeys(int slot);
+bool updateStoredString(const char*& field, const char* value);
+void compactConfigStore();
+void resetConfigStore();
+size_t collectConfigStoreFields(const char** fields[]);
+void releaseCompiledActions(int slot);
+CompiledAction* allocateCompiledAction(int slot);
+int actionTargetCount(int slot, JsonObject update);
+bool compiledTargetsFit(JsonObject* updates, char* message, size_t messageSize);
+bool actionConfigsFit(JsonObject* updates, char* message, size_t messageSize);
+void snapshotCompiledButton(int slot, CompiledButton& button, CompiledAction* storage);
+void sampleHeap();
+void onAllocFailed(size_t size, uint32_t caps, const char* function);
+void formatIPAddress(IPAddress address, char* buffer, size_t size);
+bool applyButtonUpdate(int id, JsonObject button);
+bool handleButtonPatch(int id, const char* json, char* message, size_t messageSize);
+bool readConfigBlob(Preferences& store, int slot, ConfigBlobHeader& header, uint8_t*& blob, bool spare = false);
+void releaseConfigBlob(uint8_t* blob);
+size_t encodeConfigBlob(uint8_t* buffer, size_t size, uint32_t sequence);
+bool decodeConfigBlob(const uint8_t* payload, size_t length);
+void clearConfiguration();
+void loadLegacyConfiguration(Preferences& store);
+bool hasLegacyConfiguration(Preferences& store);
+void removeLegacyConfiguration();
+void blobPutU8(BlobWriter& writer, uint8_t value);
+void blobPutU16(BlobWriter& writer, uint16_t value);
+void blobPutString(BlobWriter& writer, const char* value, bool wide = false);
+uint8_t blobGetU8(BlobReader& reader);
+uint16_t blobGetU16(BlobReader& reader);
+void blobGetString(BlobReader& reader, char* dest, size_t destSize, bool wide = false);
 void connectWiFi();
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info);
+void beginWiFiAttempt();
+void scheduleWiFiRetry();
+void updateWiFi();
+void startConfigAP();
+void loadWiFiCache();
+void saveWiFiCache();
 void setupWebServer();
+void handleConfigRequest(AsyncWebServerRequest* request);
+size_t renderConfigPiece(int piece, char* buffer, size_t size);
+bool rebuildConfigJsonCache();
+void formatConfigETag(char* etag, size_t size);
+void collectRequestBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+void sendStatusJson(AsyncWebServerRequest* request, int code, const char* status, const char* message);
+void processTestPresses();
+void scheduleRestart(unsigned long delayMs);
+void buildConfigJson(JsonDocument& doc);
+void startDiscovery();
+void handleDiscovery();
+void sendDiscoveryAnnouncement(const char* type, IPAddress address);
+void handleDiscoveryPacket(int length);
+void handleConfigPacket(int length);
+void sendConfigUpdateResponse(IPAddress address, bool success, const char* message, bool conflict = false);
+void sendConfigUploadJson(AsyncWebServerRequest* request, int code, const char* status, const char* message);
+void handleOtaRequest(AsyncWebServerRequest* request);
+void handleOtaBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+void handleOtaStatusRequest(AsyncWebServerRequest* request);
+void beginOta(AsyncWebServerRequest* request, size_t total);
+void finishOta();
+void failOta(int status, const char* error);
+bool parseSha256(const char* hex, uint8_t* digest);
+bool tokenMatches(const char* presented, const char* expected);
+void recordOtaImage(const esp_partition_t* partition);
+bool readOtaImage(OtaImage& image);
+const char* otaStateName(const esp_partition_t* partition);
+void checkOtaBoot();
+void updateOtaVerify();
+bool otaHealthy();
+void formatConfigHash(char* hash, size_t size);
+const char* deviceTypeName(DeviceType type);
 void handleButtonPress(int buttonIndex);
-void executeAction(int buttonIndex);
-void executeHttpAction(int buttonIndex, const char* actionData);
-void executeWebhookAction(int buttonIndex, const char* actionData);
+void compileActions();
+void compileAction(int buttonIndex);
+const char* actionMethodName(ActionMethod method);
+void compileActionTarget(int buttonIndex, ActionType type, JsonObject config, CompiledAction& action);
+ActionType parseActionType(JsonVariant value, ActionType fallback);
+bool executeButtonActions(int buttonIndex, const CompiledButton& button, int8_t& remoteState);
+void reportButtonFeedback(int buttonIndex, const CompiledButton& button, bool success, unsigned long elapsed,
+                          int8_t remoteState);
+int8_t parseRemoteState(const char* response);
+void executeAction(int buttonIndex, const CompiledAction& action, ActionDispatch& dispatch);
+void prepareHttpAction(const CompiledAction& action, ActionDispatch& dispatch);
+void prepareWebhookAction(const CompiledAction& action, ActionDispatch& dispatch);
+void renderTransportPayload(int buttonIndex, const CompiledAction& action, ActionDispatch& dispatch);
+void publishMqttAction(const CompiledAction& action, ActionDispatch& dispatch);
+void sendUdpAction(const CompiledAction& action, ActionDispatch& dispatch);
+bool actionSucceeded(const ActionDispatch& dispatch);
+bool batchWebhookEvent(int buttonIndex, const CompiledAction& action, ActionDispatch& dispatch);
+void flushWebhookBatch(WebhookBatch& batch);
+bool webhookBatchPending(int slot);
+void processWebhookBatches();
+const char* actionTypeName(ActionType type);
+int renderActionTemplate(const char* source, int buttonIndex, char* output, size_t size);
+bool templateValue(const char* name, int buttonIndex, char* value, size_t size);
+void compileTransportTarget(const char* url, const UrlParts& parts, JsonObject config, CompiledAction& action);
+void runHttpDispatches(ActionDispatch* dispatches, int count);
+void reportActionResult(int buttonIndex, const ActionDispatch& dispatch, bool queued);
+bool shouldRetry(const ActionDispatch& dispatch);
+bool queueRetry(int buttonIndex, const ActionDispatch& dispatch);
+void processRetryQueue();
+void removeRetryEntry(int index);
+unsigned long retryBackoff(uint8_t attempts);
+unsigned long nextRetryWait();
+void flushRetryQueueNow();
+void loadRetryQueue();
+void saveRetryQueue();
+int sendHttpRequest(PooledConnection* conn, const CompiledAction& action, const char* body, size_t bodyLength);
+int writeHttpRequest(PooledConnection* conn, const CompiledAction& action, const char* body, size_t bodyLength);
+int readHttpResponse(PooledConnection* conn, unsigned long deadline, char* bodyHead = NULL, size_t headSize = 0);
+int readHttpLine(WiFiClient* client, char* buffer, size_t size, unsigned long deadline);
+bool drainHttpBody(WiFiClient* client, long contentLength, bool chunked, unsigned long deadline, char* bodyHead,
+                   size_t headSize);
+bool parseUrl(const char* url, UrlParts& parts);
+PooledConnection* acquireConnection(bool secure, const char* host, uint16_t port, const TlsPolicy& tls);
+bool connectPooledClient(PooledConnection* conn);
+bool connectTransport(WiFiClient* client, bool secure, const char* host, uint16_t port, const TlsPolicy& tls);
+bool sameTlsPolicy(const TlsPolicy& a, const TlsPolicy& b);
+TlsSessionEntry* findTlsSession(const char* host, uint16_t port, const TlsPolicy& policy, bool create);
+void dropTlsSession(TlsSessionEntry* entry);
+bool parseFingerprint(const char* text, uint8_t* fingerprint);
+bool compileTlsPolicy(int buttonIndex, JsonObject config, const UrlParts& parts, TlsPolicy& policy);
+void closePooledConnection(PooledConnection* conn);
+void warmHttpPool();
+MqttSession* acquireMqttSession(const CompiledAction& action);
+bool mqttSessionServes(const MqttSession* session, const CompiledAction& action);
+bool connectMqttSession(MqttSession* session);
+int sendMqttPublish(MqttSession* session, const CompiledAction& action, const char* payload, size_t length);
+int readMqttPacket(MqttSession* session, uint8_t& type, uint8_t* buffer, size_t size, unsigned long deadline);
+int readMqttByte(WiFiClient* client, unsigned long deadline);
+size_t putMqttString(uint8_t* output, const char* text);
+size_t finishMqttPacket(uint8_t* packet, uint8_t header, size_t bodyLength);
+void mqttActionFields(const CompiledAction& action, const char*& topic, const char*& username, const char*& password);
+void closeMqttSession(MqttSession* session);
+void warmMqttSessions();
+void maintainMqttSessions();
+void maintainHttpPool();
+void requestHttpPoolWarmup();
+void startActionWorker();
+void recordLatency(LatencyHistogram& histogram, int64_t us);
+void recordStage(MetricStage stage, int64_t us);
+void recordActionOutcome(int buttonIndex, const char* host, bool success, int64_t us);
+HostMetrics* findHostMetrics(const char* host);
+uint32_t histogramQuantile(const LatencyHistogram& histogram, float quantile);
+void writeMetrics(Print& out);
+void writeSummary(Print& out, const char* name, const char* labels, const LatencyHistogram& histogram);
+void actionWorkerTask(void* parameter);
+bool queueAction(int buttonIndex);
+void lockConfig();
+void unlockConfig();
+void setupLEDs();
 void updateLEDs();
+void writeLED(int index, uint16_t duty, int fadeMs, unsigned long now);
+void playLedPattern(int index, LedPattern pattern, int8_t state = LED_STATE_KEEP);
+void publishLedState(int index);
+LedPattern parseLedPattern(const char* name);
+void allLEDsOff();
+void handleLedCommand(char* argument);
 void handleSerialCommands();
-void processSerialCommand(String command);
+void processSerialCommand(char* line);
+void handleSerialFrames();
+void handleSerialFrame();
+void sendFrame(uint8_t type, uint16_t id, const uint8_t* payload, size_t length);
+void writeFrame(uint8_t type, uint16_t id, const uint8_t* payload, size_t length);
+void flushConsoleLine(ConsoleLine& line);
+void setSerialFramed(bool framed);
+void handleFramedCommand(char* argument);
+void handleTextCommand(char* argument);
+void handleStatusCommand(char* argument);
+void handleConfigCommand(char* argument);
+void handleSetConfigCommand(char* argument);
+void handleSetButtonCommand(char* argument);
+void handleTestCommand(char* argument);
+void handleWiFiCommand(char* argument);
+void handlePowerCommand(char* argument);
+void handleResetWiFiCommand(char* argument);
+void handleIdentifyCommand(char* argument);
+void handleHelpCommand(char* argument);
+void handleMetricsCommand(char* argument);
+void handleBenchCommand(char* argument);
+void handleSoakCommand(char* argument);
+void benchRecord(BenchResult& result, int64_t us);
+void runBenchmarks(uint16_t runs);
+void startSoak(int slot, uint16_t intervalMs, uint32_t count);
+void updateSoak();
+void finishSoak(bool complete);
+LatencyHistogram histogramDelta(const LatencyHistogram& now, const LatencyHistogram& start);
 void sendJsonResponse(const char* type, const char* message, bool success = true);
 void sendDeviceInfo();
-void handleConfigUpload();
-void handleConfigUpload(String configJson);
+void buildDeviceInfo(JsonDocument& doc);
+void publishEvent(const char* type, JsonDocument& doc);
+void updateEventStream();
+bool handleConfigUpload(char* configJson, char* message, size_t messageSize);
+bool applyConfigUpdate(JsonObject root, char* message, size_t messageSize);
+bool applyConfigDocument(JsonObject doc);
+void restartForNetworkChange();
+void handleButtonPatchRequest(AsyncWebServerRequest* request);
 void validateConfiguration();
 bool isValidIP(const char* ip);
 bool isValidUrl(const char* url);
 void updateStatusLED();
 void setStatusLED(StatusLedMode mode);
+void boostCpu(PowerHold reason);
+void releaseCpu(PowerHold reason);
+void updatePowerGovernor();
+void applyCpuFrequency(uint32_t mhz);
+void applyWiFiPowerSave(wifi_ps_type_t mode);
+bool cpuBoosted();
+void setCriticalPower(bool critical);
+void startBatteryMonitor();
+bool sleepAllowed();
+void updateSleep();
+void enterSleep(bool deep);
+void resumeNetworkAfterSleep();
+void replayWakePresses(uint8_t buttonMask);
+void waitForWakeNetwork();
+void applyStaticIP();
+void batteryTask(void* parameter);
+void sampleBattery();
+uint8_t batteryPercentFor(float volts);
+void updateBatteryPolicy();
+const char* batteryLevelName(BatteryLevel level);
 
 void setup() {
-  Serial.begin(115200);
-  delay(100);
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_SIZE);
+  Serial.begin(SERIAL_TEXT_BAUD);
+  consoleMutex = xSemaphoreCreateMutex();
+  eventMutex = xSemaphoreCreateMutex();
+  powerMutex = xSemaphoreCreateMutex();
+  heap_caps_register_failed_alloc_callback(onAllocFailed);
+  
+  // Boot (config load, action compile, WiFi bring-up) runs boosted; loop() drops the clock afterwards
+  boostCpu(POWER_HOLD_CONFIG);
+  
+  // A button woke us from deep sleep - skip the settle delays, the press is replayed once the worker runs
+  wokeFromDeepSleep = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT1;
+  if (wokeFromDeepSleep) {
+    uint64_t wakePins = esp_sleep_get_ext1_wakeup_status();
+    for (int i = 0; i < 8; i++) {
+      if (wakePins & (1ULL << buttonGpio(i))) wakeButtonMask |= 1 << i;
+    }
+  } else {
+    delay(100);
+  }
   
   // Increment boot count for debugging
   ++bootCount;
   
-  Serial.println("\n=== PATCOM CONFIGURABLE v" + String(VERSION) + " ===");
-  Serial.println("Boot #" + String(bootCount));
-  Serial.println("Initializing...");
+  Console.printf("\n=== PATCOM CONFIGURABLE v%s ===\n", VERSION);
+  Console.printf("Boot #%d\n", bootCount);
+  Console.println("Initializing...");
+  checkOtaBoot();
   
   // Setup hardware first to control status LED
   setupPins();
   
   // Simple status LED indication
-  digitalWrite(STATUS_LED_PIN, HIGH);
-  delay(200);
-  digitalWrite(STATUS_LED_PIN, LOW);
+  if (!wokeFromDeepSleep) {
+    digitalWrite(STATUS_LED_PIN, HIGH);
+    delay(200);
+    digitalWrite(STATUS_LED_PIN, LOW);
+  }
   
   // Initialize all LEDs to OFF state
   for (int i = 0; i < 8; i++) {
     ledStates[i] = false;  // Set initial state
-    analogWrite(ledPins[i], 0);    // Turn off
   }
+  allLEDsOff();
   
-  Serial.println("LEDs initialized");
+  Console.println("LEDs initialized");
   
   // Print pin mapping for debugging
-  Serial.println("=== PIN MAPPING DEBUG ===");
+  Console.println("=== PIN MAPPING DEBUG ===");
   for (int i = 0; i < 8; i++) {
-    Serial.println("Button " + String(i) + ": GPIO " + String(buttonPins[i]) + " -> LED pin " + String(ledPins[i]) + " (A" + String(i) + " = " + String(A0 + i) + ")");
+    Console.printf("Button %d: pin %d (GPIO %d) -> LED pin %d (A%d = %d)\n", i, buttonPins[i], buttonGpio(i),
+                   ledPins[i], i, A0 + i);
   }
-  Serial.println("========================");
+  Console.println("========================");
   
   // Enable button checking after LED test is complete
+  setupButtonInterrupts();
   pinsStabilized = true;
-  Serial.println("Button detection enabled");
-  
-  // Sleep wakeup detection removed
-  Serial.println("Fresh start - sleep functions disabled");
+  Console.println("Button detection enabled");
   
-  
-  // Optimize CPU frequency for 3.3V operation and power efficiency
-  setCpuFrequencyMhz(80);  // Reduced frequency for power savings
-  Serial.println("Running at optimized frequency for power efficiency");
+  if (wokeFromDeepSleep) {
+    Console.printf("Woke from deep sleep (buttons 0x%02X)\n", wakeButtonMask);
+  } else {
+    Console.println("Fresh start");
+  }
   
   // Load configuration from flash
   loadConfiguration();
@@ -186,91 +1247,68 @@ void setup() {
   // Validate configuration
   validateConfiguration();
   
+  // Start the network worker so actions never block the main loop
+  startActionWorker();
+  
+  // The worker holds the wake press until the fast reconnect below completes
+  if (wakeButtonMask != 0) {
+    wakeNetworkDeadline = millis() + SLEEP_WAKE_NETWORK_WAIT;
+    replayWakePresses(wakeButtonMask);
+  }
+  
   // Power monitoring initialization
-  Serial.println("Sleep functions disabled - device will stay awake");
+  startBatteryMonitor();
+  lastActivity = millis();
   
   // Set status LED to connecting mode before WiFi
   setStatusLED(STATUS_CONNECTING);
   
-  // Connect to WiFi
+  // Start connecting to WiFi in the background - updateWiFi() finishes the job
   connectWiFi();
   
   // Setup web server for configuration
   setupWebServer();
   
+  // Answer the desktop configurator's UDP discovery and config requests
+  startDiscovery();
   
-  // Set final status LED state
-  if (wifiConnected) {
-    setStatusLED(STATUS_ACTIVE);
-  } else {
-    setStatusLED(STATUS_ERROR);
-  }
-  
-  Serial.println("Setup complete!");
-  Serial.println("");
-  Serial.println("");
-  Serial.println("Commands: CONFIG, STATUS, WIFI, POWER, BATTERY, HELP, RESET_WIFI");
+  Console.println("Setup complete!");
+  Console.println("");
+  Console.println("");
+  Console.println("Commands: CONFIG, STATUS, WIFI, POWER, BATTERY, HELP, RESET_WIFI");
   if (configMode) {
-    Serial.println("*** DEVICE IN CONFIG MODE ***");
-    Serial.println("*** Connect to WiFi: PATCOM-Config ***");
-    Serial.println("*** Password: patcom123 ***");
-    Serial.println("*** Open browser to: 192.168.4.1 ***");
+    Console.println("*** DEVICE IN CONFIG MODE ***");
+    Console.println("*** Connect to WiFi: PATCOM-Config ***");
+    Console.println("*** Password: patcom123 ***");
+    Console.println("*** Open browser to: 192.168.4.1 ***");
   }
   sendDeviceInfo();
+  releaseCpu(POWER_HOLD_CONFIG);
 }
 
 void loop() {
-  // Handle web server requests
-  server.handleClient();
+  // Run button tests requested over HTTP, and any SOAK in progress
+  processTestPresses();
+  updateSoak();
+  
+  // Drive WiFi connect/reconnect without blocking
+  updateWiFi();
+  
+  // Answer UDP discovery/config requests
+  handleDiscovery();
   
-  // Check button presses (only after pins are stabilized)
+  // Push telemetry to event stream subscribers
+  updateEventStream();
+  
+  // Restart requested by a network config change, once its response is out
+  if (restartAt != 0 && (long)(millis() - restartAt) >= 0) {
+    Console.println("Restarting now...");
+    ESP.restart();
+  }
+  
+  // Run the debounce/hold state machine over edges captured by the ISR
   if (pinsStabilized) {
-    for (int i = 0; i < 8; i++) {
-      bool currentState = digitalRead(buttonPins[i]);
-      unsigned long currentTime = millis();
-      
-      // Button pressed: transition from HIGH to LOW (with pullup)
-      if (buttonStates[i] == true && currentState == false) {
-        // Start tracking the press
-        if (!buttonPressed[i]) {
-          buttonPressed[i] = true;
-          buttonPressStart[i] = currentTime;
-        }
-      }
-      // Button released: transition from LOW to HIGH  
-      else if (buttonStates[i] == false && currentState == true) {
-        buttonStates[i] = true;  // Update state
-        
-        // If we were tracking a press, check if it was valid
-        if (buttonPressed[i]) {
-          unsigned long pressDuration = currentTime - buttonPressStart[i];
-          if (pressDuration >= BUTTON_HOLD_TIME && 
-              (currentTime - lastButtonPress[i]) > BUTTON_DEBOUNCE) {
-            lastButtonPress[i] = currentTime;
-            handleButtonPress(i);
-          }
-          buttonPressed[i] = false;
-        }
-      }
-      
-      // Update button state based on current reading
-      if (currentState == false && buttonPressed[i]) {
-        // Check if we've held the button long enough
-        unsigned long pressDuration = currentTime - buttonPressStart[i];
-        if (pressDuration >= BUTTON_HOLD_TIME && buttonStates[i] == true &&
-            (currentTime - lastButtonPress[i]) > BUTTON_DEBOUNCE) {
-          buttonStates[i] = false;  // Update state
-          lastButtonPress[i] = currentTime;
-          handleButtonPress(i);
-          buttonPressed[i] = false; // Prevent multiple triggers
-        }
-      }
-      
-      // Reset press tracking if button has been held too long (prevent stuck buttons)
-      if (buttonPressed[i] && (currentTime - buttonPressStart[i]) > 2000) {
-        buttonPressed[i] = false;
-      }
-    }
+    processButtonEdges();
   }
   
   // Update status LED
@@ -283,31 +1321,43 @@ void loop() {
   // Update LEDs
   updateLEDs();
   
-  // Reduced delay for better button responsiveness
-  delay(10);  // Faster polling for reliable button detection
+  // Apply the low-battery policy, then drop the clock once nothing has needed it for a while
+  updateBatteryPolicy();
+  updatePowerGovernor();
+  updateSleep();
+  sampleHeap();
+  updateOtaVerify();
+  
+  // Sleep until the next button edge or hold deadline instead of polling
+  waitForButtonActivity();
+}
+
+gpio_num_t buttonGpio(int button) {
+  // buttonPins are Arduino pin numbers, which the core may remap; IDF calls and wake masks need the GPIO
+  return (gpio_num_t)digitalPinToGPIONumber(buttonPins[button]);
 }
 
 void setupPins() {
-  Serial.println("Setting up pins...");
+  Console.println("Setting up pins...");
   
-  // Set global PWM frequency and resolution for ESP32
-  analogWriteFrequency(5000);  // 5kHz PWM frequency
-  analogWriteResolution(8);    // 8-bit resolution (0-255)
+  // Configure LED pins first (safe state)
+  setupLEDs();
   
-  // Configure LED pins first (safe state)  
-  for (int i = 0; i < 8; i++) {
-    pinMode(ledPins[i], OUTPUT);
-    analogWrite(ledPins[i], 0);  // Set to off initially
-    Serial.println("LED " + String(i) + " pin " + String(ledPins[i]) + " configured");
+  // Deep sleep left the buttons under RTC control for the wake pullups
+  if (wokeFromDeepSleep) {
+    for (int i = 0; i < 8; i++) {
+      rtc_gpio_deinit(buttonGpio(i));
+    }
   }
   
   // Configure other pins
   pinMode(BATTERY_PIN, INPUT);
+  analogSetPinAttenuation(BATTERY_PIN, ADC_11db);  // Full range of the divider output
   pinMode(STATUS_LED_PIN, OUTPUT);
   digitalWrite(STATUS_LED_PIN, LOW);
   
   // Wait for pins to stabilize
-  delay(500);
+  if (!wokeFromDeepSleep) delay(500);
   
   // Configure buttons with internal pullup - LAST
   for (int i = 0; i < 8; i++) {
@@ -316,514 +1366,5393 @@ void setupPins() {
     digitalRead(buttonPins[i]);
     buttonStates[i] = true;  // Assume released (HIGH with pullup)
     lastButtonPress[i] = millis();  // Initialize timing
-    Serial.println("Button " + String(i) + " pin " + String(buttonPins[i]) + " configured, initial state: " + String(digitalRead(buttonPins[i])));
+    Console.printf("Button %d pin %d configured, initial state: %d\n", i, buttonPins[i], digitalRead(buttonPins[i]));
   }
   
-  Serial.println("Pin setup complete - waiting for stabilization...");
-  delay(1000);  // Give pins time to stabilize
+  Console.println("Pin setup complete - waiting for stabilization...");
+  if (!wokeFromDeepSleep) delay(1000);  // Give pins time to stabilize
 }
 
-void loadConfiguration() {
-  preferences.begin("patcom", true);
-  
-  // Load device config
-  strcpy(deviceConfig.deviceName, preferences.getString("deviceName", "PATCOM").c_str());
-  strcpy(deviceConfig.deviceId, preferences.getString("deviceId", "PATCOM-" + String(ESP.getEfuseMac(), HEX)).c_str());
-  deviceConfig.deviceType = (DeviceType)preferences.getInt("deviceType", DEVICE_TYPE_BUTTON_MATRIX);
-  deviceConfig.brightness = preferences.getInt("brightness", 255);
-  deviceConfig.discoverable = preferences.getBool("discoverable", true);
-  // heartbeatInterval removed
-  strcpy(deviceConfig.firmwareVersion, VERSION);
-  deviceConfig.autoSync = preferences.getBool("autoSync", false);
-  strcpy(deviceConfig.configServerUrl, preferences.getString("configServer", "").c_str());
+// Button Input Functions
+
+void setupButtonInterrupts() {
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
   
-  // Load API keys
-  int apiKeyCount = preferences.getInt("apiKeyCount", 0);
-  for (int i = 0; i < MAX_API_KEYS; i++) {
-    apiKeys[i].active = false;
-    strcpy(apiKeys[i].name, "");
-    strcpy(apiKeys[i].value, "");
+  for (int i = 0; i < 8; i++) {
+    buttonStates[i] = digitalRead(buttonPins[i]);
+    buttonPressed[i] = false;
+    buttonHandled[i] = false;
+    attachInterruptArg(digitalPinToInterrupt(buttonPins[i]), buttonEdgeISR, (void*)(intptr_t)i, CHANGE);
   }
   
-  for (int i = 0; i < apiKeyCount && i < MAX_API_KEYS; i++) {
-    String prefix = "apiKey" + String(i) + "_";
-    strcpy(apiKeys[i].name, preferences.getString((prefix + "name").c_str(), "").c_str());
-    strcpy(apiKeys[i].value, preferences.getString((prefix + "value").c_str(), "").c_str());
-    apiKeys[i].active = strlen(apiKeys[i].name) > 0;
-  }
+  Console.printf("Button interrupts attached (edge buffer %d)\n", BUTTON_EDGE_BUFFER_SIZE);
+}
+
+void IRAM_ATTR buttonEdgeISR(void* arg) {
+  int buttonIndex = (int)(intptr_t)arg;
+  int64_t now = esp_timer_get_time();
+  bool level = digitalRead(buttonPins[buttonIndex]);
   
+  portENTER_CRITICAL_ISR(&buttonEdgeMux);
+  uint16_t next = (buttonEdgeHead + 1) & (BUTTON_EDGE_BUFFER_SIZE - 1);
+  if (next == buttonEdgeTail) {
+    // Buffer full - loop() will resync from the pin levels
+    buttonEdgeOverflow = true;
+    buttonEdgeOverflows++;
+  } else {
+    buttonEdgeBuffer[buttonEdgeHead].buttonIndex = buttonIndex;
+    buttonEdgeBuffer[buttonEdgeHead].level = level;
+    buttonEdgeBuffer[buttonEdgeHead].timestampUs = now;
+    buttonEdgeHead = next;
+  }
+  portEXIT_CRITICAL_ISR(&buttonEdgeMux);
   
-  // Load network config
-  strcpy(networkConfig.ssid, preferences.getString("ssid", "").c_str());
-  strcpy(networkConfig.password, preferences.getString("password", "").c_str());
-  networkConfig.staticIP = preferences.getBool("staticIP", false);
-  strcpy(networkConfig.ip, preferences.getString("ip", "").c_str());
-  strcpy(networkConfig.subnet, preferences.getString("subnet", "").c_str());
-  strcpy(networkConfig.gateway, preferences.getString("gateway", "").c_str());
-  strcpy(networkConfig.dns, preferences.getString("dns", "8.8.8.8").c_str());
+  // Wake loop() so the edge is handled immediately
+  BaseType_t higherPriorityWoken = pdFALSE;
+  if (loopTaskHandle != NULL) {
+    vTaskNotifyGiveFromISR(loopTaskHandle, &higherPriorityWoken);
+  }
+  portYIELD_FROM_ISR(higherPriorityWoken);
+}
+
+bool popButtonEdge(ButtonEdge& edge) {
+  bool available = false;
   
-  // Load button configs
-  for (int i = 0; i < 8; i++) {
-    String prefix = "btn" + String(i) + "_";
-    strcpy(buttonConfigs[i].name, preferences.getString((prefix + "name").c_str(), ("Button " + String(i)).c_str()).c_str());
-    buttonConfigs[i].action = (ActionType)preferences.getInt((prefix + "action").c_str(), ACTION_NONE);
-    strcpy(buttonConfigs[i].actionData, preferences.getString((prefix + "data").c_str(), "{}").c_str());
-    buttonConfigs[i].enabled = preferences.getBool((prefix + "enabled").c_str(), true);
+  portENTER_CRITICAL(&buttonEdgeMux);
+  if (buttonEdgeTail != buttonEdgeHead) {
+    edge = buttonEdgeBuffer[buttonEdgeTail];
+    buttonEdgeTail = (buttonEdgeTail + 1) & (BUTTON_EDGE_BUFFER_SIZE - 1);
+    available = true;
   }
+  portEXIT_CRITICAL(&buttonEdgeMux);
   
-  preferences.end();
-  Serial.println("Configuration loaded from flash");
+  return available;
 }
 
-void saveConfiguration() {
-  preferences.begin("patcom", false);
+void processButtonEdges() {
+  ButtonEdge edge;
+  while (popButtonEdge(edge)) {
+    applyButtonEdge(edge.buttonIndex, edge.level, edge.timestampUs);
+  }
   
-  // Save device config
-  preferences.putString("deviceName", deviceConfig.deviceName);
-  preferences.putString("deviceId", deviceConfig.deviceId);
-  preferences.putInt("deviceType", deviceConfig.deviceType);
-  preferences.putInt("brightness", deviceConfig.brightness);
-  preferences.putBool("discoverable", deviceConfig.discoverable);
-  // heartbeat setting removed
-  preferences.putBool("autoSync", deviceConfig.autoSync);
-  preferences.putString("configServer", deviceConfig.configServerUrl);
+  int64_t nowUs = esp_timer_get_time();
+  unsigned long currentTime = millis();
   
-  // Save API keys
-  int activeApiKeyCount = 0;
-  for (int i = 0; i < MAX_API_KEYS; i++) {
-    if (apiKeys[i].active) {
-      String prefix = "apiKey" + String(activeApiKeyCount) + "_";
-      preferences.putString((prefix + "name").c_str(), apiKeys[i].name);
-      preferences.putString((prefix + "value").c_str(), apiKeys[i].value);
-      activeApiKeyCount++;
+  // Edges were lost - fall back to the actual pin levels
+  if (buttonEdgeOverflow) {
+    buttonEdgeOverflow = false;
+    Console.println("WARNING: Button edge buffer overflow - resyncing pin states");
+    for (int i = 0; i < 8; i++) {
+      applyButtonEdge(i, digitalRead(buttonPins[i]), nowUs);
     }
   }
-  preferences.putInt("apiKeyCount", activeApiKeyCount);
   
-  
-  // Save network config
-  preferences.putString("ssid", networkConfig.ssid);
-  preferences.putString("password", networkConfig.password);
-  preferences.putBool("staticIP", networkConfig.staticIP);
-  preferences.putString("ip", networkConfig.ip);
-  preferences.putString("subnet", networkConfig.subnet);
-  preferences.putString("gateway", networkConfig.gateway);
-  preferences.putString("dns", networkConfig.dns);
-  
-  // Save button configs
   for (int i = 0; i < 8; i++) {
-    String prefix = "btn" + String(i) + "_";
-    preferences.putString((prefix + "name").c_str(), buttonConfigs[i].name);
-    preferences.putInt((prefix + "action").c_str(), buttonConfigs[i].action);
-    preferences.putString((prefix + "data").c_str(), buttonConfigs[i].actionData);
-    preferences.putBool((prefix + "enabled").c_str(), buttonConfigs[i].enabled);
+    // No second tap in time - the first one was a plain press
+    if (tapCount[i] > 0 && !buttonPressed[i] && (long)(currentTime - tapDeadline[i]) >= 0) {
+      tapCount[i] = 0;
+      handleButtonPress(i);
+    }
+    
+    if (!buttonPressed[i]) continue;
+    
+    unsigned long pressDuration = (unsigned long)((nowUs - buttonPressStartUs[i]) / 1000);
+    
+    // Held long enough to count as a press - fire without waiting for release
+    if (!buttonHandled[i] && pressDuration >= BUTTON_HOLD_TIME) {
+      fireButton(i, buttonPressStartUs[i] + (int64_t)BUTTON_HOLD_TIME * 1000);
+    }
+    
+    // Chord partners never arrived - carry on as a single-button press
+    if (chordWaiting[i] && (long)(currentTime - chordDeadline[i]) >= 0) {
+      chordWaiting[i] = false;
+      resolvePress(i, currentTime);
+    }
+    
+    if (awaitingRelease[i] && pressDuration >= deviceConfig.longPressMs) {
+      awaitingRelease[i] = false;
+      handleButtonPress(findGestureSlot(GESTURE_LONG, 1 << i));
+    }
+    
+    // Reset press tracking if button has been held too long (prevent stuck buttons)
+    if (pressDuration > BUTTON_STUCK_TIME + deviceConfig.longPressMs) {
+      buttonPressed[i] = false;
+      clearGestureState(i);
+    }
   }
   
-  preferences.end();
-  Serial.println("Configuration saved to flash");
+  // Boost on the first falling edge, so the clock is already up when the hold threshold fires
+  bool anyPressed = false;
+  for (int i = 0; i < 8; i++) {
+    anyPressed = anyPressed || buttonPressed[i];
+  }
+  if (anyPressed != pressHoldActive) {
+    pressHoldActive = anyPressed;
+    lastActivity = millis();
+    if (anyPressed) {
+      boostCpu(POWER_HOLD_PRESS);
+    } else {
+      releaseCpu(POWER_HOLD_PRESS);
+    }
+  }
 }
 
-void connectWiFi() {
-  Serial.println("=== WiFi Connection Debug ===");
-  Serial.println("SSID length: " + String(strlen(networkConfig.ssid)));
-  Serial.println("SSID: '" + String(networkConfig.ssid) + "'");
-  
-  if (strlen(networkConfig.ssid) == 0) {
-    Serial.println("No WiFi credentials - entering config mode");
-    configMode = true;
-    setStatusLED(STATUS_ERROR);
-    
-    // Start AP mode immediately when no credentials
-    WiFi.mode(WIFI_AP);
-    bool apResult = WiFi.softAP("PATCOM-Config", "patcom123");
-    Serial.println("AP creation result: " + String(apResult ? "SUCCESS" : "FAILED"));
-    Serial.println("AP started: PATCOM-Config");
-    Serial.println("AP IP: " + WiFi.softAPIP().toString());
-    Serial.println("Connect to PATCOM-Config with password: patcom123");
-    return;
-  }
+void applyButtonEdge(int buttonIndex, bool level, int64_t timestampUs) {
+  // Repeated level means the opposite edge was a bounce we already absorbed
+  if (level == buttonStates[buttonIndex]) return;
+  buttonStates[buttonIndex] = level;
+  unsigned long timestamp = (unsigned long)(timestampUs / 1000);  // Gesture windows are in ms, like millis()
   
-  Serial.print("Connecting to WiFi: " + String(networkConfig.ssid));
-  
-  // Configure static IP if enabled
-  if (networkConfig.staticIP && strlen(networkConfig.ip) > 0) {
-    IPAddress local_IP, gateway, subnet, dns;
-    local_IP.fromString(networkConfig.ip);
-    gateway.fromString(networkConfig.gateway);
-    subnet.fromString(networkConfig.subnet);
-    dns.fromString(networkConfig.dns);
+  if (level == LOW) {
+    // Button pressed: every falling edge restarts the hold timer, so bounces never reach BUTTON_HOLD_TIME
+    buttonPressed[buttonIndex] = true;
+    buttonHandled[buttonIndex] = false;
+    buttonPressStartUs[buttonIndex] = timestampUs;
+  } else {
+    // Button released: accept a short-lived press the hold check has not caught yet
+    if (buttonPressed[buttonIndex] && !buttonHandled[buttonIndex] &&
+        timestampUs - buttonPressStartUs[buttonIndex] >= (int64_t)BUTTON_HOLD_TIME * 1000) {
+      fireButton(buttonIndex, timestampUs);
+    }
     
-    if (!WiFi.config(local_IP, gateway, subnet, dns)) {
-      Serial.println("Static IP configuration failed");
+    // Let go before a chord or long-press formed - it was a tap
+    if (chordWaiting[buttonIndex]) {
+      chordWaiting[buttonIndex] = false;
+      resolvePress(buttonIndex, timestamp);
     }
+    if (awaitingRelease[buttonIndex]) {
+      awaitingRelease[buttonIndex] = false;
+      registerTap(buttonIndex, timestamp);
+    }
+    buttonPressed[buttonIndex] = false;
+    clearGestureState(buttonIndex);
   }
+}
+
+void fireButton(int buttonIndex, int64_t timestampUs) {
+  buttonHandled[buttonIndex] = true;
+  unsigned long timestamp = (unsigned long)(timestampUs / 1000);
   
-  WiFi.begin(networkConfig.ssid, networkConfig.password);
+  if ((timestamp - lastButtonPress[buttonIndex]) <= BUTTON_DEBOUNCE) {
+    return;
+  }
+  lastButtonPress[buttonIndex] = timestamp;
+  // Edge (or hold threshold) to here, on the ISR's own clock at full resolution
+  recordStage(METRIC_EDGE, esp_timer_get_time() - timestampUs);
   
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(1000);  // Longer delay to reduce power consumption
-    Serial.print(".");
-    attempts++;
+  // Only buttons with gestures bound ever wait - a plain press goes out right here
+  uint8_t gestures = buttonGestures[buttonIndex];
+  if (gestures == 0) {
+    handleButtonPress(buttonIndex);
+    return;
   }
   
-  if (WiFi.status() == WL_CONNECTED) {
-    wifiConnected = true;
-    Serial.println("\nWiFi connected!");
-    Serial.println("IP address: " + WiFi.localIP().toString());
-    
-    // Status LED will be set to ACTIVE in setup()
-  } else {
-    wifiConnected = false;
-    Serial.println("\nWiFi connection failed - entering config mode");
-    configMode = true;
-    setStatusLED(STATUS_ERROR);
-    
-    // Start AP mode for configuration
-    WiFi.mode(WIFI_AP);
-    delay(100);  // Give time for mode switch
-    bool apResult = WiFi.softAP("PATCOM-Config", "patcom123");
-    Serial.println("AP creation result: " + String(apResult ? "SUCCESS" : "FAILED"));
-    Serial.println("AP started: PATCOM-Config");
-    Serial.println("AP IP: " + WiFi.softAPIP().toString());
-    Serial.println("Connect to PATCOM-Config with password: patcom123");
-    
-    // Print available networks for debugging
-    Serial.println("Scanning for networks...");
-    int n = WiFi.scanNetworks();
-    if (n == 0) {
-      Serial.println("No networks found");
-    } else {
-      Serial.println(String(n) + " networks found:");
-      for (int i = 0; i < n; ++i) {
-        Serial.println(String(i + 1) + ": " + WiFi.SSID(i) + " (" + WiFi.RSSI(i) + "dBm)");
-      }
-    }
+  if (gestures & GESTURE_BIT(GESTURE_CHORD)) {
+    if (fireChord(buttonIndex)) return;
+    chordWaiting[buttonIndex] = true;
+    chordDeadline[buttonIndex] = timestamp + deviceConfig.chordWindowMs;
+    return;
   }
+  resolvePress(buttonIndex, timestamp);
 }
 
-void setupWebServer() {
+void resolvePress(int buttonIndex, unsigned long timestamp) {
+  // Still held: the long-press check in processButtonEdges() or the release decides
+  if ((buttonGestures[buttonIndex] & GESTURE_BIT(GESTURE_LONG)) && buttonPressed[buttonIndex]) {
+    awaitingRelease[buttonIndex] = true;
+    return;
+  }
+  registerTap(buttonIndex, timestamp);
+}
+
+void registerTap(int buttonIndex, unsigned long timestamp) {
+  if (!(buttonGestures[buttonIndex] & GESTURE_BIT(GESTURE_DOUBLE))) {
+    handleButtonPress(buttonIndex);
+    return;
+  }
+  
+  if (tapCount[buttonIndex] > 0 && (long)(timestamp - tapDeadline[buttonIndex]) <= 0) {
+    tapCount[buttonIndex] = 0;
+    handleButtonPress(findGestureSlot(GESTURE_DOUBLE, 1 << buttonIndex));
+    return;
+  }
+  
+  // A first tap whose window ran out before loop() got to it still counts
+  if (tapCount[buttonIndex] > 0) {
+    handleButtonPress(buttonIndex);
+  }
+  tapCount[buttonIndex] = 1;
+  tapDeadline[buttonIndex] = timestamp + deviceConfig.doubleTapMs;
+}
+
+bool fireChord(int buttonIndex) {
+  // A chord fires as soon as every one of its buttons is down and still waiting
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    const GestureBinding& binding = gestureBindings[g];
+    if (binding.type != GESTURE_CHORD || !(binding.buttons & (1 << buttonIndex))) continue;
+    if (!buttonConfigs[8 + g].enabled || buttonConfigs[8 + g].action == ACTION_NONE) continue;
+    
+    bool complete = true;
+    for (int b = 0; b < 8 && complete; b++) {
+      if (!(binding.buttons & (1 << b)) || b == buttonIndex) continue;
+      complete = buttonPressed[b] && chordWaiting[b];
+    }
+    if (!complete) continue;
+    
+    for (int b = 0; b < 8; b++) {
+      if (!(binding.buttons & (1 << b))) continue;
+      chordWaiting[b] = false;
+      awaitingRelease[b] = false;
+      tapCount[b] = 0;
+    }
+    handleButtonPress(8 + g);
+    return true;
+  }
+  return false;
+}
+
+void clearGestureState(int buttonIndex) {
+  chordWaiting[buttonIndex] = false;
+  awaitingRelease[buttonIndex] = false;
+}
+
+void waitForButtonActivity() {
+  unsigned long timeout = LOOP_IDLE_TIMEOUT;
+  unsigned long currentTime = millis();
+  
+  // Wake up exactly when a pending press reaches its hold threshold or a gesture deadline
+  for (int i = 0; i < 8; i++) {
+    unsigned long deadline = 0;
+    bool waiting = true;
+    if (buttonPressed[i] && !buttonHandled[i]) {
+      deadline = (unsigned long)(buttonPressStartUs[i] / 1000) + BUTTON_HOLD_TIME;
+    } else if (chordWaiting[i]) {
+      deadline = chordDeadline[i];
+    } else if (awaitingRelease[i]) {
+      deadline = (unsigned long)(buttonPressStartUs[i] / 1000) + deviceConfig.longPressMs;
+    } else if (tapCount[i] > 0 && !buttonPressed[i]) {
+      deadline = tapDeadline[i];
+    } else {
+      waiting = false;
+    }
+    if (waiting) {
+      long remaining = (long)(deadline - currentTime);
+      if (remaining <= 0) {
+        timeout = 0;
+      } else if ((unsigned long)remaining < timeout) {
+        timeout = remaining;
+      }
+    }
+  }
+  
+  // A soak press is due on its own schedule
+  if (soakRun.active && !soakRun.draining) {
+    long remaining = (long)(soakRun.nextPress - currentTime);
+    if (remaining <= 0) {
+      timeout = 0;
+    } else if ((unsigned long)remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+  
+  if (timeout > 0) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout));
+  }
+}
+
+void loadConfiguration() {
+  int64_t loadStart = esp_timer_get_time();
+  Preferences store;
+  store.begin("patcom", true);
+  
+  // NVS only hands out whole blobs, so each slot is read and verified once and kept for decoding.
+  // Decoding writes straight into the live config, so only the newest valid slot is decoded; if it
+  // passes CRC but still does not decode, the config is cleared before the older copy is tried
+  ConfigBlobHeader headers[2];
+  uint8_t* blobs[2];
+  bool valid[2];
+  valid[0] = readConfigBlob(store, 0, headers[0], blobs[0]);
+  valid[1] = readConfigBlob(store, 1, headers[1], blobs[1], valid[0] && blobs[0] == configBlobBuffer);
+  int newest = (valid[1] && (!valid[0] || headers[1].sequence > headers[0].sequence)) ? 1 : 0;
+  
+  configSlot = -1;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int slot = attempt == 0 ? newest : 1 - newest;
+    if (!valid[slot]) continue;
+    if (configSlot < 0) {
+      if (decodeConfigBlob(blobs[slot] + sizeof(ConfigBlobHeader), headers[slot].length)) {
+        configSlot = slot;
+        configSequence = headers[slot].sequence;
+        configCrc = headers[slot].crc;
+      } else {
+        Console.printf("Config slot %s did not decode - ignoring\n", CONFIG_BLOB_KEYS[slot]);
+        clearConfiguration();
+      }
+    }
+    releaseConfigBlob(blobs[slot]);
+  }
+  
+  bool migrate = false;
+  if (configSlot < 0) {
+    // No usable blob - fall back to the per-key layout written by older firmware
+    migrate = hasLegacyConfiguration(store);
+    loadLegacyConfiguration(store);
+  }
+  
+  store.end();
+  recordStage(METRIC_CONFIG_LOAD, esp_timer_get_time() - loadStart);
+  strcpy(deviceConfig.firmwareVersion, VERSION);
+  
+  if (configSlot >= 0) {
+    Console.printf("Configuration loaded from flash (slot %s, sequence %lu)\n", CONFIG_BLOB_KEYS[configSlot], (unsigned long)configSequence);
+  } else if (migrate) {
+    Console.println("Migrating per-key configuration to config blob...");
+    if (saveConfiguration()) {
+      removeLegacyConfiguration();
+    }
+  } else {
+    Console.println("No stored configuration - using defaults");
+  }
+  
+  // Pre-render every action so presses never touch JSON; {{key:NAME}} needs the key index first
+  rebuildApiKeyIndex();
+  compileActions();
+}
+
+bool saveConfiguration() {
+  uint32_t sequence = configSequence + 1;
+  size_t length = encodeConfigBlob(configBlobBuffer, sizeof(configBlobBuffer), sequence);
+  if (length == 0) {
+    Console.println("ERROR: Configuration does not fit the config blob - not saved");
+    return false;
+  }
+  
+  // Always overwrite the older slot so the last good copy survives a power cut mid-write
+  int slot = (configSlot == 0) ? 1 : 0;
+  
+  Preferences store;
+  store.begin("patcom", false);
+  size_t written = store.putBytes(CONFIG_BLOB_KEYS[slot], configBlobBuffer, length);
+  store.end();
+  
+  if (written != length) {
+    Console.println("ERROR: Config blob write failed");
+    return false;
+  }
+  
+  ConfigBlobHeader header;
+  memcpy(&header, configBlobBuffer, sizeof(header));
+  
+  configSlot = slot;
+  configSequence = sequence;
+  configCrc = header.crc;
+  Console.printf("Configuration saved to flash (slot %s, %u bytes)\n", CONFIG_BLOB_KEYS[slot], (unsigned)length);
+  return true;
+}
+
+// Config Blob Functions
+
+bool readConfigBlob(Preferences& store, int slot, ConfigBlobHeader& header, uint8_t*& blob, bool spare) {
+  // blob is configBlobBuffer, or a heap copy when the other slot still holds it (spare); release it once decoded
+  const char* key = CONFIG_BLOB_KEYS[slot];
+  size_t length = store.getBytesLength(key);
+  if (length < sizeof(header) || length > sizeof(configBlobBuffer)) {
+    return false;
+  }
+  
+  blob = spare ? (uint8_t*)malloc(length) : configBlobBuffer;
+  if (blob == NULL) {
+    Console.printf("ERROR: No heap for the %u byte config slot %s\n", (unsigned)length, key);
+    return false;
+  }
+  bool valid = false;
+  if (store.getBytes(key, blob, length) == length) {
+    memcpy(&header, blob, sizeof(header));
+    if (header.magic != CONFIG_BLOB_MAGIC || header.length != length - sizeof(header)) {
+      Console.printf("Config slot %s is corrupt - ignoring\n", key);
+    } else if (header.version != CONFIG_BLOB_VERSION) {
+      Console.printf("Config slot %s has unsupported version %u\n", key, (unsigned)header.version);
+    } else if (esp_rom_crc32_le(0, blob + sizeof(header), header.length) != header.crc) {
+      Console.printf("Config slot %s failed CRC check - ignoring\n", key);
+    } else {
+      valid = true;
+    }
+  }
+  
+  if (!valid) releaseConfigBlob(blob);
+  return valid;
+}
+
+void releaseConfigBlob(uint8_t* blob) {
+  if (blob != configBlobBuffer) free(blob);
+}
+
+size_t encodeConfigBlob(uint8_t* buffer, size_t size, uint32_t sequence) {
+  BlobWriter writer = {buffer + sizeof(ConfigBlobHeader), size - sizeof(ConfigBlobHeader), 0, false};
+  
+  // Device config
+  blobPutString(writer, deviceConfig.deviceName);
+  blobPutString(writer, deviceConfig.deviceId);
+  blobPutU8(writer, deviceConfig.deviceType);
+  blobPutU8(writer, constrain(deviceConfig.brightness, 0, 255));
+  blobPutU8(writer, (deviceConfig.discoverable ? 0x01 : 0) | (deviceConfig.autoSync ? 0x02 : 0) |
+                    (deviceConfig.persistRetries ? 0x04 : 0) | (deviceConfig.deepSleep ? 0x08 : 0));
+  blobPutString(writer, deviceConfig.configServerUrl);
+  
+  // Network config
+  blobPutString(writer, networkConfig.ssid);
+  blobPutString(writer, networkConfig.password);
+  blobPutU8(writer, networkConfig.staticIP);
+  blobPutString(writer, networkConfig.ip);
+  blobPutString(writer, networkConfig.subnet);
+  blobPutString(writer, networkConfig.gateway);
+  blobPutString(writer, networkConfig.dns);
+  
+  // Button configs
+  blobPutU8(writer, 8);
+  for (int i = 0; i < 8; i++) {
+    blobPutString(writer, buttonConfigs[i].name);
+    blobPutU8(writer, buttonConfigs[i].action);
+    blobPutU8(writer, buttonConfigs[i].enabled);
+    blobPutString(writer, buttonConfigs[i].actionData, true);
+  }
+  
+  // API keys - only active entries are stored
+  uint8_t activeApiKeyCount = 0;
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    if (apiKeys[i].active) activeApiKeyCount++;
+  }
+  blobPutU8(writer, activeApiKeyCount);
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    if (apiKeys[i].active) {
+      blobPutString(writer, apiKeys[i].name);
+      blobPutString(writer, apiKeys[i].value);
+    }
+  }
+  
+  // Trailing fields added after version 1 shipped - older blobs simply end before them
+  blobPutU16(writer, deviceConfig.sleepTimeout);
+  blobPutU16(writer, deviceConfig.longPressMs);
+  blobPutU16(writer, deviceConfig.doubleTapMs);
+  blobPutU16(writer, deviceConfig.chordWindowMs);
+  blobPutU8(writer, MAX_GESTURES);
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    const ButtonConfig& config = buttonConfigs[8 + g];
+    blobPutU8(writer, gestureBindings[g].type);
+    blobPutU8(writer, gestureBindings[g].buttons);
+    blobPutString(writer, config.name);
+    blobPutU8(writer, config.action);
+    blobPutU8(writer, config.enabled);
+    blobPutString(writer, config.actionData, true);
+  }
+  
+  if (writer.overflow) {
+    return 0;
+  }
+  
+  ConfigBlobHeader header;
+  header.magic = CONFIG_BLOB_MAGIC;
+  header.version = CONFIG_BLOB_VERSION;
+  header.length = writer.pos;
+  header.sequence = sequence;
+  header.crc = esp_rom_crc32_le(0, writer.data, writer.pos);
+  memcpy(buffer, &header, sizeof(header));
+  
+  return sizeof(header) + writer.pos;
+}
+
+bool decodeConfigBlob(const uint8_t* payload, size_t length) {
+  BlobReader reader = {payload, length, 0, false};
+  char value[ACTION_DATA_MAX];  // Staging for strings that go to configStore
+  
+  // Every stored string is replaced below, so start the store from empty
+  resetConfigStore();
+  
+  // Device config
+  blobGetString(reader, deviceConfig.deviceName, sizeof(deviceConfig.deviceName));
+  blobGetString(reader, deviceConfig.deviceId, sizeof(deviceConfig.deviceId));
+  deviceConfig.deviceType = (DeviceType)blobGetU8(reader);
+  deviceConfig.brightness = blobGetU8(reader);
+  uint8_t deviceFlags = blobGetU8(reader);
+  deviceConfig.discoverable = deviceFlags & 0x01;
+  deviceConfig.autoSync = deviceFlags & 0x02;
+  deviceConfig.persistRetries = deviceFlags & 0x04;
+  deviceConfig.deepSleep = deviceFlags & 0x08;
+  blobGetString(reader, deviceConfig.configServerUrl, sizeof(deviceConfig.configServerUrl));
+  
+  // Network config
+  blobGetString(reader, networkConfig.ssid, sizeof(networkConfig.ssid));
+  blobGetString(reader, networkConfig.password, sizeof(networkConfig.password));
+  networkConfig.staticIP = blobGetU8(reader);
+  blobGetString(reader, networkConfig.ip, sizeof(networkConfig.ip));
+  blobGetString(reader, networkConfig.subnet, sizeof(networkConfig.subnet));
+  blobGetString(reader, networkConfig.gateway, sizeof(networkConfig.gateway));
+  blobGetString(reader, networkConfig.dns, sizeof(networkConfig.dns));
+  
+  // Button configs
+  uint8_t buttonCount = blobGetU8(reader);
+  for (int i = 0; i < buttonCount && i < 8 && !reader.error; i++) {
+    blobGetString(reader, buttonConfigs[i].name, sizeof(buttonConfigs[i].name));
+    buttonConfigs[i].action = (ActionType)blobGetU8(reader);
+    buttonConfigs[i].enabled = blobGetU8(reader);
+    blobGetString(reader, value, sizeof(value), true);
+    if (!storeConfigString(buttonConfigs[i].actionData, value)) {
+      Console.printf("ERROR: Button %d action config did not fit the config store - not restored\n", i);
+    }
+  }
+  
+  // API keys
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    apiKeys[i].active = false;
+    strcpy(apiKeys[i].name, "");
+  }
+  uint8_t apiKeyCount = blobGetU8(reader);
+  for (int i = 0; i < apiKeyCount && i < MAX_API_KEYS && !reader.error; i++) {
+    blobGetString(reader, apiKeys[i].name, sizeof(apiKeys[i].name));
+    blobGetString(reader, value, API_KEY_VALUE_MAX);
+    apiKeys[i].active = strlen(apiKeys[i].name) > 0;
+    if (!storeConfigString(apiKeys[i].value, value) && apiKeys[i].active) {
+      Console.printf("ERROR: API key %s did not fit the config store - not restored\n", apiKeys[i].name);
+      apiKeys[i].active = false;
+    }
+  }
+  
+  deviceConfig.sleepTimeout = reader.pos < reader.size ? blobGetU16(reader) : SLEEP_DEFAULT_TIMEOUT;
+  
+  // Gesture trailer - blobs written before gestures existed have none
+  resetGestureSlots();
+  if (reader.pos < reader.size) {
+    deviceConfig.longPressMs = blobGetU16(reader);
+    deviceConfig.doubleTapMs = blobGetU16(reader);
+    deviceConfig.chordWindowMs = blobGetU16(reader);
+    uint8_t gestureCount = blobGetU8(reader);
+    for (int g = 0; g < gestureCount && g < MAX_GESTURES && !reader.error; g++) {
+      ButtonConfig& config = buttonConfigs[8 + g];
+      gestureBindings[g].type = (GestureType)blobGetU8(reader);
+      gestureBindings[g].buttons = blobGetU8(reader);
+      blobGetString(reader, config.name, sizeof(config.name));
+      config.action = (ActionType)blobGetU8(reader);
+      config.enabled = blobGetU8(reader);
+      blobGetString(reader, value, sizeof(value), true);
+      if (!storeConfigString(config.actionData, value)) {
+        Console.printf("ERROR: Gesture %d action config did not fit the config store - not restored\n", g);
+      }
+      if (gestureBindings[g].type >= GESTURE_TYPE_COUNT) gestureBindings[g].type = GESTURE_NONE;
+    }
+  }
+  
+  return !reader.error;
+}
+
+// Back to the zeroed state the globals boot with, so nothing from a half-decoded slot survives
+void clearConfiguration() {
+  memset(&deviceConfig, 0, sizeof(deviceConfig));
+  memset(&networkConfig, 0, sizeof(networkConfig));
+  memset(buttonConfigs, 0, sizeof(buttonConfigs));
+  memset(apiKeys, 0, sizeof(apiKeys));
+  resetConfigStore();
+  resetGestureSlots();
+}
+
+void blobPutU8(BlobWriter& writer, uint8_t value) {
+  if (writer.pos + 1 > writer.size) {
+    writer.overflow = true;
+    return;
+  }
+  writer.data[writer.pos++] = value;
+}
+
+void blobPutU16(BlobWriter& writer, uint16_t value) {
+  blobPutU8(writer, value & 0xFF);
+  blobPutU8(writer, value >> 8);
+}
+
+void blobPutString(BlobWriter& writer, const char* value, bool wide) {
+  // Length-prefixed, no terminator; wide strings use a 16-bit length
+  size_t length = strlen(value);
+  if (wide) {
+    blobPutU16(writer, length);
+  } else {
+    length = min(length, (size_t)255);
+    blobPutU8(writer, length);
+  }
+  
+  if (writer.pos + length > writer.size) {
+    writer.overflow = true;
+    return;
+  }
+  memcpy(writer.data + writer.pos, value, length);
+  writer.pos += length;
+}
+
+uint8_t blobGetU8(BlobReader& reader) {
+  if (reader.pos + 1 > reader.size) {
+    reader.error = true;
+    return 0;
+  }
+  return reader.data[reader.pos++];
+}
+
+uint16_t blobGetU16(BlobReader& reader) {
+  uint16_t low = blobGetU8(reader);
+  uint16_t high = blobGetU8(reader);
+  return low | (high << 8);
+}
+
+void blobGetString(BlobReader& reader, char* dest, size_t destSize, bool wide) {
+  size_t length = wide ? blobGetU16(reader) : blobGetU8(reader);
+  
+  if (reader.error || reader.pos + length > reader.size || length >= destSize) {
+    reader.error = true;
+    dest[0] = '\0';
+    return;
+  }
+  memcpy(dest, reader.data + reader.pos, length);
+  dest[length] = '\0';
+  reader.pos += length;
+}
+
+// Legacy Per-Key Configuration Functions
+
+void loadLegacyConfiguration(Preferences& store) {
+  char key[24];
+  char value[ACTION_DATA_MAX];
+  
+  // Load device config
+  strcpy(deviceConfig.deviceName, store.getString("deviceName", "PATCOM").c_str());
+  strlcpy(deviceConfig.deviceId, store.getString("deviceId", "PATCOM-" + String(ESP.getEfuseMac(), HEX)).c_str(),
+          sizeof(deviceConfig.deviceId));
+  deviceConfig.deviceType = (DeviceType)store.getInt("deviceType", DEVICE_TYPE_BUTTON_MATRIX);
+  deviceConfig.brightness = store.getInt("brightness", 255);
+  deviceConfig.discoverable = store.getBool("discoverable", true);
+  deviceConfig.autoSync = store.getBool("autoSync", false);
+  deviceConfig.persistRetries = false;
+  deviceConfig.sleepTimeout = SLEEP_DEFAULT_TIMEOUT;
+  deviceConfig.deepSleep = false;
+  resetGestureSlots();
+  strcpy(deviceConfig.configServerUrl, store.getString("configServer", "").c_str());
+  
+  // Load API keys
+  resetConfigStore();
+  int apiKeyCount = store.getInt("apiKeyCount", 0);
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    apiKeys[i].active = false;
+    strcpy(apiKeys[i].name, "");
+  }
+  
+  for (int i = 0; i < apiKeyCount && i < MAX_API_KEYS; i++) {
+    snprintf(key, sizeof(key), "apiKey%d_name", i);
+    store.getString(key, apiKeys[i].name, sizeof(apiKeys[i].name));
+    snprintf(key, sizeof(key), "apiKey%d_value", i);
+    value[0] = '\0';
+    store.getString(key, value, API_KEY_VALUE_MAX);
+    storeConfigString(apiKeys[i].value, value);
+    apiKeys[i].active = strlen(apiKeys[i].name) > 0;
+  }
+  
+  // Load network config
+  strcpy(networkConfig.ssid, store.getString("ssid", "").c_str());
+  strcpy(networkConfig.password, store.getString("password", "").c_str());
+  networkConfig.staticIP = store.getBool("staticIP", false);
+  strcpy(networkConfig.ip, store.getString("ip", "").c_str());
+  strcpy(networkConfig.subnet, store.getString("subnet", "").c_str());
+  strcpy(networkConfig.gateway, store.getString("gateway", "").c_str());
+  strcpy(networkConfig.dns, store.getString("dns", "8.8.8.8").c_str());
+  
+  // Load button configs
+  for (int i = 0; i < 8; i++) {
+    snprintf(key, sizeof(key), "btn%d_name", i);
+    snprintf(buttonConfigs[i].name, sizeof(buttonConfigs[i].name), "Button %d", i);
+    store.getString(key, buttonConfigs[i].name, sizeof(buttonConfigs[i].name));
+    snprintf(key, sizeof(key), "btn%d_action", i);
+    buttonConfigs[i].action = (ActionType)store.getInt(key, ACTION_NONE);
+    snprintf(key, sizeof(key), "btn%d_data", i);
+    strcpy(value, "{}");
+    store.getString(key, value, sizeof(value));
+    storeConfigString(buttonConfigs[i].actionData, value);
+    snprintf(key, sizeof(key), "btn%d_enabled", i);
+    buttonConfigs[i].enabled = store.getBool(key, true);
+  }
+}
+
+bool hasLegacyConfiguration(Preferences& store) {
+  return store.isKey("deviceName") || store.isKey("ssid") || store.isKey("btn0_name");
+}
+
+void removeLegacyConfiguration() {
+  static const char* legacyKeys[] = {
+    "deviceName", "deviceId", "deviceType", "brightness", "discoverable", "autoSync", "configServer",
+    "apiKeyCount", "ssid", "password", "staticIP", "ip", "subnet", "gateway", "dns"
+  };
+  static const char* legacyButtonFields[] = {"name", "action", "data", "enabled"};
+  char key[24];
+  
+  Preferences store;
+  store.begin("patcom", false);
+  for (size_t i = 0; i < sizeof(legacyKeys) / sizeof(legacyKeys[0]); i++) {
+    store.remove(legacyKeys[i]);
+  }
+  for (int i = 0; i < 8; i++) {
+    for (size_t f = 0; f < sizeof(legacyButtonFields) / sizeof(legacyButtonFields[0]); f++) {
+      snprintf(key, sizeof(key), "btn%d_%s", i, legacyButtonFields[f]);
+      store.remove(key);
+    }
+  }
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    snprintf(key, sizeof(key), "apiKey%d_name", i);
+    store.remove(key);
+    snprintf(key, sizeof(key), "apiKey%d_value", i);
+    store.remove(key);
+  }
+  store.end();
+  
+  Console.println("Legacy per-key configuration removed");
+}
+
+void connectWiFi() {
+  Console.println("=== WiFi Connection Debug ===");
+  Console.printf("SSID length: %u\n", (unsigned)strlen(networkConfig.ssid));
+  Console.printf("SSID: '%s'\n", networkConfig.ssid);
+  
+  if (strlen(networkConfig.ssid) == 0) {
+    Console.println("No WiFi credentials - entering config mode");
+    wifiState = WIFI_STATE_IDLE;
+    WiFi.mode(WIFI_AP);
+    startConfigAP();
+    return;
+  }
+  
+  // We persist our own fast-reconnect data; keep the driver from writing flash on every begin()
+  WiFi.persistent(false);
+  WiFi.setAutoReconnect(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.onEvent(onWiFiEvent);
+  applyStaticIP();
+  
+  loadWiFiCache();
+  beginWiFiAttempt();
+}
+
+void applyStaticIP() {
+  if (networkConfig.staticIP && strlen(networkConfig.ip) > 0) {
+    IPAddress local_IP, gateway, subnet, dns;
+    local_IP.fromString(networkConfig.ip);
+    gateway.fromString(networkConfig.gateway);
+    subnet.fromString(networkConfig.subnet);
+    dns.fromString(networkConfig.dns);
+    
+    if (!WiFi.config(local_IP, gateway, subnet, dns)) {
+      Console.println("Static IP configuration failed");
+    }
+  }
+}
+
+// WiFi Connection Manager Functions
+
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  // Runs in the WiFi event task - record the event and let updateWiFi() act on it
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+      memcpy(wifiEventBssid, info.wifi_sta_connected.bssid, sizeof(wifiEventBssid));
+      wifiEventChannel = info.wifi_sta_connected.channel;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      wifiConnected = true;
+      wifiEventGotIp = true;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      wifiConnected = false;
+      wifiDisconnectReason = info.wifi_sta_disconnected.reason;
+      wifiEventDisconnected = true;
+      break;
+    default:
+      break;
+  }
+}
+
+void beginWiFiAttempt() {
+  wifiFastAttempt = wifiCacheValid;
+  wifiState = WIFI_STATE_CONNECTING;
+  wifiStateSince = millis();
+  
+  if (wifiFastAttempt) {
+    Console.printf("Connecting to WiFi: %s (fast reconnect, channel %u)\n", networkConfig.ssid, wifiCache.channel);
+    WiFi.begin(networkConfig.ssid, networkConfig.password, wifiCache.channel, wifiCache.bssid, true);
+  } else {
+    Console.printf("Connecting to WiFi: %s\n", networkConfig.ssid);
+    WiFi.begin(networkConfig.ssid, networkConfig.password);
+  }
+}
+
+void scheduleWiFiRetry() {
+  // A stale cache (AP moved channel or was replaced) falls straight back to a full scan
+  if (wifiFastAttempt) {
+    Console.println("Fast reconnect failed - retrying with full scan");
+    wifiCacheValid = false;
+    beginWiFiAttempt();
+    return;
+  }
+  
+  WiFi.disconnect();
+  wifiState = WIFI_STATE_BACKOFF;
+  wifiStateSince = millis();
+  Console.printf("WiFi connection failed (reason %u) - retrying in %lums\n", wifiDisconnectReason, wifiRetryDelay);
+  
+  // Never connected since boot - open the config AP while we keep retrying
+  if (!wifiEverConnected && !configMode) {
+    Console.println("WiFi connection failed - entering config mode");
+    WiFi.mode(WIFI_AP_STA);
+    startConfigAP();
+    
+    // Print available networks for debugging (async so buttons stay responsive)
+    Console.println("Scanning for networks...");
+    WiFi.scanNetworks(true);
+    wifiScanPending = true;
+  }
+}
+
+void updateWiFi() {
+  if (wifiState == WIFI_STATE_IDLE) return;
+  
+  unsigned long currentTime = millis();
+  
+  if (wifiEventGotIp) {
+    wifiEventGotIp = false;
+    wifiState = WIFI_STATE_CONNECTED;
+    wifiRetryDelay = WIFI_RETRY_INITIAL;
+    
+    Console.printf("WiFi connected in %lums! IP address: %s\n", currentTime - wifiStateSince, WiFi.localIP().toString().c_str());
+    
+    // Connectivity is back - the fallback AP is no longer needed
+    if (configMode) {
+      configMode = false;
+      WiFi.mode(WIFI_STA);
+      Console.println("Config AP stopped");
+    }
+    
+    wifiEverConnected = true;
+    setStatusLED(STATUS_ACTIVE);
+    wifiPowerSave = WIFI_PS_MIN_MODEM;  // Driver default, re-applied whenever the station starts
+    applyWiFiPowerSave(cpuBoosted() ? WIFI_PS_NONE : (criticalBattery ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM));
+    saveWiFiCache();
+    requestHttpPoolWarmup();
+    discoveryAnnounceDue = true;
+  }
+  
+  if (wifiEventDisconnected) {
+    wifiEventDisconnected = false;
+    
+    if (wifiState == WIFI_STATE_CONNECTED) {
+      Console.printf("WiFi connection lost (reason %u) - reconnecting\n", wifiDisconnectReason);
+      setStatusLED(STATUS_CONNECTING);
+      beginWiFiAttempt();
+    } else if (wifiState == WIFI_STATE_CONNECTING) {
+      scheduleWiFiRetry();
+    }
+  }
+  
+  switch (wifiState) {
+    case WIFI_STATE_CONNECTING: {
+      unsigned long timeout = wifiFastAttempt ? WIFI_FAST_CONNECT_TIMEOUT : WIFI_CONNECT_TIMEOUT;
+      if (currentTime - wifiStateSince > timeout) {
+        Console.println("WiFi connection attempt timed out");
+        scheduleWiFiRetry();
+      }
+      break;
+    }
+    
+    case WIFI_STATE_BACKOFF:
+      if (currentTime - wifiStateSince >= wifiRetryDelay) {
+        wifiRetryDelay = min(wifiRetryDelay * 2, WIFI_RETRY_MAX);
+        beginWiFiAttempt();
+      }
+      break;
+    
+    default:
+      break;
+  }
+  
+  if (wifiScanPending) {
+    int n = WiFi.scanComplete();
+    if (n != WIFI_SCAN_RUNNING) {
+      wifiScanPending = false;
+      if (n <= 0) {
+        Console.println("No networks found");
+      } else {
+        Console.printf("%d networks found:\n", n);
+        for (int i = 0; i < n; ++i) {
+          Console.printf("%d: %s (%ddBm)\n", i + 1, WiFi.SSID(i).c_str(), (int)WiFi.RSSI(i));
+        }
+      }
+      WiFi.scanDelete();
+    }
+  }
+}
+
+void startConfigAP() {
+  configMode = true;
+  setStatusLED(STATUS_ERROR);
+  
+  bool apResult = WiFi.softAP(CONFIG_AP_SSID, CONFIG_AP_PASSWORD);
+  Console.printf("AP creation result: %s\n", apResult ? "SUCCESS" : "FAILED");
+  Console.printf("AP started: %s\n", CONFIG_AP_SSID);
+  Console.print("AP IP: ");
+  Console.println(WiFi.softAPIP());
+  Console.printf("Connect to %s with password: %s\n", CONFIG_AP_SSID, CONFIG_AP_PASSWORD);
+}
+
+void loadWiFiCache() {
+  uint32_t ssidCrc = esp_rom_crc32_le(0, (const uint8_t*)networkConfig.ssid, strlen(networkConfig.ssid));
+  
+  // After deep sleep the RTC copy is current, no flash read needed
+  if (rtcWiFiCacheValid && rtcWiFiCache.ssidCrc == ssidCrc && rtcWiFiCache.channel > 0) {
+    wifiCache = rtcWiFiCache;
+    wifiCacheValid = true;
+    return;
+  }
+  
+  Preferences store;
+  store.begin("patcom", true);
+  size_t length = store.getBytes("wifiCache", &wifiCache, sizeof(wifiCache));
+  store.end();
+  
+  wifiCacheValid = length == sizeof(wifiCache) && wifiCache.ssidCrc == ssidCrc && wifiCache.channel > 0;
+  rtcWiFiCache = wifiCache;
+  rtcWiFiCacheValid = wifiCacheValid;
+}
+
+void saveWiFiCache() {
+  WiFiFastReconnect entry;
+  entry.ssidCrc = esp_rom_crc32_le(0, (const uint8_t*)networkConfig.ssid, strlen(networkConfig.ssid));
+  memcpy(entry.bssid, wifiEventBssid, sizeof(entry.bssid));
+  entry.channel = wifiEventChannel;
+  
+  // Only touch flash when the AP or channel actually changed
+  if (wifiCacheValid && memcmp(&entry, &wifiCache, sizeof(entry)) == 0) {
+    return;
+  }
+  
+  wifiCache = entry;
+  wifiCacheValid = entry.channel > 0;
+  rtcWiFiCache = wifiCache;
+  rtcWiFiCacheValid = wifiCacheValid;
+  
+  Preferences store;
+  store.begin("patcom", false);
+  store.putBytes("wifiCache", &wifiCache, sizeof(wifiCache));
+  store.end();
+  Console.printf("Cached AP for fast reconnect (channel %u)\n", wifiCache.channel);
+}
+
+void setupWebServer() {
+  // Handlers run in the async TCP task, concurrently with loop() - anything they touch is locked or deferred
+  
   // Serve configuration page
-  server.on("/", HTTP_GET, []() {
-    String html = "<!DOCTYPE html><html><head><title>PATCOM Config</title></head><body>";
-    html += "<h1>PATCOM Configuration</h1>";
-    html += "<p>Device: " + String(deviceConfig.deviceName) + "</p>";
-    html += "<p>Version: " + String(VERSION) + "</p>";
-    html += "<p>WiFi: " + String(wifiConnected ? "Connected" : "Disconnected") + "</p>";
-    html += "<p>Power: " + String(batteryVoltage, 2) + "V</p>";
-    html += "</body></html>";
-    server.send(200, "text/html", html);
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
+    AsyncResponseStream* response = request->beginResponseStream("text/html");
+    response->print("<!DOCTYPE html><html><head><title>PATCOM Config</title></head><body>");
+    response->print("<h1>PATCOM Configuration</h1>");
+    response->printf("<p>Device: %s</p>", deviceConfig.deviceName);
+    response->printf("<p>Version: %s</p>", VERSION);
+    response->printf("<p>WiFi: %s</p>", wifiConnected ? "Connected" : "Disconnected");
+    response->printf("<p>Power: %.2fV (%u%%, %s)</p>", batteryVoltage, batteryPercent, batteryLevelName(batteryLevel));
+    response->print("</body></html>");
+    request->send(response);
+  });
+  
+  // API endpoint for configuration
+  server.on("/api/config", HTTP_GET, handleConfigRequest);
+  
+  // API endpoint for uploading configuration
+  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest* request) {
+    char* body = (char*)request->_tempObject;
+    char message[STATUS_MESSAGE_MAX];
+    if (body == NULL) {
+      sendStatusJson(request, 400, "error", "Missing or oversized body");
+      return;
+    }
+    
+    // If-Match carries the ETag the sender diffed against; the check and the upload are one locked step
+    char etag[32];
+    lockConfig();
+    formatConfigETag(etag, sizeof(etag));
+    if (request->hasHeader("If-Match") && request->getHeader("If-Match")->value() != etag) {
+      unlockConfig();
+      sendConfigUploadJson(request, 412, "error", "Configuration changed since it was read");
+    } else if (handleConfigUpload(body, message, sizeof(message))) {
+      unlockConfig();
+      sendConfigUploadJson(request, 200, "ok", message);
+    } else {
+      unlockConfig();
+      sendConfigUploadJson(request, 400, "error", message);
+    }
+  }, NULL, collectRequestBody);
+  
+  // Server-sent event stream of button presses, LED changes and telemetry
+  events.onConnect([](AsyncEventSourceClient* client) {
+    // Start the new subscriber off with current state
+    StaticJsonDocument<512> doc;
+    buildDeviceInfo(doc);
+    doc["type"] = "telemetry";
+    char payload[512];
+    serializeJson(doc, payload, sizeof(payload));
+    client->send(payload, "telemetry", millis());
+  });
+  events.setFilter([](AsyncWebServerRequest* request) {
+    return events.count() < (size_t)EVENT_STREAM_MAX_CLIENTS;
+  });
+  server.addHandler(&events);
+  
+  // API endpoint for updating a single button
+  server.on("/api/button", HTTP_PATCH, handleButtonPatchRequest, NULL, collectRequestBody);
+  
+  // Firmware update: the raw image is the body, streamed into flash as it arrives
+  server.on("/api/ota", HTTP_POST, handleOtaRequest, NULL, handleOtaBody);
+  server.on("/api/ota", HTTP_GET, handleOtaStatusRequest);
+  
+  // Prometheus text exposition of the latency histograms and outcome counters
+  server.on("/api/metrics", HTTP_GET, [](AsyncWebServerRequest* request) {
+    AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+    writeMetrics(*response);
+    request->send(response);
+  });
+  
+  // API endpoint for button testing
+  server.on("/api/test", HTTP_POST, [](AsyncWebServerRequest* request) {
+    bool hasButton = request->hasParam("button") || request->hasParam("button", true);
+    if (!hasButton) {
+      sendStatusJson(request, 400, "error", "Missing button parameter");
+      return;
+    }
+    
+    AsyncWebParameter* param = request->hasParam("button") ? request->getParam("button") : request->getParam("button", true);
+    int buttonIndex = param->value().toInt();
+    if (buttonIndex < 0 || buttonIndex >= 8) {
+      sendStatusJson(request, 400, "error", "Invalid button index");
+      return;
+    }
+    
+    // LEDs and the action queue belong to loop() - hand the press over
+    portENTER_CRITICAL(&buttonEdgeMux);
+    pendingTestPresses |= (1 << buttonIndex);
+    portEXIT_CRITICAL(&buttonEdgeMux);
+    if (loopTaskHandle != NULL) {
+      xTaskNotifyGive(loopTaskHandle);
+    }
+    char message[32];
+    snprintf(message, sizeof(message), "Button %d triggered", buttonIndex);
+    sendStatusJson(request, 200, "ok", message);
+  });
+  
+  server.onNotFound([](AsyncWebServerRequest* request) {
+    sendStatusJson(request, 404, "error", "Not found");
+  });
+  
+  server.begin();
+  Console.println("Web server started on port 80");
+}
+
+void handleConfigRequest(AsyncWebServerRequest* request) {
+  char etag[32];
+  formatConfigETag(etag, sizeof(etag));
+  
+  // Pollers that already hold this generation get an empty 304
+  if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == etag) {
+    AsyncWebServerResponse* response = request->beginResponse(304);
+    response->addHeader("ETag", etag);
+    request->send(response);
+    return;
+  }
+  
+  lockConfig();
+  if (configJsonCache.data == nullptr || configJsonCache.generation != configGeneration) {
+    rebuildConfigJsonCache();
+  }
+  std::shared_ptr<char> data = configJsonCache.data;
+  size_t length = configJsonCache.length;
+  formatConfigETag(etag, sizeof(etag));  // Matches the body even if a commit landed since the check above
+  unlockConfig();
+  
+  if (data == nullptr) {
+    sendStatusJson(request, 500, "error", "Out of memory");
+    return;
+  }
+  
+  AsyncWebServerResponse* response = request->beginResponse("application/json", length,
+    [data, length](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      size_t chunk = min(maxLen, length - index);
+      memcpy(buffer, data.get() + index, chunk);
+      return chunk;
+    });
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+bool rebuildConfigJsonCache() {
+  // Caller holds the config lock. First pass sizes the body, second renders it
+  char piece[CONFIG_JSON_PIECE_SIZE];
+  size_t length = 0;
+  for (int i = 0; i < CONFIG_JSON_PIECES; i++) {
+    length += renderConfigPiece(i, piece, sizeof(piece));
+  }
+  
+  char* buffer = (char*)malloc(length + 1);
+  if (buffer == NULL) {
+    configJsonCache.data = nullptr;
+    return false;
+  }
+  
+  size_t pos = 0;
+  for (int i = 0; i < CONFIG_JSON_PIECES; i++) {
+    pos += renderConfigPiece(i, buffer + pos, length + 1 - pos);
+  }
+  
+  configJsonCache.data = std::shared_ptr<char>(buffer, free);
+  configJsonCache.length = pos;
+  configJsonCache.generation = configGeneration;
+  return true;
+}
+
+void formatConfigETag(char* etag, size_t size) {
+  // Firmware version is included because it is part of the body
+  snprintf(etag, size, "\"%s-%lu.%lu\"", VERSION, (unsigned long)configSequence, (unsigned long)configGeneration);
+}
+
+size_t renderConfigPiece(int piece, char* buffer, size_t size) {
+  // Pieces: 0 = device/network and the opening of "buttons", 1-8 = buttons, 9.. = gestures, last = closing
+  size_t length = 0;
+  lockConfig();
+  
+  if (piece == 0) {
+    StaticJsonDocument<512> doc;
+    doc["device"]["name"] = deviceConfig.deviceName;
+    doc["device"]["version"] = VERSION;
+    doc["device"]["brightness"] = deviceConfig.brightness;
+    doc["device"]["discoverable"] = deviceConfig.discoverable;
+    doc["device"]["persistRetries"] = deviceConfig.persistRetries;
+    doc["device"]["sleepTimeout"] = deviceConfig.sleepTimeout;
+    doc["device"]["deepSleep"] = deviceConfig.deepSleep;
+    doc["device"]["longPressMs"] = deviceConfig.longPressMs;
+    doc["device"]["doubleTapMs"] = deviceConfig.doubleTapMs;
+    doc["device"]["chordWindowMs"] = deviceConfig.chordWindowMs;
+    
+    doc["network"]["ssid"] = networkConfig.ssid;
+    doc["network"]["staticIP"] = networkConfig.staticIP;
+    doc["network"]["ip"] = networkConfig.ip;
+    doc["network"]["subnet"] = networkConfig.subnet;
+    doc["network"]["gateway"] = networkConfig.gateway;
+    
+    // Reopen the object so the button array can follow
+    length = serializeJson(doc, buffer, size);
+    if (length > 0 && length + 12 < size) {
+      length += snprintf(buffer + length - 1, size - length + 1, ",\"buttons\":[") - 1;
+    } else {
+      length = 0;
+    }
+  } else if (piece <= 8) {
+    int i = piece - 1;
+    StaticJsonDocument<256> doc;
+    doc["id"] = i;
+    doc["name"] = buttonConfigs[i].name;
+    doc["action"] = buttonConfigs[i].action;
+    doc["enabled"] = buttonConfigs[i].enabled;
+    
+    // Action data is already JSON - embed it without re-parsing
+    doc["config"] = serialized((const char*)buttonConfigs[i].actionData);
+    
+    if (i > 0) {
+      buffer[length++] = ',';
+    }
+    length += serializeJson(doc, buffer + length, size - length);
+  } else if (piece < CONFIG_JSON_PIECES - 1) {
+    int g = piece - 9;
+    if (g == 0) {
+      length = strlcpy(buffer, "],\"gestures\":[", size);
+    }
+    if (gestureBindings[g].type != GESTURE_NONE) {
+      // Comma only if an earlier slot rendered something
+      for (int earlier = 0; earlier < g; earlier++) {
+        if (gestureBindings[earlier].type != GESTURE_NONE) {
+          buffer[length++] = ',';
+          break;
+        }
+      }
+      StaticJsonDocument<320> doc;
+      renderGestureJson(g, doc.to<JsonObject>());
+      length += serializeJson(doc, buffer + length, size - length);
+    }
+  } else {
+    length = strlcpy(buffer, "]}", size);
+  }
+  
+  unlockConfig();
+  return length;
+}
+
+void collectRequestBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+  // Bodies arrive in TCP-sized pieces; assemble into a NUL-terminated buffer freed with the request
+  if (index == 0) {
+    if (total > CONFIG_UPLOAD_MAX) return;
+    request->_tempObject = malloc(total + 1);
+  }
+  char* body = (char*)request->_tempObject;
+  if (body == NULL) return;
+  
+  memcpy(body + index, data, len);
+  if (index + len == total) {
+    body[total] = '\0';
+  }
+}
+
+void sendStatusJson(AsyncWebServerRequest* request, int code, const char* status, const char* message) {
+  StaticJsonDocument<256> doc;
+  doc["status"] = status;
+  doc["message"] = message;
+  
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  response->setCode(code);
+  serializeJson(doc, *response);
+  request->send(response);
+}
+
+void sendConfigUploadJson(AsyncWebServerRequest* request, int code, const char* status, const char* message) {
+  // Like sendStatusJson, plus what a fleet sync needs next: the new ETag and whether a restart is pending
+  char etag[32];
+  formatConfigETag(etag, sizeof(etag));
+  StaticJsonDocument<256> doc;
+  doc["status"] = status;
+  doc["message"] = message;
+  doc["etag"] = etag;
+  doc["restart"] = restartAt != 0;
+  
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  response->setCode(code);
+  response->addHeader("ETag", etag);
+  serializeJson(doc, *response);
+  request->send(response);
+}
+
+void processTestPresses() {
+  if (pendingTestPresses == 0) return;
+  
+  portENTER_CRITICAL(&buttonEdgeMux);
+  uint8_t presses = pendingTestPresses;
+  pendingTestPresses = 0;
+  portEXIT_CRITICAL(&buttonEdgeMux);
+  
+  for (int i = 0; i < 8; i++) {
+    if (presses & (1 << i)) {
+      handleButtonPress(i);
+    }
+  }
+}
+
+void buildConfigJson(JsonDocument& doc) {
+  doc["device"]["name"] = deviceConfig.deviceName;
+  doc["device"]["version"] = VERSION;
+  doc["device"]["brightness"] = deviceConfig.brightness;
+  doc["device"]["discoverable"] = deviceConfig.discoverable;
+  doc["device"]["persistRetries"] = deviceConfig.persistRetries;
+  doc["device"]["sleepTimeout"] = deviceConfig.sleepTimeout;
+  doc["device"]["deepSleep"] = deviceConfig.deepSleep;
+  doc["device"]["longPressMs"] = deviceConfig.longPressMs;
+  doc["device"]["doubleTapMs"] = deviceConfig.doubleTapMs;
+  doc["device"]["chordWindowMs"] = deviceConfig.chordWindowMs;
+  
+  doc["network"]["ssid"] = networkConfig.ssid;
+  doc["network"]["staticIP"] = networkConfig.staticIP;
+  doc["network"]["ip"] = networkConfig.ip;
+  doc["network"]["subnet"] = networkConfig.subnet;
+  doc["network"]["gateway"] = networkConfig.gateway;
+  
+  JsonArray buttons = doc.createNestedArray("buttons");
+  for (int i = 0; i < 8; i++) {
+    JsonObject btn = buttons.createNestedObject();
+    btn["id"] = i;
+    btn["name"] = buttonConfigs[i].name;
+    btn["action"] = buttonConfigs[i].action;
+    btn["enabled"] = buttonConfigs[i].enabled;
+    
+    // Action data is already JSON - embed it without re-parsing
+    btn["config"] = serialized((const char*)buttonConfigs[i].actionData);
+  }
+  
+  JsonArray gestures = doc.createNestedArray("gestures");
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    if (gestureBindings[g].type != GESTURE_NONE) {
+      renderGestureJson(g, gestures.createNestedObject());
+    }
+  }
+}
+
+void renderGestureJson(int id, JsonObject gesture) {
+  const ButtonConfig& config = buttonConfigs[8 + id];
+  gesture["id"] = id;
+  gesture["type"] = gestureName(8 + id);
+  JsonArray buttons = gesture.createNestedArray("buttons");
+  for (int b = 0; b < 8; b++) {
+    if (gestureBindings[id].buttons & (1 << b)) buttons.add(b);
+  }
+  gesture["name"] = config.name;
+  gesture["action"] = config.action;
+  gesture["enabled"] = config.enabled;
+  gesture["config"] = serialized((const char*)config.actionData);
+}
+
+// Discovery Functions
+
+void startDiscovery() {
+  if (discoveryStarted) return;
+  
+  // Both sockets bind INADDR_ANY, so they also answer on the config AP
+  if (!discoveryUdp.begin(DISCOVERY_PORT) || !configUdp.begin(CONFIG_PORT)) {
+    Console.println("ERROR: Failed to open UDP discovery sockets");
+    return;
+  }
+  discoveryStarted = true;
+  Console.printf("UDP discovery on port %u, config on port %u\n", DISCOVERY_PORT, CONFIG_PORT);
+}
+
+void handleDiscovery() {
+  if (!discoveryStarted) return;
+  
+  int length = discoveryUdp.parsePacket();
+  if (length > 0) {
+    handleDiscoveryPacket(length);
+  }
+  
+  length = configUdp.parsePacket();
+  if (length > 0) {
+    handleConfigPacket(length);
+  }
+  
+  // Periodic announcement lets the configurator notice devices without polling
+  if (deviceConfig.discoverable && wifiConnected) {
+    unsigned long currentTime = millis();
+    if (discoveryAnnounceDue || currentTime - lastDiscoveryAnnounce >= DISCOVERY_ANNOUNCE_INTERVAL) {
+      discoveryAnnounceDue = false;
+      lastDiscoveryAnnounce = currentTime;
+      sendDiscoveryAnnouncement("device_discovery", WiFi.broadcastIP());
+    }
+  }
+}
+
+void sendDiscoveryAnnouncement(const char* type, IPAddress address) {
+  StaticJsonDocument<512> doc;
+  doc["type"] = type;
+  doc["device_id"] = deviceConfig.deviceId;
+  doc["device_name"] = deviceConfig.deviceName;
+  doc["device_type"] = deviceTypeName(deviceConfig.deviceType);
+  doc["version"] = VERSION;
+  // char arrays are copied into the document, so the buffers can stay on the stack
+  char ip[16];
+  char mac[18];
+  char hash[9];
+  uint8_t macBytes[6];
+  formatIPAddress(wifiConnected ? WiFi.localIP() : WiFi.softAPIP(), ip, sizeof(ip));
+  WiFi.macAddress(macBytes);
+  snprintf(mac, sizeof(mac), "%02X:%02X:%02X:%02X:%02X:%02X", macBytes[0], macBytes[1], macBytes[2], macBytes[3],
+           macBytes[4], macBytes[5]);
+  formatConfigHash(hash, sizeof(hash));
+  doc["ip"] = ip;
+  doc["mac"] = mac;
+  doc["battery"] = batteryVoltage;
+  doc["uptime"] = millis();
+  doc["config_hash"] = hash;
+  doc["wifi_rssi"] = wifiConnected ? WiFi.RSSI() : 0;
+  
+  // The access point lets a rollout limit how many devices flash behind one AP at a time
+  char bssid[18] = "";
+  if (wifiConnected && wifiCacheValid) {
+    snprintf(bssid, sizeof(bssid), "%02X:%02X:%02X:%02X:%02X:%02X", wifiCache.bssid[0], wifiCache.bssid[1],
+             wifiCache.bssid[2], wifiCache.bssid[3], wifiCache.bssid[4], wifiCache.bssid[5]);
+  }
+  doc["bssid"] = bssid;
+  doc["ota_state"] = otaStateName(esp_ota_get_running_partition());
+  
+  discoveryUdp.beginPacket(address, DISCOVERY_PORT);
+  serializeJson(doc, discoveryUdp);
+  discoveryUdp.endPacket();
+}
+
+void handleDiscoveryPacket(int length) {
+  IPAddress remote = discoveryUdp.remoteIP();
+  if (length > (int)UDP_PACKET_MAX) {
+    discoveryUdp.flush();
+    return;
+  }
+  
+  int read = discoveryUdp.read(udpPacketBuffer, UDP_PACKET_MAX);
+  udpPacketBuffer[read > 0 ? read : 0] = '\0';
+  
+  StaticJsonDocument<128> doc;
+  if (deserializeJson(doc, udpPacketBuffer)) return;
+  
+  // Our own and other devices' announcements arrive here too - only answer requests
+  const char* type = doc["type"] | "";
+  if (strcmp(type, "discover_devices") == 0 && deviceConfig.discoverable) {
+    sendDiscoveryAnnouncement("device_response", remote);
+  }
+}
+
+void handleConfigPacket(int length) {
+  IPAddress remote = configUdp.remoteIP();
+  if (length > (int)UDP_PACKET_MAX) {
+    configUdp.flush();
+    sendConfigUpdateResponse(remote, false, "Request too large");
+    return;
+  }
+  
+  int read = configUdp.read(udpPacketBuffer, UDP_PACKET_MAX);
+  udpPacketBuffer[read > 0 ? read : 0] = '\0';
+  
+  DynamicJsonDocument doc(UDP_CONFIG_DOC_SIZE);
+  if (doc.capacity() == 0) {
+    sendConfigUpdateResponse(remote, false, "Out of memory");
+    return;
+  }
+  DeserializationError error = deserializeJson(doc, udpPacketBuffer);
+  if (error == DeserializationError::NoMemory) {
+    sendConfigUpdateResponse(remote, false, "Request too complex");
+    return;
+  }
+  if (error) {
+    sendConfigUpdateResponse(remote, false, "Invalid JSON");
+    return;
+  }
+  
+  // Requests addressed to another device on the same subnet are ignored
+  const char* deviceId = doc["device_id"] | "";
+  if (deviceId[0] != '\0' && strcmp(deviceId, deviceConfig.deviceId) != 0) {
+    return;
+  }
+  
+  const char* type = doc["type"] | "";
+  if (strcmp(type, "get_config") == 0) {
+    doc.clear();
+    doc["type"] = "config_response";
+    doc["device_id"] = deviceConfig.deviceId;
+    char hash[9];
+    formatConfigHash(hash, sizeof(hash));
+    doc["config_hash"] = hash;
+    
+    // Action configs are embedded by pointer into the config store - hold it until they are sent
+    lockConfig();
+    char etag[32];
+    formatConfigETag(etag, sizeof(etag));
+    doc["etag"] = etag;  // Echoed back as if_match by a set_config built from this copy
+    buildConfigJson(doc);
+    
+    // WiFiUDP sends a datagram each time its buffer fills, so a larger reply would arrive as
+    // several packets of broken JSON: answer with the hash and size and let the host use GET /api/config.
+    // A config that overflowed the document would be cut short, so it gets the same answer
+    size_t size = measureJson(doc);
+    if (size > UDP_PACKET_MAX || doc.overflowed()) {
+      doc.clear();
+      doc["type"] = "config_response";
+      doc["device_id"] = deviceConfig.deviceId;
+      doc["config_hash"] = hash;
+      doc["etag"] = etag;
+      doc["too_large"] = true;
+      doc["size"] = size;
+      doc["use_http"] = true;
+    }
+    configUdp.beginPacket(remote, CONFIG_PORT);
+    serializeJson(doc, configUdp);
+    configUdp.endPacket();
+    unlockConfig();
+  } else if (strcmp(type, "set_config") == 0) {
+    Console.print("Config update over UDP from ");
+    Console.println(remote);
+    
+    // Optional if_match: only apply on top of the generation the sender read
+    const char* ifMatch = doc["if_match"] | "";
+    char etag[32];
+    lockConfig();
+    formatConfigETag(etag, sizeof(etag));
+    if (ifMatch[0] != '\0' && strcmp(ifMatch, etag) != 0) {
+      unlockConfig();
+      sendConfigUpdateResponse(remote, false, "Configuration changed since it was read", true);
+      return;
+    }
+    // A network change schedules the restart before the response, so it can report it
+    char message[STATUS_MESSAGE_MAX];
+    bool success = applyConfigUpdate(doc.as<JsonObject>(), message, sizeof(message));
+    unlockConfig();
+    sendConfigUpdateResponse(remote, success, message);
+  }
+}
+
+void sendConfigUpdateResponse(IPAddress address, bool success, const char* message, bool conflict) {
+  StaticJsonDocument<320> doc;
+  doc["type"] = "config_update_response";
+  doc["device_id"] = deviceConfig.deviceId;
+  doc["success"] = success;
+  doc["message"] = message;
+  doc["conflict"] = conflict;
+  doc["restart"] = restartAt != 0;
+  char hash[9];
+  formatConfigHash(hash, sizeof(hash));
+  doc["config_hash"] = hash;
+  char etag[32];
+  formatConfigETag(etag, sizeof(etag));
+  doc["etag"] = etag;
+  
+  configUdp.beginPacket(address, CONFIG_PORT);
+  serializeJson(doc, configUdp);
+  configUdp.endPacket();
+}
+
+void formatConfigHash(char* hash, size_t size) {
+  snprintf(hash, size, "%08lx", (unsigned long)configCrc);
+}
+
+void formatIPAddress(IPAddress address, char* buffer, size_t size) {
+  snprintf(buffer, size, "%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
+}
+
+const char* deviceTypeName(DeviceType type) {
+  switch (type) {
+    case DEVICE_TYPE_OUTLET_CONTROLLER: return "outlet_controller";
+    case DEVICE_TYPE_CUSTOM: return "custom";
+    default: return "button_matrix";
+  }
+}
+
+void handleButtonPress(int slot) {
+  // slot is an action slot: 0-7 the press of that button, 8+ a gesture shown on its first button's LED
+  if (slot < 0 || slot >= ACTION_SLOTS) return;
+  int buttonIndex = slotButton(slot);
+  
+  // An action with feedback pulses until the worker reports back; anything else toggles right away
+  bool queued = true;
+  bool feedback = buttonConfigs[slot].enabled && compiledButtons[slot].count > 0 && compiledButtons[slot].feedback;
+  if (!feedback) {
+    ledStates[buttonIndex] = !ledStates[buttonIndex];
+  }
+  
+  // Hand the configured action to the worker - never run it inline
+  if (buttonConfigs[slot].enabled) {
+    queued = queueAction(slot);
+  }
+  if (feedback) {
+    playLedPattern(buttonIndex, queued ? LED_PATTERN_PENDING : LED_PATTERN_FAILURE);
+  }
+  updateLEDs();
+  
+  Console.printf("=== BUTTON %d %s ===\n", buttonIndex, slot < 8 ? "PRESSED" : gestureName(slot));
+  Console.printf("Button name: %s\n", buttonConfigs[slot].name);
+  Console.printf("Pin: %d -> LED: %d\n", buttonPins[buttonIndex], ledPins[buttonIndex]);
+  
+  // Send button press notification
+  StaticJsonDocument<160> doc;
+  doc["type"] = "button_press";
+  doc["button"] = buttonIndex;
+  doc["gesture"] = gestureName(slot);
+  doc["name"] = buttonConfigs[slot].name;
+  doc["timestamp"] = millis();
+  doc["queued"] = queued;
+  
+  Console.print("EVENT:");
+  serializeJson(doc, Console);
+  Console.println();
+  Console.println("========================");
+  publishEvent("button_press", doc);
+  
+  if (!feedback) {
+    publishLedState(buttonIndex);
+  }
+}
+
+bool executeButtonActions(int buttonIndex, const CompiledButton& button, int8_t& remoteState) {
+  static ActionDispatch dispatches[MAX_CHAIN_ACTIONS];  // Only the worker task runs chains
+  remoteState = LED_STATE_KEEP;
+  
+  if (button.count == 0) {
+    Console.printf("No action configured for button %d\n", buttonIndex);
+    return false;
+  }
+  
+  // Stages run in ascending order; all targets of one stage are in flight together
+  bool failed = false;
+  int stage = -1;
+  for (;;) {
+    int next = 256;
+    for (int i = 0; i < button.count; i++) {
+      if (button.actions[i]->stage > stage && button.actions[i]->stage < next) {
+        next = button.actions[i]->stage;
+      }
+    }
+    if (next == 256) break;
+    stage = next;
+    
+    int count = 0;
+    for (int i = 0; i < button.count; i++) {
+      if (button.actions[i]->stage != stage) continue;
+      
+      ActionDispatch& dispatch = dispatches[count++];
+      dispatch.target = i;
+      if (failed && button.stopOnError) {
+        dispatch.action = button.actions[i];
+        dispatch.result = HTTP_ERROR_SKIPPED;
+        dispatch.attempt = 0;
+        dispatch.started = millis();
+        dispatch.response[0] = '\0';
+      } else {
+        executeAction(buttonIndex, *button.actions[i], dispatch);
+      }
+    }
+    
+    runHttpDispatches(dispatches, count);
+    
+    for (int i = 0; i < count; i++) {
+      bool queued = shouldRetry(dispatches[i]) && queueRetry(buttonIndex, dispatches[i]);
+      reportActionResult(buttonIndex, dispatches[i], queued);
+      if (dispatches[i].result == ACTION_RESULT_BATCHED) {
+        continue;  // Not sent yet - the flush reports it, and later stages still run
+      } else if (!actionSucceeded(dispatches[i])) {
+        failed = true;
+      } else if (button.syncState && remoteState == LED_STATE_KEEP) {
+        remoteState = parseRemoteState(dispatches[i].response);
+      }
+    }
+  }
+  return !failed;
+}
+
+void reportButtonFeedback(int slot, const CompiledButton& button, bool success, unsigned long elapsed,
+                          int8_t remoteState) {
+  int buttonIndex = slotButton(slot);
+  if (!button.feedback) {
+    // Config changed while the press was queued - just make sure no pulse is left running
+    playLedPattern(buttonIndex, LED_PATTERN_NONE);
+    return;
+  }
+  
+  // Only a press that landed moves the toggle; the remote's own state wins when it reported one
+  if (!success) {
+    playLedPattern(buttonIndex, LED_PATTERN_FAILURE);
+  } else {
+    bool slow = button.slowMs > 0 && elapsed > button.slowMs;
+    playLedPattern(buttonIndex, slow ? LED_PATTERN_SLOW : LED_PATTERN_SUCCESS,
+                   remoteState != LED_STATE_KEEP ? remoteState : LED_STATE_TOGGLE);
+  }
+  Console.printf("Button %d %s %s after %lums\n", buttonIndex, gestureName(slot), success ? "landed" : "failed",
+                 elapsed);
+}
+
+int8_t parseRemoteState(const char* response) {
+  // {"state":"on"}, [{"entity_id":...,"state":"off"}], {"state":true} - first match wins
+  const char* key = strstr(response, "\"state\"");
+  if (key == NULL) return LED_STATE_KEEP;
+  const char* value = key + 7;
+  while (*value == ' ' || *value == ':') value++;
+  if (*value == '"') value++;
+  
+  if (strncasecmp(value, "on", 2) == 0 || strncasecmp(value, "true", 4) == 0 || *value == '1') {
+    return LED_STATE_ON;
+  }
+  if (strncasecmp(value, "off", 3) == 0 || strncasecmp(value, "false", 5) == 0 || *value == '0') {
+    return LED_STATE_OFF;
+  }
+  return LED_STATE_KEEP;
+}
+
+void executeAction(int buttonIndex, const CompiledAction& action, ActionDispatch& dispatch) {
+  dispatch.action = &action;
+  dispatch.conn = NULL;
+  dispatch.reused = false;
+  dispatch.result = 0;
+  dispatch.attempt = 0;
+  dispatch.started = millis();
+  dispatch.body = NULL;
+  dispatch.bodyLength = 0;
+  dispatch.response[0] = '\0';
+  
+  if (!action.valid) {
+    dispatch.result = HTTP_ERROR_INVALID_ACTION;
+    return;
+  }
+  
+  // The body is rendered even while offline, so the press can wait in the retry queue
+  switch (action.type) {
+    case ACTION_HTTP:
+      prepareHttpAction(action, dispatch);
+      break;
+    case ACTION_WEBHOOK:
+      prepareWebhookAction(action, dispatch);
+      break;
+    case ACTION_MQTT:
+    case ACTION_UDP:
+      renderTransportPayload(buttonIndex, action, dispatch);
+      break;
+    case ACTION_NONE:
+    default:
+      dispatch.result = HTTP_ERROR_INVALID_ACTION;
+      break;
+  }
+  if (dispatch.result != 0) return;
+  
+  // Batched webhooks keep collecting while offline, the batch waits for the link
+  if (action.type == ACTION_WEBHOOK && action.batchEvents > 0 && batchWebhookEvent(buttonIndex, action, dispatch)) {
+    return;
+  }
+  if (!wifiConnected) {
+    dispatch.result = HTTP_ERROR_OFFLINE;
+    return;
+  }
+  
+  // HTTP targets are only prepared here and sent together by runHttpDispatches();
+  // MQTT and UDP are cheap enough to go out immediately
+  if (action.type == ACTION_MQTT) {
+    publishMqttAction(action, dispatch);
+  } else if (action.type == ACTION_UDP) {
+    sendUdpAction(action, dispatch);
+  }
+}
+
+void prepareHttpAction(const CompiledAction& action, ActionDispatch& dispatch) {
+  dispatch.body = action.body;
+  dispatch.bodyLength = action.bodyLength;
+}
+
+void prepareWebhookAction(const CompiledAction& action, ActionDispatch& dispatch) {
+  // Complete the pre-rendered payload with the per-press fields
+  int payloadLength = snprintf(dispatch.payload, sizeof(dispatch.payload), "%s,\"timestamp\":%lu,\"battery\":%.2f}",
+                               action.body, millis(), batteryVoltage);
+  if (payloadLength < 0 || payloadLength >= (int)sizeof(dispatch.payload)) {
+    Console.println("Webhook payload too large");
+    dispatch.result = HTTP_ERROR_INVALID_ACTION;
+    return;
+  }
+  
+  dispatch.body = dispatch.payload;
+  dispatch.bodyLength = payloadLength;
+}
+
+void renderTransportPayload(int buttonIndex, const CompiledAction& action, ActionDispatch& dispatch) {
+  int payloadLength = renderActionTemplate(action.body, buttonIndex, dispatch.payload, sizeof(dispatch.payload));
+  if (payloadLength < 0) {
+    Console.printf("%s payload too large\n", action.type == ACTION_MQTT ? "MQTT" : "UDP");
+    dispatch.result = HTTP_ERROR_INVALID_ACTION;
+    return;
+  }
+  
+  dispatch.body = dispatch.payload;
+  dispatch.bodyLength = payloadLength;
+}
+
+void publishMqttAction(const CompiledAction& action, ActionDispatch& dispatch) {
+  MqttSession* session = acquireMqttSession(action);
+  
+  // A broker may drop an idle session between pings - retry once on a fresh one
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = session->client->connected();
+    
+    if (!connectMqttSession(session)) {
+      dispatch.result = HTTPC_ERROR_CONNECTION_REFUSED;
+      return;
+    }
+    dispatch.result = sendMqttPublish(session, action, dispatch.body, dispatch.bodyLength);
+    
+    bool staleSocket = dispatch.result == HTTPC_ERROR_SEND_PAYLOAD_FAILED ||
+                       dispatch.result == HTTPC_ERROR_CONNECTION_LOST;
+    if (!(reused && staleSocket)) break;
+    
+    Console.printf("MQTT session to %s dropped - reconnecting\n", session->host);
+    session->client->stop();
+  }
+}
+
+void sendUdpAction(const CompiledAction& action, ActionDispatch& dispatch) {
+  // Fire and forget: delivered means handed to the network stack
+  if (!actionUdp.beginPacket(action.host, action.port)) {
+    dispatch.result = HTTPC_ERROR_CONNECTION_REFUSED;
+    return;
+  }
+  actionUdp.write((const uint8_t*)dispatch.body, dispatch.bodyLength);
+  dispatch.result = actionUdp.endPacket() ? ACTION_RESULT_SENT : HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+}
+
+void runHttpDispatches(ActionDispatch* dispatches, int count) {
+  boostCpu(POWER_HOLD_ACTION);
+  
+  // Write every pending request before reading any response, so the servers work
+  // in parallel. Targets sharing a host share a socket and go out in later rounds.
+  for (;;) {
+    int inFlight[MAX_CHAIN_ACTIONS];
+    int inFlightCount = 0;
+    
+    for (int i = 0; i < count; i++) {
+      ActionDispatch& dispatch = dispatches[i];
+      if (dispatch.result != 0) continue;
+      
+      const CompiledAction& action = *dispatch.action;
+      bool sameHost = false;
+      for (int j = 0; j < inFlightCount; j++) {
+        const CompiledAction& other = *dispatches[inFlight[j]].action;
+        if (other.secure == action.secure && other.port == action.port && strcmp(other.host, action.host) == 0) {
+          sameHost = true;
+          break;
+        }
+      }
+      if (sameHost) continue;
+      
+      dispatch.conn = acquireConnection(action.secure, action.host, action.port, action.tls);
+      dispatch.conn->inUse = true;
+      dispatch.reused = dispatch.conn->client->connected();
+      
+      int written = writeHttpRequest(dispatch.conn, action, dispatch.body, dispatch.bodyLength);
+      if (written < 0 && dispatch.reused) {
+        Console.printf("Pooled connection to %s dropped - reconnecting\n", dispatch.conn->host);
+        dispatch.reused = false;
+        written = writeHttpRequest(dispatch.conn, action, dispatch.body, dispatch.bodyLength);
+      }
+      
+      if (written < 0) {
+        dispatch.result = written;
+        dispatch.conn->inUse = false;
+      } else {
+        inFlight[inFlightCount++] = i;
+      }
+    }
+    
+    if (inFlightCount == 0) break;
+    
+    unsigned long deadline = millis() + HTTP_TIMEOUT;
+    for (int j = 0; j < inFlightCount; j++) {
+      ActionDispatch& dispatch = dispatches[inFlight[j]];
+      int httpCode = readHttpResponse(dispatch.conn, deadline, dispatch.response, sizeof(dispatch.response));
+      
+      // A server may close an idle socket just as the request goes out - retry once on a fresh one
+      bool staleSocket = httpCode == HTTPC_ERROR_CONNECTION_LOST || httpCode == HTTPC_ERROR_NOT_CONNECTED;
+      if (dispatch.reused && staleSocket) {
+        Console.printf("Pooled connection to %s dropped - reconnecting\n", dispatch.conn->host);
+        dispatch.conn->client->stop();
+        httpCode = sendHttpRequest(dispatch.conn, *dispatch.action, dispatch.body, dispatch.bodyLength);
+      } else if (dispatch.reused && httpCode > 0) {
+        Console.printf("Reused pooled connection to %s:%u\n", dispatch.conn->host, dispatch.conn->port);
+      }
+      
+      dispatch.result = httpCode;
+      dispatch.conn->lastUsed = millis();
+      dispatch.conn->inUse = false;
+    }
+  }
+  
+  releaseCpu(POWER_HOLD_ACTION);
+}
+
+void reportActionResult(int buttonIndex, const ActionDispatch& dispatch, bool queued) {
+  const CompiledAction& action = *dispatch.action;
+  unsigned long elapsed = millis() - dispatch.started;
+  bool success = actionSucceeded(dispatch);
+  if (dispatch.result != HTTP_ERROR_SKIPPED && dispatch.result != ACTION_RESULT_BATCHED) {
+    recordActionOutcome(buttonIndex, action.host, success, (int64_t)elapsed * 1000);
+  }
+  
+  if (dispatch.result == ACTION_RESULT_BATCHED && action.type == ACTION_WEBHOOK) {
+    Console.printf("Webhook event for %s batched\n", action.url);
+  } else if (dispatch.result > 0) {
+    if (action.type == ACTION_MQTT) {
+      Console.printf("MQTT publish to %s (QoS %u) delivered in %lums\n", action.url, action.qos, elapsed);
+    } else if (action.type == ACTION_UDP) {
+      Console.printf("UDP datagram sent to %s\n", action.url);
+    } else if (action.type == ACTION_WEBHOOK) {
+      Console.printf("Webhook sent to %s - Response: %d\n", action.url, dispatch.result);
+    } else {
+      Console.printf("HTTP %s to %s - Response: %d\n", actionMethodName(action.method), action.url, dispatch.result);
+    }
+  } else if (dispatch.result == HTTP_ERROR_OFFLINE) {
+    Console.printf("WiFi not connected - button %d target %d %s\n", buttonIndex, dispatch.target,
+                   queued ? "queued for retry" : "not sent");
+  } else if (dispatch.result == HTTP_ERROR_SKIPPED) {
+    Console.printf("Button %d target %d skipped after an earlier failure\n", buttonIndex, dispatch.target);
+  } else {
+    Console.printf("Button %d target %d failed: %d\n", buttonIndex, dispatch.target, dispatch.result);
+  }
+  
+  StaticJsonDocument<384> doc;
+  doc["type"] = "action_result";
+  doc["button"] = slotButton(buttonIndex);
+  doc["gesture"] = gestureName(buttonIndex);
+  doc["target"] = dispatch.target;
+  doc["stage"] = action.stage;
+  doc["action"] = actionTypeName(action.type);
+  doc["url"] = (const char*)action.url;
+  doc["code"] = dispatch.result;
+  doc["success"] = success;
+  if (dispatch.result == ACTION_RESULT_BATCHED) doc["batched"] = true;
+  doc["elapsed_ms"] = elapsed;
+  doc["attempt"] = dispatch.attempt;
+  doc["queued"] = queued;
+  doc["timestamp"] = millis();
+  
+  Console.print("EVENT:");
+  serializeJson(doc, Console);
+  Console.println();
+  publishEvent("action_result", doc);
+}
+
+bool actionSucceeded(const ActionDispatch& dispatch) {
+  // A batched webhook has not landed anywhere yet: it succeeds or fails with its batch
+  if (dispatch.action->type == ACTION_MQTT || dispatch.action->type == ACTION_UDP) {
+    return dispatch.result == ACTION_RESULT_SENT;
+  }
+  return dispatch.result >= 200 && dispatch.result <= 299;
+}
+
+// Webhook Batch Functions
+
+bool batchWebhookEvent(int buttonIndex, const CompiledAction& action, ActionDispatch& dispatch) {
+  WebhookBatch* batch = NULL;
+  WebhookBatch* freeSlot = NULL;
+  for (int i = 0; i < WEBHOOK_BATCH_SLOTS; i++) {
+    WebhookBatch& slot = webhookBatches[i];
+    if (slot.active && slot.buttonIndex == buttonIndex && slot.target == dispatch.target) {
+      batch = &slot;
+      break;
+    }
+    if (!slot.active && freeSlot == NULL) freeSlot = &slot;
+  }
+  
+  // No slot left: this press is sent on its own
+  if (batch == NULL) {
+    if (freeSlot == NULL) return false;
+    batch = freeSlot;
+    batch->active = true;
+    batch->buttonIndex = buttonIndex;
+    batch->target = dispatch.target;
+    batch->count = 0;
+    batch->attempts = 0;
+    batch->length = 0;
+    batch->flushAt = millis() + action.batchAge * 1000UL;
+  }
+  
+  // Separator + event + closing bracket must fit the size limit
+  if (batch->count > 0 && batch->length + 1 + dispatch.bodyLength + 1 > action.batchBytes) {
+    flushWebhookBatch(*batch);
+    if (batch->active) return false;  // Could not be sent, the event goes out on its own
+    return batchWebhookEvent(buttonIndex, action, dispatch);
+  }
+  if (batch->count == 0 && dispatch.bodyLength + 2 > action.batchBytes) {
+    batch->active = false;
+    return false;
+  }
+  
+  batch->data[batch->length++] = batch->count == 0 ? '[' : ',';
+  memcpy(batch->data + batch->length, dispatch.body, dispatch.bodyLength);
+  batch->length += dispatch.bodyLength;
+  batch->count++;
+  dispatch.result = ACTION_RESULT_BATCHED;
+  
+  // Due right away, but sent once the press has finished: the flush reports this press's feedback too
+  if (batch->count >= action.batchEvents) {
+    batch->flushAt = millis();
+  }
+  return true;
+}
+
+void flushWebhookBatch(WebhookBatch& batch) {
+  static ActionDispatch dispatch;  // Worker task only
+  static CompiledAction action;
+  
+  // Resolve the target again so a config change between presses applies to the whole batch
+  lockConfig();
+  const CompiledButton& button = compiledButtons[batch.buttonIndex];
+  bool valid = batch.target < button.count && button.actions[batch.target]->valid &&
+               button.actions[batch.target]->type == ACTION_WEBHOOK;
+  if (valid) {
+    action = *button.actions[batch.target];
+  }
+  unlockConfig();
+  
+  if (!valid) {
+    Console.printf("Button %d target %d changed - dropping %u batched events\n", batch.buttonIndex, batch.target, batch.count);
+    batch.active = false;
+    playLedPattern(slotButton(batch.buttonIndex), LED_PATTERN_NONE);
+    return;
+  }
+  
+  batch.data[batch.length] = ']';
+  dispatch.action = &action;
+  dispatch.target = batch.target;
+  dispatch.conn = NULL;
+  dispatch.reused = false;
+  dispatch.result = wifiConnected ? 0 : HTTP_ERROR_OFFLINE;
+  dispatch.attempt = batch.attempts;
+  dispatch.started = millis();
+  dispatch.body = batch.data;
+  dispatch.bodyLength = batch.length + 1;
+  runHttpDispatches(&dispatch, 1);
+  
+  bool retry = shouldRetry(dispatch);
+  if (retry && dispatch.result != HTTP_ERROR_OFFLINE) {
+    batch.attempts++;
+    retry = batch.attempts < RETRY_MAX_ATTEMPTS;
+  }
+  
+  Console.printf("Webhook batch of %u events for button %d\n", batch.count, batch.buttonIndex);
+  reportActionResult(batch.buttonIndex, dispatch, retry);
+  
+  if (retry) {
+    batch.flushAt = millis() + (batch.attempts > 0 ? retryBackoff(batch.attempts) : RETRY_INITIAL_DELAY);
+    return;
+  }
+  
+  bool success = actionSucceeded(dispatch);
+  if (!success) {
+    Console.printf("Webhook batch of %u events for button %d dropped\n", batch.count, batch.buttonIndex);
+  }
+  batch.active = false;
+  
+  // The presses in the batch have been breathing since they were buffered; this is their outcome
+  lockConfig();
+  reportButtonFeedback(batch.buttonIndex, compiledButtons[batch.buttonIndex], success, millis() - dispatch.started,
+                       LED_STATE_KEEP);
+  unlockConfig();
+}
+
+bool webhookBatchPending(int slot) {
+  for (int i = 0; i < WEBHOOK_BATCH_SLOTS; i++) {
+    if (webhookBatches[i].active && webhookBatches[i].buttonIndex == slot) return true;
+  }
+  return false;
+}
+
+void processWebhookBatches() {
+  if (!wifiConnected) return;
+  
+  for (int i = 0; i < WEBHOOK_BATCH_SLOTS; i++) {
+    if (webhookBatches[i].active && (long)(millis() - webhookBatches[i].flushAt) >= 0) {
+      flushWebhookBatch(webhookBatches[i]);
+    }
+  }
+}
+
+// Retry Queue Functions
+
+bool shouldRetry(const ActionDispatch& dispatch) {
+  // Transport failures and server-side errors are worth another try; client errors are not
+  int result = dispatch.result;
+  if (result == HTTP_ERROR_INVALID_ACTION || result == HTTP_ERROR_SKIPPED || actionSucceeded(dispatch)) {
+    return false;
+  }
+  return result < 0 || result == 429 || result >= 500;
+}
+
+bool queueRetry(int buttonIndex, const ActionDispatch& dispatch) {
+  if (dispatch.body == NULL || dispatch.bodyLength >= sizeof(RetryEntry::body)) {
+    return false;
+  }
+  
+  if (retryCount == RETRY_QUEUE_LENGTH) {
+    const RetryEntry& oldest = retryQueue[0];
+    retryDrops++;
+    
+    StaticJsonDocument<128> doc;
+    doc["type"] = "action_dropped";
+    doc["button"] = slotButton(oldest.buttonIndex);
+    doc["target"] = oldest.target;
+    doc["reason"] = "retry_queue_full";
+    doc["overflows"] = retryDrops;
+    doc["timestamp"] = millis();
+    
+    Console.print("EVENT:");
+    serializeJson(doc, Console);
+    Console.println();
+    publishEvent("action_dropped", doc);
+    removeRetryEntry(0);
+  }
+  
+  // Offline attempts do not count against the entry, it waits for the link
+  RetryEntry& entry = retryQueue[retryCount++];
+  entry.buttonIndex = buttonIndex;
+  entry.target = dispatch.target;
+  entry.type = dispatch.action->type;
+  entry.attempts = dispatch.result == HTTP_ERROR_OFFLINE ? dispatch.attempt : dispatch.attempt + 1;
+  entry.nextAttempt = entry.attempts > 0 ? millis() + retryBackoff(entry.attempts) : 0;
+  entry.bodyLength = dispatch.bodyLength;
+  memcpy(entry.body, dispatch.body, dispatch.bodyLength);
+  entry.body[dispatch.bodyLength] = '\0';
+  
+  retryQueueDirty = true;
+  retryQueueChanged = millis();
+  return true;
+}
+
+void processRetryQueue() {
+  static ActionDispatch dispatches[RETRY_BATCH_SIZE];   // Worker task only
+  static CompiledAction actions[RETRY_BATCH_SIZE];
+  
+  if (!wifiConnected || retryCount == 0 || millis() - lastRetryBatch < RETRY_BATCH_SPACING) {
+    return;
+  }
+  
+  // Pick due entries, oldest first; the target is looked up again so config changes apply
+  int entries[RETRY_BATCH_SIZE];
+  int count = 0;
+  unsigned long now = millis();
+  
+  lockConfig();
+  for (int i = 0; i < retryCount && count < RETRY_BATCH_SIZE; i++) {
+    RetryEntry& entry = retryQueue[i];
+    if (entry.nextAttempt != 0 && (long)(now - entry.nextAttempt) < 0) continue;
+    
+    const CompiledButton& button = compiledButtons[entry.buttonIndex];
+    if (!buttonConfigs[entry.buttonIndex].enabled || entry.target >= button.count ||
+        button.actions[entry.target]->type != entry.type || !button.actions[entry.target]->valid) {
+      Console.printf("Button %d target %d changed - dropping queued retry\n", entry.buttonIndex, entry.target);
+      removeRetryEntry(i--);
+      continue;
+    }
+    
+    actions[count] = *button.actions[entry.target];
+    entries[count++] = i;
+  }
+  unlockConfig();
+  
+  if (count == 0) return;
+  lastRetryBatch = millis();
+  
+  for (int i = 0; i < count; i++) {
+    const RetryEntry& entry = retryQueue[entries[i]];
+    ActionDispatch& dispatch = dispatches[i];
+    dispatch.action = &actions[i];
+    dispatch.target = entry.target;
+    dispatch.conn = NULL;
+    dispatch.reused = false;
+    dispatch.result = 0;
+    dispatch.attempt = entry.attempts;
+    dispatch.started = millis();
+    dispatch.body = entry.body;
+    dispatch.bodyLength = entry.bodyLength;
+    
+    if (actions[i].type == ACTION_MQTT) {
+      publishMqttAction(actions[i], dispatch);
+    } else if (actions[i].type == ACTION_UDP) {
+      sendUdpAction(actions[i], dispatch);
+    }
+  }
+  runHttpDispatches(dispatches, count);
+  
+  // Walk backwards so removals keep the remaining indices valid
+  for (int i = count - 1; i >= 0; i--) {
+    RetryEntry& entry = retryQueue[entries[i]];
+    const ActionDispatch& dispatch = dispatches[i];
+    bool retry = shouldRetry(dispatch);
+    
+    if (retry && dispatch.result != HTTP_ERROR_OFFLINE) {
+      entry.attempts++;
+      retry = entry.attempts < RETRY_MAX_ATTEMPTS;
+      entry.nextAttempt = millis() + retryBackoff(entry.attempts);
+    }
+    
+    reportActionResult(entry.buttonIndex, dispatch, retry);
+    if (!retry) {
+      if (!actionSucceeded(dispatch)) {
+        Console.printf("Button %d target %d given up after %u attempts\n", entry.buttonIndex, entry.target, entry.attempts);
+      }
+      removeRetryEntry(entries[i]);
+    }
+  }
+  
+  retryQueueDirty = true;
+  retryQueueChanged = millis();
+}
+
+void removeRetryEntry(int index) {
+  memmove(&retryQueue[index], &retryQueue[index + 1], (retryCount - index - 1) * sizeof(RetryEntry));
+  retryCount--;
+  retryQueueDirty = true;
+  retryQueueChanged = millis();
+}
+
+unsigned long retryBackoff(uint8_t attempts) {
+  unsigned long delayMs = RETRY_INITIAL_DELAY << min(attempts - 1, 16);
+  if (delayMs > RETRY_MAX_DELAY) delayMs = RETRY_MAX_DELAY;
+  // Jitter so entries from one outage do not all come due together
+  return delayMs + random(delayMs / 4 + 1);
+}
+
+unsigned long nextRetryWait() {
+  // How long the worker may sleep before the queue needs attention again
+  unsigned long wait = HTTP_POOL_MAINTENANCE_INTERVAL;
+  unsigned long now = millis();
+  
+  if (retryQueueDirty && deviceConfig.persistRetries) {
+    unsigned long persistAt = retryQueueChanged + RETRY_PERSIST_DELAY;
+    wait = (long)(persistAt - now) > 0 ? min(wait, persistAt - now) : 0;
+  }
+  if (!wifiConnected) {
+    return wait;
+  }
+  
+  for (int i = 0; i < WEBHOOK_BATCH_SLOTS && wait > 0; i++) {
+    if (webhookBatches[i].active) {
+      unsigned long due = webhookBatches[i].flushAt;
+      wait = (long)(due - now) > 0 ? min(wait, due - now) : 0;
+    }
+  }
+  
+  for (int i = 0; i < retryCount && wait > 0; i++) {
+    unsigned long due = retryQueue[i].nextAttempt == 0 ? now : retryQueue[i].nextAttempt;
+    unsigned long batchAt = lastRetryBatch + RETRY_BATCH_SPACING;
+    if ((long)(batchAt - due) > 0) due = batchAt;
+    wait = (long)(due - now) > 0 ? min(wait, due - now) : 0;
+  }
+  return wait;
+}
+
+void flushRetryQueueNow() {
+  // Link is back: everything becomes due, processRetryQueue() paces it in batches
+  for (int i = 0; i < retryCount; i++) {
+    retryQueue[i].nextAttempt = 0;
+  }
+  for (int i = 0; i < WEBHOOK_BATCH_SLOTS; i++) {
+    if (webhookBatches[i].active && webhookBatches[i].attempts > 0) {
+      webhookBatches[i].flushAt = millis();
+    }
+  }
+  if (retryCount > 0) {
+    Console.printf("Flushing %d queued action(s)\n", retryCount);
+  }
+}
+
+void loadRetryQueue() {
+  Preferences store;
+  if (!store.begin("patcom-retry", true)) {
+    return;
+  }
+  
+  RetryQueueHeader header;
+  bool valid = store.getBytes("header", &header, sizeof(header)) == sizeof(header) &&
+               header.magic == RETRY_QUEUE_MAGIC && header.version == RETRY_QUEUE_VERSION &&
+               header.count <= RETRY_QUEUE_LENGTH &&
+               store.getBytesLength("entries") == header.count * sizeof(RetryEntry);
+  if (valid && header.count > 0) {
+    store.getBytes("entries", retryQueue, header.count * sizeof(RetryEntry));
+    retryCount = header.count;
+    
+    // millis() restarted; entries become due once WiFi is up
+    for (int i = 0; i < retryCount; i++) {
+      retryQueue[i].nextAttempt = 0;
+    }
+    Console.printf("Restored %d queued action(s) from flash\n", retryCount);
+  }
+  store.end();
+}
+
+void saveRetryQueue() {
+  Preferences store;
+  if (!store.begin("patcom-retry", false)) {
+    return;
+  }
+  
+  if (retryCount == 0) {
+    store.clear();
+  } else {
+    RetryQueueHeader header = {RETRY_QUEUE_MAGIC, RETRY_QUEUE_VERSION, (uint16_t)retryCount};
+    store.putBytes("entries", retryQueue, retryCount * sizeof(RetryEntry));
+    store.putBytes("header", &header, sizeof(header));
+  }
+  store.end();
+  
+  retryQueueDirty = false;
+}
+
+const char* actionTypeName(ActionType type) {
+  switch (type) {
+    case ACTION_HTTP: return "http";
+    case ACTION_WEBHOOK: return "webhook";
+    case ACTION_MQTT: return "mqtt";
+    case ACTION_UDP: return "udp";
+    case ACTION_NONE:
+    default: return "none";
+  }
+}
+
+int renderActionTemplate(const char* source, int buttonIndex, char* output, size_t size) {
+  // Expands {{name}} placeholders; unknown names are copied through unchanged
+  size_t length = 0;
+  const char* cursor = source;
+  
+  while (*cursor) {
+    if (cursor[0] == '{' && cursor[1] == '{') {
+      const char* end = strstr(cursor + 2, "}}");
+      char name[24];
+      char value[48];
+      size_t nameLength = end ? end - (cursor + 2) : 0;
+      if (end && nameLength < sizeof(name)) {
+        memcpy(name, cursor + 2, nameLength);
+        name[nameLength] = '\0';
+        if (templateValue(name, buttonIndex, value, sizeof(value))) {
+          size_t valueLength = strlen(value);
+          if (length + valueLength >= size) return -1;
+          memcpy(output + length, value, valueLength);
+          length += valueLength;
+          cursor = end + 2;
+          continue;
+        }
+      }
+    }
+    
+    if (length + 1 >= size) return -1;
+    output[length++] = *cursor++;
+  }
+  
+  output[length] = '\0';
+  return length;
+}
+
+bool templateValue(const char* name, int buttonIndex, char* value, size_t size) {
+  if (strcmp(name, "button") == 0) {
+    snprintf(value, size, "%d", slotButton(buttonIndex));
+  } else if (strcmp(name, "button_name") == 0) {
+    strlcpy(value, buttonConfigs[buttonIndex].name, size);
+  } else if (strcmp(name, "gesture") == 0) {
+    strlcpy(value, gestureName(buttonIndex), size);
+  } else if (strcmp(name, "device_id") == 0) {
+    strlcpy(value, deviceConfig.deviceId, size);
+  } else if (strcmp(name, "device_name") == 0) {
+    strlcpy(value, deviceConfig.deviceName, size);
+  } else if (strcmp(name, "timestamp") == 0) {
+    snprintf(value, size, "%lu", millis());
+  } else if (strcmp(name, "battery") == 0) {
+    snprintf(value, size, "%.2f", batteryVoltage);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Compiled Action Functions
+
+void compileActions() {
+  memset(compiledActionOwner, -1, sizeof(compiledActionOwner));
+  for (int i = 0; i < ACTION_SLOTS; i++) {
+    compileAction(i);
+  }
+  rebuildGestureIndex();
+}
+
+void compileAction(int buttonIndex) {
+  const ButtonConfig& button = buttonConfigs[buttonIndex];
+  CompiledButton& compiled = compiledButtons[buttonIndex];
+  
+  releaseCompiledActions(buttonIndex);
+  compiled.count = 0;
+  compiled.stopOnError = false;
+  compiled.feedback = true;
+  compiled.syncState = false;
+  compiled.slowMs = 0;
+  
+  if (button.action == ACTION_NONE || (buttonIndex >= 8 && gestureBindings[buttonIndex - 8].type == GESTURE_NONE)) {
+    return;
+  }
+  
+  StaticJsonDocument<1536> config;
+  DeserializationError error = deserializeJson(config, button.actionData);
+  if (error) {
+    Console.printf("Button %d action config is not valid JSON: %s\n", buttonIndex, error.c_str());
+    return;
+  }
+  
+  // "feedback": false keeps the old toggle-on-press, an object tunes the outcome display
+  JsonVariant feedback = config["feedback"];
+  if (feedback.is<bool>()) {
+    compiled.feedback = feedback.as<bool>();
+  } else if (feedback.is<JsonObject>()) {
+    compiled.syncState = feedback["sync_state"] | false;
+    compiled.slowMs = feedback["slow_ms"] | 0;
+  }
+  
+  // {"actions":[...],"stop_on_error":bool} is a chain; anything else is a single target
+  JsonArray chain = config["actions"];
+  if (chain.isNull()) {
+    CompiledAction* action = allocateCompiledAction(buttonIndex);
+    if (action == NULL) return;
+    compileActionTarget(buttonIndex, button.action, config.as<JsonObject>(), *action);
+    compiled.actions[compiled.count++] = action;
+    return;
+  }
+  
+  compiled.stopOnError = config["stop_on_error"] | false;
+  for (JsonObject entry : chain) {
+    if (compiled.count == MAX_CHAIN_ACTIONS) {
+      Console.printf("Button %d: only the first %d chained actions are used\n", buttonIndex, MAX_CHAIN_ACTIONS);
+      break;
+    }
+    CompiledAction* action = allocateCompiledAction(buttonIndex);
+    if (action == NULL) break;
+    compileActionTarget(buttonIndex, parseActionType(entry["type"], button.action), entry, *action);
+    action->stage = entry["stage"] | 0;
+    compiled.actions[compiled.count++] = action;
+  }
+}
+
+void releaseCompiledActions(int slot) {
+  // Caller holds the config lock; the worker only ever reads its own snapshot
+  for (int i = 0; i < COMPILED_ACTION_POOL; i++) {
+    if (compiledActionOwner[i] == slot) compiledActionOwner[i] = -1;
+  }
+}
+
+CompiledAction* allocateCompiledAction(int slot) {
+  for (int i = 0; i < COMPILED_ACTION_POOL; i++) {
+    if (compiledActionOwner[i] < 0) {
+      compiledActionOwner[i] = slot;
+      return &compiledActionPool[i];
+    }
+  }
+  Console.printf("ERROR: Compiled action pool full (%d targets) - button %d is missing targets\n",
+                 COMPILED_ACTION_POOL, slot);
+  return NULL;
+}
+
+int actionTargetCount(int slot, JsonObject update) {
+  // Targets compileAction() will build for the slot once update (may be null) is applied. Caller holds the lock
+  const ButtonConfig& button = buttonConfigs[slot];
+  bool updated = !update.isNull();
+  int action = button.action;
+  if (updated && (update.containsKey("action") || update.containsKey("ACTION"))) {
+    action = update.containsKey("action") ? update["action"] : update["ACTION"];
+  }
+  GestureType gesture = slot >= 8 ? gestureBindings[slot - 8].type : GESTURE_NONE;
+  if (slot >= 8 && updated && update.containsKey("type")) {
+    gesture = parseGestureType(update["type"] | "");
+  }
+  if (action == ACTION_NONE || (slot >= 8 && gesture == GESTURE_NONE)) return 0;
+  
+  StaticJsonDocument<1536> stored;
+  JsonObject config;
+  if (updated && (update.containsKey("config") || update.containsKey("CONFIG"))) {
+    config = update.containsKey("config") ? update["config"] : update["CONFIG"];
+  } else if (deserializeJson(stored, button.actionData) == DeserializationError::Ok) {
+    config = stored.as<JsonObject>();
+  } else {
+    return 0;  // Compiles to nothing
+  }
+  JsonArray chain = config["actions"];
+  return chain.isNull() ? 1 : min((int)chain.size(), MAX_CHAIN_ACTIONS);
+}
+
+bool compiledTargetsFit(JsonObject* updates, char* message, size_t messageSize) {
+  // Refuses a change up front rather than compiling some slots without their targets
+  int needed = 0;
+  for (int slot = 0; slot < ACTION_SLOTS; slot++) {
+    needed += actionTargetCount(slot, updates[slot]);
+  }
+  if (needed <= COMPILED_ACTION_POOL) return true;
+  Console.printf("ERROR: Config needs %d action targets, the compiled pool holds %d - not applied\n", needed,
+                 COMPILED_ACTION_POOL);
+  snprintf(message, messageSize, "Too many action targets (%d of %d)", needed, COMPILED_ACTION_POOL);
+  return false;
+}
+
+bool actionConfigsFit(JsonObject* updates, char* message, size_t messageSize) {
+  // An oversized config refuses the whole update, so its action, name and enabled flag are not applied alone
+  for (int slot = 0; slot < ACTION_SLOTS; slot++) {
+    JsonObject update = updates[slot];
+    if (update.isNull() || !(update.containsKey("config") || update.containsKey("CONFIG"))) continue;
+    size_t length = measureJson(update.containsKey("config") ? update["config"] : update["CONFIG"]);
+    if (length < ACTION_DATA_MAX) continue;
+    Console.printf("ERROR: Action config of slot %d is %u bytes, the limit is %u - not applied\n", slot,
+                   (unsigned)length, (unsigned)ACTION_DATA_MAX - 1);
+    snprintf(message, messageSize, "%s %d config too large (%u of %u bytes)", slot < 8 ? "Button" : "Gesture",
+             slot < 8 ? slot : slot - 8, (unsigned)length, (unsigned)ACTION_DATA_MAX - 1);
+    return false;
+  }
+  return true;
+}
+
+void snapshotCompiledButton(int slot, CompiledButton& button, CompiledAction* storage) {
+  // Caller holds the config lock. Copies the targets too, since a commit may recompile the pool entries
+  button = compiledButtons[slot];
+  for (int i = 0; i < button.count; i++) {
+    storage[i] = *button.actions[i];
+    button.actions[i] = &storage[i];
+  }
+}
+
+ActionType parseActionType(JsonVariant value, ActionType fallback) {
+  // Accepts the numeric ActionType or its name, like the configurator sends
+  if (value.is<const char*>()) {
+    const char* name = value.as<const char*>();
+    if (strcasecmp(name, "http") == 0) return ACTION_HTTP;
+    if (strcasecmp(name, "webhook") == 0) return ACTION_WEBHOOK;
+    if (strcasecmp(name, "mqtt") == 0) return ACTION_MQTT;
+    if (strcasecmp(name, "udp") == 0) return ACTION_UDP;
+    return ACTION_NONE;
+  }
+  if (value.is<int>()) {
+    int type = value.as<int>();
+    return (type >= ACTION_HTTP && type <= ACTION_UDP) ? (ActionType)type : ACTION_NONE;
+  }
+  return fallback;
+}
+
+void compileActionTarget(int buttonIndex, ActionType type, JsonObject config, CompiledAction& action) {
+  memset(&action, 0, sizeof(action));
+  action.type = type;
+  
+  if (type == ACTION_NONE) {
+    return;
+  }
+  
+  // The URL scheme has to match the action type, http(s):// for webhooks too.
+  // Keys are expanded for parsing only; action.url keeps the template so logs never show a secret
+  const char* url = config["url"] | "";
+  char expandedUrl[API_KEY_TEMPLATE_MAX];
+  UrlParts parts;
+  if (strlen(url) == 0 || strlen(url) >= sizeof(action.url) ||
+      expandKeyReferences(url, expandedUrl, sizeof(expandedUrl), action) < 0 ||
+      strpbrk(expandedUrl, "\r\n ") != NULL || !parseUrl(expandedUrl, parts) ||
+      parts.transport != (type == ACTION_WEBHOOK ? ACTION_HTTP : type)) {
+    return;
+  }
+  if (!compileTlsPolicy(buttonIndex, config, parts, action.tls)) {
+    return;
+  }
+  
+  if (type == ACTION_MQTT || type == ACTION_UDP) {
+    compileTransportTarget(url, parts, config, action);
+    return;
+  }
+  
+  strcpy(action.url, url);
+  strcpy(action.host, parts.host);
+  action.secure = parts.secure;
+  action.port = parts.port;
+  
+  action.method = METHOD_POST;
+  if (type == ACTION_HTTP) {
+    const char* method = config["method"] | "POST";
+    if (strcasecmp(method, "GET") == 0) {
+      action.method = METHOD_GET;
+    } else if (strcasecmp(method, "PUT") == 0) {
+      action.method = METHOD_PUT;
+    }
+  }
+  
+  // Only add the port to Host when it is not the scheme default
+  char hostHeader[80];
+  bool defaultPort = parts.port == (parts.secure ? 443 : 80);
+  if (defaultPort) {
+    snprintf(hostHeader, sizeof(hostHeader), "%s", parts.host);
+  } else {
+    snprintf(hostHeader, sizeof(hostHeader), "%s:%u", parts.host, parts.port);
+  }
+  
+  size_t headSize = sizeof(action.requestHead);
+  int length = snprintf(action.requestHead, headSize,
+                        "%s %s%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: PATCOM/%s\r\nConnection: keep-alive\r\nContent-Type: application/json\r\n",
+                        actionMethodName(action.method), parts.pathPrefix, parts.path, hostHeader, VERSION);
+  bool truncated = length < 0 || length >= (int)headSize;
+  
+  // Custom headers, rejecting anything that could split the request
+  JsonObject headers = config["headers"];
+  for (JsonPair header : headers) {
+    if (truncated) break;
+    const char* name = header.key().c_str();
+    char value[API_KEY_TEMPLATE_MAX];
+    if (expandKeyReferences(header.value() | "", value, sizeof(value), action) < 0) {
+      truncated = true;
+      break;
+    }
+    if (strpbrk(name, "\r\n:") != NULL || strpbrk(value, "\r\n") != NULL) {
+      Console.printf("Button %d: ignoring invalid header '%s'\n", buttonIndex, name);
+      continue;
+    }
+    int added = snprintf(action.requestHead + length, headSize - length, "%s: %s\r\n", name, value);
+    truncated = added < 0 || added >= (int)(headSize - length);
+    length += truncated ? 0 : added;
+  }
+  
+  if (type == ACTION_WEBHOOK) {
+    char secret[API_KEY_TEMPLATE_MAX];
+    if (expandKeyReferences(config["secret"] | "", secret, sizeof(secret), action) < 0) {
+      truncated = true;
+    }
+    if (!truncated && strlen(secret) > 0 && strpbrk(secret, "\r\n") == NULL) {
+      int added = snprintf(action.requestHead + length, headSize - length, "X-Webhook-Secret: %s\r\n", secret);
+      truncated = added < 0 || added >= (int)(headSize - length);
+      length += truncated ? 0 : added;
+    }
+    
+    // Serialize the static part of the payload once; the closing brace is replaced per press
+    StaticJsonDocument<256> payload;
+    payload["device_id"] = deviceConfig.deviceId;
+    payload["device_name"] = deviceConfig.deviceName;
+    payload["button"] = slotButton(buttonIndex);
+    payload["button_name"] = buttonConfigs[buttonIndex].name;
+    if (buttonIndex >= 8) {
+      payload["gesture"] = gestureName(buttonIndex);
+    }
+    size_t payloadLength = serializeJson(payload, action.body, sizeof(action.body));
+    if (payloadLength == 0 || payloadLength >= sizeof(action.body) - 1) {
+      truncated = true;
+    } else {
+      action.body[payloadLength - 1] = '\0';
+      action.bodyLength = payloadLength - 1;
+    }
+    
+    // "batch": {"max_events", "max_age" (s), "max_bytes"} - each array element keeps the single-event schema
+    JsonObject batch = config["batch"];
+    if (!batch.isNull()) {
+      int events = batch["max_events"] | (int)WEBHOOK_BATCH_DEFAULT_EVENTS;
+      int age = batch["max_age"] | (int)WEBHOOK_BATCH_DEFAULT_AGE;
+      int bytes = batch["max_bytes"] | (int)(WEBHOOK_BATCH_BUFFER - 1);
+      action.batchEvents = constrain(events, 1, 255);
+      action.batchAge = constrain(age, 1, 3600);
+      action.batchBytes = constrain(bytes, 64, (int)(WEBHOOK_BATCH_BUFFER - 1));
+    }
+  } else {
+    int bodyLength = expandKeyReferences(config["body"] | "", action.body, sizeof(action.body), action);
+    if (bodyLength < 0) {
+      truncated = true;
+    } else {
+      action.bodyLength = bodyLength;
+    }
+  }
+  
+  if (truncated) {
+    if (!action.keyMissing) {
+      Console.printf("Button %d action does not fit the compiled request buffers\n", buttonIndex);
+    }
+    return;
+  }
+  
+  action.requestHeadLength = length;
+  action.valid = true;
+}
+
+// The chain is checked against the built-in CA bundle unless "tls": {"verify": false}; "fingerprint"
+// pins the SHA-256 of the server certificate (works for self-signed servers); both may be combined
+bool compileTlsPolicy(int buttonIndex, JsonObject config, const UrlParts& parts, TlsPolicy& policy) {
+  memset(&policy, 0, sizeof(policy));
+  if (!parts.secure) {
+    return true;
+  }
+  
+  JsonObject tls = config["tls"];
+  policy.verifyChain = tls["verify"] | true;
+  const char* fingerprint = tls["fingerprint"] | "";
+  if (strlen(fingerprint) > 0) {
+    if (!parseFingerprint(fingerprint, policy.fingerprint)) {
+      Console.printf("Button %d: tls.fingerprint must be a SHA-256 in hex\n", buttonIndex);
+      return false;
+    }
+    policy.pinned = true;
+  }
+  
+  if (!policy.verifyChain && !policy.pinned) {
+    Console.printf("Button %d: %s is encrypted but not verified (tls.verify is off and no tls.fingerprint)\n",
+                   buttonIndex, parts.host);
+  }
+  return true;
+}
+
+// Accepts 64 hex digits, optionally separated by ':' or spaces as certificate viewers print them
+bool parseFingerprint(const char* text, uint8_t* fingerprint) {
+  size_t digits = 0;
+  for (const char* c = text; *c != '\0'; c++) {
+    if (*c == ':' || *c == ' ') continue;
+    if (!isxdigit((unsigned char)*c) || digits >= TLS_FINGERPRINT_SIZE * 2) {
+      return false;
+    }
+    uint8_t value = isdigit((unsigned char)*c) ? *c - '0' : (tolower((unsigned char)*c) - 'a' + 10);
+    if (digits % 2 == 0) {
+      fingerprint[digits / 2] = value << 4;
+    } else {
+      fingerprint[digits / 2] |= value;
+    }
+    digits++;
+  }
+  return digits == TLS_FINGERPRINT_SIZE * 2;
+}
+
+void compileTransportTarget(const char* url, const UrlParts& parts, JsonObject config, CompiledAction& action) {
+  // Keys resolve now; the per-press placeholders ({{button}}, ...) stay in the payload template
+  int payloadLength = expandKeyReferences(config["payload"] | "", action.body, sizeof(action.body), action);
+  if (parts.port == 0 || payloadLength < 0) {
+    return;
+  }
+  
+  strcpy(action.url, url);
+  strcpy(action.host, parts.host);
+  action.secure = parts.secure;
+  action.port = parts.port;
+  action.bodyLength = payloadLength;
+  
+  if (action.type == ACTION_MQTT) {
+    char topic[API_KEY_TEMPLATE_MAX];
+    char username[API_KEY_TEMPLATE_MAX];
+    char password[API_KEY_TEMPLATE_MAX];
+    if (expandKeyReferences(config["topic"] | "", topic, sizeof(topic), action) < 0 ||
+        expandKeyReferences(config["username"] | "", username, sizeof(username), action) < 0 ||
+        expandKeyReferences(config["password"] | "", password, sizeof(password), action) < 0) {
+      return;
+    }
+    
+    // Topic and credentials share requestHead as three NUL-terminated strings
+    size_t topicLength = strlen(topic);
+    size_t usernameLength = strlen(username);
+    size_t passwordLength = strlen(password);
+    if (topicLength == 0 || strpbrk(topic, "+#") != NULL ||
+        usernameLength >= sizeof(MqttSession::username) || passwordLength >= sizeof(MqttSession::password) ||
+        topicLength + usernameLength + passwordLength + 3 > sizeof(action.requestHead)) {
+      return;
+    }
+    memcpy(action.requestHead, topic, topicLength + 1);
+    memcpy(action.requestHead + topicLength + 1, username, usernameLength + 1);
+    memcpy(action.requestHead + topicLength + usernameLength + 2, password, passwordLength + 1);
+    action.requestHeadLength = topicLength;
+    
+    // QoS 2 needs a four-way handshake per press; at-least-once is the most we offer
+    int qos = config["qos"] | 0;
+    action.qos = qos > 0 ? 1 : 0;
+    action.retain = config["retain"] | false;
+  }
+  
+  action.valid = true;
+}
+
+const char* actionMethodName(ActionMethod method) {
+  switch (method) {
+    case METHOD_GET: return "GET";
+    case METHOD_PUT: return "PUT";
+    case METHOD_POST:
+    default: return "POST";
+  }
+}
+
+// TLS Client Functions
+
+TlsClient::~TlsClient() {
+  stop();
+  if (seeded) {
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+  }
+}
+
+int TlsClient::connectSocket(IPAddress address, uint16_t port, int32_t timeout) {
+  stop();
+  return tcp.connect(address, port, timeout);
+}
+
+bool TlsClient::handshake(const char* host, uint16_t port, const TlsPolicy& policy, int32_t timeout) {
+  if (!seeded) {
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                              (const unsigned char*)DEVICE_NAME, strlen(DEVICE_NAME)) != 0) {
+      Console.printf("TLS random generator failed to seed\n");
+      tcp.stop();
+      return false;
+    }
+    seeded = true;
+  }
+  
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&conf);
+  active = true;
+  closed = false;
+  peeked = -1;
+  ioTimeout = timeout;
+  
+  // A pinned certificate is checked after the handshake, so only a chain check needs verification here
+  bool ready = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT) == 0;
+  if (ready) {
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+    mbedtls_ssl_conf_authmode(&conf, policy.verifyChain ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    ready = (!policy.verifyChain || esp_crt_bundle_attach(&conf) == ESP_OK) &&
+            mbedtls_ssl_setup(&ssl, &conf) == 0 && mbedtls_ssl_set_hostname(&ssl, host) == 0;
+  }
+  if (!ready) {
+    Console.printf("TLS setup for %s failed\n", host);
+    stop();
+    return false;
+  }
+  mbedtls_ssl_set_bio(&ssl, this, sendCallback, recvCallback, NULL);
+  
+  // Offer the last session ticket/ID; a server that no longer knows it falls back to a full handshake
+  TlsSessionEntry* cached = findTlsSession(host, port, policy, false);
+  bool offered = cached != NULL && mbedtls_ssl_set_session(&ssl, &cached->session) == 0;
+  
+  unsigned long start = millis();
+  int result;
+  while ((result = mbedtls_ssl_handshake(&ssl)) != 0) {
+    bool pending = result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE;
+    if (!pending || millis() - start > (unsigned long)timeout) {
+      Console.printf("TLS handshake with %s failed (-0x%04X)\n", host, pending ? 0 : -result);
+      if (cached != NULL) dropTlsSession(cached);
+      stop();
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  
+  // Resumed sessions carry the certificate that was checked on the full handshake
+  if (policy.pinned) {
+    const mbedtls_x509_crt* peer = mbedtls_ssl_get_peer_cert(&ssl);
+    uint8_t digest[TLS_FINGERPRINT_SIZE];
+#if MBEDTLS_VERSION_MAJOR >= 3
+    bool hashed = peer != NULL && mbedtls_sha256(peer->raw.p, peer->raw.len, digest, 0) == 0;
+#else
+    bool hashed = peer != NULL && mbedtls_sha256_ret(peer->raw.p, peer->raw.len, digest, 0) == 0;
+#endif
+    if (!hashed || memcmp(digest, policy.fingerprint, TLS_FINGERPRINT_SIZE) != 0) {
+      Console.printf("TLS certificate of %s does not match the pinned fingerprint\n", host);
+      if (cached != NULL) dropTlsSession(cached);
+      stop();
+      return false;
+    }
+  }
+  
+  // Keep the session (renewed ticket included) for the next connection to this host
+  TlsSessionEntry* entry = cached != NULL ? cached : findTlsSession(host, port, policy, true);
+  mbedtls_ssl_session_free(&entry->session);
+  mbedtls_ssl_session_init(&entry->session);
+  entry->valid = mbedtls_ssl_get_session(&ssl, &entry->session) == 0;
+  entry->lastUsed = millis();
+  
+  Console.printf("TLS handshake with %s in %lums%s\n", host, millis() - start, offered ? " (session offered)" : "");
+  return true;
+}
+
+size_t TlsClient::write(const uint8_t* buffer, size_t size) {
+  if (!active || closed) {
+    return 0;
+  }
+  
+  size_t sent = 0;
+  unsigned long start = millis();
+  while (sent < size) {
+    int result = mbedtls_ssl_write(&ssl, buffer + sent, size - sent);
+    if (result > 0) {
+      sent += result;
+      continue;
+    }
+    bool pending = result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE;
+    if (!pending || millis() - start > (unsigned long)ioTimeout) {
+      closed = true;
+      break;
+    }
+    vTaskDelay(1);
+  }
+  return sent;
+}
+
+// Decrypts at most one byte so available() never blocks on a partial record
+bool TlsClient::pull() {
+  if (peeked >= 0) {
+    return true;
+  }
+  if (!active || closed) {
+    return false;
+  }
+  
+  uint8_t c;
+  int result = mbedtls_ssl_read(&ssl, &c, 1);
+  if (result == 1) {
+    peeked = c;
+    return true;
+  }
+  if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    closed = true;
+  }
+  return false;
+}
+
+int TlsClient::available() {
+  if (!pull()) {
+    return 0;
+  }
+  return 1 + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::read() {
+  if (!pull()) {
+    return -1;
+  }
+  int c = peeked;
+  peeked = -1;
+  return c;
+}
+
+int TlsClient::read(uint8_t* buffer, size_t size) {
+  if (size == 0 || !pull()) {
+    return -1;
+  }
+  buffer[0] = peeked;
+  peeked = -1;
+  
+  // Only hand out what is already decrypted, the rest of the record may still be in flight
+  size_t count = 1;
+  size_t buffered = mbedtls_ssl_get_bytes_avail(&ssl);
+  if (size > 1 && buffered > 0) {
+    int result = mbedtls_ssl_read(&ssl, buffer + 1, min(size - 1, buffered));
+    if (result > 0) count += result;
+  }
+  return count;
+}
+
+int TlsClient::peek() {
+  return pull() ? peeked : -1;
+}
+
+uint8_t TlsClient::connected() {
+  if (!active) {
+    return 0;
+  }
+  if (peeked >= 0 || mbedtls_ssl_get_bytes_avail(&ssl) > 0) {
+    return 1;
+  }
+  return (!closed && tcp.connected()) ? 1 : 0;
+}
+
+void TlsClient::stop() {
+  if (active) {
+    if (!closed && tcp.connected()) {
+      mbedtls_ssl_close_notify(&ssl);
+    }
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_config_free(&conf);
+    active = false;
+  }
+  closed = false;
+  peeked = -1;
+  tcp.stop();
+}
+
+int TlsClient::sendCallback(void* context, const unsigned char* buffer, size_t length) {
+  WiFiClient& tcp = static_cast<TlsClient*>(context)->tcp;
+  size_t written = tcp.write(buffer, length);
+  return written > 0 ? (int)written : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int TlsClient::recvCallback(void* context, unsigned char* buffer, size_t length) {
+  WiFiClient& tcp = static_cast<TlsClient*>(context)->tcp;
+  int available = tcp.available();
+  if (available <= 0) {
+    return tcp.connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int received = tcp.read(buffer, min(length, (size_t)available));
+  return received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+bool sameTlsPolicy(const TlsPolicy& a, const TlsPolicy& b) {
+  return a.verifyChain == b.verifyChain && a.pinned == b.pinned &&
+         memcmp(a.fingerprint, b.fingerprint, TLS_FINGERPRINT_SIZE) == 0;
+}
+
+TlsSessionEntry* findTlsSession(const char* host, uint16_t port, const TlsPolicy& policy, bool create) {
+  TlsSessionEntry* victim = &tlsSessions[0];
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    TlsSessionEntry* entry = &tlsSessions[i];
+    if (entry->valid && entry->port == port && strcmp(entry->host, host) == 0 &&
+        sameTlsPolicy(entry->policy, policy)) {
+      return entry;
+    }
+    if (!entry->valid) {
+      if (victim->valid) victim = entry;
+    } else if (victim->valid && entry->lastUsed < victim->lastUsed) {
+      victim = entry;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  
+  // Recycle the least recently used session
+  dropTlsSession(victim);
+  strcpy(victim->host, host);
+  victim->port = port;
+  victim->policy = policy;
+  return victim;
+}
+
+void dropTlsSession(TlsSessionEntry* entry) {
+  mbedtls_ssl_session_free(&entry->session);
+  mbedtls_ssl_session_init(&entry->session);
+  entry->valid = false;
+}
+
+// DNS, TCP connect and the TLS handshake, each timed as its own stage
+bool connectTransport(WiFiClient* client, bool secure, const char* host, uint16_t port, const TlsPolicy& tls) {
+  IPAddress address;
+  int64_t dnsStart = esp_timer_get_time();
+  if (!WiFi.hostByName(host, address)) {
+    Console.printf("DNS lookup for %s failed\n", host);
+    return false;
+  }
+  int64_t connectStart = esp_timer_get_time();
+  recordStage(METRIC_DNS, connectStart - dnsStart);
+  
+  // WiFiClient::connect() is not virtual, a TLS transport has to be reached through its own type
+  TlsClient* tlsClient = secure ? static_cast<TlsClient*>(client) : NULL;
+  bool connected = secure ? tlsClient->connectSocket(address, port, HTTP_TIMEOUT)
+                          : client->connect(address, port, HTTP_TIMEOUT);
+  if (!connected) {
+    return false;
+  }
+  int64_t handshakeStart = esp_timer_get_time();
+  recordStage(METRIC_CONNECT, handshakeStart - connectStart);
+  
+  if (secure) {
+    // Pool maintenance reconnects outside any press, the handshake still wants the full clock
+    boostCpu(POWER_HOLD_ACTION);
+    bool established = tlsClient->handshake(host, port, tls, HTTP_TIMEOUT);
+    releaseCpu(POWER_HOLD_ACTION);
+    if (!established) {
+      return false;
+    }
+    recordStage(METRIC_TLS, esp_timer_get_time() - handshakeStart);
+  }
+  return true;
+}
+
+// HTTP Connection Pool Functions
+
+int sendHttpRequest(PooledConnection* conn, const CompiledAction& action, const char* body, size_t bodyLength) {
+  int written = writeHttpRequest(conn, action, body, bodyLength);
+  if (written < 0) {
+    return written;
+  }
+  return readHttpResponse(conn, millis() + HTTP_TIMEOUT);
+}
+
+int writeHttpRequest(PooledConnection* conn, const CompiledAction& action, const char* body, size_t bodyLength) {
+  WiFiClient* client = conn->client;
+  
+  if (!client->connected() && !connectPooledClient(conn)) {
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+  conn->requestStartUs = esp_timer_get_time();
+  
+  // Request head is pre-rendered; only Content-Length depends on this press
+  char lengthHeader[40];
+  int lengthHeaderSize = snprintf(lengthHeader, sizeof(lengthHeader), "Content-Length: %u\r\n\r\n", (unsigned)bodyLength);
+  
+  if (client->write((const uint8_t*)action.requestHead, action.requestHeadLength) != action.requestHeadLength ||
+      client->write((const uint8_t*)lengthHeader, lengthHeaderSize) != (size_t)lengthHeaderSize) {
+    client->stop();
+    return HTTPC_ERROR_SEND_HEADER_FAILED;
+  }
+  if (bodyLength > 0 && client->write((const uint8_t*)body, bodyLength) != bodyLength) {
+    client->stop();
+    return HTTPC_ERROR_CONNECTION_LOST;
+  }
+  
+  return 0;
+}
+
+int readHttpResponse(PooledConnection* conn, unsigned long deadline, char* bodyHead, size_t headSize) {
+  WiFiClient* client = conn->client;
+  char line[128];
+  if (headSize > 0) bodyHead[0] = '\0';
+  
+  // Interim 1xx responses (100 Continue, 103 Early Hints) are a status line and headers only;
+  // the final response follows on the same socket
+  int httpCode;
+  bool keepAlive;
+  long contentLength;
+  bool chunked;
+  int64_t statusUs;
+  do {
+    // Status line: "HTTP/1.1 200 OK"
+    int lineLength = readHttpLine(client, line, sizeof(line), deadline);
+    if (lineLength < 0) {
+      client->stop();
+      return lineLength;
+    }
+    const char* status = strchr(line, ' ');
+    httpCode = status ? atoi(status + 1) : 0;
+    if (strncmp(line, "HTTP/1.", 7) != 0 || httpCode <= 0) {
+      client->stop();
+      return HTTPC_ERROR_CONNECTION_LOST;
+    }
+    statusUs = esp_timer_get_time();
+    keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+    
+    // Headers - only the ones that decide how to drain the body and whether to keep the socket
+    contentLength = -1;
+    chunked = false;
+    for (;;) {
+      lineLength = readHttpLine(client, line, sizeof(line), deadline);
+      if (lineLength < 0) {
+        client->stop();
+        return lineLength;
+      }
+      if (lineLength == 0) break;
+      
+      if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        contentLength = atol(line + 15);
+      } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+        chunked = strcasestr(line + 18, "chunked") != NULL;
+      } else if (strncasecmp(line, "Connection:", 11) == 0) {
+        if (strcasestr(line + 11, "close") != NULL) keepAlive = false;
+        if (strcasestr(line + 11, "keep-alive") != NULL) keepAlive = true;
+      }
+    }
+  } while (httpCode < 200);
+  recordStage(METRIC_REQUEST, statusUs - conn->requestStartUs);
+  
+  // 204 and 304 never carry a body, whatever the headers say
+  if (httpCode == 204 || httpCode == 304) {
+    contentLength = 0;
+    chunked = false;
+  }
+  
+  // Without a length the body runs until close, so the socket cannot be reused
+  if (contentLength < 0 && !chunked) {
+    keepAlive = false;
+  }
+  
+  bool drained = (contentLength < 0 && !chunked) ||
+                 drainHttpBody(client, contentLength, chunked, deadline, bodyHead, headSize);
+  if (!keepAlive || !drained) {
+    client->stop();
+  }
+  recordStage(METRIC_RESPONSE, esp_timer_get_time() - statusUs);
+  
+  return httpCode;
+}
+
+int readHttpLine(WiFiClient* client, char* buffer, size_t size, unsigned long deadline) {
+  size_t length = 0;
+  
+  for (;;) {
+    int c = client->read();
+    if (c < 0) {
+      if (!client->connected()) return HTTPC_ERROR_CONNECTION_LOST;
+      if ((long)(millis() - deadline) >= 0) return HTTPC_ERROR_READ_TIMEOUT;
+      vTaskDelay(1);
+      continue;
+    }
+    
+    if (c == '\n') break;
+    if (c != '\r' && length < size - 1) {
+      buffer[length++] = (char)c;
+    }
+  }
+  
+  buffer[length] = '\0';
+  return length;
+}
+
+bool drainHttpBody(WiFiClient* client, long contentLength, bool chunked, unsigned long deadline, char* bodyHead,
+                   size_t headSize) {
+  uint8_t scratch[128];
+  char line[32];
+  size_t headLength = 0;
+  
+  for (;;) {
+    long remaining = contentLength;
+    
+    if (chunked) {
+      if (readHttpLine(client, line, sizeof(line), deadline) < 0) return false;
+      remaining = strtol(line, NULL, 16);
+    }
+    
+    while (remaining > 0) {
+      int available = client->available();
+      if (available <= 0) {
+        if (!client->connected() || (long)(millis() - deadline) >= 0) return false;
+        vTaskDelay(1);
+        continue;
+      }
+      int chunk = client->read(scratch, min((long)sizeof(scratch), min((long)available, remaining)));
+      if (chunk <= 0) return false;
+      remaining -= chunk;
+      
+      // Keep the start of the body for callers that look at it, discard the rest
+      if (headLength + 1 < headSize) {
+        size_t keep = min((size_t)chunk, headSize - 1 - headLength);
+        memcpy(bodyHead + headLength, scratch, keep);
+        headLength += keep;
+        bodyHead[headLength] = '\0';
+      }
+    }
+    
+    if (!chunked) return true;
+    
+    // Consume the CRLF after the chunk; a zero-size chunk ends the body (trailers ignored)
+    bool lastChunk = strtol(line, NULL, 16) == 0;
+    if (readHttpLine(client, line, sizeof(line), deadline) < 0) return false;
+    if (lastChunk) return true;
+  }
+}
+
+bool parseUrl(const char* url, UrlParts& parts) {
+  // Default port 0: udp:// targets must name one
+  static const struct {
+    const char* prefix;
+    ActionType transport;
+    bool secure;
+    uint16_t port;
+  } schemes[] = {
+    {"https://", ACTION_HTTP, true, 443},
+    {"http://", ACTION_HTTP, false, 80},
+    {"mqtts://", ACTION_MQTT, true, 8883},
+    {"mqtt://", ACTION_MQTT, false, 1883},
+    {"udp://", ACTION_UDP, false, 0},
+  };
+  
+  const char* hostStart = NULL;
+  for (size_t i = 0; i < sizeof(schemes) / sizeof(schemes[0]); i++) {
+    size_t prefixLength = strlen(schemes[i].prefix);
+    if (strncmp(url, schemes[i].prefix, prefixLength) == 0) {
+      parts.transport = schemes[i].transport;
+      parts.secure = schemes[i].secure;
+      parts.port = schemes[i].port;
+      hostStart = url + prefixLength;
+      break;
+    }
+  }
+  if (hostStart == NULL) {
+    return false;
+  }
+  
+  const char* hostEnd = hostStart;
+  while (*hostEnd && *hostEnd != ':' && *hostEnd != '/' && *hostEnd != '?') {
+    hostEnd++;
+  }
+  
+  size_t hostLength = hostEnd - hostStart;
+  if (hostLength == 0 || hostLength >= sizeof(parts.host)) {
+    return false;
+  }
+  memcpy(parts.host, hostStart, hostLength);
+  parts.host[hostLength] = '\0';
+  
+  const char* pathStart = hostEnd;
+  if (*pathStart == ':') {
+    // Digits only, up to the path or query - strtoul alone would take " 80", "+80" or "80abc"
+    char* portEnd;
+    unsigned long port = isdigit((unsigned char)pathStart[1]) ? strtoul(pathStart + 1, &portEnd, 10) : 0;
+    if (port == 0 || port > 65535 || (*portEnd != '\0' && *portEnd != '/' && *portEnd != '?')) {
+      return false;
+    }
+    parts.port = (uint16_t)port;
+    pathStart = portEnd;
+  }
+  
+  parts.path = (*pathStart == '\0') ? "/" : pathStart;
+  parts.pathPrefix = (*pathStart == '?') ? "/" : "";
+  return true;
+}
+
+PooledConnection* acquireConnection(bool secure, const char* host, uint16_t port, const TlsPolicy& tls) {
+  PooledConnection* victim = &httpPool[0];
+  
+  // MAX_CHAIN_ACTIONS <= HTTP_POOL_SIZE, so a free or idle slot always remains
+  for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+    PooledConnection* conn = &httpPool[i];
+    if (conn->assigned && conn->secure == secure && conn->port == port &&
+        strcmp(conn->host, host) == 0 && sameTlsPolicy(conn->tls, tls)) {
+      return conn;
+    }
+    
+    // Prefer an empty slot, otherwise evict the least recently used host not carrying a request
+    if (conn->inUse) continue;
+    if (!conn->assigned) {
+      if (victim->inUse || victim->assigned) victim = conn;
+    } else if (victim->inUse || (victim->assigned && conn->lastUsed < victim->lastUsed)) {
+      victim = conn;
+    }
+  }
+  
+  if (victim->assigned) {
+    Console.printf("Evicting pooled connection to %s\n", victim->host);
+    closePooledConnection(victim);
+  }
+  
+  // Only reallocate the transport when the scheme changes
+  if (victim->client != NULL && victim->secure != secure) {
+    delete victim->client;
+    victim->client = NULL;
+  }
+  if (victim->client == NULL) {
+    if (secure) {
+      victim->client = new TlsClient();
+    } else {
+      victim->client = new WiFiClient();
+    }
+  }
+  
+  victim->assigned = true;
+  victim->secure = secure;
+  victim->tls = tls;
+  victim->port = port;
+  strcpy(victim->host, host);
+  victim->lastUsed = millis();
+  return victim;
+}
+
+bool connectPooledClient(PooledConnection* conn) {
+  if (conn->client->connected()) {
+    return true;
+  }
+  
+  unsigned long start = millis();
+  bool connected = connectTransport(conn->client, conn->secure, conn->host, conn->port, conn->tls);
+  
+  if (connected) {
+    Console.printf("Connected to %s:%u in %lums\n", conn->host, conn->port, millis() - start);
+  } else {
+    Console.printf("Connect to %s:%u failed\n", conn->host, conn->port);
+  }
+  return connected;
+}
+
+void closePooledConnection(PooledConnection* conn) {
+  if (conn->client != NULL) {
+    conn->client->stop();
+  }
+  conn->assigned = false;
+  conn->host[0] = '\0';
+}
+
+void warmHttpPool() {
+  if (!wifiConnected) return;
+  
+  // Collect distinct configured hosts under the lock, connect without holding it;
+  // more hosts than pool slots would only evict each other
+  UrlParts targets[HTTP_POOL_SIZE];
+  TlsPolicy policies[HTTP_POOL_SIZE];
+  int targetCount = 0;
+  
+  lockConfig();
+  for (int i = 0; i < ACTION_SLOTS && targetCount < HTTP_POOL_SIZE; i++) {
+    if (!buttonConfigs[i].enabled) continue;
+    
+    for (int j = 0; j < compiledButtons[i].count && targetCount < HTTP_POOL_SIZE; j++) {
+      const CompiledAction& action = *compiledButtons[i].actions[j];
+      if (!action.valid || (action.type != ACTION_HTTP && action.type != ACTION_WEBHOOK)) continue;
+      
+      bool known = false;
+      for (int k = 0; k < targetCount && !known; k++) {
+        known = targets[k].secure == action.secure && targets[k].port == action.port &&
+                strcmp(targets[k].host, action.host) == 0 && sameTlsPolicy(policies[k], action.tls);
+      }
+      if (known) continue;
+      
+      targets[targetCount].secure = action.secure;
+      targets[targetCount].port = action.port;
+      strcpy(targets[targetCount].host, action.host);
+      policies[targetCount] = action.tls;
+      targetCount++;
+    }
+  }
+  unlockConfig();
+  
+  for (int i = 0; i < targetCount; i++) {
+    PooledConnection* conn = acquireConnection(targets[i].secure, targets[i].host, targets[i].port, policies[i]);
+    connectPooledClient(conn);
+  }
+  
+  lastPoolMaintenance = millis();
+}
+
+void maintainHttpPool() {
+  if (!wifiConnected) return;
+  
+  // Re-open sockets the server closed while idle so the next press skips the handshake
+  for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+    if (httpPool[i].assigned && !httpPool[i].client->connected()) {
+      connectPooledClient(&httpPool[i]);
+    }
+  }
+  
+  lastPoolMaintenance = millis();
+}
+
+// MQTT Session Functions
+
+bool mqttSessionServes(const MqttSession* session, const CompiledAction& action) {
+  const char* topic;
+  const char* username;
+  const char* password;
+  mqttActionFields(action, topic, username, password);
+  return session->assigned && session->secure == action.secure && session->port == action.port &&
+         strcmp(session->host, action.host) == 0 && strcmp(session->username, username) == 0 &&
+         strcmp(session->password, password) == 0 && sameTlsPolicy(session->tls, action.tls);
+}
+
+MqttSession* acquireMqttSession(const CompiledAction& action) {
+  const char* topic;
+  const char* username;
+  const char* password;
+  mqttActionFields(action, topic, username, password);
+  
+  MqttSession* victim = &mqttSessions[0];
+  for (int i = 0; i < MQTT_MAX_SESSIONS; i++) {
+    MqttSession* session = &mqttSessions[i];
+    if (mqttSessionServes(session, action)) {
+      return session;
+    }
+    
+    // Prefer an empty slot, otherwise evict the longest idle broker
+    if (!session->assigned) {
+      if (victim->assigned) victim = session;
+    } else if (victim->assigned && session->lastActivity < victim->lastActivity) {
+      victim = session;
+    }
+  }
+  
+  if (victim->assigned) {
+    Console.printf("Evicting MQTT session to %s\n", victim->host);
+    closeMqttSession(victim);
+  }
+  
+  if (victim->client != NULL && victim->secure != action.secure) {
+    delete victim->client;
+    victim->client = NULL;
+  }
+  if (victim->client == NULL) {
+    if (action.secure) {
+      victim->client = new TlsClient();
+    } else {
+      victim->client = new WiFiClient();
+    }
+  }
+  
+  victim->assigned = true;
+  victim->secure = action.secure;
+  victim->tls = action.tls;
+  victim->port = action.port;
+  strcpy(victim->host, action.host);
+  strcpy(victim->username, username);
+  strcpy(victim->password, password);
+  victim->lastActivity = millis();
+  return victim;
+}
+
+bool connectMqttSession(MqttSession* session) {
+  WiFiClient* client = session->client;
+  if (client->connected()) {
+    return true;
+  }
+  
+  unsigned long start = millis();
+  if (!connectTransport(client, session->secure, session->host, session->port, session->tls)) {
+    Console.printf("MQTT connect to %s:%u failed\n", session->host, session->port);
+    return false;
+  }
+  
+  // CONNECT: protocol "MQTT" level 4, clean session, keep-alive, then client id and credentials
+  uint8_t packet[MQTT_PACKET_MAX];
+  uint8_t* body = packet + MQTT_HEADER_MAX;
+  size_t length = putMqttString(body, "MQTT");
+  body[length++] = 0x04;
+  uint8_t flags = 0x02;
+  if (session->username[0] != '\0') flags |= 0x80;
+  if (session->password[0] != '\0') flags |= 0x40;
+  body[length++] = flags;
+  body[length++] = MQTT_KEEPALIVE >> 8;
+  body[length++] = MQTT_KEEPALIVE & 0xFF;
+  // A broker drops the older connection when a client id connects again, so two sessions to one broker
+  // (different users) must not share one: the session index keeps them apart, within the 23 bytes of MQTT 3.1.1
+  char clientId[sizeof(deviceConfig.deviceId) + 4];
+  snprintf(clientId, sizeof(clientId), "%s-%d", deviceConfig.deviceId, (int)(session - mqttSessions));
+  length += putMqttString(body + length, clientId);
+  if (flags & 0x80) length += putMqttString(body + length, session->username);
+  if (flags & 0x40) length += putMqttString(body + length, session->password);
+  
+  size_t offset = finishMqttPacket(packet, 0x10, length);
+  size_t packetLength = MQTT_HEADER_MAX - offset + length;
+  if (client->write(packet + offset, packetLength) != packetLength) {
+    client->stop();
+    return false;
+  }
+  
+  uint8_t type = 0;
+  uint8_t response[4];
+  int responseLength = readMqttPacket(session, type, response, sizeof(response), millis() + HTTP_TIMEOUT);
+  if (responseLength < 2 || type != 2 || response[1] != 0) {
+    Console.printf("MQTT broker %s refused the session (%d)\n", session->host, responseLength >= 2 ? response[1] : responseLength);
+    client->stop();
+    return false;
+  }
+  
+  session->lastActivity = millis();
+  Console.printf("MQTT session to %s:%u open in %lums\n", session->host, session->port, millis() - start);
+  return true;
+}
+
+int sendMqttPublish(MqttSession* session, const CompiledAction& action, const char* payload, size_t length) {
+  const char* topic;
+  const char* username;
+  const char* password;
+  mqttActionFields(action, topic, username, password);
+  
+  uint8_t packet[MQTT_PACKET_MAX];
+  uint8_t* body = packet + MQTT_HEADER_MAX;
+  size_t bodyLength = putMqttString(body, topic);
+  
+  uint16_t packetId = 0;
+  if (action.qos > 0) {
+    packetId = ++session->nextPacketId;
+    if (packetId == 0) packetId = ++session->nextPacketId;  // 0 is not a valid id
+    body[bodyLength++] = packetId >> 8;
+    body[bodyLength++] = packetId & 0xFF;
+  }
+  
+  if (MQTT_HEADER_MAX + bodyLength + length > sizeof(packet)) {
+    return HTTP_ERROR_INVALID_ACTION;
+  }
+  memcpy(body + bodyLength, payload, length);
+  bodyLength += length;
+  
+  uint8_t header = 0x30 | (action.qos << 1) | (action.retain ? 0x01 : 0x00);
+  size_t offset = finishMqttPacket(packet, header, bodyLength);
+  size_t packetLength = MQTT_HEADER_MAX - offset + bodyLength;
+  
+  WiFiClient* client = session->client;
+  if (client->write(packet + offset, packetLength) != packetLength) {
+    client->stop();
+    return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+  }
+  session->lastActivity = millis();
+  
+  if (action.qos == 0) {
+    return ACTION_RESULT_SENT;
+  }
+  
+  // Wait for our PUBACK; a PINGRESP may arrive first
+  unsigned long deadline = millis() + HTTP_TIMEOUT;
+  for (;;) {
+    uint8_t type = 0;
+    uint8_t response[4];
+    int responseLength = readMqttPacket(session, type, response, sizeof(response), deadline);
+    if (responseLength < 0) {
+      client->stop();
+      return responseLength;
+    }
+    if (type == 4 && responseLength >= 2 && ((response[0] << 8) | response[1]) == packetId) {
+      return ACTION_RESULT_SENT;
+    }
+  }
+}
+
+int readMqttPacket(MqttSession* session, uint8_t& type, uint8_t* buffer, size_t size, unsigned long deadline) {
+  WiFiClient* client = session->client;
+  
+  int header = readMqttByte(client, deadline);
+  if (header < 0) return header;
+  
+  // Remaining length: 7 bits per byte, continuation in the top bit, at most 4 bytes
+  uint32_t remaining = 0;
+  for (int i = 0; i < 4; i++) {
+    int value = readMqttByte(client, deadline);
+    if (value < 0) return value;
+    remaining |= (uint32_t)(value & 0x7F) << (7 * i);
+    if (!(value & 0x80)) break;
+    if (i == 3) return HTTPC_ERROR_CONNECTION_LOST;
+  }
+  
+  // Anything beyond the buffer is read and dropped
+  size_t length = 0;
+  for (uint32_t i = 0; i < remaining; i++) {
+    int value = readMqttByte(client, deadline);
+    if (value < 0) return value;
+    if (length < size) buffer[length++] = (uint8_t)value;
+  }
+  
+  type = header >> 4;
+  return length;
+}
+
+int readMqttByte(WiFiClient* client, unsigned long deadline) {
+  for (;;) {
+    int c = client->read();
+    if (c >= 0) return c;
+    if (!client->connected()) return HTTPC_ERROR_CONNECTION_LOST;
+    if ((long)(millis() - deadline) >= 0) return HTTPC_ERROR_READ_TIMEOUT;
+    vTaskDelay(1);
+  }
+}
+
+size_t putMqttString(uint8_t* output, const char* text) {
+  size_t length = strlen(text);
+  output[0] = length >> 8;
+  output[1] = length & 0xFF;
+  memcpy(output + 2, text, length);
+  return length + 2;
+}
+
+size_t finishMqttPacket(uint8_t* packet, uint8_t header, size_t bodyLength) {
+  // The body starts at MQTT_HEADER_MAX; the fixed header is written right before it
+  uint8_t encoded[4];
+  size_t encodedLength = 0;
+  do {
+    uint8_t value = bodyLength & 0x7F;
+    bodyLength >>= 7;
+    encoded[encodedLength++] = value | (bodyLength > 0 ? 0x80 : 0x00);
+  } while (bodyLength > 0 && encodedLength < sizeof(encoded));
+  
+  size_t offset = MQTT_HEADER_MAX - 1 - encodedLength;
+  packet[offset] = header;
+  memcpy(packet + offset + 1, encoded, encodedLength);
+  return offset;
+}
+
+void mqttActionFields(const CompiledAction& action, const char*& topic, const char*& username, const char*& password) {
+  topic = action.requestHead;
+  username = topic + strlen(topic) + 1;
+  password = username + strlen(username) + 1;
+}
+
+void closeMqttSession(MqttSession* session) {
+  if (session->client != NULL && session->client->connected()) {
+    static const uint8_t disconnect[2] = {0xE0, 0x00};
+    session->client->write(disconnect, sizeof(disconnect));
+    session->client->stop();
+  }
+  session->assigned = false;
+  session->host[0] = '\0';
+}
+
+void warmMqttSessions() {
+  // Runs after every commit that touched targets: a session no enabled target uses any more is closed,
+  // or maintainMqttSessions() would keep reconnecting to a broker that was removed
+  bool unused[MQTT_MAX_SESSIONS];
+  lockConfig();
+  for (int s = 0; s < MQTT_MAX_SESSIONS; s++) {
+    unused[s] = mqttSessions[s].assigned;
+    for (int i = 0; i < ACTION_SLOTS && unused[s]; i++) {
+      if (!buttonConfigs[i].enabled) continue;
+      for (int j = 0; j < compiledButtons[i].count; j++) {
+        const CompiledAction& action = *compiledButtons[i].actions[j];
+        if (action.valid && action.type == ACTION_MQTT && mqttSessionServes(&mqttSessions[s], action)) {
+          unused[s] = false;
+          break;
+        }
+      }
+    }
+  }
+  unlockConfig();
+  for (int s = 0; s < MQTT_MAX_SESSIONS; s++) {
+    if (unused[s]) {
+      Console.printf("Closing MQTT session to %s - no target uses it\n", mqttSessions[s].host);
+      closeMqttSession(&mqttSessions[s]);
+    }
+  }
+  
+  if (!wifiConnected) return;
+  
+  // Sessions only open for brokers still configured; MqttSession keeps its own copy of the credentials
+  static CompiledAction brokers[MQTT_MAX_SESSIONS];
+  int brokerCount = 0;
+  
+  lockConfig();
+  for (int i = 0; i < ACTION_SLOTS && brokerCount < MQTT_MAX_SESSIONS; i++) {
+    if (!buttonConfigs[i].enabled) continue;
+    for (int j = 0; j < compiledButtons[i].count && brokerCount < MQTT_MAX_SESSIONS; j++) {
+      const CompiledAction& action = *compiledButtons[i].actions[j];
+      if (action.valid && action.type == ACTION_MQTT) {
+        brokers[brokerCount++] = action;
+      }
+    }
+  }
+  unlockConfig();
+  
+  for (int i = 0; i < brokerCount; i++) {
+    connectMqttSession(acquireMqttSession(brokers[i]));
+  }
+}
+
+void maintainMqttSessions() {
+  if (!wifiConnected) return;
+  
+  for (int i = 0; i < MQTT_MAX_SESSIONS; i++) {
+    MqttSession* session = &mqttSessions[i];
+    if (!session->assigned) continue;
+    
+    // Reconnect in the background so a press never waits for the broker handshake
+    if (!session->client->connected()) {
+      connectMqttSession(session);
+      continue;
+    }
+    
+    // Consume PINGRESPs and anything else the broker pushed
+    while (session->client->available() > 0) {
+      uint8_t type = 0;
+      uint8_t scratch[4];
+      if (readMqttPacket(session, type, scratch, sizeof(scratch), millis() + HTTP_TIMEOUT) < 0) {
+        session->client->stop();
+        break;
+      }
+    }
+    
+    if (session->client->connected() && millis() - session->lastActivity > MQTT_PING_INTERVAL) {
+      static const uint8_t ping[2] = {0xC0, 0x00};
+      if (session->client->write(ping, sizeof(ping)) != sizeof(ping)) {
+        session->client->stop();
+      }
+      session->lastActivity = millis();
+    }
+  }
+}
+
+void requestHttpPoolWarmup() {
+  if (actionQueue == NULL) return;
+  
+  ActionEvent event;
+  event.buttonIndex = ACTION_EVENT_POOL_WARMUP;
+  event.timestamp = millis();
+  event.queuedUs = esp_timer_get_time();
+  xQueueSend(actionQueue, &event, 0);
+}
+
+// Metrics Functions
+
+void recordLatency(LatencyHistogram& histogram, int64_t us) {
+  if (us < 0) us = 0;
+  int bucket = 0;
+  while (bucket < METRIC_BUCKETS && (uint64_t)us > METRIC_BUCKET_BOUNDS_US[bucket]) {
+    bucket++;
+  }
+  
+  portENTER_CRITICAL(&metricsMux);
+  histogram.buckets[bucket]++;
+  histogram.count++;
+  histogram.sumUs += us;
+  portEXIT_CRITICAL(&metricsMux);
+}
+
+void recordStage(MetricStage stage, int64_t us) {
+  recordLatency(stageMetrics[stage], us);
+}
+
+void recordActionOutcome(int slot, const char* host, bool success, int64_t us) {
+  ButtonMetrics& button = buttonMetrics[slotButton(slot)];
+  recordLatency(button.action, us);
+  
+  portENTER_CRITICAL(&metricsMux);
+  if (success) button.successes++; else button.failures++;
+  portEXIT_CRITICAL(&metricsMux);
+  
+  HostMetrics* hostEntry = host[0] != '\0' ? findHostMetrics(host) : NULL;
+  if (hostEntry != NULL) {
+    recordLatency(hostEntry->request, us);
+    portENTER_CRITICAL(&metricsMux);
+    if (success) hostEntry->successes++; else hostEntry->failures++;
+    portEXIT_CRITICAL(&metricsMux);
+  }
+}
+
+HostMetrics* findHostMetrics(const char* host) {
+  // Only the action worker adds hosts, so the table itself needs no lock
+  HostMetrics* victim = &hostMetrics[0];
+  for (int i = 0; i < METRIC_HOSTS; i++) {
+    HostMetrics& entry = hostMetrics[i];
+    if (entry.used && strcmp(entry.host, host) == 0) {
+      return &entry;
+    }
+    if (!entry.used) {
+      if (victim->used) victim = &entry;
+    } else if (victim->used && entry.request.count < victim->request.count) {
+      victim = &entry;
+    }
+  }
+  
+  portENTER_CRITICAL(&metricsMux);
+  memset(victim, 0, sizeof(HostMetrics));
+  strlcpy(victim->host, host, sizeof(victim->host));
+  victim->used = true;
+  portEXIT_CRITICAL(&metricsMux);
+  return victim;
+}
+
+uint32_t histogramQuantile(const LatencyHistogram& histogram, float quantile) {
+  // Upper bound of the bucket holding the quantile - coarse, but monotonic and cheap
+  if (histogram.count == 0) return 0;
+  uint32_t rank = (uint32_t)ceilf(quantile * histogram.count);
+  uint32_t seen = 0;
+  for (int i = 0; i < METRIC_BUCKETS; i++) {
+    seen += histogram.buckets[i];
+    if (seen >= rank) return METRIC_BUCKET_BOUNDS_US[i];
+  }
+  return METRIC_BUCKET_BOUNDS_US[METRIC_BUCKETS - 1] * 2;  // Above the last bound
+}
+
+void writeMetrics(Print& out) {
+  char labels[96];
+  LatencyHistogram histogram;
+  
+  out.println("# HELP patcom_uptime_seconds Time since boot");
+  out.println("# TYPE patcom_uptime_seconds gauge");
+  out.printf("patcom_uptime_seconds %lu\n", millis() / 1000);
+  out.println("# HELP patcom_action_queue_overflows_total Presses dropped because the action queue was full");
+  out.println("# TYPE patcom_action_queue_overflows_total counter");
+  out.printf("patcom_action_queue_overflows_total %lu\n", (unsigned long)actionQueueOverflows);
+  out.println("# HELP patcom_retry_queue_depth Sends waiting for a retry");
+  out.println("# TYPE patcom_retry_queue_depth gauge");
+  out.printf("patcom_retry_queue_depth %d\n", retryCount);
+  out.println("# HELP patcom_heap_free_bytes Free heap at the last sample");
+  out.println("# TYPE patcom_heap_free_bytes gauge");
+  out.printf("patcom_heap_free_bytes %lu\n", (unsigned long)heapStats.freeBytes);
+  out.println("# HELP patcom_heap_min_free_bytes Lowest free heap since boot");
+  out.println("# TYPE patcom_heap_min_free_bytes gauge");
+  out.printf("patcom_heap_min_free_bytes %lu\n", (unsigned long)heapStats.minFreeBytes);
+  out.println("# HELP patcom_heap_largest_block_bytes Largest allocatable block at the last sample");
+  out.println("# TYPE patcom_heap_largest_block_bytes gauge");
+  out.printf("patcom_heap_largest_block_bytes %lu\n", (unsigned long)heapStats.largestBlock);
+  out.println("# HELP patcom_heap_min_largest_block_bytes Lowest largest block seen since boot");
+  out.println("# TYPE patcom_heap_min_largest_block_bytes gauge");
+  out.printf("patcom_heap_min_largest_block_bytes %lu\n", (unsigned long)heapStats.minLargestBlock);
+  out.println("# HELP patcom_heap_alloc_failures_total Allocations that returned NULL");
+  out.println("# TYPE patcom_heap_alloc_failures_total counter");
+  out.printf("patcom_heap_alloc_failures_total %lu\n", (unsigned long)heapStats.allocFailures);
+  out.println("# HELP patcom_config_store_bytes Config store in use, including gaps left by replaced strings");
+  out.println("# TYPE patcom_config_store_bytes gauge");
+  out.printf("patcom_config_store_bytes %u\n", (unsigned)configStoreUsed);
+  
+  out.println("# HELP patcom_stage_latency_seconds Latency of instrumented hot paths");
+  out.println("# TYPE patcom_stage_latency_seconds summary");
+  for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+    portENTER_CRITICAL(&metricsMux);
+    histogram = stageMetrics[i];
+    portEXIT_CRITICAL(&metricsMux);
+    snprintf(labels, sizeof(labels), "stage=\"%s\"", METRIC_STAGE_NAMES[i]);
+    writeSummary(out, "patcom_stage_latency_seconds", labels, histogram);
+  }
+  
+  out.println("# HELP patcom_button_presses_total Presses handed to the action worker");
+  out.println("# TYPE patcom_button_presses_total counter");
+  out.println("# HELP patcom_button_actions_total Action targets finished, by result");
+  out.println("# TYPE patcom_button_actions_total counter");
+  out.println("# HELP patcom_button_action_latency_seconds Action start to result, per target");
+  out.println("# TYPE patcom_button_action_latency_seconds summary");
+  for (int i = 0; i < 8; i++) {
+    portENTER_CRITICAL(&metricsMux);
+    ButtonMetrics button = buttonMetrics[i];
+    portEXIT_CRITICAL(&metricsMux);
+    out.printf("patcom_button_presses_total{button=\"%d\"} %lu\n", i, (unsigned long)button.presses);
+    out.printf("patcom_button_actions_total{button=\"%d\",result=\"success\"} %lu\n", i, (unsigned long)button.successes);
+    out.printf("patcom_button_actions_total{button=\"%d\",result=\"failure\"} %lu\n", i, (unsigned long)button.failures);
+    snprintf(labels, sizeof(labels), "button=\"%d\"", i);
+    writeSummary(out, "patcom_button_action_latency_seconds", labels, button.action);
+  }
+  
+  out.println("# HELP patcom_host_requests_total Action targets finished per host, by result");
+  out.println("# TYPE patcom_host_requests_total counter");
+  out.println("# HELP patcom_host_latency_seconds Action start to result per host");
+  out.println("# TYPE patcom_host_latency_seconds summary");
+  for (int i = 0; i < METRIC_HOSTS; i++) {
+    portENTER_CRITICAL(&metricsMux);
+    HostMetrics host = hostMetrics[i];
+    portEXIT_CRITICAL(&metricsMux);
+    if (!host.used) continue;
+    out.printf("patcom_host_requests_total{host=\"%s\",result=\"success\"} %lu\n", host.host, (unsigned long)host.successes);
+    out.printf("patcom_host_requests_total{host=\"%s\",result=\"failure\"} %lu\n", host.host, (unsigned long)host.failures);
+    snprintf(labels, sizeof(labels), "host=\"%s\"", host.host);
+    writeSummary(out, "patcom_host_latency_seconds", labels, host.request);
+  }
+}
+
+void sampleHeap() {
+  unsigned long now = millis();
+  if (heapStats.lastSample != 0 && now - heapStats.lastSample < HEAP_SAMPLE_INTERVAL) return;
+  heapStats.lastSample = now;
+  
+  heapStats.freeBytes = ESP.getFreeHeap();
+  heapStats.minFreeBytes = ESP.getMinFreeHeap();
+  heapStats.largestBlock = ESP.getMaxAllocHeap();
+  if (heapStats.minLargestBlock == 0 || heapStats.largestBlock < heapStats.minLargestBlock) {
+    heapStats.minLargestBlock = heapStats.largestBlock;
+  }
+  
+  // The callback cannot print, so failures are reported from here
+  uint32_t failures = heapStats.allocFailures;
+  if (failures != heapStats.reportedFailures) {
+    Console.printf("WARNING: %lu allocation(s) failed, last %lu bytes (free %lu, largest block %lu)\n",
+                   (unsigned long)(failures - heapStats.reportedFailures), (unsigned long)heapStats.lastFailedSize,
+                   (unsigned long)heapStats.freeBytes, (unsigned long)heapStats.largestBlock);
+    heapStats.reportedFailures = failures;
+  }
+}
+
+void onAllocFailed(size_t size, uint32_t caps, const char* function) {
+  // Runs in whichever task failed to allocate - count only
+  portENTER_CRITICAL_SAFE(&metricsMux);
+  heapStats.allocFailures++;
+  heapStats.lastFailedSize = size;
+  portEXIT_CRITICAL_SAFE(&metricsMux);
+}
+
+void writeSummary(Print& out, const char* name, const char* labels, const LatencyHistogram& histogram) {
+  static const float quantiles[3] = {0.5f, 0.95f, 0.99f};
+  for (int i = 0; i < 3; i++) {
+    out.printf("%s{%s,quantile=\"%g\"} %.6f\n", name, labels, quantiles[i],
+               histogramQuantile(histogram, quantiles[i]) / 1000000.0);
+  }
+  out.printf("%s_sum{%s} %.6f\n", name, labels, histogram.sumUs / 1000000.0);
+  out.printf("%s_count{%s} %lu\n", name, labels, (unsigned long)histogram.count);
+}
+
+// OTA Update Functions
+
+extern "C" bool verifyRollbackLater() {
+  // The Arduino core would confirm a new image as soon as it boots - updateOtaVerify() decides instead
+  return true;
+}
+
+void checkOtaBoot() {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  otaPendingVerify = running != NULL && esp_ota_get_state_partition(running, &state) == ESP_OK &&
+                     state == ESP_OTA_IMG_PENDING_VERIFY;
+  
+  // The invalid mark outlives the rollback, so it only counts while it is on the image uploaded last
+  const esp_partition_t* invalid = esp_ota_get_last_invalid_partition();
+  esp_app_desc_t description;
+  otaRolledBack = invalid != NULL && readOtaImage(otaRejected) && strcmp(otaRejected.partition, invalid->label) == 0 &&
+                  esp_ota_get_partition_description(invalid, &description) == ESP_OK &&
+                  strncmp(otaRejected.version, description.version, sizeof(otaRejected.version)) == 0 &&
+                  memcmp(otaRejected.elfSha256, description.app_elf_sha256, OTA_SHA256_SIZE) == 0;
+  
+  Console.printf("Firmware partition %s (%s)\n", running != NULL ? running->label : "?", otaStateName(running));
+  if (otaPendingVerify) {
+    Console.printf("New firmware - confirming within %lus or rolling back\n", OTA_VERIFY_TIMEOUT / 1000);
+  }
+  if (otaRolledBack) {
+    Console.printf("WARNING: Firmware %s in %s was rejected - running the previous image\n", otaRejected.version,
+                   otaRejected.partition);
+  }
+}
+
+void recordOtaImage(const esp_partition_t* partition) {
+  OtaImage image = {};
+  esp_app_desc_t description;
+  strlcpy(image.partition, partition->label, sizeof(image.partition));
+  if (esp_ota_get_partition_description(partition, &description) == ESP_OK) {
+    strlcpy(image.version, description.version, sizeof(image.version));
+    memcpy(image.elfSha256, description.app_elf_sha256, OTA_SHA256_SIZE);
+  }
+  Preferences store;
+  store.begin("patcom", false);
+  store.putBytes(OTA_IMAGE_KEY, &image, sizeof(image));
+  store.end();
+}
+
+bool readOtaImage(OtaImage& image) {
+  Preferences store;
+  store.begin("patcom", true);
+  bool found = store.getBytes(OTA_IMAGE_KEY, &image, sizeof(image)) == sizeof(image);
+  store.end();
+  image.partition[sizeof(image.partition) - 1] = '\0';
+  image.version[sizeof(image.version) - 1] = '\0';
+  return found;
+}
+
+bool otaHealthy() {
+  // Setup finished, the worker runs and the device is back on its network, and has stayed up for a while
+  if (millis() < OTA_HEALTHY_UPTIME || actionQueue == NULL) return false;
+  return strlen(networkConfig.ssid) == 0 || wifiConnected;
+}
+
+void updateOtaVerify() {
+  if (!otaPendingVerify) return;
+  
+  if (otaHealthy()) {
+    esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+    otaPendingVerify = false;
+    Preferences store;
+    store.begin("patcom", false);
+    store.remove(OTA_IMAGE_KEY);  // Confirmed - nothing left to roll back
+    store.end();
+    Console.printf("Firmware confirmed after %lums (%s)\n", millis(), esp_err_to_name(err));
+    
+    StaticJsonDocument<128> doc;
+    doc["type"] = "ota";
+    doc["state"] = "confirmed";
+    doc["partition"] = esp_ota_get_running_partition()->label;
+    Console.print("EVENT:");
+    serializeJson(doc, Console);
+    Console.println();
+    publishEvent("ota", doc);
+  } else if (millis() >= OTA_VERIFY_TIMEOUT) {
+    Console.println("ERROR: New firmware did not become healthy - rolling back");
+    delay(100);  // Let the log reach the host
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
+const char* otaStateName(const esp_partition_t* partition) {
+  esp_ota_img_states_t state;
+  if (partition == NULL || esp_ota_get_state_partition(partition, &state) != ESP_OK) {
+    return "factory";  // No OTA state - factory app, or rollback support is off
+  }
+  switch (state) {
+    case ESP_OTA_IMG_NEW: return "new";
+    case ESP_OTA_IMG_PENDING_VERIFY: return "pending_verify";
+    case ESP_OTA_IMG_VALID: return "valid";
+    case ESP_OTA_IMG_INVALID: return "invalid";
+    case ESP_OTA_IMG_ABORTED: return "aborted";
+    default: return "undefined";
+  }
+}
+
+bool parseSha256(const char* hex, uint8_t* digest) {
+  if (strlen(hex) != OTA_SHA256_SIZE * 2) return false;
+  for (size_t i = 0; i < OTA_SHA256_SIZE; i++) {
+    char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+    if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1])) return false;
+    digest[i] = strtoul(byte, NULL, 16);
+  }
+  return true;
+}
+
+bool tokenMatches(const char* presented, const char* expected) {
+  // Walks the whole expected token whatever was presented, so the time taken doesn't tell how much matched
+  size_t presentedLength = strlen(presented);
+  size_t expectedLength = strlen(expected);
+  uint8_t difference = presentedLength != expectedLength;
+  for (size_t i = 0; i < expectedLength; i++) {
+    difference |= (uint8_t)(expected[i] ^ presented[i < presentedLength ? i : 0]);
+  }
+  return expectedLength > 0 && difference == 0;
+}
+
+void beginOta(AsyncWebServerRequest* request, size_t total) {
+  // Refusals still claim the session, so the request handler can report why once the body is in
+  memset(&otaSession, 0, sizeof(otaSession));
+  otaSession.active = true;
+  otaSession.owner = request;
+  otaSession.total = total;
+  otaSession.started = millis();
+  request->onDisconnect([request]() {
+    if (otaSession.active && otaSession.owner == request) {
+      if (!otaSession.done) failOta(400, "Upload interrupted");
+      otaSession.active = false;
+    }
   });
   
-  // API endpoint for configuration
-  server.on("/api/config", HTTP_GET, []() {
-    StaticJsonDocument<2048> doc;
-    doc["device"]["name"] = deviceConfig.deviceName;
-    doc["device"]["version"] = VERSION;
-    doc["device"]["brightness"] = deviceConfig.brightness;
-    doc["device"]["discoverable"] = deviceConfig.discoverable;
+  // Uploads are off until an OTA_TOKEN API key is set, and then have to present it
+  lockConfig();
+  String token = getApiKey("OTA_TOKEN");
+  unlockConfig();
+  if (token.length() == 0) {
+    failOta(403, "Firmware updates are disabled - set an OTA_TOKEN API key");
+    return;
+  }
+  if (!request->hasHeader("X-OTA-Token") ||
+      !tokenMatches(request->getHeader("X-OTA-Token")->value().c_str(), token.c_str())) {
+    failOta(403, "Missing or wrong X-OTA-Token");
+    return;
+  }
+  if (!request->hasHeader("X-Firmware-SHA256") ||
+      !parseSha256(request->getHeader("X-Firmware-SHA256")->value().c_str(), otaSession.expected)) {
+    failOta(400, "X-Firmware-SHA256 header with the image digest is required");
+    return;
+  }
+  if (restartAt != 0 || otaPendingVerify) {
+    failOta(409, "Restart or firmware confirmation pending");
+    return;
+  }
+  
+  otaSession.partition = esp_ota_get_next_update_partition(NULL);
+  if (otaSession.partition == NULL) {
+    failOta(500, "No OTA partition in this partition table");
+    return;
+  }
+  if (total == 0 || total > otaSession.partition->size) {
+    failOta(413, "Image size missing or larger than the OTA partition");
+    return;
+  }
+  
+  // Sequential writes erase each sector just before it is written, so the upload starts at once
+  esp_err_t err = esp_ota_begin(otaSession.partition, OTA_WITH_SEQUENTIAL_WRITES, &otaSession.handle);
+  if (err != ESP_OK) {
+    failOta(500, esp_err_to_name(err));
+    return;
+  }
+  otaSession.begun = true;
+  mbedtls_sha256_init(&otaSession.sha);
+  mbedtls_sha256_starts(&otaSession.sha, 0);
+  boostCpu(POWER_HOLD_OTA);
+  lastActivity = millis();
+  
+  Console.printf("OTA: %u bytes into %s\n", (unsigned)total, otaSession.partition->label);
+}
+
+void handleOtaBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+  if (index == 0) {
+    if (otaSession.active) return;  // Someone else is flashing - handleOtaRequest() answers 409
+    beginOta(request, total);
+  }
+  if (!otaSession.active || otaSession.owner != request || otaSession.status != 0) {
+    return;
+  }
+  
+  // Each chunk goes straight to flash and into the digest, then the TCP buffer is released
+  esp_err_t err = esp_ota_write(otaSession.handle, data, len);
+  if (err != ESP_OK) {
+    failOta(500, esp_err_to_name(err));
+    return;
+  }
+  mbedtls_sha256_update(&otaSession.sha, data, len);
+  otaSession.written += len;
+  lastActivity = millis();
+  
+  uint8_t progress = otaSession.written * 10 / otaSession.total;
+  if (progress != otaSession.progress) {
+    otaSession.progress = progress;
+    Console.printf("OTA: %u%%\n", progress * 10);
+  }
+  
+  if (index + len == total) {
+    finishOta();
+  }
+}
+
+void finishOta() {
+  uint8_t digest[OTA_SHA256_SIZE];
+  mbedtls_sha256_finish(&otaSession.sha, digest);
+  if (memcmp(digest, otaSession.expected, sizeof(digest)) != 0) {
+    failOta(400, "SHA-256 mismatch");
+    return;
+  }
+  mbedtls_sha256_free(&otaSession.sha);
+  
+  // esp_ota_end() checks the image itself; only then does the bootloader get pointed at it
+  otaSession.begun = false;
+  releaseCpu(POWER_HOLD_OTA);
+  esp_err_t err = esp_ota_end(otaSession.handle);
+  if (err == ESP_OK) {
+    err = esp_ota_set_boot_partition(otaSession.partition);
+  }
+  if (err != ESP_OK) {
+    failOta(err == ESP_ERR_OTA_VALIDATE_FAILED ? 400 : 500,
+            err == ESP_ERR_OTA_VALIDATE_FAILED ? "Not a valid firmware image" : esp_err_to_name(err));
+    return;
+  }
+  
+  recordOtaImage(otaSession.partition);
+  otaRolledBack = false;  // Whatever was rejected before has just been overwritten
+  otaSession.done = true;
+  Console.printf("OTA: image verified in %lums - %s boots next, pending confirmation\n",
+                 millis() - otaSession.started, otaSession.partition->label);
+}
+
+void failOta(int status, const char* error) {
+  if (otaSession.begun) {
+    esp_ota_abort(otaSession.handle);
+    mbedtls_sha256_free(&otaSession.sha);
+    otaSession.begun = false;
+    releaseCpu(POWER_HOLD_OTA);
+  }
+  otaSession.status = status;
+  strlcpy(otaSession.error, error, sizeof(otaSession.error));
+  Console.printf("OTA failed: %s\n", error);
+}
+
+void handleOtaRequest(AsyncWebServerRequest* request) {
+  // Runs once the whole body has been through handleOtaBody()
+  if (otaSession.active && otaSession.owner != request) {
+    sendStatusJson(request, 409, "error", "Another firmware update is in progress");
+    return;
+  }
+  if (!otaSession.active) {
+    sendStatusJson(request, 400, "error", "Firmware image body required");
+    return;
+  }
+  
+  if (otaSession.status == 0 && !otaSession.done) {
+    failOta(400, "Image incomplete");
+  }
+  
+  StaticJsonDocument<256> doc;
+  doc["type"] = "ota";
+  doc["partition"] = otaSession.partition != NULL ? otaSession.partition->label : "";
+  doc["bytes"] = otaSession.written;
+  if (otaSession.done) {
+    doc["state"] = "verified";
+    sendStatusJson(request, 200, "ok", "Image verified - restarting into it");
+    scheduleRestart(NETWORK_RESTART_DELAY);
+  } else {
+    doc["state"] = "failed";
+    doc["error"] = (const char*)otaSession.error;
+    sendStatusJson(request, otaSession.status, "error", otaSession.error);
+  }
+  otaSession.active = false;
+  
+  Console.print("EVENT:");
+  serializeJson(doc, Console);
+  Console.println();
+  publishEvent("ota", doc);
+}
+
+void handleOtaStatusRequest(AsyncWebServerRequest* request) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  const esp_partition_t* next = esp_ota_get_next_update_partition(NULL);
+  
+  StaticJsonDocument<512> doc;
+  doc["version"] = VERSION;
+  doc["partition"] = running != NULL ? running->label : "";
+  doc["state"] = otaStateName(running);
+  doc["rolled_back"] = otaRolledBack;
+  if (otaRolledBack) {
+    // Lets the uploader check the rejected image is the one it sent
+    char sha[OTA_SHA256_SIZE * 2 + 1];
+    for (size_t i = 0; i < OTA_SHA256_SIZE; i++) {
+      snprintf(sha + i * 2, 3, "%02x", otaRejected.elfSha256[i]);
+    }
+    JsonObject rejected = doc.createNestedObject("rejected");
+    rejected["partition"] = (const char*)otaRejected.partition;
+    rejected["version"] = (const char*)otaRejected.version;
+    rejected["elf_sha256"] = sha;
+  }
+  doc["next_partition"] = next != NULL ? next->label : "";
+  doc["next_size"] = next != NULL ? next->size : 0;
+  doc["uptime"] = millis();
+  doc["updating"] = otaSession.active;
+  if (otaSession.active) {
+    doc["written"] = otaSession.written;
+    doc["total"] = otaSession.total;
+  }
+  
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  serializeJson(doc, *response);
+  request->send(response);
+}
+
+// Benchmark and Soak Functions
+
+void benchRecord(BenchResult& result, int64_t us) {
+  if (result.runs == 0 || us < result.minUs) result.minUs = us;
+  if (us > result.maxUs) result.maxUs = us;
+  result.totalUs += us;
+  result.runs++;
+}
+
+void runBenchmarks(uint16_t runs) {
+  // Times the hot paths in place, on the live config and at the boosted clock presses and uploads run at.
+  // Flash writes are left out - METRICS already reports config_save/config_load from real commits.
+  // The config lock is only ever held for one run, so the worker never waits a whole benchmark
+  enum { BENCH_PARSE, BENCH_ENCODE, BENCH_DECODE, BENCH_COMPILE, BENCH_DISPATCH, BENCH_DEBOUNCE, BENCH_COUNT };
+  BenchResult results[BENCH_COUNT] = {
+    {"config_parse"}, {"config_encode"}, {"config_decode"}, {"compile"}, {"dispatch"}, {"debounce"}
+  };
+  
+  size_t jsonSize = CONFIG_UPLOAD_MAX;
+  char* json = (char*)malloc(jsonSize);
+  char* scratch = (char*)malloc(jsonSize);
+  uint8_t* blob = (uint8_t*)malloc(CONFIG_BLOB_MAX_SIZE);
+  DynamicJsonDocument doc(CONFIG_UPLOAD_DOC_SIZE);
+  if (json == NULL || scratch == NULL || blob == NULL || doc.capacity() == 0) {
+    free(json);
+    free(scratch);
+    free(blob);
+    sendJsonResponse("bench", "Not enough heap to run benchmarks", false);
+    return;
+  }
+  
+  boostCpu(POWER_HOLD_CONFIG);
+  Console.printf("=== BENCH (%u runs, %luMHz) ===\n", runs, (unsigned long)getCpuFrequencyMhz());
+  
+  // The upload parser, fed the current /api/config so the document has a realistic shape
+  lockConfig();
+  buildConfigJson(doc);
+  size_t jsonLength = serializeJson(doc, json, jsonSize);
+  unlockConfig();
+  if (jsonLength > 0 && jsonLength < jsonSize) {
+    for (int i = 0; i < runs; i++) {
+      memcpy(scratch, json, jsonLength + 1);  // Parsed in place, like handleConfigUpload()
+      int64_t start = esp_timer_get_time();
+      deserializeJson(doc, scratch);
+      benchRecord(results[BENCH_PARSE], esp_timer_get_time() - start);
+    }
+  }
+  
+  // Save and load minus the flash. The lock is taken per run so presses and uploads interleave with the
+  // benchmark; decoding the blob just encoded leaves the config as it was before the lock is released
+  size_t blobLength = 0;
+  for (int i = 0; i < runs; i++) {
+    lockConfig();
+    int64_t start = esp_timer_get_time();
+    blobLength = encodeConfigBlob(blob, CONFIG_BLOB_MAX_SIZE, configSequence);
+    benchRecord(results[BENCH_ENCODE], esp_timer_get_time() - start);
+    unlockConfig();
+  }
+  for (int i = 0; i < runs && blobLength > sizeof(ConfigBlobHeader); i++) {
+    lockConfig();
+    // Re-encoded under this lock, an upload in between would otherwise be rolled back
+    blobLength = encodeConfigBlob(blob, CONFIG_BLOB_MAX_SIZE, configSequence);
+    int64_t start = esp_timer_get_time();
+    bool decoded = decodeConfigBlob(blob + sizeof(ConfigBlobHeader), blobLength - sizeof(ConfigBlobHeader));
+    benchRecord(results[BENCH_DECODE], esp_timer_get_time() - start);
+    rebuildApiKeyIndex();
+    unlockConfig();
+    if (!decoded) {
+      Console.println("ERROR: Config blob did not decode during BENCH");
+      break;
+    }
+  }
+  
+  for (int i = 0; i < runs; i++) {
+    lockConfig();
+    int64_t start = esp_timer_get_time();
+    compileActions();
+    benchRecord(results[BENCH_COMPILE], esp_timer_get_time() - start);
+    unlockConfig();
+  }
+  
+  // What the worker does per press before the first byte goes out: snapshot the chain, render each target
+  static CompiledAction benchActions[MAX_CHAIN_ACTIONS];  // Serial commands only run on loop()
+  static char payload[sizeof(ActionDispatch::payload)];
+  CompiledButton button;
+  for (int slot = 0; slot < ACTION_SLOTS; slot++) {
+    for (int i = 0; i < runs; i++) {
+      // Like the worker: the snapshot is taken under the lock, rendering runs outside it
+      lockConfig();
+      bool active = buttonConfigs[slot].enabled && compiledButtons[slot].count > 0;
+      int64_t start = esp_timer_get_time();
+      if (active) snapshotCompiledButton(slot, button, benchActions);
+      unlockConfig();
+      if (!active) break;
+      for (int t = 0; t < button.count; t++) {
+        renderActionTemplate(button.actions[t]->body, slot, payload, sizeof(payload));
+      }
+      benchRecord(results[BENCH_DISPATCH], esp_timer_get_time() - start);
+    }
+  }
+  
+  // A bouncing press released before the hold time, on an idle button so nothing fires
+  int idle = -1;
+  for (int i = 0; i < 8 && idle < 0; i++) {
+    if (buttonStates[i] && !buttonPressed[i] && tapCount[i] == 0) idle = i;
+  }
+  if (idle >= 0) {
+    int64_t savedPressStart = buttonPressStartUs[idle];
+    bool savedHandled = buttonHandled[idle];
+    int64_t timestamp = esp_timer_get_time();
+    for (int i = 0; i < runs; i++) {
+      int64_t start = esp_timer_get_time();
+      for (int b = 0; b < BENCH_BOUNCES; b++) {
+        applyButtonEdge(idle, LOW, timestamp);
+        applyButtonEdge(idle, HIGH, timestamp);
+      }
+      applyButtonEdge(idle, LOW, timestamp);
+      applyButtonEdge(idle, HIGH, timestamp + 1000);
+      benchRecord(results[BENCH_DEBOUNCE], esp_timer_get_time() - start);
+    }
+    buttonPressStartUs[idle] = savedPressStart;
+    buttonHandled[idle] = savedHandled;
+  }
+  releaseCpu(POWER_HOLD_CONFIG);
+  free(json);
+  free(scratch);
+  free(blob);
+  
+  StaticJsonDocument<768> event;
+  event["type"] = "bench";
+  event["runs"] = runs;
+  event["cpu_mhz"] = getCpuFrequencyMhz();
+  event["config_bytes"] = jsonLength;
+  event["blob_bytes"] = blobLength;
+  JsonObject paths = event.createNestedObject("results");
+  for (int i = 0; i < BENCH_COUNT; i++) {
+    const BenchResult& result = results[i];
+    if (result.runs == 0) {
+      Console.printf("  %-14s skipped\n", result.name);
+      continue;
+    }
+    uint32_t averageUs = result.totalUs / result.runs;
+    Console.printf("  %-14s n=%-6lu avg=%6luus min=%6luus max=%6luus\n", result.name, (unsigned long)result.runs,
+                   (unsigned long)averageUs, (unsigned long)result.minUs, (unsigned long)result.maxUs);
+    JsonObject entry = paths.createNestedObject(result.name);
+    entry["n"] = result.runs;
+    entry["avg_us"] = averageUs;
+    entry["min_us"] = result.minUs;
+    entry["max_us"] = result.maxUs;
+  }
+  Console.println("================================");
+  
+  Console.print("EVENT:");
+  serializeJson(event, Console);
+  Console.println();
+  publishEvent("bench", event);
+}
+
+void startSoak(int slot, uint16_t intervalMs, uint32_t count) {
+  // Results come from the same metrics the presses already feed, read back as deltas
+  portENTER_CRITICAL(&metricsMux);
+  soakRun.startButton = buttonMetrics[slotButton(slot)];
+  soakRun.startQueueWait = stageMetrics[METRIC_QUEUE_WAIT];
+  portEXIT_CRITICAL(&metricsMux);
+  
+  soakRun.slot = slot;
+  soakRun.intervalMs = intervalMs;
+  soakRun.remaining = count;
+  soakRun.fired = 0;
+  soakRun.started = millis();
+  soakRun.nextPress = soakRun.started;
+  soakRun.lastProgress = soakRun.started;
+  soakRun.startOverflows = actionQueueOverflows;
+  soakRun.startFreeHeap = ESP.getFreeHeap();
+  soakRun.startLargestBlock = ESP.getMaxAllocHeap();
+  soakRun.startAllocFailures = heapStats.allocFailures;
+  soakRun.minFreeHeap = soakRun.startFreeHeap;
+  soakRun.draining = false;
+  soakRun.active = true;
+  
+  Console.printf("Soak: %lu presses of slot %d every %ums (free heap %lu)\n", (unsigned long)count, slot,
+                 intervalMs, (unsigned long)soakRun.startFreeHeap);
+}
+
+void updateSoak() {
+  if (!soakRun.active) return;
+  unsigned long now = millis();
+  
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < soakRun.minFreeHeap) soakRun.minFreeHeap = freeHeap;
+  
+  if (!soakRun.draining && (long)(now - soakRun.nextPress) >= 0) {
+    handleButtonPress(soakRun.slot);
+    lastActivity = now;
+    soakRun.fired++;
+    soakRun.remaining--;
     
-    doc["network"]["ssid"] = networkConfig.ssid;
-    doc["network"]["staticIP"] = networkConfig.staticIP;
-    doc["network"]["ip"] = networkConfig.ip;
-    doc["network"]["subnet"] = networkConfig.subnet;
-    doc["network"]["gateway"] = networkConfig.gateway;
+    // Keep the rate steady, but don't burst to catch up after a stall
+    soakRun.nextPress += soakRun.intervalMs;
+    if ((long)(now - soakRun.nextPress) > (long)soakRun.intervalMs) {
+      soakRun.nextPress = now + soakRun.intervalMs;
+    }
+    if (soakRun.remaining == 0) {
+      soakRun.draining = true;
+      soakRun.drainStarted = now;
+    }
+  }
+  
+  if (now - soakRun.lastProgress >= SOAK_PROGRESS_INTERVAL) {
+    soakRun.lastProgress = now;
+    Console.printf("Soak: %lu fired, %lu to go, free heap %lu\n", (unsigned long)soakRun.fired,
+                   (unsigned long)soakRun.remaining, (unsigned long)freeHeap);
+  }
+  
+  if (!soakRun.draining) return;
+  
+  // Done once every accepted press has reported each of its targets, or the drain gives up
+  portENTER_CRITICAL(&metricsMux);
+  ButtonMetrics button = buttonMetrics[slotButton(soakRun.slot)];
+  portEXIT_CRITICAL(&metricsMux);
+  uint32_t outcomes = (button.successes - soakRun.startButton.successes) +
+                      (button.failures - soakRun.startButton.failures);
+  uint32_t accepted = soakRun.fired - (actionQueueOverflows - soakRun.startOverflows);
+  if (outcomes >= accepted * compiledButtons[soakRun.slot].count) {
+    finishSoak(true);
+  } else if (now - soakRun.drainStarted >= SOAK_DRAIN_TIMEOUT) {
+    finishSoak(false);
+  }
+}
+
+LatencyHistogram histogramDelta(const LatencyHistogram& now, const LatencyHistogram& start) {
+  LatencyHistogram delta;
+  for (int i = 0; i <= METRIC_BUCKETS; i++) {
+    delta.buckets[i] = now.buckets[i] - start.buckets[i];
+  }
+  delta.count = now.count - start.count;
+  delta.sumUs = now.sumUs - start.sumUs;
+  return delta;
+}
+
+void finishSoak(bool complete) {
+  soakRun.active = false;
+  
+  portENTER_CRITICAL(&metricsMux);
+  ButtonMetrics button = buttonMetrics[slotButton(soakRun.slot)];
+  LatencyHistogram queueWait = histogramDelta(stageMetrics[METRIC_QUEUE_WAIT], soakRun.startQueueWait);
+  portEXIT_CRITICAL(&metricsMux);
+  LatencyHistogram action = histogramDelta(button.action, soakRun.startButton.action);
+  
+  // Drift is only meaningful once the connection pool and TLS sessions are warm - compare repeated soaks
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  
+  StaticJsonDocument<640> doc;
+  doc["type"] = "soak_result";
+  doc["slot"] = soakRun.slot;
+  doc["complete"] = complete;
+  doc["presses"] = soakRun.fired;
+  doc["interval_ms"] = soakRun.intervalMs;
+  doc["duration_ms"] = millis() - soakRun.started;
+  doc["ok"] = button.successes - soakRun.startButton.successes;
+  doc["failed"] = button.failures - soakRun.startButton.failures;
+  doc["dropped"] = actionQueueOverflows - soakRun.startOverflows;
+  doc["p50_ms"] = histogramQuantile(action, 0.5f) / 1000.0;
+  doc["p95_ms"] = histogramQuantile(action, 0.95f) / 1000.0;
+  doc["p99_ms"] = histogramQuantile(action, 0.99f) / 1000.0;
+  doc["queue_wait_p99_ms"] = histogramQuantile(queueWait, 0.99f) / 1000.0;
+  JsonObject heap = doc.createNestedObject("heap");
+  heap["start_free"] = soakRun.startFreeHeap;
+  heap["end_free"] = freeHeap;
+  heap["drift"] = (int32_t)(freeHeap - soakRun.startFreeHeap);
+  heap["min_free"] = soakRun.minFreeHeap;
+  heap["start_largest"] = soakRun.startLargestBlock;
+  heap["end_largest"] = largestBlock;
+  heap["alloc_failures"] = heapStats.allocFailures - soakRun.startAllocFailures;
+  
+  Console.printf("=== SOAK %s (slot %d) ===\n", complete ? "COMPLETE" : "STOPPED", soakRun.slot);
+  Console.printf("  presses=%lu ok=%lu failed=%lu dropped=%lu\n", (unsigned long)soakRun.fired,
+                 (unsigned long)(button.successes - soakRun.startButton.successes),
+                 (unsigned long)(button.failures - soakRun.startButton.failures),
+                 (unsigned long)(actionQueueOverflows - soakRun.startOverflows));
+  Console.printf("  action p50/p95/p99 %.1f/%.1f/%.1f ms, queue wait p99 %.1f ms\n",
+                 histogramQuantile(action, 0.5f) / 1000.0, histogramQuantile(action, 0.95f) / 1000.0,
+                 histogramQuantile(action, 0.99f) / 1000.0, histogramQuantile(queueWait, 0.99f) / 1000.0);
+  Console.printf("  heap free %lu -> %lu (%+ld), min %lu, largest block %lu -> %lu\n",
+                 (unsigned long)soakRun.startFreeHeap, (unsigned long)freeHeap,
+                 (long)(int32_t)(freeHeap - soakRun.startFreeHeap), (unsigned long)soakRun.minFreeHeap,
+                 (unsigned long)soakRun.startLargestBlock, (unsigned long)largestBlock);
+  Console.println("================================");
+  
+  Console.print("EVENT:");
+  serializeJson(doc, Console);
+  Console.println();
+  publishEvent("soak_result", doc);
+}
+
+// Action Worker Functions
+
+void startActionWorker() {
+  configMutex = xSemaphoreCreateRecursiveMutex();
+  actionQueue = xQueueCreate(ACTION_QUEUE_LENGTH, sizeof(ActionEvent));
+  
+  if (configMutex == NULL || actionQueue == NULL) {
+    Console.println("ERROR: Failed to allocate action queue");
+    setStatusLED(STATUS_ERROR);
+    return;
+  }
+  
+  if (deviceConfig.persistRetries) {
+    loadRetryQueue();
+  }
+  
+  BaseType_t result = xTaskCreatePinnedToCore(actionWorkerTask, "action_worker", ACTION_WORKER_STACK,
+                                              NULL, ACTION_WORKER_PRIORITY, &actionWorkerHandle, ACTION_WORKER_CORE);
+  if (result != pdPASS) {
+    Console.println("ERROR: Failed to start action worker task");
+    setStatusLED(STATUS_ERROR);
+    return;
+  }
+  
+  Console.printf("Action worker started on core %d (queue depth %d)\n", (int)ACTION_WORKER_CORE, ACTION_QUEUE_LENGTH);
+}
+
+bool queueAction(int buttonIndex) {
+  if (actionQueue == NULL) {
+    Console.printf("Action worker not running - button %d action skipped\n", buttonIndex);
+    return false;
+  }
+  
+  ActionEvent event;
+  event.buttonIndex = buttonIndex;
+  event.timestamp = millis();
+  event.queuedUs = esp_timer_get_time();
+  
+  // Never block the caller; a full queue is reported instead
+  if (xQueueSend(actionQueue, &event, 0) != pdTRUE) {
+    actionQueueOverflows++;
     
-    JsonArray buttons = doc.createNestedArray("buttons");
-    for (int i = 0; i < 8; i++) {
-      JsonObject btn = buttons.createNestedObject();
-      btn["id"] = i;
-      btn["name"] = buttonConfigs[i].name;
-      btn["action"] = buttonConfigs[i].action;
-      btn["enabled"] = buttonConfigs[i].enabled;
-      
-      // Parse action data JSON
-      StaticJsonDocument<256> actionDoc;
-      deserializeJson(actionDoc, buttonConfigs[i].actionData);
-      btn["config"] = actionDoc;
+    StaticJsonDocument<128> doc;
+    doc["type"] = "action_dropped";
+    doc["button"] = slotButton(buttonIndex);
+    doc["reason"] = "queue_full";
+    doc["overflows"] = actionQueueOverflows;
+    doc["timestamp"] = event.timestamp;
+    
+    Console.print("EVENT:");
+    serializeJson(doc, Console);
+    Console.println();
+    publishEvent("action_dropped", doc);
+    Console.printf("WARNING: Action queue full - button %d press not executed\n", buttonIndex);
+    return false;
+  }
+  
+  return true;
+}
+
+void actionWorkerTask(void* parameter) {
+  ActionEvent event;
+  static CompiledButton button;  // Kept off the task stack; only this task uses it
+  static CompiledAction buttonActions[MAX_CHAIN_ACTIONS];
+  
+  for (;;) {
+    // Wake periodically to keep pooled sockets alive between presses
+    // New presses always go first; queued retries run when the worker would otherwise sleep
+    if (xQueueReceive(actionQueue, &event, pdMS_TO_TICKS(nextRetryWait())) != pdTRUE) {
+      if (millis() - lastPoolMaintenance >= HTTP_POOL_MAINTENANCE_INTERVAL) {
+        maintainHttpPool();
+        maintainMqttSessions();
+      }
+      processWebhookBatches();
+      processRetryQueue();
+      if (retryQueueDirty && deviceConfig.persistRetries && millis() - retryQueueChanged >= RETRY_PERSIST_DELAY) {
+        saveRetryQueue();
+      }
+      continue;
     }
     
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response);
-  });
+    if (event.buttonIndex == ACTION_EVENT_POOL_WARMUP) {
+      boostCpu(POWER_HOLD_ACTION);
+      warmHttpPool();
+      warmMqttSessions();
+      flushRetryQueueNow();
+      releaseCpu(POWER_HOLD_ACTION);
+      continue;
+    }
+    
+    // Work on a snapshot so a config upload can proceed while the request is in flight
+    lockConfig();
+    bool enabled = buttonConfigs[event.buttonIndex].enabled;
+    snapshotCompiledButton(event.buttonIndex, button, buttonActions);
+    unlockConfig();
+    
+    if (!enabled) {
+      playLedPattern(slotButton(event.buttonIndex), LED_PATTERN_NONE);
+      continue;
+    }
+    
+    recordStage(METRIC_QUEUE_WAIT, esp_timer_get_time() - event.queuedUs);
+    portENTER_CRITICAL(&metricsMux);
+    buttonMetrics[slotButton(event.buttonIndex)].presses++;
+    portEXIT_CRITICAL(&metricsMux);
+    unsigned long waited = millis() - event.timestamp;
+    if (waited > 0) {
+      Console.printf("Button %d action dequeued after %lums\n", event.buttonIndex, waited);
+    }
+    
+    waitForWakeNetwork();
+    boostCpu(POWER_HOLD_ACTION);
+    int8_t remoteState;
+    bool success = executeButtonActions(event.buttonIndex, button, remoteState);
+    if (!success || !webhookBatchPending(event.buttonIndex)) {
+      reportButtonFeedback(event.buttonIndex, button, success, millis() - event.timestamp, remoteState);
+    }
+    releaseCpu(POWER_HOLD_ACTION);
+    lastActivity = millis();
+    
+    if (millis() - lastPoolMaintenance > HTTP_POOL_MAINTENANCE_INTERVAL) {
+      maintainHttpPool();
+      maintainMqttSessions();
+    }
+  }
+}
+
+void lockConfig() {
+  // Recursive: a whole upload holds it while commitConfiguration() takes it again
+  if (configMutex != NULL) {
+    xSemaphoreTakeRecursive(configMutex, portMAX_DELAY);
+  }
+}
+
+void unlockConfig() {
+  if (configMutex != NULL) {
+    xSemaphoreGiveRecursive(configMutex);
+  }
+}
+
+// Gesture Functions
+
+int findGestureSlot(GestureType type, uint8_t buttons) {
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    // Same test as rebuildGestureIndex(), so a disabled duplicate never shadows the live binding
+    if (gestureBindings[g].type == type && gestureBindings[g].buttons == buttons && buttonConfigs[8 + g].enabled &&
+        compiledButtons[8 + g].count > 0) {
+      return 8 + g;
+    }
+  }
+  return -1;
+}
+
+int slotButton(int slot) {
+  // A gesture reports, lights and counts as the lowest button it uses
+  if (slot < 8) return slot;
+  uint8_t buttons = gestureBindings[slot - 8].buttons;
+  return buttons != 0 ? __builtin_ctz(buttons) : 0;
+}
+
+const char* gestureName(int slot) {
+  if (slot < 8) return "press";
+  switch (gestureBindings[slot - 8].type) {
+    case GESTURE_LONG: return "long";
+    case GESTURE_DOUBLE: return "double";
+    case GESTURE_CHORD: return "chord";
+    default: return "none";
+  }
+}
+
+GestureType parseGestureType(const char* name) {
+  if (strcasecmp(name, "long") == 0) return GESTURE_LONG;
+  if (strcasecmp(name, "double") == 0) return GESTURE_DOUBLE;
+  if (strcasecmp(name, "chord") == 0) return GESTURE_CHORD;
+  return GESTURE_NONE;
+}
+
+void rebuildGestureIndex() {
+  // Caller holds the config lock; a button with nothing bound keeps the zero-wait press path
+  uint8_t gestures[8] = {0};
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    const GestureBinding& binding = gestureBindings[g];
+    if (binding.type == GESTURE_NONE || compiledButtons[8 + g].count == 0 || !buttonConfigs[8 + g].enabled) continue;
+    for (int b = 0; b < 8; b++) {
+      if (binding.buttons & (1 << b)) gestures[b] |= GESTURE_BIT(binding.type);
+    }
+  }
+  memcpy(buttonGestures, gestures, sizeof(buttonGestures));
+}
+
+void resetGestureSlots() {
+  deviceConfig.longPressMs = GESTURE_DEFAULT_LONG_PRESS;
+  deviceConfig.doubleTapMs = GESTURE_DEFAULT_DOUBLE_TAP;
+  deviceConfig.chordWindowMs = GESTURE_DEFAULT_CHORD_WINDOW;
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    gestureBindings[g].type = GESTURE_NONE;
+    gestureBindings[g].buttons = 0;
+    ButtonConfig& config = buttonConfigs[8 + g];
+    config.name[0] = '\0';
+    config.action = ACTION_NONE;
+    storeConfigString(config.actionData, "{}");
+    config.enabled = true;
+  }
+}
+
+// LED Engine Functions
+
+void setupLEDs() {
+  for (int i = 0; i < 256; i++) {
+    ledGamma[i] = (uint16_t)(powf(i / 255.0f, LED_GAMMA) * LED_DUTY_MAX + 0.5f);
+  }
   
-  // API endpoint for uploading configuration
-  server.on("/api/config", HTTP_POST, []() {
-    handleConfigUpload();
-  });
+  // One LEDC channel per LED, so every button gets real PWM and hardware fades
+  for (int i = 0; i < 8; i++) {
+    leds[i].attached = ledcAttach(ledPins[i], LED_PWM_FREQUENCY, LED_PWM_RESOLUTION);
+    if (leds[i].attached) {
+      ledcWrite(ledPins[i], 0);
+      Console.printf("LED %d pin %d configured\n", i, ledPins[i]);
+    } else {
+      // No channel left - plain on/off is better than a dark LED
+      pinMode(ledPins[i], OUTPUT);
+      digitalWrite(ledPins[i], LOW);
+      Console.printf("LED %d pin %d has no LEDC channel, using on/off\n", i, ledPins[i]);
+    }
+    leds[i].duty = 0;
+  }
+}
+
+void updateLEDs() {
+  unsigned long now = millis();
+  uint8_t brightness = constrain(deviceConfig.brightness, 0, 255) * ledPowerScale / 100;
   
-  // API endpoint for button testing
-  server.on("/api/test", HTTP_POST, []() {
-    if (server.hasArg("button")) {
-      int buttonIndex = server.arg("button").toInt();
-      if (buttonIndex >= 0 && buttonIndex < 8) {
-        handleButtonPress(buttonIndex);
-        server.send(200, "application/json", "{\"status\":\"ok\",\"message\":\"Button " + String(buttonIndex) + " triggered\"}");
-      } else {
-        server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid button index\"}");
+  int8_t requests[8];
+  int8_t states[8];
+  portENTER_CRITICAL(&ledMux);
+  memcpy(requests, ledPatternRequests, sizeof(requests));
+  memcpy(states, ledStateRequests, sizeof(states));
+  memset(ledPatternRequests, -1, sizeof(ledPatternRequests));
+  memset(ledStateRequests, -1, sizeof(ledStateRequests));
+  portEXIT_CRITICAL(&ledMux);
+  
+  for (int i = 0; i < 8; i++) {
+    LedChannel& led = leds[i];
+    if (requests[i] >= 0) {
+      led.pattern = (LedPattern)requests[i];
+      led.step = 0;
+      led.stepStarted = false;
+    }
+    if (states[i] != LED_STATE_KEEP) {
+      bool state = states[i] == LED_STATE_TOGGLE ? !ledStates[i] : states[i] == LED_STATE_ON;
+      if (state != ledStates[i]) {
+        ledStates[i] = state;
+        publishLedState(i);
+      }
+    }
+    
+    // Never cut a running hardware fade short - the next write waits for it
+    if ((long)(now - led.fadeUntil) < 0) continue;
+    
+    if (led.pattern != LED_PATTERN_NONE) {
+      const LedPatternDef& pattern = ledPatterns[led.pattern];
+      if (led.stepStarted && (long)(now - led.stepEnds) < 0) continue;
+      
+      if (led.stepStarted && ++led.step >= pattern.count) {
+        led.step = 0;
+        if (!pattern.repeat) led.pattern = LED_PATTERN_NONE;
+      }
+      if (led.pattern != LED_PATTERN_NONE) {
+        const LedStep& step = pattern.steps[led.step];
+        led.stepStarted = true;
+        led.stepEnds = now + step.duration;
+        writeLED(i, ledGamma[brightness * step.percent / 100], step.fade ? step.duration : 0, now);
+        continue;
       }
+    }
+    
+    // Steady state: the toggle at the configured brightness, only written when it changes
+    writeLED(i, ledStates[i] ? ledGamma[brightness] : 0, LED_FADE_TIME, now);
+  }
+}
+
+void writeLED(int index, uint16_t duty, int fadeMs, unsigned long now) {
+  LedChannel& led = leds[index];
+  if (duty == led.duty) return;
+  
+  if (!led.attached) {
+    digitalWrite(ledPins[index], duty > 0 ? HIGH : LOW);
+  } else if (fadeMs > 0 && ledcFade(ledPins[index], led.duty, duty, fadeMs)) {
+    led.fadeUntil = now + fadeMs;
+  } else {
+    ledcWrite(ledPins[index], duty);
+  }
+  led.duty = duty;
+}
+
+void playLedPattern(int index, LedPattern pattern, int8_t state) {
+  if (index < 0 || index >= 8 || pattern >= LED_PATTERN_COUNT) return;
+  
+  // Safe from any task; loop() starts the pattern on its next pass
+  portENTER_CRITICAL(&ledMux);
+  ledPatternRequests[index] = pattern;
+  if (state != LED_STATE_KEEP) ledStateRequests[index] = state;
+  portEXIT_CRITICAL(&ledMux);
+  if (loopTaskHandle != NULL && xTaskGetCurrentTaskHandle() != loopTaskHandle) {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+}
+
+void publishLedState(int index) {
+  StaticJsonDocument<96> doc;
+  doc["type"] = "led";
+  doc["led"] = index;
+  doc["state"] = ledStates[index];
+  doc["brightness"] = deviceConfig.brightness;
+  publishEvent("led", doc);
+}
+
+LedPattern parseLedPattern(const char* name) {
+  for (int i = 0; i < LED_PATTERN_COUNT; i++) {
+    if (strcasecmp(name, ledPatterns[i].name) == 0) return (LedPattern)i;
+  }
+  return LED_PATTERN_COUNT;
+}
+
+void allLEDsOff() {
+  // Immediate, for boot and sleep - patterns are dropped and the toggle state is redrawn on the next pass
+  for (int i = 0; i < 8; i++) {
+    if (leds[i].attached) {
+      ledcWrite(ledPins[i], 0);
     } else {
-      server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Missing button parameter\"}");
+      digitalWrite(ledPins[i], LOW);
     }
-  });
+    leds[i].duty = 0;
+    leds[i].fadeUntil = 0;
+    leds[i].pattern = LED_PATTERN_NONE;
+  }
+}
+
+// Serial Command Functions
+
+const SerialCommand serialCommands[] = {
+  {"STATUS", false, handleStatusCommand, "STATUS", "Device information"},
+  {"CONFIG", false, handleConfigCommand, "CONFIG", "Get configuration"},
+  {"SET_CONFIG", true, handleSetConfigCommand, "SET_CONFIG:<json>", "Upload configuration"},
+  {"SET_BUTTON", true, handleSetButtonCommand, "SET_BUTTON:<id>:<json>", "Update a single button"},
+  {"TEST", true, handleTestCommand, "TEST:<n>", "Test button n"},
+  {"WIFI", false, handleWiFiCommand, "WIFI", "WiFi status"},
+  {"POWER", false, handlePowerCommand, "POWER", "Power supply voltage"},
+  {"BATTERY", false, handlePowerCommand, "BATTERY", "Power supply voltage (alias)"},
+  {"IDENTIFY", false, handleIdentifyCommand, "IDENTIFY", "Device identification for configurator"},
+  {"RESET_WIFI", false, handleResetWiFiCommand, "RESET_WIFI", "Clear WiFi and enter config mode"},
+  {"FRAMED", false, handleFramedCommand, "FRAMED", "Switch to framed protocol at the default baud"},
+  {"FRAMED", true, handleFramedCommand, "FRAMED:<baud>", "Switch to framed protocol at <baud>"},
+  {"TEXT", false, handleTextCommand, "TEXT", "Return from framed to text protocol"},
+  {"METRICS", false, handleMetricsCommand, "METRICS", "Latency percentiles and success counters"},
+  {"LED", true, handleLedCommand, "LED:<n>:<pattern>", "Play pending, success, failure, slow or none on LED n"},
+  {"BENCH", false, handleBenchCommand, "BENCH", "Time the config, compile, dispatch and debounce paths"},
+  {"BENCH", true, handleBenchCommand, "BENCH:<runs>", "BENCH with <runs> iterations per path"},
+  {"SOAK", true, handleSoakCommand, "SOAK:<slot>:<ms>:<count>", "Fire <count> presses of <slot> every <ms>, or SOAK:STOP"},
+  {"HELP", false, handleHelpCommand, "HELP", "This help"},
+};
+const int SERIAL_COMMAND_COUNT = sizeof(serialCommands) / sizeof(serialCommands[0]);
+
+void handleSerialCommands() {
+  if (serialFramed) {
+    handleSerialFrames();
+    return;
+  }
   
-  server.begin();
-  Serial.println("Web server started on port 80");
+  // Consume only what has already arrived; a partial line waits for the next pass
+  int budget = SERIAL_READ_BUDGET;
+  while (budget-- > 0 && Serial.available()) {
+    char c = Serial.read();
+    
+    if (c == '\n') {
+      if (serialLineOverflow) {
+        sendJsonResponse("error", "Command too long", false);
+      } else {
+        // Strip trailing whitespace (CRLF senders, padded commands)
+        while (serialLineLength > 0 && isspace((unsigned char)serialLine[serialLineLength - 1])) {
+          serialLineLength--;
+        }
+        serialLine[serialLineLength] = '\0';
+        processSerialCommand(serialLine);
+      }
+      serialLineLength = 0;
+      serialLineOverflow = false;
+      if (serialFramed) return;  // FRAMED negotiated - remaining bytes are frames
+    } else if (serialLineLength < SERIAL_LINE_MAX) {
+      serialLine[serialLineLength++] = c;
+    } else {
+      serialLineOverflow = true;
+    }
+  }
 }
 
-void handleButtonPress(int buttonIndex) {
-  if (buttonIndex < 0 || buttonIndex >= 8) return;
-  
-  Serial.println("=== BUTTON " + String(buttonIndex) + " PRESSED ===");
-  Serial.println("Button name: " + String(buttonConfigs[buttonIndex].name));
-  Serial.println("Pin: " + String(buttonPins[buttonIndex]) + " -> LED: " + String(ledPins[buttonIndex]));
-  
-  // Toggle LED state for visual feedback
-  ledStates[buttonIndex] = !ledStates[buttonIndex];
+void processSerialCommand(char* line) {
+  while (isspace((unsigned char)*line)) line++;
+  if (*line == '\0') return;
+  lastActivity = millis();
   
-  // Debug output for buttons 5-7 LED state
-  if (buttonIndex >= 5) {
-    int brightness = map(deviceConfig.brightness, 0, 255, 0, 255);
-    Serial.println("LED " + String(buttonIndex) + " pin " + String(ledPins[buttonIndex]) + " (A" + String(buttonIndex) + ") new state: " + String(ledStates[buttonIndex]) + " brightness: " + String(brightness));
-    Serial.println("Pin value: " + String(ledPins[buttonIndex]) + " (expected A" + String(buttonIndex) + " = " + String(A0 + buttonIndex) + ")");
+  for (int i = 0; i < SERIAL_COMMAND_COUNT; i++) {
+    const SerialCommand& cmd = serialCommands[i];
+    size_t nameLength = strlen(cmd.name);
+    if (strncasecmp(line, cmd.name, nameLength) != 0) continue;
+    
+    char next = line[nameLength];
+    if (cmd.takesArgument && next == ':') {
+      cmd.handler(line + nameLength + 1);
+      return;
+    }
+    if (!cmd.takesArgument && next == '\0') {
+      cmd.handler(line + nameLength);
+      return;
+    }
   }
   
-  // Apply the state immediately
-  updateLEDs();
+  sendJsonResponse("error", "Unknown command", false);
+}
+
+void handleStatusCommand(char* argument) {
+  sendDeviceInfo();
+}
+
+void handleConfigCommand(char* argument) {
+  // Send current configuration as JSON
+  StaticJsonDocument<2048> doc;
+  doc["device"]["name"] = deviceConfig.deviceName;
+  doc["device"]["brightness"] = deviceConfig.brightness;
+  doc["network"]["ssid"] = networkConfig.ssid;
+  doc["network"]["connected"] = wifiConnected;
   
-  // Execute configured action
-  if (buttonConfigs[buttonIndex].enabled) {
-    executeAction(buttonIndex);
+  JsonArray buttons = doc.createNestedArray("buttons");
+  for (int i = 0; i < 8; i++) {
+    JsonObject btn = buttons.createNestedObject();
+    btn["id"] = i;
+    btn["name"] = buttonConfigs[i].name;
+    btn["action"] = buttonConfigs[i].action;
+    btn["enabled"] = buttonConfigs[i].enabled;
   }
   
-  // Send button press notification
-  StaticJsonDocument<128> doc;
-  doc["type"] = "button_press";
-  doc["button"] = buttonIndex;
-  doc["name"] = buttonConfigs[buttonIndex].name;
-  doc["timestamp"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  Serial.println("EVENT:" + message);
-  Serial.println("========================");
+  static char response[1024];  // Serial commands only run on loop()
+  serializeJson(doc, response, sizeof(response));
+  sendJsonResponse("config", response);
 }
 
-void executeAction(int buttonIndex) {
-  ActionType action = buttonConfigs[buttonIndex].action;
-  const char* actionData = buttonConfigs[buttonIndex].actionData;
-  
-  switch (action) {
-    case ACTION_HTTP:
-      executeHttpAction(buttonIndex, actionData);
-      break;
-    case ACTION_WEBHOOK:
-      executeWebhookAction(buttonIndex, actionData);
-      break;
-    case ACTION_NONE:
-    default:
-      Serial.println("No action configured for button " + String(buttonIndex));
-      break;
+void handleSetConfigCommand(char* argument) {
+  // Payload is parsed in place from the line buffer
+  char message[STATUS_MESSAGE_MAX];
+  bool success = handleConfigUpload(argument, message, sizeof(message));
+  sendJsonResponse("config_upload", success ? "Configuration updated successfully" : message, success);
+}
+
+void handleSetButtonCommand(char* argument) {
+  // SET_BUTTON:<id>:<json> - update one button without a full config upload
+  char* separator = strchr(argument, ':');
+  int buttonIndex = separator > argument ? atoi(argument) : -1;
+  char message[STATUS_MESSAGE_MAX];
+  if (separator == NULL || buttonIndex < 0 || buttonIndex >= 8) {
+    sendJsonResponse("set_button", "Usage: SET_BUTTON:<id>:<json>", false);
+  } else {
+    bool success = handleButtonPatch(buttonIndex, separator + 1, message, sizeof(message));
+    sendJsonResponse("set_button", message, success);
   }
 }
 
-void executeHttpAction(int buttonIndex, const char* actionData) {
-  if (!wifiConnected) {
-    Serial.println("WiFi not connected - cannot execute HTTP action");
+void handleTestCommand(char* argument) {
+  int buttonIndex = atoi(argument);
+  if (buttonIndex >= 0 && buttonIndex < 8) {
+    handleButtonPress(buttonIndex);
+    char message[32];
+    snprintf(message, sizeof(message), "Button %d triggered", buttonIndex);
+    sendJsonResponse("test", message);
+  }
+}
+
+void handleLedCommand(char* argument) {
+  // LED:<n>:<pattern> - preview a status pattern without running an action
+  char* separator = strchr(argument, ':');
+  int index = separator > argument ? atoi(argument) : -1;
+  LedPattern pattern = separator != NULL ? parseLedPattern(separator + 1) : LED_PATTERN_COUNT;
+  if (index < 0 || index >= 8 || pattern == LED_PATTERN_COUNT) {
+    sendJsonResponse("led", "Usage: LED:<n>:<pending|success|failure|slow|none>", false);
     return;
   }
+  playLedPattern(index, pattern);
+  char message[48];
+  snprintf(message, sizeof(message), "LED %d playing %s", index, ledPatterns[pattern].name);
+  sendJsonResponse("led", message);
+}
+
+void handleMetricsCommand(char* argument) {
+  LatencyHistogram histogram;
   
-  StaticJsonDocument<256> config;
-  deserializeJson(config, actionData);
+  // Percentiles in ms, from the same histograms as /api/metrics
+  Console.println("=== METRICS (p50/p95/p99 ms) ===");
+  for (int i = 0; i < METRIC_STAGE_COUNT; i++) {
+    portENTER_CRITICAL(&metricsMux);
+    histogram = stageMetrics[i];
+    portEXIT_CRITICAL(&metricsMux);
+    Console.printf("  %-12s n=%-6lu %8.1f %8.1f %8.1f\n", METRIC_STAGE_NAMES[i], (unsigned long)histogram.count,
+                   histogramQuantile(histogram, 0.5f) / 1000.0, histogramQuantile(histogram, 0.95f) / 1000.0,
+                   histogramQuantile(histogram, 0.99f) / 1000.0);
+  }
   
-  const char* url = config["url"];
-  const char* method = config["method"] | "POST";
-  const char* body = config["body"] | "";
+  for (int i = 0; i < 8; i++) {
+    portENTER_CRITICAL(&metricsMux);
+    ButtonMetrics button = buttonMetrics[i];
+    portEXIT_CRITICAL(&metricsMux);
+    if (button.presses == 0 && button.action.count == 0) continue;
+    Console.printf("  button %d     presses=%lu ok=%lu failed=%lu %8.1f %8.1f %8.1f\n", i, (unsigned long)button.presses,
+                   (unsigned long)button.successes, (unsigned long)button.failures,
+                   histogramQuantile(button.action, 0.5f) / 1000.0, histogramQuantile(button.action, 0.95f) / 1000.0,
+                   histogramQuantile(button.action, 0.99f) / 1000.0);
+  }
   
-  if (strlen(url) == 0) {
-    Serial.println("No URL configured for HTTP action");
+  for (int i = 0; i < METRIC_HOSTS; i++) {
+    portENTER_CRITICAL(&metricsMux);
+    HostMetrics host = hostMetrics[i];
+    portEXIT_CRITICAL(&metricsMux);
+    if (!host.used) continue;
+    Console.printf("  %s ok=%lu failed=%lu %8.1f %8.1f %8.1f\n", host.host, (unsigned long)host.successes,
+                   (unsigned long)host.failures, histogramQuantile(host.request, 0.5f) / 1000.0,
+                   histogramQuantile(host.request, 0.95f) / 1000.0, histogramQuantile(host.request, 0.99f) / 1000.0);
+  }
+  Console.printf("  heap         free=%lu min=%lu largest=%lu min_largest=%lu failures=%lu store=%u/%u\n",
+                 (unsigned long)heapStats.freeBytes, (unsigned long)heapStats.minFreeBytes,
+                 (unsigned long)heapStats.largestBlock, (unsigned long)heapStats.minLargestBlock,
+                 (unsigned long)heapStats.allocFailures, (unsigned)configStoreUsed, (unsigned)CONFIG_STORE_SIZE);
+  Console.println("================================");
+}
+
+void handleBenchCommand(char* argument) {
+  int runs = argument[0] != '\0' ? atoi(argument) : BENCH_DEFAULT_RUNS;
+  if (runs <= 0 || runs > BENCH_MAX_RUNS) {
+    sendJsonResponse("bench", "Usage: BENCH[:<runs>], 1-1000 runs", false);
     return;
   }
-  
-  HTTPClient http;
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("User-Agent", "PATCOM/" + String(VERSION));
-  
-  int httpCode;
-  if (strcmp(method, "GET") == 0) {
-    httpCode = http.GET();
-  } else if (strcmp(method, "POST") == 0) {
-    httpCode = http.POST(body);
-  } else if (strcmp(method, "PUT") == 0) {
-    httpCode = http.PUT(body);
-  } else {
-    httpCode = http.POST(body);
+  runBenchmarks(runs);
+}
+
+void handleSoakCommand(char* argument) {
+  // SOAK:<slot>:<interval ms>:<count>, or SOAK:STOP to end early and report what ran
+  if (strcasecmp(argument, "STOP") == 0) {
+    if (!soakRun.active) {
+      sendJsonResponse("soak", "No soak running", false);
+      return;
+    }
+    finishSoak(false);
+    return;
   }
   
-  if (httpCode > 0) {
-    Serial.println("HTTP " + String(method) + " to " + String(url) + " - Response: " + String(httpCode));
-  } else {
-    Serial.println("HTTP request failed: " + String(httpCode));
+  int slot = -1;
+  unsigned int intervalMs = 0;
+  unsigned long count = 0;
+  if (sscanf(argument, "%d:%u:%lu", &slot, &intervalMs, &count) != 3 || slot < 0 || slot >= ACTION_SLOTS ||
+      intervalMs == 0 || intervalMs > 65535 || count == 0) {
+    sendJsonResponse("soak", "Usage: SOAK:<slot 0-15>:<interval ms>:<count>", false);
+    return;
+  }
+  if (soakRun.active) {
+    sendJsonResponse("soak", "A soak is already running - SOAK:STOP first", false);
+    return;
+  }
+  if (!buttonConfigs[slot].enabled || compiledButtons[slot].count == 0) {
+    sendJsonResponse("soak", "Slot has no enabled action to soak", false);
+    return;
   }
   
-  http.end();
+  startSoak(slot, intervalMs, count);
+  sendJsonResponse("soak", "Soak started");
 }
 
+void handleWiFiCommand(char* argument) {
+  sendJsonResponse("wifi", wifiConnected ? "Connected" : "Disconnected");
+}
 
+void handlePowerCommand(char* argument) {
+  Console.printf("Battery %.2fV %u%% (%s)\n", batteryVoltage, batteryPercent, batteryLevelName(batteryLevel));
+  Console.printf("CPU %luMHz%s, WiFi power save %d%s\n", (unsigned long)cpuFrequency, cpuBoosted() ? " (boosted)" : "",
+                 (int)wifiPowerSave, criticalBattery ? ", critical power" : "");
+  char message[16];
+  snprintf(message, sizeof(message), "%.2fV", batteryVoltage);
+  sendJsonResponse("power", message);
+}
 
+void handleResetWiFiCommand(char* argument) {
+  Console.println("Clearing WiFi credentials and restarting...");
+  strcpy(networkConfig.ssid, "");
+  strcpy(networkConfig.password, "");
+  markConfigDirty(CONFIG_DIRTY_NETWORK);
+  if (!commitConfiguration()) {
+    // Restarting now would bring the old credentials straight back
+    Console.println("ERROR: WiFi credentials could not be cleared from flash - not restarting");
+    sendJsonResponse("error", "WiFi reset not saved", false);
+    return;
+  }
+  delay(1000);
+  ESP.restart();
+}
 
+void handleIdentifyCommand(char* argument) {
+  // Send device identification for electron configurator
+  StaticJsonDocument<256> doc;
+  doc["type"] = "device_identification";
+  doc["device_name"] = deviceConfig.deviceName;
+  doc["device_id"] = deviceConfig.deviceId;
+  doc["version"] = VERSION;
+  doc["device_type"] = "PATCOM";
+  doc["connection"] = "USB";
+  doc["protocol"] = serialFramed ? "framed" : "text";
+  doc["framed_baud"] = SERIAL_FRAMED_BAUD;  // Request with FRAMED or FRAMED:<baud>
+  
+  Console.print("IDENTIFY:");
+  serializeJson(doc, Console);
+  Console.println();
+}
 
-void executeWebhookAction(int buttonIndex, const char* actionData) {
-  if (!wifiConnected) {
-    Serial.println("WiFi not connected - cannot execute webhook");
+void handleFramedCommand(char* argument) {
+  unsigned long baud = (*argument != '\0') ? strtoul(argument, NULL, 10) : SERIAL_FRAMED_BAUD;
+  if (baud < SERIAL_TEXT_BAUD || baud > 2000000) {
+    sendJsonResponse("framed", "Unsupported baud rate", false);
     return;
   }
-  
-  StaticJsonDocument<256> config;
-  deserializeJson(config, actionData);
-  
-  const char* url = config["url"];
-  const char* secret = config["secret"];
-  
-  if (strlen(url) == 0) {
-    Serial.println("No webhook URL configured");
+  if (serialFramed) {
+    sendJsonResponse("framed", "Already in framed mode", false);
     return;
   }
   
-  HTTPClient http;
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("User-Agent", "PATCOM/" + String(VERSION));
-  
-  if (strlen(secret) > 0) {
-    http.addHeader("X-Webhook-Secret", secret);
+  // Confirm in text at the old rate, then switch - the host follows once it sees this line
+  serialFramedBaud = baud;
+  char message[64];
+  snprintf(message, sizeof(message), "Switching to framed protocol at %lu baud", baud);
+  sendJsonResponse("framed", message);
+  setSerialFramed(true);
+}
+
+void handleTextCommand(char* argument) {
+  if (!serialFramed) {
+    sendJsonResponse("text", "Already in text mode");
+    return;
   }
+  // Applied by handleSerialFrame() after the ACK so the host gets it framed
+  serialLeaveFramed = true;
+  char message[64];
+  snprintf(message, sizeof(message), "Returning to text protocol at %lu baud", SERIAL_TEXT_BAUD);
+  sendJsonResponse("text", message);
+}
+
+void handleHelpCommand(char* argument) {
+  Console.println("=== PATCOM Commands ===");
+  for (int i = 0; i < SERIAL_COMMAND_COUNT; i++) {
+    Console.printf("%-10s - %s\n", serialCommands[i].usage, serialCommands[i].help);
+  }
+}
+
+// Framed Serial Functions
+
+void setSerialFramed(bool framed) {
+  Serial.flush();
+  Serial.begin(framed ? serialFramedBaud : SERIAL_TEXT_BAUD);
   
-  // Build webhook payload
-  StaticJsonDocument<256> payload;
-  payload["device_id"] = deviceConfig.deviceId;
-  payload["device_name"] = deviceConfig.deviceName;
-  payload["button"] = buttonIndex;
-  payload["button_name"] = buttonConfigs[buttonIndex].name;
-  payload["timestamp"] = millis();
-  payload["battery"] = batteryVoltage;
-  
-  String payloadStr;
-  serializeJson(payload, payloadStr);
-  
-  int httpCode = http.POST(payloadStr);
+  xSemaphoreTake(consoleMutex, portMAX_DELAY);
+  consoleLines[0].length = consoleLines[1].length = 0;
+  consoleLines[0].type = consoleLines[1].type = 0;
+  serialFramed = framed;
+  xSemaphoreGive(consoleMutex);
   
-  if (httpCode > 0) {
-    Serial.println("Webhook sent to " + String(url) + " - Response: " + String(httpCode));
-  } else {
-    Serial.println("Webhook failed: " + String(httpCode));
+  frameRxState = FRAME_RX_SOF;
+  serialLeaveFramed = false;
+  serialLineLength = 0;
+  serialLineOverflow = false;
+}
+
+size_t SerialConsole::write(const uint8_t* buffer, size_t size) {
+  if (!serialFramed) {
+    return Serial.write(buffer, size);
   }
   
-  http.end();
+  // Lines from the worker task get their own buffer so they never splice into loop() output
+  xSemaphoreTake(consoleMutex, portMAX_DELAY);
+  ConsoleLine& line = consoleLines[xTaskGetCurrentTaskHandle() == loopTaskHandle ? 0 : 1];
+  for (size_t i = 0; i < size; i++) {
+    char c = buffer[i];
+    if (c == '\r') continue;
+    if (c == '\n') {
+      flushConsoleLine(line);
+      line.type = 0;
+      continue;
+    }
+    if (line.length == sizeof(line.data)) {
+      flushConsoleLine(line);
+    }
+    line.data[line.length++] = c;
+  }
+  xSemaphoreGive(consoleMutex);
+  return size;
 }
 
-void updateLEDs() {
-  for (int i = 0; i < 8; i++) {
-    int brightness = map(deviceConfig.brightness, 0, 255, 0, 255);
-    int ledValue = ledStates[i] ? brightness : 0;
-    
-    // For buttons 5-7, try digitalWrite instead of analogWrite as fallback
-    if (i >= 5) {
-      if (ledStates[i]) {
-        digitalWrite(ledPins[i], HIGH);
-      } else {
-        digitalWrite(ledPins[i], LOW);
-      }
+void flushConsoleLine(ConsoleLine& line) {
+  // Caller holds consoleMutex
+  if (line.type == 0) {
+    if (line.length >= 9 && strncmp(line.data, "RESPONSE:", 9) == 0) {
+      line.type = FRAME_RESPONSE;
+    } else if (line.length >= 12 && strncmp(line.data, "DEVICE_INFO:", 12) == 0) {
+      line.type = FRAME_RESPONSE;
+    } else if (line.length >= 9 && strncmp(line.data, "IDENTIFY:", 9) == 0) {
+      line.type = FRAME_RESPONSE;
+    } else if (line.length >= 6 && strncmp(line.data, "EVENT:", 6) == 0) {
+      line.type = FRAME_EVENT;
     } else {
-      analogWrite(ledPins[i], ledValue);
+      line.type = FRAME_LOG;
     }
   }
+  
+  uint16_t id = 0;
+  if (line.type == FRAME_RESPONSE && &line == &consoleLines[0]) {
+    id = framedRequestId;
+  }
+  writeFrame(line.type, id, (const uint8_t*)line.data, line.length);
+  line.length = 0;
 }
 
-void handleSerialCommands() {
-  if (Serial.available()) {
-    String command = Serial.readStringUntil('\n');
-    command.trim();
-    processSerialCommand(command);
+void sendFrame(uint8_t type, uint16_t id, const uint8_t* payload, size_t length) {
+  xSemaphoreTake(consoleMutex, portMAX_DELAY);
+  writeFrame(type, id, payload, length);
+  xSemaphoreGive(consoleMutex);
+}
+
+void writeFrame(uint8_t type, uint16_t id, const uint8_t* payload, size_t length) {
+  // Caller holds consoleMutex so frames from both cores never interleave
+  uint8_t header[1 + FRAME_HEADER_SIZE] = {
+    FRAME_SOF, type,
+    (uint8_t)(id & 0xFF), (uint8_t)(id >> 8),
+    (uint8_t)(length & 0xFF), (uint8_t)(length >> 8)
+  };
+  uint32_t crc = esp_rom_crc32_le(0, header + 1, FRAME_HEADER_SIZE);
+  crc = esp_rom_crc32_le(crc, payload, length);
+  uint8_t trailer[4] = {
+    (uint8_t)(crc & 0xFF), (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24)
+  };
+  
+  Serial.write(header, sizeof(header));
+  if (length > 0) {
+    Serial.write(payload, length);
   }
+  Serial.write(trailer, sizeof(trailer));
 }
 
-void processSerialCommand(String command) {
-  command.toUpperCase();
+void handleSerialFrames() {
+  unsigned long currentTime = millis();
   
-  if (command == "STATUS") {
-    sendDeviceInfo();
-  } else if (command == "CONFIG") {
-    // Send current configuration as JSON
-    StaticJsonDocument<2048> doc;
-    doc["device"]["name"] = deviceConfig.deviceName;
-    doc["device"]["brightness"] = deviceConfig.brightness;
-    doc["network"]["ssid"] = networkConfig.ssid;
-    doc["network"]["connected"] = wifiConnected;
+  // A stalled sender must not wedge the parser mid-frame
+  if (frameRxState != FRAME_RX_SOF && currentTime - frameRxLastByte > SERIAL_FRAME_TIMEOUT) {
+    frameRxState = FRAME_RX_SOF;
+  }
+  
+  int budget = SERIAL_READ_BUDGET;
+  while (budget-- > 0 && Serial.available()) {
+    uint8_t c = Serial.read();
+    frameRxLastByte = currentTime;
     
-    JsonArray buttons = doc.createNestedArray("buttons");
-    for (int i = 0; i < 8; i++) {
-      JsonObject btn = buttons.createNestedObject();
-      btn["id"] = i;
-      btn["name"] = buttonConfigs[i].name;
-      btn["action"] = buttonConfigs[i].action;
-      btn["enabled"] = buttonConfigs[i].enabled;
-    }
-    
-    String response;
-    serializeJson(doc, response);
-    sendJsonResponse("config", response.c_str());
-  } else if (command.startsWith("SET_CONFIG:")) {
-    // Receive configuration JSON
-    String configJson = command.substring(11);
-    handleConfigUpload(configJson);
-  } else if (command.startsWith("TEST:")) {
-    int buttonIndex = command.substring(5).toInt();
-    if (buttonIndex >= 0 && buttonIndex < 8) {
-      handleButtonPress(buttonIndex);
-      sendJsonResponse("test", ("Button " + String(buttonIndex) + " triggered").c_str());
-    }
-  } else if (command == "WIFI") {
-    sendJsonResponse("wifi", wifiConnected ? "Connected" : "Disconnected");
-  } else if (command == "POWER" || command == "BATTERY") {
-    sendJsonResponse("power", (String(batteryVoltage, 2) + "V").c_str());
-  } else if (command == "RESET_WIFI") {
-    Serial.println("Clearing WiFi credentials and restarting...");
-    preferences.begin("patcom", false);
-    preferences.putString("ssid", "");
-    preferences.putString("password", "");
-    preferences.end();
-    delay(1000);
-    ESP.restart();
-  } else if (command == "IDENTIFY") {
-    // Send device identification for electron configurator
-    StaticJsonDocument<256> doc;
-    doc["type"] = "device_identification";
-    doc["device_name"] = deviceConfig.deviceName;
-    doc["device_id"] = deviceConfig.deviceId;
-    doc["version"] = VERSION;
-    doc["device_type"] = "PATCOM";
-    doc["connection"] = "USB";
-    
-    String response;
-    serializeJson(doc, response);
-    Serial.println("IDENTIFY:" + response);
-  } else if (command == "HELP") {
-    Serial.println("=== PATCOM Commands ===");
-    Serial.println("STATUS     - Device information");
-    Serial.println("CONFIG     - Get configuration");
-    Serial.println("SET_CONFIG:<json> - Upload configuration");
-    Serial.println("TEST:<n>   - Test button n");
-    Serial.println("WIFI       - WiFi status");
-    Serial.println("POWER      - Power supply voltage");
-    Serial.println("BATTERY    - Power supply voltage (alias)");
-    Serial.println("IDENTIFY   - Device identification for configurator");
-    Serial.println("RESET_WIFI - Clear WiFi and enter config mode");
-    Serial.println("HELP       - This help");
-  } else {
-    sendJsonResponse("error", "Unknown command", false);
+    switch (frameRxState) {
+      case FRAME_RX_SOF:
+        if (c == FRAME_SOF) {
+          frameRxState = FRAME_RX_HEADER;
+          frameRxPos = 0;
+        }
+        break;
+      
+      case FRAME_RX_HEADER:
+        frameRxHeader[frameRxPos++] = c;
+        if (frameRxPos == FRAME_HEADER_SIZE) {
+          frameRxLength = frameRxHeader[3] | (frameRxHeader[4] << 8);
+          frameRxPos = 0;
+          if (frameRxLength > SERIAL_LINE_MAX) {
+            uint16_t id = frameRxHeader[1] | (frameRxHeader[2] << 8);
+            sendFrame(FRAME_NACK, id, (const uint8_t*)"too_long", 8);
+            frameRxState = FRAME_RX_SOF;
+          } else {
+            frameRxState = frameRxLength > 0 ? FRAME_RX_PAYLOAD : FRAME_RX_CRC;
+          }
+        }
+        break;
+      
+      case FRAME_RX_PAYLOAD:
+        serialLine[frameRxPos++] = c;
+        if (frameRxPos == frameRxLength) {
+          frameRxPos = 0;
+          frameRxState = FRAME_RX_CRC;
+        }
+        break;
+      
+      case FRAME_RX_CRC:
+        frameRxCrc[frameRxPos++] = c;
+        if (frameRxPos == sizeof(frameRxCrc)) {
+          frameRxState = FRAME_RX_SOF;
+          handleSerialFrame();
+          if (!serialFramed) return;  // Left framed mode - remaining bytes are text
+        }
+        break;
+    }
+  }
+}
+
+void handleSerialFrame() {
+  uint8_t type = frameRxHeader[0];
+  uint16_t id = frameRxHeader[1] | (frameRxHeader[2] << 8);
+  
+  uint32_t crc = esp_rom_crc32_le(0, frameRxHeader, FRAME_HEADER_SIZE);
+  crc = esp_rom_crc32_le(crc, (const uint8_t*)serialLine, frameRxLength);
+  uint32_t received = frameRxCrc[0] | (frameRxCrc[1] << 8) | (frameRxCrc[2] << 16) | ((uint32_t)frameRxCrc[3] << 24);
+  if (crc != received) {
+    sendFrame(FRAME_NACK, id, (const uint8_t*)"bad_crc", 7);
+    return;
+  }
+  if (type != FRAME_COMMAND) {
+    sendFrame(FRAME_NACK, id, (const uint8_t*)"bad_type", 8);
+    return;
+  }
+  
+  // Output printed while the command runs is tagged with its id
+  serialLine[frameRxLength] = '\0';
+  framedRequestId = id;
+  processSerialCommand(serialLine);
+  framedRequestId = 0;
+  sendFrame(FRAME_ACK, id, NULL, 0);
+  
+  if (serialLeaveFramed) {
+    setSerialFramed(false);
   }
 }
 
@@ -834,291 +6763,719 @@ void sendJsonResponse(const char* type, const char* message, bool success) {
   doc["message"] = message;
   doc["timestamp"] = millis();
   
-  String response;
-  serializeJson(doc, response);
-  Serial.println("RESPONSE:" + response);
+  Console.print("RESPONSE:");
+  serializeJson(doc, Console);
+  Console.println();
 }
 
 void sendDeviceInfo() {
-  StaticJsonDocument<512> doc;
+  StaticJsonDocument<768> doc;
+  buildDeviceInfo(doc);
+  
+  Console.print("DEVICE_INFO:");
+  serializeJson(doc, Console);
+  Console.println();
+}
+
+void buildDeviceInfo(JsonDocument& doc) {
   doc["type"] = "device_info";
   doc["device"] = deviceConfig.deviceName;
   doc["version"] = VERSION;
   doc["uptime"] = millis();
   doc["power"] = batteryVoltage;  // Keep 'batteryVoltage' variable name for compatibility
+  doc["battery_percent"] = batteryPercent;
+  doc["battery_level"] = batteryLevelName(batteryLevel);
+  doc["cpu_mhz"] = cpuFrequency;
+  doc["low_power"] = criticalBattery;
   doc["wifi"]["connected"] = wifiConnected;
   doc["wifi"]["ssid"] = networkConfig.ssid;
-  doc["wifi"]["ip"] = wifiConnected ? WiFi.localIP().toString() : "";
+  char ip[16] = "";
+  if (wifiConnected) formatIPAddress(WiFi.localIP(), ip, sizeof(ip));
+  doc["wifi"]["ip"] = ip;
   doc["wifi"]["rssi"] = wifiConnected ? WiFi.RSSI() : 0;
   doc["config_mode"] = configMode;
+  doc["heap"]["free"] = heapStats.freeBytes;
+  doc["heap"]["min_free"] = heapStats.minFreeBytes;
+  doc["heap"]["largest_block"] = heapStats.largestBlock;
+  doc["heap"]["min_largest_block"] = heapStats.minLargestBlock;
+  doc["heap"]["alloc_failures"] = heapStats.allocFailures;
+  doc["heap"]["config_store"] = configStoreUsed;
+}
+
+// Event Stream Functions
+
+void publishEvent(const char* type, JsonDocument& doc) {
+  if (events.count() == 0) return;
   
-  String response;
-  serializeJson(doc, response);
-  Serial.println("DEVICE_INFO:" + response);
+  // Serialize once; AsyncEventSource queues the same message to every subscriber
+  xSemaphoreTake(eventMutex, portMAX_DELAY);
+  size_t length = serializeJson(doc, eventBuffer, sizeof(eventBuffer));
+  if (length > 0 && length < sizeof(eventBuffer) - 1) {
+    events.send(eventBuffer, type, millis());
+  }
+  xSemaphoreGive(eventMutex);
 }
 
-void handleConfigUpload() {
-  String body = server.arg("plain");
-  handleConfigUpload(body);
+void updateEventStream() {
+  unsigned long currentTime = millis();
+  if (currentTime - lastTelemetry < TELEMETRY_INTERVAL * telemetryStretch) return;
+  lastTelemetry = currentTime;
+  
+  StaticJsonDocument<512> doc;
+  buildDeviceInfo(doc);
+  doc["type"] = "telemetry";
+  doc["action_overflows"] = actionQueueOverflows;
+  publishEvent("telemetry", doc);
 }
 
-void handleConfigUpload(String configJson) {
-  Serial.println("=== CONFIG UPLOAD DEBUG ===");
-  Serial.println("Received JSON length: " + String(configJson.length()));
-  Serial.println("JSON content: " + configJson);
+bool handleConfigUpload(char* configJson, char* message, size_t messageSize) {
+  Console.println("=== CONFIG UPLOAD DEBUG ===");
+  // Length only - the document carries the WiFi password and apiKeys, which never go to the log
+  Console.printf("Received JSON length: %u\n", (unsigned)strlen(configJson));
   
-  StaticJsonDocument<2048> doc;
+  // Parsed in place (zero-copy): strings in doc point into configJson, which must outlive it
+  boostCpu(POWER_HOLD_CONFIG);
+  DynamicJsonDocument doc(CONFIG_UPLOAD_DOC_SIZE);
   DeserializationError error = deserializeJson(doc, configJson);
   
   if (error) {
-    Serial.println("Failed to parse configuration JSON");
-    Serial.println("Parse error: " + String(error.c_str()));
-    if (server.client()) {
-      server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid JSON\"}");
-    } else {
-      sendJsonResponse("config_upload", "Invalid JSON", false);
+    Console.println("Failed to parse configuration JSON");
+    Console.printf("Parse error: %s\n", error.c_str());
+    strlcpy(message, "Invalid JSON", messageSize);
+    releaseCpu(POWER_HOLD_CONFIG);
+    return false;
+  }
+  
+  Console.println("JSON parsed successfully");
+  
+  bool success = applyConfigUpdate(doc.as<JsonObject>(), message, messageSize);
+  if (success) {
+    Console.println("Configuration upload completed");
+    Console.println("========================");
+    lastActivity = millis();
+  }
+  releaseCpu(POWER_HOLD_CONFIG);
+  return success;
+}
+
+bool applyConfigUpdate(JsonObject root, char* message, size_t messageSize) {
+  // Every upload path (HTTP, serial, UDP) goes through here: uploads arrive from loop() and the web task,
+  // so they are applied one at a time, and refused whole before anything changes
+  lockConfig();
+  JsonObject updates[ACTION_SLOTS];
+  JsonArray buttons = root.containsKey("buttons") ? root["buttons"] : root["BUTTONS"];
+  for (JsonObject button : buttons) {
+    int id = button.containsKey("id") ? button["id"] : button["ID"];
+    if (id >= 0 && id < 8) updates[id] = button;
+  }
+  for (JsonObject gesture : root["gestures"].as<JsonArray>()) {
+    int id = gesture["id"] | -1;
+    if (id >= 0 && id < MAX_GESTURES) updates[8 + id] = gesture;
+  }
+  if (!actionConfigsFit(updates, message, messageSize) || !compiledTargetsFit(updates, message, messageSize)) {
+    unlockConfig();
+    return false;
+  }
+  bool networkChanged = applyConfigDocument(root);
+  
+  // Save configuration if anything changed
+  bool changed = commitConfiguration();
+  if (!changed) {
+    if (configDirty != 0) {
+      unlockConfig();
+      strlcpy(message, "Configuration applied but could not be saved to flash", messageSize);
+      return false;
     }
-    return;
+    Console.println("No configuration changes detected");
+  }
+  unlockConfig();
+  
+  // Restart if network config changed - deferred so the caller can respond first
+  if (networkChanged) {
+    restartForNetworkChange();
   }
   
-  Serial.println("JSON parsed successfully");
+  strlcpy(message, changed ? "Configuration updated" : "No configuration changes", messageSize);
+  return true;
+}
+
+bool applyConfigDocument(JsonObject doc) {
   bool networkChanged = false;
-  bool configChanged = false;
   
   // Update device configuration (handle both lowercase and uppercase keys)
   if (doc.containsKey("device") || doc.containsKey("DEVICE")) {
-    Serial.println("Processing device configuration...");
+    Console.println("Processing device configuration...");
     JsonObject deviceObj = doc.containsKey("device") ? doc["device"] : doc["DEVICE"];
     
     if (deviceObj.containsKey("name") || deviceObj.containsKey("NAME")) {
-      String newName = deviceObj.containsKey("name") ? deviceObj["name"] : deviceObj["NAME"];
-      Serial.println("Updating device name to: " + newName);
-      strcpy(deviceConfig.deviceName, newName.c_str());
-      configChanged = true;
+      const char* newName = (deviceObj.containsKey("name") ? deviceObj["name"] : deviceObj["NAME"]) | "";
+      if (updateConfigString(deviceConfig.deviceName, sizeof(deviceConfig.deviceName), newName)) {
+        Console.printf("Updating device name to: %s\n", deviceConfig.deviceName);
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
     }
     if (deviceObj.containsKey("brightness") || deviceObj.containsKey("BRIGHTNESS")) {
       int newBrightness = deviceObj.containsKey("brightness") ? deviceObj["brightness"] : deviceObj["BRIGHTNESS"];
-      Serial.println("Updating brightness to: " + String(newBrightness));
-      deviceConfig.brightness = newBrightness;
-      configChanged = true;
+      if (newBrightness != deviceConfig.brightness) {
+        Console.printf("Updating brightness to: %d\n", newBrightness);
+        deviceConfig.brightness = newBrightness;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
     }
     if (deviceObj.containsKey("discoverable") || deviceObj.containsKey("DISCOVERABLE")) {
       bool newDiscoverable = deviceObj.containsKey("discoverable") ? deviceObj["discoverable"] : deviceObj["DISCOVERABLE"];
-      Serial.println("Updating discoverable to: " + String(newDiscoverable));
-      deviceConfig.discoverable = newDiscoverable;
-      configChanged = true;
+      if (newDiscoverable != deviceConfig.discoverable) {
+        Console.printf("Updating discoverable to: %d\n", newDiscoverable);
+        deviceConfig.discoverable = newDiscoverable;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+    if (deviceObj.containsKey("persistRetries")) {
+      bool newPersistRetries = deviceObj["persistRetries"];
+      if (newPersistRetries != deviceConfig.persistRetries) {
+        Console.printf("Updating persistRetries to: %d\n", newPersistRetries);
+        deviceConfig.persistRetries = newPersistRetries;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+    if (deviceObj.containsKey("sleepTimeout")) {
+      uint16_t newSleepTimeout = constrain(deviceObj["sleepTimeout"].as<long>(), 0L, 65535L);
+      if (newSleepTimeout != deviceConfig.sleepTimeout) {
+        Console.printf("Updating sleepTimeout to: %u\n", newSleepTimeout);
+        deviceConfig.sleepTimeout = newSleepTimeout;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+    if (deviceObj.containsKey("deepSleep")) {
+      bool newDeepSleep = deviceObj["deepSleep"];
+      if (newDeepSleep != deviceConfig.deepSleep) {
+        Console.printf("Updating deepSleep to: %d\n", newDeepSleep);
+        deviceConfig.deepSleep = newDeepSleep;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+    if (deviceObj.containsKey("longPressMs")) {
+      uint16_t newLongPress = constrain(deviceObj["longPressMs"].as<long>(), 200L, 5000L);
+      if (newLongPress != deviceConfig.longPressMs) {
+        Console.printf("Updating longPressMs to: %u\n", newLongPress);
+        deviceConfig.longPressMs = newLongPress;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+    if (deviceObj.containsKey("doubleTapMs")) {
+      uint16_t newDoubleTap = constrain(deviceObj["doubleTapMs"].as<long>(), 100L, 1000L);
+      if (newDoubleTap != deviceConfig.doubleTapMs) {
+        Console.printf("Updating doubleTapMs to: %u\n", newDoubleTap);
+        deviceConfig.doubleTapMs = newDoubleTap;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+    if (deviceObj.containsKey("chordWindowMs")) {
+      uint16_t newChordWindow = constrain(deviceObj["chordWindowMs"].as<long>(), 20L, 500L);
+      if (newChordWindow != deviceConfig.chordWindowMs) {
+        Console.printf("Updating chordWindowMs to: %u\n", newChordWindow);
+        deviceConfig.chordWindowMs = newChordWindow;
+        markConfigDirty(CONFIG_DIRTY_DEVICE);
+      }
+    }
+  } else {
+    Console.println("No device configuration provided - keeping existing settings");
+  }
+  
+  // Update network configuration (handle both lowercase and uppercase keys)
+  if (doc.containsKey("network") || doc.containsKey("NETWORK")) {
+    Console.println("Processing network configuration...");
+    JsonObject networkObj = doc.containsKey("network") ? doc["network"] : doc["NETWORK"];
+    
+    if (networkObj.containsKey("ssid") || networkObj.containsKey("SSID")) {
+      const char* newSSID = (networkObj.containsKey("ssid") ? networkObj["ssid"] : networkObj["SSID"]) | "";
+      if (updateConfigString(networkConfig.ssid, sizeof(networkConfig.ssid), newSSID)) {
+        Console.printf("Updating SSID to: %s\n", networkConfig.ssid);
+        networkChanged = true;
+      }
+    }
+    if (networkObj.containsKey("password") || networkObj.containsKey("PASSWORD")) {
+      const char* newPassword = (networkObj.containsKey("password") ? networkObj["password"] : networkObj["PASSWORD"]) | "";
+      if (updateConfigString(networkConfig.password, sizeof(networkConfig.password), newPassword)) {
+        Console.printf("Updating WiFi password (length: %u)\n", (unsigned)strlen(networkConfig.password));
+        networkChanged = true;
+      }
+    }
+    // Addressing is applied when WiFi connects, so any change here needs the restart too
+    if (networkObj.containsKey("staticIP") || networkObj.containsKey("STATICIP")) {
+      bool newStaticIP = networkObj.containsKey("staticIP") ? networkObj["staticIP"] : networkObj["STATICIP"];
+      if (newStaticIP != networkConfig.staticIP) {
+        Console.printf("Updating staticIP to: %d\n", newStaticIP);
+        networkConfig.staticIP = newStaticIP;
+        networkChanged = true;
+      }
+    }
+    if (networkObj.containsKey("ip") || networkObj.containsKey("IP")) {
+      const char* newIP = (networkObj.containsKey("ip") ? networkObj["ip"] : networkObj["IP"]) | "";
+      if (updateConfigString(networkConfig.ip, sizeof(networkConfig.ip), newIP)) {
+        Console.printf("Updating IP to: %s\n", networkConfig.ip);
+        networkChanged = true;
+      }
+    }
+    if (networkObj.containsKey("subnet") || networkObj.containsKey("SUBNET")) {
+      const char* newSubnet = (networkObj.containsKey("subnet") ? networkObj["subnet"] : networkObj["SUBNET"]) | "";
+      if (updateConfigString(networkConfig.subnet, sizeof(networkConfig.subnet), newSubnet)) {
+        Console.printf("Updating subnet to: %s\n", networkConfig.subnet);
+        networkChanged = true;
+      }
+    }
+    if (networkObj.containsKey("gateway") || networkObj.containsKey("GATEWAY")) {
+      const char* newGateway = (networkObj.containsKey("gateway") ? networkObj["gateway"] : networkObj["GATEWAY"]) | "";
+      if (updateConfigString(networkConfig.gateway, sizeof(networkConfig.gateway), newGateway)) {
+        Console.printf("Updating gateway to: %s\n", networkConfig.gateway);
+        networkChanged = true;
+      }
+    }
+    
+    if (networkChanged) {
+      markConfigDirty(CONFIG_DIRTY_NETWORK);
+    }
+  } else {
+    Console.println("No network configuration provided - keeping existing settings");
+  }
+  
+  // API keys: {"NAME": "value"}, an empty or null value removes the key. Values are never sent back
+  if (doc.containsKey("apiKeys")) {
+    lockConfig();
+    for (JsonPair key : doc["apiKeys"].as<JsonObject>()) {
+      const char* value = key.value() | "";
+      if (value[0] == '\0') {
+        removeApiKey(key.key().c_str());
+      } else {
+        setApiKey(key.key().c_str(), value);
+      }
+    }
+    unlockConfig();
+  }
+  
+  // Update button configurations (handle both lowercase and uppercase keys)
+  if (doc.containsKey("buttons") || doc.containsKey("BUTTONS")) {
+    Console.println("Processing button configurations...");
+    JsonArray buttons = doc.containsKey("buttons") ? doc["buttons"] : doc["BUTTONS"];
+    Console.printf("Number of buttons to update: %u\n", (unsigned)buttons.size());
+    
+    lockConfig();
+    for (JsonObject button : buttons) {
+      int id = button.containsKey("id") ? button["id"] : button["ID"];
+      if (id >= 0 && id < 8) {
+        applyButtonUpdate(id, button);
+      } else {
+        Console.printf("Invalid button ID: %d\n", id);
+      }
     }
+    unlockConfig();
   } else {
-    Serial.println("No device configuration provided - keeping existing settings");
+    Console.println("No button configuration provided - keeping existing settings");
+  }
+  
+  // Gesture bindings: {"id", "type", "buttons": [..], plus the same fields as a button}
+  if (doc.containsKey("gestures")) {
+    JsonArray gestures = doc["gestures"];
+    Console.printf("Number of gestures to update: %u\n", (unsigned)gestures.size());
+    
+    lockConfig();
+    for (JsonObject gesture : gestures) {
+      int id = gesture["id"] | -1;
+      if (id >= 0 && id < MAX_GESTURES) {
+        applyGestureUpdate(id, gesture);
+      } else {
+        Console.printf("Invalid gesture ID: %d\n", id);
+      }
+    }
+    unlockConfig();
+  }
+  
+  return networkChanged;
+}
+
+void restartForNetworkChange() {
+  Console.printf("Network configuration changed - restarting in %lums...\n", NETWORK_RESTART_DELAY);
+  scheduleRestart(NETWORK_RESTART_DELAY);
+}
+
+void scheduleRestart(unsigned long delayMs) {
+  restartAt = millis() + delayMs;
+  if (restartAt == 0) restartAt = 1;
+}
+
+
+
+
+
+
+
+
+void handleButtonPatchRequest(AsyncWebServerRequest* request) {
+  int id = request->hasParam("id") ? request->getParam("id")->value().toInt() : -1;
+  char message[STATUS_MESSAGE_MAX];
+  
+  if (!request->hasParam("id") || id < 0 || id >= 8) {
+    sendStatusJson(request, 400, "error", "Invalid button index");
+    return;
+  }
+  
+  const char* body = (const char*)request->_tempObject;
+  if (body == NULL) {
+    sendStatusJson(request, 400, "error", "Missing or oversized body");
+  } else if (handleButtonPatch(id, body, message, sizeof(message))) {
+    sendStatusJson(request, 200, "ok", message);
+  } else {
+    sendStatusJson(request, 400, "error", message);
+  }
+}
+
+bool handleButtonPatch(int id, const char* json, char* message, size_t messageSize) {
+  // A single button fits a much smaller document than a full upload
+  StaticJsonDocument<1536> doc;
+  DeserializationError error = deserializeJson(doc, json);
+  
+  if (error || !doc.is<JsonObject>()) {
+    strlcpy(message, "Invalid JSON", messageSize);
+    return false;
+  }
+  
+  lockConfig();
+  JsonObject updates[ACTION_SLOTS];
+  updates[id] = doc.as<JsonObject>();
+  if (!actionConfigsFit(updates, message, messageSize) || !compiledTargetsFit(updates, message, messageSize)) {
+    unlockConfig();
+    return false;
   }
+  bool changed = applyButtonUpdate(id, doc.as<JsonObject>());
+  if (changed && !commitConfiguration()) {
+    unlockConfig();
+    snprintf(message, messageSize, "Button %d applied but could not be saved to flash", id);
+    return false;
+  }
+  unlockConfig();
   
-  // Update network configuration (handle both lowercase and uppercase keys)
-  if (doc.containsKey("network") || doc.containsKey("NETWORK")) {
-    Serial.println("Processing network configuration...");
-    JsonObject networkObj = doc.containsKey("network") ? doc["network"] : doc["NETWORK"];
-    
-    if (networkObj.containsKey("ssid") || networkObj.containsKey("SSID")) {
-      String newSSID = networkObj.containsKey("ssid") ? networkObj["ssid"] : networkObj["SSID"];
-      Serial.println("Updating SSID to: " + newSSID);
-      strcpy(networkConfig.ssid, newSSID.c_str());
-      networkChanged = true;
-      configChanged = true;
-    }
-    if (networkObj.containsKey("password") || networkObj.containsKey("PASSWORD")) {
-      String newPassword = networkObj.containsKey("password") ? networkObj["password"] : networkObj["PASSWORD"];
-      Serial.println("Updating WiFi password (length: " + String(newPassword.length()) + ")");
-      strcpy(networkConfig.password, newPassword.c_str());
-      networkChanged = true;
-      configChanged = true;
-    }
-    if (networkObj.containsKey("staticIP") || networkObj.containsKey("STATICIP")) {
-      bool newStaticIP = networkObj.containsKey("staticIP") ? networkObj["staticIP"] : networkObj["STATICIP"];
-      Serial.println("Updating staticIP to: " + String(newStaticIP));
-      networkConfig.staticIP = newStaticIP;
-      configChanged = true;
-    }
-    if (networkObj.containsKey("ip") || networkObj.containsKey("IP")) {
-      String newIP = networkObj.containsKey("ip") ? networkObj["ip"] : networkObj["IP"];
-      Serial.println("Updating IP to: " + newIP);
-      strcpy(networkConfig.ip, newIP.c_str());
-      configChanged = true;
+  snprintf(message, messageSize, "Button %d %s", id, changed ? "updated" : "unchanged");
+  return true;
+}
+
+bool applyButtonUpdate(int id, JsonObject button) {
+  ButtonConfig& config = buttonConfigs[id];
+  bool changed = false;
+  
+  Console.printf("Updating button %d:\n", id);
+  
+  if (button.containsKey("name") || button.containsKey("NAME")) {
+    const char* newName = (button.containsKey("name") ? button["name"] : button["NAME"]) | "";
+    if (updateConfigString(config.name, sizeof(config.name), newName)) {
+      Console.printf("  Name: %s\n", config.name);
+      changed = true;
     }
-    if (networkObj.containsKey("subnet") || networkObj.containsKey("SUBNET")) {
-      String newSubnet = networkObj.containsKey("subnet") ? networkObj["subnet"] : networkObj["SUBNET"];
-      Serial.println("Updating subnet to: " + newSubnet);
-      strcpy(networkConfig.subnet, newSubnet.c_str());
-      configChanged = true;
+  }
+  
+  if (button.containsKey("action") || button.containsKey("ACTION")) {
+    int newAction = button.containsKey("action") ? button["action"] : button["ACTION"];
+    if (newAction != config.action) {
+      Console.printf("  Action: %d\n", newAction);
+      config.action = (ActionType)newAction;
+      changed = true;
     }
-    if (networkObj.containsKey("gateway") || networkObj.containsKey("GATEWAY")) {
-      String newGateway = networkObj.containsKey("gateway") ? networkObj["gateway"] : networkObj["GATEWAY"];
-      Serial.println("Updating gateway to: " + newGateway);
-      strcpy(networkConfig.gateway, newGateway.c_str());
-      configChanged = true;
+  }
+  
+  if (button.containsKey("enabled") || button.containsKey("ENABLED")) {
+    bool newEnabled = button.containsKey("enabled") ? button["enabled"] : button["ENABLED"];
+    if (newEnabled != config.enabled) {
+      Console.printf("  Enabled: %d\n", newEnabled);
+      config.enabled = newEnabled;
+      changed = true;
     }
-  } else {
-    Serial.println("No network configuration provided - keeping existing settings");
   }
   
-  // Update button configurations (handle both lowercase and uppercase keys)
-  if (doc.containsKey("buttons") || doc.containsKey("BUTTONS")) {
-    Serial.println("Processing button configurations...");
-    JsonArray buttons = doc.containsKey("buttons") ? doc["buttons"] : doc["BUTTONS"];
-    Serial.println("Number of buttons to update: " + String(buttons.size()));
-    
-    for (JsonObject button : buttons) {
-      int id = button.containsKey("id") ? button["id"] : button["ID"];
-      if (id >= 0 && id < 8) {
-        Serial.println("Updating button " + String(id) + ":");
-        
-        if (button.containsKey("name") || button.containsKey("NAME")) {
-          String newName = button.containsKey("name") ? button["name"] : button["NAME"];
-          Serial.println("  Name: " + newName);
-          strcpy(buttonConfigs[id].name, newName.c_str());
-        } else {
-          // Keep existing name if not provided
-          Serial.println("  Name: keeping existing (" + String(buttonConfigs[id].name) + ")");
-        }
-        
-        if (button.containsKey("action") || button.containsKey("ACTION")) {
-          int newAction = button.containsKey("action") ? button["action"] : button["ACTION"];
-          Serial.println("  Action: " + String(newAction));
-          buttonConfigs[id].action = (ActionType)newAction;
-        } else {
-          Serial.println("  Action: keeping existing (" + String(buttonConfigs[id].action) + ")");
-        }
-        
-        if (button.containsKey("enabled") || button.containsKey("ENABLED")) {
-          bool newEnabled = button.containsKey("enabled") ? button["enabled"] : button["ENABLED"];
-          Serial.println("  Enabled: " + String(newEnabled));
-          buttonConfigs[id].enabled = newEnabled;
-        } else {
-          Serial.println("  Enabled: keeping existing (" + String(buttonConfigs[id].enabled) + ")");
-        }
-        
-        // Handle action configuration
-        if (button.containsKey("config") || button.containsKey("CONFIG")) {
-          JsonObject configObj = button.containsKey("config") ? button["config"] : button["CONFIG"];
-          String actionData;
-          serializeJson(configObj, actionData);
-          Serial.println("  Config: " + actionData);
-          strcpy(buttonConfigs[id].actionData, actionData.c_str());
-        } else {
-          Serial.println("  Config: keeping existing");
-        }
-        
-        configChanged = true;
-      } else {
-        Serial.println("Invalid button ID: " + String(id));
+  // Handle action configuration
+  if (button.containsKey("config") || button.containsKey("CONFIG")) {
+    JsonObject configObj = button.containsKey("config") ? button["config"] : button["CONFIG"];
+    char actionData[ACTION_DATA_MAX];
+    if (measureJson(configObj) >= sizeof(actionData)) {
+      Console.println("  Config: too large - keeping existing");
+    } else {
+      serializeJson(configObj, actionData, sizeof(actionData));
+      if (updateStoredString(config.actionData, actionData)) {
+        Console.printf("  Config: %s\n", config.actionData);
+        changed = true;
       }
     }
-  } else {
-    Serial.println("No button configuration provided - keeping existing settings");
   }
   
-  // Save configuration if anything changed
-  if (configChanged) {
-    Serial.println("Configuration changed - saving to flash...");
-    saveConfiguration();
-    Serial.println("Configuration saved successfully");
-    
-    // Validate and display updated configuration
-    validateConfiguration();
+  if (changed) {
+    markConfigDirty(CONFIG_DIRTY_BUTTON(id));
   } else {
-    Serial.println("No configuration changes detected");
+    Console.println("  No changes");
   }
+  return changed;
+}
+
+bool applyGestureUpdate(int id, JsonObject gesture) {
+  GestureBinding& binding = gestureBindings[id];
+  bool changed = false;
   
-  // Send response before potential restart
-  if (server.client()) {
-    server.send(200, "application/json", "{\"status\":\"ok\",\"message\":\"Configuration updated\"}");
-  } else {
-    sendJsonResponse("config_upload", "Configuration updated successfully");
+  if (gesture.containsKey("type")) {
+    GestureType newType = parseGestureType(gesture["type"] | "");
+    if (newType != binding.type) {
+      binding.type = newType;
+      changed = true;
+    }
+  }
+  if (gesture.containsKey("buttons")) {
+    uint8_t newButtons = 0;
+    for (JsonVariant button : gesture["buttons"].as<JsonArray>()) {
+      int b = button | -1;
+      if (b >= 0 && b < 8) newButtons |= 1 << b;
+    }
+    if (newButtons != binding.buttons) {
+      binding.buttons = newButtons;
+      changed = true;
+    }
   }
   
-  Serial.println("Configuration upload completed");
-  Serial.println("========================");
+  // Long-press and double-tap belong to one button, a chord needs at least two
+  int count = __builtin_popcount(binding.buttons);
+  if (binding.type != GESTURE_NONE && (binding.type == GESTURE_CHORD ? count < 2 : count != 1)) {
+    Console.printf("Gesture %d: %s needs %s - slot cleared\n", id, gestureName(8 + id),
+                   binding.type == GESTURE_CHORD ? "two or more buttons" : "exactly one button");
+    binding.type = GESTURE_NONE;
+    changed = true;
+  }
+  if (changed) {
+    Console.printf("Gesture %d: %s on buttons 0x%02X\n", id, gestureName(8 + id), binding.buttons);
+    markConfigDirty(CONFIG_DIRTY_BUTTON(8 + id));
+  }
   
-  // Restart if network config changed (after sending response)
-  if (networkChanged) {
-    Serial.println("Network configuration changed - restarting in 3 seconds...");
-    delay(1000); // Give time for response to be sent
-    Serial.println("Restarting in 2 seconds...");
-    delay(1000);
-    Serial.println("Restarting in 1 second...");
-    delay(1000);
-    Serial.println("Restarting now...");
-    ESP.restart();
+  // Name, action, enabled and config are stored exactly like a button's
+  return applyButtonUpdate(8 + id, gesture) || changed;
+}
+
+// Config Dirty Tracking Functions
+
+void markConfigDirty(uint32_t sections) {
+  configDirty |= sections;
+}
+
+bool updateConfigString(char* dest, size_t size, const char* value) {
+  if (strncmp(dest, value, size - 1) == 0) {
+    return false;
   }
+  strlcpy(dest, value, size);
+  return true;
 }
 
+// Config Store Functions
 
+bool updateStoredString(const char*& field, const char* value) {
+  if (strcmp(field, value) == 0) {
+    return false;
+  }
+  return storeConfigString(field, value);
+}
 
+bool storeConfigString(const char*& field, const char* value) {
+  // Caller holds the config lock, and value must not point into configStore.
+  // The common defaults need no storage; a value that fits the old copy overwrites it in place.
+  size_t length = strlen(value);
+  if (length == 0 || strcmp(value, "{}") == 0) {
+    field = length == 0 ? "" : "{}";
+    return true;
+  }
+  bool stored = field >= configStore && field < configStore + CONFIG_STORE_SIZE;
+  if (stored && strlen(field) >= length) {
+    memcpy((char*)field, value, length + 1);
+    return true;
+  }
+  
+  if (configStoreUsed + length + 1 > CONFIG_STORE_SIZE) {
+    // Count what compaction would keep before giving up the old value
+    const char** fields[ACTION_SLOTS + MAX_API_KEYS];
+    size_t count = collectConfigStoreFields(fields);
+    size_t live = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (fields[i] != &field) live += strlen(*fields[i]) + 1;
+    }
+    if (live + length + 1 > CONFIG_STORE_SIZE) {
+      Console.printf("ERROR: Config store full (%u bytes live, %u more needed)\n", (unsigned)live, (unsigned)length + 1);
+      return false;
+    }
+    field = "";
+    compactConfigStore();
+  }
+  
+  char* copy = configStore + configStoreUsed;
+  memcpy(copy, value, length + 1);
+  configStoreUsed += length + 1;
+  field = copy;
+  return true;
+}
 
+size_t collectConfigStoreFields(const char** fields[]) {
+  size_t count = 0;
+  for (int i = 0; i < ACTION_SLOTS; i++) {
+    fields[count++] = &buttonConfigs[i].actionData;
+  }
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    fields[count++] = &apiKeys[i].value;
+  }
+  
+  // Keep only the strings that live in the store, in address order
+  size_t stored = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (*fields[i] >= configStore && *fields[i] < configStore + CONFIG_STORE_SIZE) fields[stored++] = fields[i];
+  }
+  for (size_t i = 1; i < stored; i++) {
+    const char** field = fields[i];
+    size_t j = i;
+    for (; j > 0 && *fields[j - 1] > *field; j--) fields[j] = fields[j - 1];
+    fields[j] = field;
+  }
+  return stored;
+}
 
+void compactConfigStore() {
+  // Slide every live string down over the gaps; address order means nothing is overwritten before it moves
+  const char** fields[ACTION_SLOTS + MAX_API_KEYS];
+  size_t count = collectConfigStoreFields(fields);
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t size = strlen(*fields[i]) + 1;
+    char* dest = configStore + used;
+    if (dest != *fields[i]) memmove(dest, *fields[i], size);
+    *fields[i] = dest;
+    used += size;
+  }
+  Console.printf("Config store compacted: %u of %u bytes in use\n", (unsigned)used, (unsigned)CONFIG_STORE_SIZE);
+  configStoreUsed = used;
+}
 
+void resetConfigStore() {
+  for (int i = 0; i < ACTION_SLOTS; i++) {
+    buttonConfigs[i].actionData = "{}";
+  }
+  for (int i = 0; i < MAX_API_KEYS; i++) {
+    apiKeys[i].value = "";
+  }
+  configStoreUsed = 0;
+}
 
+// False when there was nothing to save or the save failed; on failure configDirty stays set, so the
+// next commit retries and the device stays awake rather than sleep away changes only held in RAM
+bool commitConfiguration() {
+  if (configDirty == 0) {
+    return false;
+  }
+  
+  uint32_t dirty = configDirty;
+  Console.println("Configuration changed - saving to flash...");
+  boostCpu(POWER_HOLD_CONFIG);
+  
+  // Recompile only what changed; device name/ID are baked into every webhook payload,
+  // a key only into the targets that reference it
+  lockConfig();
+  for (int i = 0; i < ACTION_SLOTS; i++) {
+    if ((dirty & (CONFIG_DIRTY_DEVICE | CONFIG_DIRTY_BUTTON(i))) ||
+        ((dirty & CONFIG_DIRTY_API_KEYS) && usesChangedApiKeys(i))) {
+      compileAction(i);
+    }
+  }
+  apiKeysChanged = 0;
+  rebuildGestureIndex();
+  unlockConfig();
+  
+  int64_t saveStart = esp_timer_get_time();
+  bool saved = saveConfiguration();
+  recordStage(METRIC_CONFIG_SAVE, esp_timer_get_time() - saveStart);
+  configGeneration++;
+  if (saved) {
+    configDirty = 0;
+    Console.println("Configuration saved successfully");
+  } else {
+    Console.println("ERROR: Configuration applied but not saved - will retry on the next change");
+  }
+  
+  // Validate and display updated configuration
+  validateConfiguration();
+  
+  // Pre-connect to any newly configured hosts
+  if (dirty & (CONFIG_DIRTY_BUTTONS | CONFIG_DIRTY_API_KEYS)) {
+    requestHttpPoolWarmup();
+  }
+  releaseCpu(POWER_HOLD_CONFIG);
+  return saved;
+}
 
 void validateConfiguration() {
   bool hasErrors = false;
   
   // Display current configuration for verification
-  Serial.println("=== CURRENT CONFIGURATION ===");
-  Serial.println("Device:");
-  Serial.println("  Name: " + String(deviceConfig.deviceName));
-  Serial.println("  Brightness: " + String(deviceConfig.brightness));
-  Serial.println("  Discoverable: " + String(deviceConfig.discoverable));
-  
-  Serial.println("Network:");
-  Serial.println("  SSID: " + String(networkConfig.ssid));
-  Serial.println("  Password: " + String(strlen(networkConfig.password) > 0 ? "***SET***" : "***EMPTY***"));
-  Serial.println("  Static IP: " + String(networkConfig.staticIP));
+  Console.println("=== CURRENT CONFIGURATION ===");
+  Console.println("Device:");
+  Console.printf("  Name: %s\n", deviceConfig.deviceName);
+  Console.printf("  Brightness: %d\n", deviceConfig.brightness);
+  Console.printf("  Discoverable: %d\n", deviceConfig.discoverable);
+  
+  Console.println("Network:");
+  Console.printf("  SSID: %s\n", networkConfig.ssid);
+  Console.printf("  Password: %s\n", strlen(networkConfig.password) > 0 ? "***SET***" : "***EMPTY***");
+  Console.printf("  Static IP: %d\n", networkConfig.staticIP);
   if (networkConfig.staticIP) {
-    Serial.println("  IP: " + String(networkConfig.ip));
-    Serial.println("  Subnet: " + String(networkConfig.subnet));
-    Serial.println("  Gateway: " + String(networkConfig.gateway));
+    Console.printf("  IP: %s\n", networkConfig.ip);
+    Console.printf("  Subnet: %s\n", networkConfig.subnet);
+    Console.printf("  Gateway: %s\n", networkConfig.gateway);
   }
   
-  Serial.println("Buttons:");
+  Console.println("Buttons:");
   for (int i = 0; i < 8; i++) {
-    Serial.println("  Button " + String(i) + ":");
-    Serial.println("    Name: " + String(buttonConfigs[i].name));
-    Serial.println("    Action: " + String(buttonConfigs[i].action));
-    Serial.println("    Enabled: " + String(buttonConfigs[i].enabled));
+    Console.printf("  Button %d:\n", i);
+    Console.printf("    Name: %s\n", buttonConfigs[i].name);
+    Console.printf("    Action: %d\n", buttonConfigs[i].action);
+    Console.printf("    Enabled: %d\n", buttonConfigs[i].enabled);
     if (strlen(buttonConfigs[i].actionData) > 2) { // More than just "{}"
-      Serial.println("    Config: " + String(buttonConfigs[i].actionData));
+      Console.printf("    Config: %s\n", buttonConfigs[i].actionData);
     }
   }
-  Serial.println("=============================");
+  for (int g = 0; g < MAX_GESTURES; g++) {
+    if (gestureBindings[g].type == GESTURE_NONE) continue;
+    Console.printf("  Gesture %d: %s on buttons 0x%02X -> %s (action %d%s)\n", g, gestureName(8 + g),
+                   gestureBindings[g].buttons, buttonConfigs[8 + g].name, buttonConfigs[8 + g].action,
+                   buttonConfigs[8 + g].enabled ? "" : ", disabled");
+  }
+  Console.println("=============================");
   
   // Validate network settings
   if (networkConfig.staticIP) {
     if (!isValidIP(networkConfig.ip)) {
-      Serial.println("ERROR: Invalid static IP address");
+      Console.println("ERROR: Invalid static IP address");
       hasErrors = true;
     }
     if (!isValidIP(networkConfig.gateway)) {
-      Serial.println("ERROR: Invalid gateway address");
+      Console.println("ERROR: Invalid gateway address");
       hasErrors = true;
     }
   }
   
-  // Validate button actions
-  for (int i = 0; i < 8; i++) {
-    if (buttonConfigs[i].action == ACTION_HTTP || buttonConfigs[i].action == ACTION_WEBHOOK) {
-      StaticJsonDocument<256> config;
-      deserializeJson(config, buttonConfigs[i].actionData);
-      const char* url = config["url"];
-      
-      if (strlen(url) > 0 && !isValidUrl(url)) {
-        Serial.println("ERROR: Invalid URL for button " + String(i));
-        hasErrors = true;
+  // Validate button and gesture actions
+  for (int i = 0; i < ACTION_SLOTS; i++) {
+    if (buttonConfigs[i].action != ACTION_NONE) {
+      // compileAction() only marks an action valid once its URL has been parsed
+      if (strlen(buttonConfigs[i].actionData) <= 2) continue;
+      for (int j = 0; j < compiledButtons[i].count; j++) {
+        if (!compiledButtons[i].actions[j]->valid) {
+          Console.printf("ERROR: Invalid URL for button %d action %d\n", i, j);
+          hasErrors = true;
+        }
       }
     }
   }
   
   if (hasErrors) {
-    Serial.println("Configuration validation failed - some features may not work");
+    Console.println("Configuration validation failed - some features may not work");
   } else {
-    Serial.println("Configuration validation passed");
+    Console.println("Configuration validation passed");
   }
 }
 
@@ -1128,64 +7485,496 @@ bool isValidIP(const char* ip) {
 }
 
 bool isValidUrl(const char* url) {
-  String urlStr = String(url);
-  return urlStr.startsWith("http://") || urlStr.startsWith("https://");
+  return strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0;
 }
 
-// API Key helper functions
-String getApiKey(const char* keyName) {
-  for (int i = 0; i < MAX_API_KEYS; i++) {
-    if (apiKeys[i].active && strcmp(apiKeys[i].name, keyName) == 0) {
-      return String(apiKeys[i].value);
-    }
-  }
-  return "";
+// API Key helper functions - callers hold the config lock, values move when the store compacts
+const char* getApiKey(const char* keyName) {
+  int slot = findApiKey(keyName, strlen(keyName));
+  return slot >= 0 ? apiKeys[slot].value : "";
 }
 
 void setApiKey(const char* keyName, const char* value) {
+  if (!isValidApiKeyName(keyName)) {
+    Console.printf("Invalid API key name '%s' - use letters, digits, '_' or '-'\n", keyName);
+    return;
+  }
+  if (strlen(value) >= API_KEY_VALUE_MAX) {
+    Console.printf("API key %s is longer than %u bytes - ignored\n", keyName, (unsigned)API_KEY_VALUE_MAX - 1);
+    return;
+  }
+  
   // First try to update existing key
-  for (int i = 0; i < MAX_API_KEYS; i++) {
-    if (apiKeys[i].active && strcmp(apiKeys[i].name, keyName) == 0) {
-      strcpy(apiKeys[i].value, value);
-      return;
+  int slot = findApiKey(keyName, strlen(keyName));
+  if (slot >= 0) {
+    if (updateStoredString(apiKeys[slot].value, value)) {
+      Console.printf("API key %s updated\n", keyName);
+      apiKeysChanged |= 1UL << slot;
+      markConfigDirty(CONFIG_DIRTY_API_KEYS);
     }
+    return;
   }
   
   // If not found, add new key
   for (int i = 0; i < MAX_API_KEYS; i++) {
     if (!apiKeys[i].active) {
-      strcpy(apiKeys[i].name, keyName);
-      strcpy(apiKeys[i].value, value);
+      if (!storeConfigString(apiKeys[i].value, value)) return;
+      strlcpy(apiKeys[i].name, keyName, sizeof(apiKeys[i].name));
       apiKeys[i].active = true;
+      rebuildApiKeyIndex();
+      Console.printf("API key %s added\n", keyName);
+      apiKeysChanged |= 1UL << i;
+      markConfigDirty(CONFIG_DIRTY_API_KEYS);
       return;
     }
   }
+  Console.printf("No room for API key %s (%d keys max)\n", keyName, MAX_API_KEYS);
 }
 
 void removeApiKey(const char* keyName) {
+  int slot = findApiKey(keyName, strlen(keyName));
+  if (slot < 0) return;
+  
+  apiKeys[slot].active = false;
+  strcpy(apiKeys[slot].name, "");
+  apiKeys[slot].value = "";
+  rebuildApiKeyIndex();
+  Console.printf("API key %s removed\n", keyName);
+  apiKeysChanged |= 1UL << slot;
+  markConfigDirty(CONFIG_DIRTY_API_KEYS);
+}
+
+bool isValidApiKeyName(const char* name) {
+  size_t length = strlen(name);
+  if (length == 0 || length >= sizeof(ApiKeyEntry::name)) return false;
+  for (size_t i = 0; i < length; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-') return false;
+  }
+  return true;
+}
+
+uint32_t apiKeyHash(const char* name, size_t length) {
+  // FNV-1a
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)name[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+int findApiKey(const char* name, size_t length) {
+  // name need not be terminated - templates look keys up straight from the action config
+  uint32_t hash = apiKeyHash(name, length);
+  for (int probe = 0; probe < API_KEY_INDEX_SIZE; probe++) {
+    int slot = apiKeyIndex[(hash + probe) & (API_KEY_INDEX_SIZE - 1)];
+    if (slot < 0) return -1;
+    const ApiKeyEntry& entry = apiKeys[slot];
+    if (entry.hash == hash && strncmp(entry.name, name, length) == 0 && entry.name[length] == '\0') {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void rebuildApiKeyIndex() {
+  // Linear probing; rebuilt whole on add or remove, which keeps removal free of tombstones
+  memset(apiKeyIndex, -1, sizeof(apiKeyIndex));
   for (int i = 0; i < MAX_API_KEYS; i++) {
-    if (apiKeys[i].active && strcmp(apiKeys[i].name, keyName) == 0) {
-      apiKeys[i].active = false;
-      strcpy(apiKeys[i].name, "");
-      strcpy(apiKeys[i].value, "");
-      return;
+    ApiKeyEntry& entry = apiKeys[i];
+    if (!entry.active) continue;
+    entry.hash = apiKeyHash(entry.name, strlen(entry.name));
+    uint32_t bucket = entry.hash & (API_KEY_INDEX_SIZE - 1);
+    while (apiKeyIndex[bucket] >= 0) {
+      bucket = (bucket + 1) & (API_KEY_INDEX_SIZE - 1);
     }
+    apiKeyIndex[bucket] = i;
   }
 }
 
+int expandKeyReferences(const char* source, char* output, size_t size, CompiledAction& action) {
+  // {{key:NAME}} becomes the key's value at compile time, so a press only copies the rendered text.
+  // Returns the length, or -1 if the result does not fit or a key is missing
+  size_t length = 0;
+  const char* cursor = source;
+  
+  while (*cursor) {
+    if (strncmp(cursor, "{{key:", 6) == 0) {
+      const char* name = cursor + 6;
+      const char* end = strstr(name, "}}");
+      if (end != NULL) {
+        int slot = findApiKey(name, end - name);
+        if (slot < 0) {
+          Console.printf("Unknown API key '%.*s' - target disabled until it is added\n", (int)(end - name), name);
+          action.keyMissing = true;
+          return -1;
+        }
+        
+        size_t valueLength = strlen(apiKeys[slot].value);
+        if (length + valueLength >= size) return -1;
+        memcpy(output + length, apiKeys[slot].value, valueLength);
+        length += valueLength;
+        action.keyRefs |= 1UL << slot;
+        cursor = end + 2;
+        continue;
+      }
+    }
+    
+    if (length + 1 >= size) return -1;
+    output[length++] = *cursor++;
+  }
+  
+  output[length] = '\0';
+  return length;
+}
+
+bool usesChangedApiKeys(int slot) {
+  // A missing key may be the one just added, so those targets always get another try
+  const CompiledButton& button = compiledButtons[slot];
+  for (int i = 0; i < button.count; i++) {
+    if ((button.actions[i]->keyRefs & apiKeysChanged) || button.actions[i]->keyMissing) return true;
+  }
+  return false;
+}
+
 // Power Management Functions
 
-// Power saving configuration removed for testing
+void boostCpu(PowerHold reason) {
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  powerHolds[reason]++;
+  applyCpuFrequency(criticalBattery ? CPU_FREQ_BOOST_LOW_POWER : CPU_FREQ_BOOST);
+  
+  // Modem sleep would hold the response back until the next beacon
+  applyWiFiPowerSave(WIFI_PS_NONE);
+  xSemaphoreGive(powerMutex);
+}
+
+void releaseCpu(PowerHold reason) {
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  if (powerHolds[reason] > 0) {
+    powerHolds[reason]--;
+  }
+  powerLastHold = millis();
+  xSemaphoreGive(powerMutex);
+}
+
+bool cpuBoosted() {
+  for (int i = 0; i < POWER_HOLD_COUNT; i++) {
+    if (powerHolds[i] > 0) return true;
+  }
+  return false;
+}
+
+void updatePowerGovernor() {
+  if (cpuBoosted() || millis() - powerLastHold < POWER_BOOST_LINGER) {
+    return;
+  }
+  
+  // Re-checked under the lock - a task may have boosted since
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  if (!cpuBoosted()) {
+    applyCpuFrequency(WiFi.getMode() == WIFI_OFF ? CPU_FREQ_RADIO_OFF : CPU_FREQ_IDLE);
+    applyWiFiPowerSave(criticalBattery ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+  }
+  xSemaphoreGive(powerMutex);
+}
+
+void applyCpuFrequency(uint32_t mhz) {
+  if (cpuFrequency == mhz) {
+    return;
+  }
+  if (setCpuFrequencyMhz(mhz)) {
+    cpuFrequency = mhz;
+  } else {
+    Console.printf("CPU frequency %luMHz rejected\n", (unsigned long)mhz);
+  }
+}
+
+void applyWiFiPowerSave(wifi_ps_type_t mode) {
+  // Only meaningful on a joined station
+  if (!wifiConnected || wifiPowerSave == mode) {
+    return;
+  }
+  if (WiFi.setSleep(mode)) {
+    wifiPowerSave = mode;
+  }
+}
+
+// Critical power caps the boost clock, uses the deepest modem sleep and shows STATUS_LOW_POWER
+void setCriticalPower(bool critical) {
+  if (critical == criticalBattery) {
+    return;
+  }
+  criticalBattery = critical;
+  Console.printf("Power %s\n", critical ? "critical - entering low power mode" : "recovered - leaving low power mode");
+  
+  if (critical) {
+    setStatusLED(STATUS_LOW_POWER);
+  } else if (currentStatusMode == STATUS_LOW_POWER) {
+    setStatusLED(wifiConnected ? STATUS_ACTIVE : STATUS_CONNECTING);
+  }
+  
+  // Takes effect on the next idle drop, or right away when nothing is running
+  powerLastHold = millis() - POWER_BOOST_LINGER;
+}
+
+// Sleep Functions
+
+bool sleepAllowed() {
+  if (deviceConfig.sleepTimeout == 0 || batteryLevel == BATTERY_EXTERNAL) {
+    return false;
+  }
+  if (millis() - lastActivity < deviceConfig.sleepTimeout * 1000UL) {
+    return false;
+  }
+  
+  // Anything in flight, buffered or being watched would be lost or stalled
+  if (configMode || restartAt != 0 || configDirty != 0 || pressHoldActive || cpuBoosted() || events.count() > 0) {
+    return false;
+  }
+  if (otaSession.active || otaPendingVerify) {
+    return false;
+  }
+  if (actionQueue == NULL || uxQueueMessagesWaiting(actionQueue) > 0 || retryCount > 0 || retryQueueDirty) {
+    return false;
+  }
+  for (int i = 0; i < WEBHOOK_BATCH_SLOTS; i++) {
+    if (webhookBatches[i].active) return false;
+  }
+  return true;
+}
+
+void updateSleep() {
+  if (sleepAllowed()) {
+    enterSleep(deviceConfig.deepSleep);
+  }
+}
+
+void enterSleep(bool deep) {
+  Console.printf("Idle for %us - entering %s sleep\n", deviceConfig.sleepTimeout, deep ? "deep" : "light");
+  StaticJsonDocument<96> doc;
+  doc["type"] = "sleep";
+  doc["mode"] = deep ? "deep" : "light";
+  doc["timestamp"] = millis();
+  Console.print("EVENT:");
+  serializeJson(doc, Console);
+  Console.println();
+  Serial.flush();
+  
+  allLEDsOff();
+  digitalWrite(STATUS_LED_PIN, LOW);
+  
+  if (deep) {
+    // The radio does not survive deep sleep; pooled sockets are reopened (TLS resumed) after the reboot
+    WiFi.mode(WIFI_OFF);
+    delay(SLEEP_WIFI_SETTLE);
+    
+    // Digital pullups are off in deep sleep - hold the buttons high from the RTC domain
+    uint64_t wakePins = 0;
+    for (int i = 0; i < 8; i++) {
+      wakePins |= 1ULL << buttonGpio(i);
+      rtc_gpio_pullup_en(buttonGpio(i));
+      rtc_gpio_pulldown_dis(buttonGpio(i));
+    }
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON);
+    esp_sleep_enable_ext1_wakeup(wakePins, ESP_EXT1_WAKEUP_ANY_LOW);
+    esp_deep_sleep_start();
+  }
+  
+  // Light sleep keeps the station associated in max modem sleep, which only listens for every few beacons,
+  // so a wake press goes out without reassociating. Pooled sockets the server dropped meanwhile reconnect
+  applyWiFiPowerSave(WIFI_PS_MAX_MODEM);
+  // The wake level would also fire buttonEdgeISR over and over while a button is held after waking -
+  // mask the interrupts while the pins are armed as level wake sources
+  for (int i = 0; i < 8; i++) {
+    gpio_intr_disable(buttonGpio(i));
+    gpio_wakeup_enable(buttonGpio(i), GPIO_INTR_LOW_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+  unsigned long sleptAt = millis();
+  esp_light_sleep_start();
+  
+  // The wake level replaced the edge interrupts - restore them before looking at the pins
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  uint8_t pressed = 0;
+  int64_t wokeUs = esp_timer_get_time();
+  for (int i = 0; i < 8; i++) {
+    gpio_wakeup_disable(buttonGpio(i));
+    gpio_set_intr_type(buttonGpio(i), GPIO_INTR_ANYEDGE);
+    gpio_intr_enable(buttonGpio(i));
+    if (digitalRead(buttonPins[i]) == LOW) {
+      pressed |= 1 << i;
+    } else {
+      // No edges were seen while masked - a release then must not leave the button held
+      applyButtonEdge(i, HIGH, wokeUs);
+    }
+  }
+  Console.printf("Woke from light sleep after %lus (buttons 0x%02X)\n", (millis() - sleptAt) / 1000, pressed);
+  
+  // RAM survived, so the compiled actions are ready - the radio only has to come back if the AP dropped us
+  wakeNetworkDeadline = millis() + SLEEP_WAKE_NETWORK_WAIT;
+  replayWakePresses(pressed);
+  if (wifiConnected) {
+    applyWiFiPowerSave(criticalBattery ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+    lastActivity = millis();
+  } else {
+    resumeNetworkAfterSleep();
+  }
+}
+
+void resumeNetworkAfterSleep() {
+  // Stale events from before the sleep must not count against the new attempt
+  wifiConnected = false;
+  wifiEventDisconnected = false;
+  wifiEventGotIp = false;
+  
+  WiFi.mode(WIFI_STA);
+  applyStaticIP();
+  setStatusLED(STATUS_CONNECTING);
+  beginWiFiAttempt();
+  lastActivity = millis();
+}
+
+void replayWakePresses(uint8_t buttonMask) {
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < 8; i++) {
+    if (!(buttonMask & (1 << i))) continue;
+    
+    // The wake level is the debounce - fire now instead of waiting out BUTTON_HOLD_TIME
+    lastButtonPress[i] = (unsigned long)(now / 1000) - BUTTON_DEBOUNCE - 1;
+    applyButtonEdge(i, LOW, now);
+    fireButton(i, now);
+    
+    // Released before we got here - resync so the next press registers its edge
+    if (digitalRead(buttonPins[i]) == HIGH) {
+      applyButtonEdge(i, HIGH, now);
+    }
+  }
+}
+
+void waitForWakeNetwork() {
+  // A press that woke the device waits for the fast reconnect instead of failing offline
+  while (!wifiConnected && wakeNetworkDeadline != 0 && (long)(millis() - wakeNetworkDeadline) < 0) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+// Battery Monitoring Functions
+
+void startBatteryMonitor() {
+  // Seed the filter synchronously so the first telemetry and webhook carry a real reading
+  sampleBattery();
+  Console.printf("Battery %.2fV (%u%%)\n", batteryVoltage, batteryPercent);
+  
+  BaseType_t result = xTaskCreate(batteryTask, "battery", BATTERY_TASK_STACK, NULL, 1, &batteryTaskHandle);
+  if (result != pdPASS) {
+    Console.println("ERROR: Failed to start battery monitor task");
+  }
+}
+
+void batteryTask(void* parameter) {
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(BATTERY_SAMPLE_INTERVAL));
+    sampleBattery();
+  }
+}
+
+void sampleBattery() {
+  // ADC2 reads can fail or spike while WiFi transmits - sort the burst and average the middle
+  uint32_t readings[BATTERY_OVERSAMPLE];
+  for (int i = 0; i < BATTERY_OVERSAMPLE; i++) {
+    uint32_t value = analogReadMilliVolts(BATTERY_PIN);
+    int j = i;
+    for (; j > 0 && readings[j - 1] > value; j--) {
+      readings[j] = readings[j - 1];
+    }
+    readings[j] = value;
+  }
+  
+  uint32_t sum = 0;
+  for (int i = BATTERY_TRIM; i < BATTERY_OVERSAMPLE - BATTERY_TRIM; i++) {
+    sum += readings[i];
+  }
+  float volts = sum * BATTERY_DIVIDER_RATIO / ((BATTERY_OVERSAMPLE - 2 * BATTERY_TRIM) * 1000.0f);
+  
+  float filtered = batterySampled ? batteryVoltage + BATTERY_EMA_ALPHA * (volts - batteryVoltage) : volts;
+  batteryVoltage = filtered;
+  batteryPercent = batteryPercentFor(filtered);
+  batterySampled = true;
+}
 
-// Activity tracking removed for testing
+// Piecewise-linear over BATTERY_CURVE_VOLTS, highest point first
+uint8_t batteryPercentFor(float volts) {
+  if (volts >= BATTERY_CURVE_VOLTS[0]) {
+    return BATTERY_CURVE_PERCENT[0];
+  }
+  for (int i = 1; i < BATTERY_CURVE_POINTS; i++) {
+    if (volts >= BATTERY_CURVE_VOLTS[i]) {
+      float span = BATTERY_CURVE_VOLTS[i - 1] - BATTERY_CURVE_VOLTS[i];
+      float fraction = (volts - BATTERY_CURVE_VOLTS[i]) / span;
+      return BATTERY_CURVE_PERCENT[i] + fraction * (BATTERY_CURVE_PERCENT[i - 1] - BATTERY_CURVE_PERCENT[i]) + 0.5f;
+    }
+  }
+  return 0;
+}
 
-// Power management functions removed for testing
+void updateBatteryPolicy() {
+  float volts = batteryVoltage;
+  uint8_t percent = batteryPercent;
+  
+  // Thresholds apply on the way down, recovery needs the hysteresis margin on top
+  BatteryLevel level = batteryLevel;
+  if (volts < BATTERY_ABSENT_VOLTAGE) {
+    level = BATTERY_EXTERNAL;
+  } else if (percent <= BATTERY_CRITICAL_PERCENT) {
+    level = BATTERY_CRITICAL;
+  } else if (percent <= BATTERY_LOW_PERCENT) {
+    if (level != BATTERY_CRITICAL || percent > BATTERY_CRITICAL_PERCENT + BATTERY_HYSTERESIS_PERCENT) {
+      level = BATTERY_LOW;
+    }
+  } else if (level == BATTERY_EXTERNAL || percent > BATTERY_LOW_PERCENT + BATTERY_HYSTERESIS_PERCENT) {
+    level = BATTERY_OK;
+  } else if (level == BATTERY_CRITICAL) {
+    level = BATTERY_LOW;  // Well clear of critical, but not yet of low
+  }
+  
+  if (level == batteryLevel) {
+    return;
+  }
+  batteryLevel = level;
+  
+  ledPowerScale = level == BATTERY_CRITICAL ? 25 : (level == BATTERY_LOW ? 50 : 100);
+  telemetryStretch = level == BATTERY_CRITICAL ? 12 : (level == BATTERY_LOW ? 4 : 1);
+  setCriticalPower(level == BATTERY_CRITICAL);
+  
+  StaticJsonDocument<128> doc;
+  doc["type"] = "battery";
+  doc["level"] = batteryLevelName(level);
+  doc["voltage"] = volts;
+  doc["percent"] = percent;
+  doc["timestamp"] = millis();
+  
+  Console.print("EVENT:");
+  serializeJson(doc, Console);
+  Console.println();
+  publishEvent("battery", doc);
+}
 
-// Deep sleep function removed for testing
+const char* batteryLevelName(BatteryLevel level) {
+  switch (level) {
+    case BATTERY_OK: return "ok";
+    case BATTERY_LOW: return "low";
+    case BATTERY_CRITICAL: return "critical";
+    default: return "external";
+  }
+}
 
 // Status LED Management Functions
 
 void setStatusLED(StatusLedMode mode) {
+  // Low power stays visible over the normal connected state
+  if (criticalBattery && mode == STATUS_ACTIVE) {
+    mode = STATUS_LOW_POWER;
+  }
   currentStatusMode = mode;
   lastStatusBlink = millis();
   
@@ -21,12 +21,15 @@ import * as fs from 'fs';
 import { SerialService } from './services/SerialService';
 import { ConfigService } from './services/ConfigService';
 import { DiscoveryService } from './services/DiscoveryService';
+import { FleetService } from './services/FleetService';
 
 class PatcomApp {
   private mainWindow: BrowserWindow | null = null;
   private serialService = new SerialService();
   private configService = new ConfigService();
   private discoveryService = new DiscoveryService();
+  private fleetService = new FleetService(this.discoveryService,
+    (config) => this.serialService.transformConfigForArduino(config, true));
   private iconPath: string = '';
 
   constructor() {
@@ -302,7 +305,6 @@ class PatcomApp {
       try {
         console.log('[MAIN] Getting config from ConfigService...');
         const config = this.configService.getConfig();
-        console.log('[MAIN] Config retrieved:', config);
         console.log('[MAIN] Config type:', typeof config);
         console.log('[MAIN] Config keys:', config ? Object.keys(config) : 'null/undefined');
         
@@ -350,14 +352,20 @@ class PatcomApp {
       return this.discoveryService.getDiscoveredDevices();
     });
 
-    ipcMain.handle('sync-all-devices', async () => {
+    // Both go through the fleet sync: read each device, send only the delta, in parallel
+    ipcMain.handle('sync-all-devices', async (_event, options) => {
       const config = this.configService.getConfig();
-      this.discoveryService.syncAllDevices(config);
+      return await this.fleetService.syncFleet(config, undefined, options);
     });
 
-    ipcMain.handle('sync-to-device', async (_event, deviceId) => {
+    ipcMain.handle('sync-to-device', async (_event, deviceId, options) => {
       const config = this.configService.getConfig();
-      this.discoveryService.syncConfigToDevice(deviceId, config);
+      const [result] = await this.fleetService.syncFleet(config, [deviceId], options);
+      return result;
+    });
+
+    ipcMain.handle('rollout-firmware', async (_event, imagePath, deviceIds, options) => {
+      return await this.fleetService.rolloutFirmware(imagePath, deviceIds, options);
     });
 
     ipcMain.handle('get-device-config', async (_event, deviceId) => {
@@ -423,6 +431,14 @@ class PatcomApp {
     this.discoveryService.on('config-update-ack', (ack) => {
       this.mainWindow?.webContents.send('config-update-ack', ack);
     });
+
+    this.fleetService.on('fleet-sync-progress', (result) => {
+      this.mainWindow?.webContents.send('fleet-sync-progress', result);
+    });
+
+    this.fleetService.on('firmware-rollout-progress', (result) => {
+      this.mainWindow?.webContents.send('firmware-rollout-progress', result);
+    });
   }
 
   // Menu handlers
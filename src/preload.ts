@@ -16,8 +16,9 @@ interface ElectronAPI {
   // Network discovery operations
   discoverDevices: () => Promise<void>;
   getDiscoveredDevices: () => Promise<any[]>;
-  syncAllDevices: () => Promise<void>;
-  syncToDevice: (deviceId: string) => Promise<void>;
+  syncAllDevices: (options?: any) => Promise<any[]>;
+  syncToDevice: (deviceId: string, options?: any) => Promise<any>;
+  rolloutFirmware: (imagePath: string, deviceIds?: string[], options?: any) => Promise<any[]>;
   getDeviceConfig: (deviceId: string) => Promise<any>;
 
   // App info
@@ -47,8 +48,9 @@ const electronAPIImpl: ElectronAPI = {
   // Discovery operations
   discoverDevices: () => ipcRenderer.invoke('discover-devices'),
   getDiscoveredDevices: () => ipcRenderer.invoke('get-discovered-devices'),
-  syncAllDevices: () => ipcRenderer.invoke('sync-all-devices'),
-  syncToDevice: (deviceId) => ipcRenderer.invoke('sync-to-device', deviceId),
+  syncAllDevices: (options) => ipcRenderer.invoke('sync-all-devices', options),
+  syncToDevice: (deviceId, options) => ipcRenderer.invoke('sync-to-device', deviceId, options),
+  rolloutFirmware: (imagePath, deviceIds, options) => ipcRenderer.invoke('rollout-firmware', imagePath, deviceIds, options),
   getDeviceConfig: (deviceId) => ipcRenderer.invoke('get-device-config', deviceId),
 
   // App utilities
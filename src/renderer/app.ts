@@ -572,6 +572,62 @@ class PatcomApp {
         `;
         break;
         
+      case 'mqtt':
+        configHTML = `
+          <div class="space-y-3">
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Broker</label>
+              <input type="text" class="material-input text-sm action-url" placeholder="mqtt://broker.local:1883">
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Topic</label>
+              <input type="text" class="material-input text-sm action-topic" placeholder="patcom/button/${buttonIndex}">
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">QoS</label>
+              <select class="material-select text-sm action-qos">
+                <option value="0">0 - At most once</option>
+                <option value="1">1 - At least once</option>
+              </select>
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Retain</label>
+              <select class="material-select text-sm action-retain">
+                <option value="false">No</option>
+                <option value="true">Yes</option>
+              </select>
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Username</label>
+              <input type="text" class="material-input text-sm action-username">
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Password</label>
+              <input type="password" class="material-input text-sm action-password">
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Payload</label>
+              <textarea class="material-input text-sm action-payload" rows="2" placeholder='{"button": {{button}}, "battery": {{battery}}}'></textarea>
+            </div>
+          </div>
+        `;
+        break;
+        
+      case 'udp':
+        configHTML = `
+          <div class="space-y-3">
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Target</label>
+              <input type="text" class="material-input text-sm action-url" placeholder="udp://192.168.1.50:7000">
+            </div>
+            <div>
+              <label class="block text-xs font-medium text-gray-600 mb-1">Payload</label>
+              <textarea class="material-input text-sm action-payload" rows="2" placeholder="/cue/{{button}}/go"></textarea>
+            </div>
+          </div>
+        `;
+        break;
+        
       case 'script':
         configHTML = `
           <div class="space-y-3">
@@ -18,6 +18,7 @@ export class ConfigService {
         config: {},
         enabled: true
       })),
+      gestures: [],
       network: {
         ssid: '',
         password: '',
@@ -35,6 +36,12 @@ export class ConfigService {
         deviceType: 0,
         discoverable: true,
         autoSync: false,
+        persistRetries: false,
+        sleepTimeout: 300,
+        deepSleep: false,
+        longPressMs: 600,
+        doubleTapMs: 300,
+        chordWindowMs: 80,
         configServerUrl: ''
       },
       apiKeys: {},
@@ -44,15 +51,13 @@ export class ConfigService {
 
   getConfig(): ConfigData {
     console.log('[CONFIG-SERVICE] getConfig() called');
-    console.log('[CONFIG-SERVICE] Current configData:', this.configData);
     console.log('[CONFIG-SERVICE] ConfigData keys:', Object.keys(this.configData));
-    console.log('[CONFIG-SERVICE] Network section:', this.configData.network);
+    console.log('[CONFIG-SERVICE] Network SSID:', this.configData.network.ssid);
     console.log('[CONFIG-SERVICE] Device section:', this.configData.device);
     console.log('[CONFIG-SERVICE] Buttons section length:', this.configData.buttons.length);
     
-    const configCopy = { ...this.configData };
-    console.log('[CONFIG-SERVICE] Returning config copy:', configCopy);
-    return configCopy;
+    // The whole config is never printed: it carries the WiFi password and the API keys
+    return { ...this.configData };
   }
 
   updateConfig(newConfig: Partial<ConfigData>): ConfigData {
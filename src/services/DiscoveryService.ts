@@ -1,7 +1,8 @@
 import * as dgram from 'dgram';
+import * as http from 'http';
 import * as os from 'os';
 import { EventEmitter } from 'events';
-import { DiscoveredDevice, ConfigData } from '../types';
+import { DiscoveredDevice, ConfigUpdateAck } from '../types';
 
 export class DiscoveryService extends EventEmitter {
   private discoverySocket: dgram.Socket | null = null;
@@ -9,6 +10,7 @@ export class DiscoveryService extends EventEmitter {
   private discoveredDevices = new Map<string, DiscoveredDevice>();
   private readonly DISCOVERY_PORT = 12345;
   private readonly CONFIG_PORT = 12346;
+  readonly UDP_PACKET_MAX = 1460;  // Largest request the firmware accepts on the config port
 
   initialize(): void {
     this.setupDiscoveryService();
@@ -59,6 +61,8 @@ export class DiscoveryService extends EventEmitter {
         uptime: message.uptime,
         configHash: message.config_hash,
         rssi: message.wifi_rssi,
+        bssid: message.bssid || undefined,
+        otaState: message.ota_state,
         lastSeen: Date.now()
       };
       
@@ -77,12 +81,16 @@ export class DiscoveryService extends EventEmitter {
         source: rinfo.address
       });
     } else if (message.type === 'config_update_response') {
-      this.emit('config-update-ack', {
+      const ack: ConfigUpdateAck = {
         deviceId: message.device_id || 'unknown',
         success: message.success,
         message: message.message,
-        configHash: message.config_hash
-      });
+        configHash: message.config_hash,
+        etag: message.etag,
+        conflict: message.conflict === true,
+        restart: message.restart === true
+      };
+      this.emit('config-update-ack', ack);
     }
   }
 
@@ -127,33 +135,47 @@ export class DiscoveryService extends EventEmitter {
     return Array.from(this.discoveredDevices.values());
   }
 
-  syncConfigToDevice(deviceId: string, configData: ConfigData): void {
+  // set_config with an acknowledgement; ifMatch makes the device refuse it if its config moved on
+  sendConfigUpdate(deviceId: string, update: any, ifMatch?: string, timeoutMs = 5000): Promise<ConfigUpdateAck> {
     const device = this.discoveredDevices.get(deviceId);
     if (!device) {
-      throw new Error('Device not found');
+      return Promise.reject(new Error('Device not found'));
     }
 
-    const configRequest = JSON.stringify({
+    const request = JSON.stringify({
       type: 'set_config',
-      device_id: device.deviceId,
-      ...configData
+      device_id: deviceId,
+      ...(ifMatch ? { if_match: ifMatch } : {}),
+      ...update
     });
-    
-    this.configSocket!.send(configRequest, this.CONFIG_PORT, device.ip, (err) => {
-      if (err) {
-        console.error('Config sync error for', device.deviceName, ':', err);
-      } else {
-        console.log('Config synced to', device.deviceName);
-      }
-    });
-  }
-
-  syncAllDevices(configData: ConfigData): void {
-    console.log('Syncing configuration to all discovered devices...');
-    
-    for (const [deviceId] of this.discoveredDevices) {
-      this.syncConfigToDevice(deviceId, configData);
+    if (Buffer.byteLength(request) > this.UDP_PACKET_MAX) {
+      return Promise.reject(new Error('Config update does not fit one datagram'));
     }
+
+    return new Promise((resolve, reject) => {
+      const timeout = setTimeout(() => {
+        this.off('config-update-ack', handler);
+        reject(new Error('Config update timeout'));
+      }, timeoutMs);
+
+      const handler = (ack: ConfigUpdateAck) => {
+        if (ack.deviceId === deviceId) {
+          clearTimeout(timeout);
+          this.off('config-update-ack', handler);
+          resolve(ack);
+        }
+      };
+
+      this.on('config-update-ack', handler);
+
+      this.configSocket!.send(request, this.CONFIG_PORT, device.ip, (err) => {
+        if (err) {
+          clearTimeout(timeout);
+          this.off('config-update-ack', handler);
+          reject(err);
+        }
+      });
+    });
   }
 
   async getDeviceConfig(deviceId: string): Promise<any> {
@@ -167,7 +189,7 @@ export class DiscoveryService extends EventEmitter {
       device_id: deviceId
     });
     
-    return new Promise((resolve, reject) => {
+    const config = await new Promise<any>((resolve, reject) => {
       const timeout = setTimeout(() => {
         reject(new Error('Config request timeout'));
       }, 5000);
@@ -190,6 +212,36 @@ export class DiscoveryService extends EventEmitter {
         }
       });
     });
+
+    // A config that does not fit one datagram comes back as a stub: read the full one over HTTP
+    if (config.too_large || config.use_http) {
+      return this.fetchConfigOverHttp(device.ip);
+    }
+    return config;
+  }
+
+  private fetchConfigOverHttp(ip: string): Promise<any> {
+    return new Promise((resolve, reject) => {
+      const request = http.get({ host: ip, port: 80, path: '/api/config', timeout: 5000 }, response => {
+        const chunks: Buffer[] = [];
+        response.on('data', chunk => chunks.push(chunk));
+        response.on('end', () => {
+          if (response.statusCode !== 200) {
+            reject(new Error(`GET /api/config returned ${response.statusCode}`));
+            return;
+          }
+          try {
+            const config = JSON.parse(Buffer.concat(chunks).toString());
+            resolve({ ...config, etag: String(response.headers.etag || config.etag || '') });
+          } catch (error) {
+            reject(error);
+          }
+        });
+      });
+
+      request.on('timeout', () => request.destroy(new Error('Config request timeout')));
+      request.on('error', reject);
+    });
   }
 
   cleanup(): void {
@@ -0,0 +1,432 @@
+import * as http from 'http';
+import * as fs from 'fs';
+import * as crypto from 'crypto';
+import { EventEmitter } from 'events';
+import { DiscoveryService } from './DiscoveryService';
+import {
+  ConfigData, DiscoveredDevice, FirmwareRolloutOptions, FirmwareRolloutResult, FleetSyncOptions, FleetSyncResult
+} from '../types';
+
+interface DeviceSnapshot {
+  config: any;
+  etag: string;
+}
+
+interface DeliveredKeys {
+  revision: string;
+  names: string[];              // Names only - a name that is gone is sent empty to remove it on the device
+}
+
+interface HttpResult {
+  status: number;
+  etag: string;
+  body: any;
+}
+
+interface FirmwareImage {
+  data: Buffer;
+  sha256: string;               // Of the whole file, checked by the device as it streams in
+  version: string;              // From the image's esp_app_desc_t, empty if it has none
+  elfSha256: string;            // Likewise - the device reports both for an image it rolled back
+}
+
+// Pushes one configuration to every discovered device at once. Each device is read first and only
+// the settings that differ are sent, guarded by the ETag of what was read, so a device edited in
+// between is retried instead of overwritten. Only devices whose network settings changed restart.
+// Firmware goes out the same way, in stages: canaries first, then a few devices per access point.
+export class FleetService extends EventEmitter {
+  private readonly DEFAULT_CONCURRENCY = 8;
+  private readonly DEFAULT_TIMEOUT = 5000;
+  private readonly DEFAULT_PER_ACCESS_POINT = 2;
+  private readonly DEFAULT_CANARY = 1;
+  private readonly DEFAULT_VERIFY_TIMEOUT = 120000;   // Device-side rollback fires after 90s
+  private readonly UPLOAD_TIMEOUT = 30000;
+  private readonly POLL_INTERVAL = 2000;
+  private readonly APP_DESC_OFFSET = 32;              // esp_app_desc_t follows the image and first segment headers
+  private readonly APP_DESC_MAGIC = 0xABCD5432;
+
+  // API keys cannot be read back, so the revision and names of the key set last written to each device
+  // are kept here: keys go out once after they change, not with every sync
+  private deliveredKeys = new Map<string, DeliveredKeys>();
+
+  constructor(
+    private discoveryService: DiscoveryService,
+    private transformConfig: (configData: ConfigData) => any
+  ) {
+    super();
+  }
+
+  async syncFleet(configData: ConfigData, deviceIds?: string[], options: FleetSyncOptions = {}): Promise<FleetSyncResult[]> {
+    const devices = this.discoveryService.getDiscoveredDevices()
+      .filter(device => !deviceIds || deviceIds.includes(device.deviceId));
+    const target = this.transformConfig(configData);
+    const keyRevision = this.keyRevision(target.apiKeys);
+    const concurrency = Math.max(1, options.concurrency || this.DEFAULT_CONCURRENCY);
+    console.log('[FLEET] Syncing', devices.length, 'devices,', concurrency, 'at a time');
+
+    const results: FleetSyncResult[] = new Array(devices.length);
+    let next = 0;
+    const worker = async () => {
+      while (next < devices.length) {
+        const index = next++;
+        results[index] = await this.syncDevice(devices[index], target, keyRevision, options);
+        this.emit('fleet-sync-progress', results[index]);
+      }
+    };
+    await Promise.all(Array.from({ length: Math.min(concurrency, devices.length) }, worker));
+
+    const updated = results.filter(result => result.status === 'updated').length;
+    const restarting = results.filter(result => result.restarting).length;
+    console.log('[FLEET] Done:', updated, 'updated,', restarting, 'restarting,',
+      results.filter(result => result.status === 'failed' || result.status === 'conflict').length, 'failed');
+    return results;
+  }
+
+  async rolloutFirmware(imagePath: string, deviceIds?: string[],
+                        options: FirmwareRolloutOptions = {}): Promise<FirmwareRolloutResult[]> {
+    const image = this.readFirmwareImage(await fs.promises.readFile(imagePath));
+    const devices = this.discoveryService.getDiscoveredDevices()
+      .filter(device => !deviceIds || deviceIds.includes(device.deviceId));
+    const canary = Math.min(Math.max(0, options.canary ?? this.DEFAULT_CANARY), devices.length);
+    console.log('[OTA] Rolling out', imagePath, `(${image.data.length} bytes, version ${image.version || '?'},`,
+      `sha256 ${image.sha256})`, 'to', devices.length, 'devices,', canary, 'canary');
+
+    const results: FirmwareRolloutResult[] = [];
+    const stages = [devices.slice(0, canary), devices.slice(canary)];
+    for (const stage of stages) {
+      // A canary that did not come back healthy stops everything after it
+      if (results.some(result => result.status !== 'updated')) {
+        for (const device of stage) {
+          const skipped: FirmwareRolloutResult = {
+            deviceId: device.deviceId, deviceName: device.deviceName, ip: device.ip,
+            status: 'skipped', message: 'Canary failed', elapsedMs: 0
+          };
+          results.push(skipped);
+          this.emit('firmware-rollout-progress', skipped);
+        }
+        continue;
+      }
+      results.push(...await this.flashStage(stage, image, options));
+    }
+
+    console.log('[OTA] Done:', results.filter(result => result.status === 'updated').length, 'updated,',
+      results.filter(result => result.status === 'rolled_back').length, 'rolled back,',
+      results.filter(result => result.status === 'failed').length, 'failed,',
+      results.filter(result => result.status === 'skipped').length, 'skipped');
+    return results;
+  }
+
+  // Every device drops off its AP while it restarts, so only a few per AP are flashed at once
+  private async flashStage(devices: DiscoveredDevice[], image: FirmwareImage,
+                           options: FirmwareRolloutOptions): Promise<FirmwareRolloutResult[]> {
+    const concurrency = Math.max(1, options.concurrency || this.DEFAULT_CONCURRENCY);
+    const perAccessPoint = Math.max(1, options.perAccessPoint || this.DEFAULT_PER_ACCESS_POINT);
+    const pending = devices.map((device, index) => ({ device, index }));
+    const active = new Map<string, number>();
+    const results: FirmwareRolloutResult[] = new Array(devices.length);
+
+    const worker = async () => {
+      while (pending.length > 0) {
+        const position = pending.findIndex(entry => (active.get(entry.device.bssid || '') || 0) < perAccessPoint);
+        if (position < 0) {
+          await this.sleep(this.POLL_INTERVAL / 4);
+          continue;
+        }
+
+        const [{ device, index }] = pending.splice(position, 1);
+        const accessPoint = device.bssid || '';
+        active.set(accessPoint, (active.get(accessPoint) || 0) + 1);
+        try {
+          results[index] = await this.flashDevice(device, image, options);
+        } finally {
+          active.set(accessPoint, (active.get(accessPoint) || 1) - 1);
+        }
+        this.emit('firmware-rollout-progress', results[index]);
+      }
+    };
+    await Promise.all(Array.from({ length: Math.min(concurrency, devices.length) }, worker));
+    return results;
+  }
+
+  private async flashDevice(device: DiscoveredDevice, image: FirmwareImage,
+                            options: FirmwareRolloutOptions): Promise<FirmwareRolloutResult> {
+    const started = Date.now();
+    const result: FirmwareRolloutResult = {
+      deviceId: device.deviceId,
+      deviceName: device.deviceName,
+      ip: device.ip,
+      status: 'failed',
+      elapsedMs: 0
+    };
+
+    try {
+      const before = await this.httpRequest('GET', device.ip, '/api/ota', undefined, {});
+      if (before.status !== 200) {
+        throw new Error(`GET /api/ota returned ${before.status} - firmware without OTA support`);
+      }
+      result.partition = before.body.next_partition;
+
+      const headers: Record<string, string> = { 'X-Firmware-SHA256': image.sha256 };
+      if (options.token) headers['X-OTA-Token'] = options.token;
+      const upload = await this.httpRequest('POST', device.ip, '/api/ota', image.data, headers, this.UPLOAD_TIMEOUT);
+      if (upload.status !== 200) {
+        throw new Error(upload.body?.message || `POST /api/ota returned ${upload.status}`);
+      }
+
+      // Wait for the device to boot the new image and confirm it, or for its bootloader to roll back
+      const deadline = Date.now() + (options.verifyTimeoutMs || this.DEFAULT_VERIFY_TIMEOUT);
+      result.message = 'Did not come back before the verify timeout';
+      while (Date.now() < deadline) {
+        await this.sleep(this.POLL_INTERVAL);
+        const status = await this.httpRequest('GET', device.ip, '/api/ota', undefined, {})
+          .catch(() => undefined);   // Offline while it restarts
+        if (!status || status.status !== 200) continue;
+
+        result.version = status.body.version;
+        if (status.body.partition === result.partition && status.body.state !== 'pending_verify') {
+          result.status = 'updated';
+          result.message = undefined;
+          break;
+        }
+        if (status.body.partition !== result.partition && this.rejectedImage(status.body, result.partition, image)) {
+          result.status = 'rolled_back';
+          result.message = 'New image failed to confirm - previous firmware restored';
+          break;
+        }
+      }
+    } catch (error) {
+      result.status = 'failed';
+      result.message = (error as Error).message;
+    }
+
+    result.elapsedMs = Date.now() - started;
+    console.log('[OTA]', device.deviceName, result.status, result.partition || '', result.message || '');
+    return result;
+  }
+
+  private readFirmwareImage(data: Buffer): FirmwareImage {
+    const image: FirmwareImage = {
+      data,
+      sha256: crypto.createHash('sha256').update(data).digest('hex'),
+      version: '',
+      elfSha256: ''
+    };
+    // esp_app_desc_t: magic at 0, version[32] at 16, app_elf_sha256[32] at 144
+    const desc = this.APP_DESC_OFFSET;
+    if (data.length >= desc + 176 && data.readUInt32LE(desc) === this.APP_DESC_MAGIC) {
+      const version = data.subarray(desc + 16, desc + 48);
+      const end = version.indexOf(0);
+      image.version = version.subarray(0, end < 0 ? version.length : end).toString('utf8');
+      image.elfSha256 = data.subarray(desc + 144, desc + 176).toString('hex');
+    }
+    return image;
+  }
+
+  // rolled_back stays set on a device until its next upload, so it only counts for the image just sent
+  private rejectedImage(status: any, partition: string | undefined, image: FirmwareImage): boolean {
+    const rejected = status.rolled_back ? status.rejected : undefined;
+    if (!rejected || rejected.partition !== partition) return false;
+    if (!image.elfSha256) return true;   // No app description to compare - the partition has to do
+    return rejected.version === image.version && rejected.elf_sha256 === image.elfSha256;
+  }
+
+  private sleep(ms: number): Promise<void> {
+    return new Promise(resolve => setTimeout(resolve, ms));
+  }
+
+  private async syncDevice(device: DiscoveredDevice, target: any, keyRevision: string,
+                           options: FleetSyncOptions): Promise<FleetSyncResult> {
+    const started = Date.now();
+    const result: FleetSyncResult = {
+      deviceId: device.deviceId,
+      deviceName: device.deviceName,
+      ip: device.ip,
+      status: 'failed',
+      sections: [],
+      restarting: false,
+      elapsedMs: 0
+    };
+
+    try {
+      // A conflict means the device changed after it was read - diff again against the new copy once
+      for (let attempt = 0; attempt < 2; attempt++) {
+        const snapshot = await this.readDevice(device, options);
+        const delivered = this.deliveredKeys.get(device.deviceId);
+        const keys = delivered?.revision === keyRevision ? undefined : this.keyDelta(target.apiKeys, delivered);
+        const delta = this.diffConfig(snapshot.config, target, keys);
+        result.sections = Object.keys(delta);
+        result.etag = snapshot.etag;
+
+        if (result.sections.length === 0) {
+          result.status = 'unchanged';
+          break;
+        }
+
+        const outcome = await this.writeDevice(device, delta, snapshot.etag, options, result);
+        if (outcome === 'updated' && delta.apiKeys) {
+          this.deliveredKeys.set(device.deviceId, { revision: keyRevision, names: Object.keys(target.apiKeys || {}) });
+        }
+        if (outcome !== 'conflict') break;
+      }
+    } catch (error) {
+      result.status = 'failed';
+      result.message = (error as Error).message;
+    }
+
+    result.elapsedMs = Date.now() - started;
+    console.log('[FLEET]', device.deviceName, result.status, result.sections.join(','), result.message || '');
+    return result;
+  }
+
+  private async readDevice(device: DiscoveredDevice, options: FleetSyncOptions): Promise<DeviceSnapshot> {
+    const transport = options.transport || 'auto';
+    if (transport !== 'udp') {
+      try {
+        const response = await this.httpRequest('GET', device.ip, '/api/config', undefined, {}, options.timeoutMs);
+        if (response.status === 200) {
+          return { config: response.body, etag: response.etag };
+        }
+        throw new Error(`GET /api/config returned ${response.status}`);
+      } catch (error) {
+        if (transport === 'http') throw error;
+      }
+    }
+
+    const config = await this.discoveryService.getDeviceConfig(device.deviceId);
+    return { config, etag: config.etag || '' };
+  }
+
+  private async writeDevice(device: DiscoveredDevice, delta: any, etag: string, options: FleetSyncOptions,
+                            result: FleetSyncResult): Promise<FleetSyncResult['status']> {
+    const transport = options.transport || 'auto';
+    const datagram = Buffer.byteLength(JSON.stringify({ type: 'set_config', device_id: device.deviceId, if_match: etag, ...delta }));
+
+    if (transport === 'udp' || (transport === 'auto' && datagram <= this.discoveryService.UDP_PACKET_MAX)) {
+      result.transport = 'udp';
+      const ack = await this.discoveryService.sendConfigUpdate(device.deviceId, delta, etag, options.timeoutMs);
+      result.status = ack.success ? 'updated' : (ack.conflict ? 'conflict' : 'failed');
+      result.restarting = ack.restart === true;
+      result.etag = ack.etag;
+      result.message = ack.message;
+      return result.status;
+    }
+
+    result.transport = 'http';
+    const headers: Record<string, string> = etag ? { 'If-Match': etag } : {};
+    const response = await this.httpRequest('POST', device.ip, '/api/config', JSON.stringify(delta), headers, options.timeoutMs);
+    result.status = response.status === 200 ? 'updated' : (response.status === 412 ? 'conflict' : 'failed');
+    result.restarting = response.body?.restart === true;
+    result.etag = response.etag || response.body?.etag;
+    result.message = response.body?.message;
+    return result.status;
+  }
+
+  // Only what differs from the device is sent. Per-device identity (name, static addressing) is
+  // never pushed to a fleet. API keys are write-only, so the caller passes the key changes to send, if any
+  private diffConfig(current: any, target: any, apiKeys: Record<string, string> | undefined): any {
+    const delta: any = {};
+
+    const device: any = {};
+    for (const [key, value] of Object.entries(target.device || {})) {
+      if (key !== 'name' && !this.sameJson(current?.device?.[key], value)) {
+        device[key] = value;
+      }
+    }
+    if (Object.keys(device).length > 0) delta.device = device;
+
+    // The device never reports the WiFi password; it is sent with an SSID change only
+    if (target.network?.ssid && target.network.ssid !== current?.network?.ssid) {
+      delta.network = { ssid: target.network.ssid, password: target.network.password || '' };
+    }
+
+    const buttons = (target.buttons || []).filter((button: any) => {
+      const existing = (current?.buttons || []).find((entry: any) => entry.id === button.id);
+      return !existing || Object.keys(button).some(key => !this.sameJson(existing[key], button[key]));
+    });
+    if (buttons.length > 0) delta.buttons = buttons;
+
+    // The device lists bound gestures only, so a slot the target leaves out is cleared explicitly
+    const targetGestures: any[] = target.gestures || [];
+    const gestures: any[] = targetGestures.filter(gesture => {
+      const existing = (current?.gestures || []).find((entry: any) => entry.id === gesture.id);
+      return !existing || Object.keys(gesture).some(key => !this.sameJson(existing[key], gesture[key]));
+    });
+    for (const existing of current?.gestures || []) {
+      if (!targetGestures.some(gesture => gesture.id === existing.id)) {
+        gestures.push({ id: existing.id, type: 'none' });
+      }
+    }
+    if (gestures.length > 0) delta.gestures = gestures;
+
+    if (apiKeys) delta.apiKeys = apiKeys;
+    return delta;
+  }
+
+  // The key set, plus an empty value for each name last delivered that is gone, which the device removes
+  private keyDelta(apiKeys: Record<string, string> | undefined,
+                   delivered: DeliveredKeys | undefined): Record<string, string> | undefined {
+    const delta: Record<string, string> = { ...(apiKeys || {}) };
+    for (const name of delivered?.names || []) {
+      if (!(name in delta)) delta[name] = '';
+    }
+    return Object.keys(delta).length > 0 ? delta : undefined;
+  }
+
+  // Digest of the key set, so the values themselves are never kept around. No keys is a revision of
+  // its own, so removing the last key still reaches the devices
+  private keyRevision(apiKeys: Record<string, string> | undefined): string {
+    return crypto.createHash('sha256').update(this.canonicalJson(apiKeys || {})).digest('hex');
+  }
+
+  private sameJson(a: any, b: any): boolean {
+    return this.canonicalJson(a) === this.canonicalJson(b);
+  }
+
+  private canonicalJson(value: any): string {
+    if (Array.isArray(value)) {
+      return `[${value.map(item => this.canonicalJson(item)).join(',')}]`;
+    }
+    if (value && typeof value === 'object') {
+      return `{${Object.keys(value).sort().map(key => `${JSON.stringify(key)}:${this.canonicalJson(value[key])}`).join(',')}}`;
+    }
+    return JSON.stringify(value ?? null);
+  }
+
+  private httpRequest(method: string, host: string, path: string, body: string | Buffer | undefined,
+                      headers: Record<string, string>, timeoutMs = this.DEFAULT_TIMEOUT): Promise<HttpResult> {
+    return new Promise((resolve, reject) => {
+      const request = http.request({
+        host,
+        port: 80,
+        path,
+        method,
+        timeout: timeoutMs,
+        headers: {
+          ...headers,
+          ...(body !== undefined ? {
+            'Content-Type': Buffer.isBuffer(body) ? 'application/octet-stream' : 'application/json',
+            'Content-Length': Buffer.byteLength(body)
+          } : {})
+        }
+      }, response => {
+        const chunks: Buffer[] = [];
+        response.on('data', chunk => chunks.push(chunk));
+        response.on('end', () => {
+          const text = Buffer.concat(chunks).toString();
+          let parsed: any = null;
+          try {
+            parsed = text ? JSON.parse(text) : null;
+          } catch {
+            parsed = null;
+          }
+          resolve({ status: response.statusCode || 0, etag: String(response.headers.etag || ''), body: parsed });
+        });
+      });
+
+      request.on('timeout', () => request.destroy(new Error(`${method} ${path} timeout`)));
+      request.on('error', reject);
+      if (body !== undefined) request.write(body);
+      request.end();
+    });
+  }
+}
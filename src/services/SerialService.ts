@@ -3,10 +3,111 @@ import { ReadlineParser } from '@serialport/parser-readline';
 import { EventEmitter } from 'events';
 import { SerialPortInfo, DeviceInfo, ConnectionResult, DeviceMessage, ConfigData } from '../types';
 
+// Framed serial protocol (see the README): SOF, type, id (u16 LE), length (u16 LE), payload, CRC32 (LE) over type..payload
+const FRAME_SOF = 0xA5;
+const FRAME_COMMAND = 0x01;
+const FRAME_RESPONSE = 0x02;
+const FRAME_EVENT = 0x03;
+const FRAME_LOG = 0x04;
+const FRAME_ACK = 0x05;
+const FRAME_NACK = 0x06;
+const FRAME_HEADER_SIZE = 5;
+const FRAME_PAYLOAD_MAX = 4096;  // Same as the firmware's SERIAL_LINE_MAX, which also bounds text lines
+
+export interface SerialFrame {
+  type: number;
+  id: number;
+  payload: Buffer;
+}
+
+const CRC32_TABLE = (() => {
+  const table = new Uint32Array(256);
+  for (let i = 0; i < 256; i++) {
+    let crc = i;
+    for (let bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >>> 1) ^ 0xEDB88320 : crc >>> 1;
+    }
+    table[i] = crc >>> 0;
+  }
+  return table;
+})();
+
+// Same result as the firmware's esp_rom_crc32_le(0, data, length)
+export function crc32(data: Buffer): number {
+  let crc = 0xFFFFFFFF;
+  for (const byte of data) {
+    crc = CRC32_TABLE[(crc ^ byte) & 0xFF] ^ (crc >>> 8);
+  }
+  return (crc ^ 0xFFFFFFFF) >>> 0;
+}
+
+export function encodeFrame(type: number, id: number, payload: Buffer): Buffer {
+  const frame = Buffer.alloc(1 + FRAME_HEADER_SIZE + payload.length + 4);
+  frame[0] = FRAME_SOF;
+  frame[1] = type;
+  frame.writeUInt16LE(id, 2);
+  frame.writeUInt16LE(payload.length, 4);
+  payload.copy(frame, 1 + FRAME_HEADER_SIZE);
+  frame.writeUInt32LE(crc32(frame.subarray(1, 1 + FRAME_HEADER_SIZE + payload.length)), 1 + FRAME_HEADER_SIZE + payload.length);
+  return frame;
+}
+
+// Reassembles frames from the raw byte stream. A frame with a bad length or CRC is dropped and the
+// parser resynchronizes on the next start byte after the one it rejected
+export class FrameParser {
+  private buffer = Buffer.alloc(0);
+
+  constructor(private onFrame: (frame: SerialFrame) => void) {}
+
+  push(chunk: Buffer): void {
+    this.buffer = Buffer.concat([this.buffer, chunk]);
+    for (;;) {
+      const start = this.buffer.indexOf(FRAME_SOF);
+      if (start < 0) {
+        this.buffer = Buffer.alloc(0);
+        return;
+      }
+      this.buffer = this.buffer.subarray(start);
+      if (this.buffer.length < 1 + FRAME_HEADER_SIZE) return;
+
+      const length = this.buffer.readUInt16LE(4);
+      if (length > FRAME_PAYLOAD_MAX) {
+        this.buffer = this.buffer.subarray(1);
+        continue;
+      }
+      const frameLength = 1 + FRAME_HEADER_SIZE + length + 4;
+      if (this.buffer.length < frameLength) return;
+
+      const crc = this.buffer.readUInt32LE(1 + FRAME_HEADER_SIZE + length);
+      if (crc32(this.buffer.subarray(1, 1 + FRAME_HEADER_SIZE + length)) !== crc) {
+        this.buffer = this.buffer.subarray(1);
+        continue;
+      }
+      const frame = {
+        type: this.buffer[1],
+        id: this.buffer.readUInt16LE(2),
+        payload: Buffer.from(this.buffer.subarray(1 + FRAME_HEADER_SIZE, 1 + FRAME_HEADER_SIZE + length))
+      };
+      this.buffer = this.buffer.subarray(frameLength);
+      this.onFrame(frame);
+    }
+  }
+
+  reset(): void {
+    this.buffer = Buffer.alloc(0);
+  }
+}
+
 export class SerialService extends EventEmitter {
   private serialPort: SerialPort | null = null;
   private parser: ReadlineParser | null = null;
   private deviceConnected = false;
+  // Every device line, text or framed, for the request/response handlers below
+  private lines = new EventEmitter();
+  private framed = false;
+  private framedBaud = 0;     // Set while FRAMED is waiting for its confirmation
+  private frameParser = new FrameParser((frame) => this.handleFrame(frame));
+  private nextFrameId = 0;
 
   async getSerialPorts(): Promise<SerialPortInfo[]> {
     console.log('[SERIAL-SERVICE] Getting serial ports...');
@@ -117,6 +218,9 @@ export class SerialService extends EventEmitter {
       console.log('[SERIAL-SERVICE] Creating new SerialPort instance');
       this.serialPort = new SerialPort({ path: portPath, baudRate });
       this.parser = this.serialPort.pipe(new ReadlineParser({ delimiter: '\n' }));
+      this.framed = false;
+      this.framedBaud = 0;
+      this.frameParser.reset();
 
       const timeout = setTimeout(() => {
         console.error('[SERIAL-SERVICE] Connection timeout after 5 seconds');
@@ -128,12 +232,15 @@ export class SerialService extends EventEmitter {
         clearTimeout(timeout);
         this.deviceConnected = true;
         
-        // Request device identification first
+        // Request device identification first - the reply says whether framed mode is on offer.
+        // STATUS waits while FRAMED is being negotiated and is sent once the switch is done
         console.log('[SERIAL-SERVICE] Sending IDENTIFY command');
         this.serialPort!.write('IDENTIFY\n');
         setTimeout(() => {
-          console.log('[SERIAL-SERVICE] Sending STATUS command');
-          this.serialPort!.write('STATUS\n');
+          if (this.framedBaud === 0 && !this.framed) {
+            console.log('[SERIAL-SERVICE] Sending STATUS command');
+            this.sendCommand('STATUS');
+          }
         }, 500);
         
         console.log('[SERIAL-SERVICE] Connection successful, resolving promise');
@@ -154,24 +261,90 @@ export class SerialService extends EventEmitter {
 
       this.parser!.on('data', (data: string) => {
         console.log('[SERIAL-SERVICE] Received data from device:', data.trim());
-        this.handleDeviceMessage(data.trim());
+        this.receiveLine(data.trim());
       });
     });
   }
 
   async disconnectDevice(): Promise<ConnectionResult> {
     if (this.serialPort && this.serialPort.isOpen) {
+      // Leave the device in text mode at 115200 so the next connection can talk to it
+      if (this.framed) {
+        this.sendCommand('TEXT');
+        await new Promise<void>((resolve) => this.serialPort!.drain(() => resolve()));
+      }
       await this.serialPort.close();
     }
     this.deviceConnected = false;
+    this.framed = false;
+    this.framedBaud = 0;
     this.serialPort = null;
     this.parser = null;
     return { success: true, message: 'Disconnected successfully' };
   }
 
+  // One command line, as a command frame once framed mode is on
+  private sendCommand(command: string): void {
+    if (this.framed) {
+      this.nextFrameId = (this.nextFrameId % 0xFFFF) + 1;  // 0 is the id of unsolicited output
+      this.serialPort!.write(encodeFrame(FRAME_COMMAND, this.nextFrameId, Buffer.from(command, 'utf8')));
+    } else {
+      this.serialPort!.write(`${command}\n`);
+    }
+  }
+
+  private receiveLine(line: string): void {
+    this.lines.emit('line', line);
+    this.handleDeviceMessage(line);
+  }
+
+  private negotiateFramed(deviceInfo: DeviceInfo): void {
+    if (this.framed || this.framedBaud !== 0 || deviceInfo.protocol !== 'text' || !deviceInfo.framed_baud) {
+      return;
+    }
+    console.log('[SERIAL-SERVICE] Device offers framed protocol, requesting FRAMED at', deviceInfo.framed_baud);
+    this.framedBaud = deviceInfo.framed_baud;
+    this.sendCommand(`FRAMED:${this.framedBaud}`);
+  }
+
+  private async switchToFramed(): Promise<void> {
+    // The device confirmed in text and is switching baud now: follow it and parse frames from here on
+    const baudRate = this.framedBaud;
+    this.framedBaud = 0;
+    this.serialPort!.unpipe(this.parser!);
+    this.parser!.removeAllListeners('data');
+    this.serialPort!.on('data', (chunk: Buffer) => {
+      if (this.framed) this.frameParser.push(chunk);
+    });
+    await new Promise<void>((resolve, reject) => {
+      this.serialPort!.update({ baudRate }, (error) => (error ? reject(error) : resolve()));
+    });
+    this.framed = true;
+    console.log('[SERIAL-SERVICE] Framed protocol active at', baudRate, 'baud');
+    this.sendCommand('STATUS');
+  }
+
+  private handleFrame(frame: SerialFrame): void {
+    switch (frame.type) {
+      case FRAME_RESPONSE:
+      case FRAME_EVENT:
+        this.receiveLine(frame.payload.toString('utf8'));
+        break;
+      case FRAME_LOG:
+        console.log('[SERIAL-SERVICE] Device log:', frame.payload.toString('utf8'));
+        break;
+      case FRAME_ACK:
+        break;
+      case FRAME_NACK:
+        console.error('[SERIAL-SERVICE] Device rejected frame', frame.id, ':', frame.payload.toString('utf8'));
+        break;
+      default:
+        console.warn('[SERIAL-SERVICE] Unknown frame type', frame.type);
+    }
+  }
+
   async uploadConfig(configData: ConfigData): Promise<DeviceMessage> {
     console.log('[SERIAL-SERVICE] Starting uploadConfig()');
-    console.log('[SERIAL-SERVICE] Raw config data received:', configData);
     
     if (!this.serialPort || !this.serialPort.isOpen) {
       console.error('[SERIAL-SERVICE] Device not connected for upload');
@@ -180,29 +353,16 @@ export class SerialService extends EventEmitter {
 
     console.log('[SERIAL-SERVICE] Device is connected, transforming config...');
     const arduinoConfig = this.transformConfigForArduino(configData);
-    console.log('[SERIAL-SERVICE] Transformed Arduino config:', arduinoConfig);
+    console.log('[SERIAL-SERVICE] Transformed Arduino config:', this.redactForLog(arduinoConfig));
     
     const configJson = JSON.stringify(arduinoConfig);
-    console.log('[SERIAL-SERVICE] Config JSON string:', configJson);
     console.log('[SERIAL-SERVICE] Config JSON length:', configJson.length);
     
-    // Check if the optimized config is still too large (>500 chars as safety margin)
-    if (configJson.length > 500) {
-      console.warn('[SERIAL-SERVICE] Optimized config still large, trying network-only upload');
-      
-      // Send only network configuration if it's the most important
-      const networkOnlyConfig = {
-        n: arduinoConfig.n || {}
-      };
-      
-      const networkJson = JSON.stringify(networkOnlyConfig);
-      console.log('[SERIAL-SERVICE] Network-only JSON:', networkJson);
-      console.log('[SERIAL-SERVICE] Network-only JSON length:', networkJson.length);
-      
-      if (networkJson.length <= 200) {
-        console.log('[SERIAL-SERVICE] Sending network-only configuration as fallback');
-        return await this.sendConfigCommand(networkJson);
-      }
+    // The device drops a longer command line (SERIAL_LINE_MAX) or frame, so refuse it here instead
+    const commandBytes = Buffer.byteLength(`SET_CONFIG:${configJson}`, 'utf8');
+    if (commandBytes > FRAME_PAYLOAD_MAX) {
+      console.error('[SERIAL-SERVICE] Config too large for the serial link:', commandBytes, 'bytes');
+      throw new Error(`Config is too large to upload over USB (${commandBytes} of ${FRAME_PAYLOAD_MAX} bytes)`);
     }
     
     // Send the full optimized configuration
@@ -211,8 +371,6 @@ export class SerialService extends EventEmitter {
 
   private async sendConfigCommand(configJson: string): Promise<DeviceMessage> {
     console.log('[SERIAL-SERVICE] Sending config command with JSON length:', configJson.length);
-    console.log('[SERIAL-SERVICE] Config JSON first 100 chars:', configJson.substring(0, 100));
-    console.log('[SERIAL-SERVICE] Config JSON last 100 chars:', configJson.substring(Math.max(0, configJson.length - 100)));
     console.log('[SERIAL-SERVICE] Config JSON contains quotes:', configJson.includes('"'));
     console.log('[SERIAL-SERVICE] Config JSON contains braces:', configJson.includes('{') && configJson.includes('}'));
     
@@ -226,11 +384,10 @@ export class SerialService extends EventEmitter {
       throw new Error('Generated invalid JSON');
     }
     
-    const command = `SET_CONFIG:${configJson}\n`;
-    console.log('[SERIAL-SERVICE] Full command to send:', command);
+    const command = `SET_CONFIG:${configJson}`;
     console.log('[SERIAL-SERVICE] Command length:', command.length);
     console.log('[SERIAL-SERVICE] Command starts with SET_CONFIG:', command.startsWith('SET_CONFIG:'));
-    console.log('[SERIAL-SERVICE] Command ends with newline:', command.endsWith('\n'));
+    console.log('[SERIAL-SERVICE] Sending as:', this.framed ? 'command frame' : 'text line');
     
     return new Promise((resolve, reject) => {
       const timeout = setTimeout(() => {
@@ -248,7 +405,7 @@ export class SerialService extends EventEmitter {
             if (response.type === 'config_upload') {
               console.log('[SERIAL-SERVICE] Config upload response received');
               clearTimeout(timeout);
-              this.parser!.off('data', responseHandler);
+              this.lines.off('line', responseHandler);
               resolve(response);
             }
           } catch (parseError) {
@@ -259,8 +416,8 @@ export class SerialService extends EventEmitter {
       };
 
       console.log('[SERIAL-SERVICE] Setting up response handler and sending command...');
-      this.parser!.on('data', responseHandler);
-      this.serialPort!.write(command);
+      this.lines.on('line', responseHandler);
+      this.sendCommand(command);
       console.log('[SERIAL-SERVICE] Command sent to device');
     });
   }
@@ -280,11 +437,23 @@ export class SerialService extends EventEmitter {
       } else if (message.startsWith('IDENTIFY:')) {
         const deviceId = JSON.parse(message.substring(9));
         this.emit('device-identified', deviceId);
+        this.negotiateFramed(deviceId);
       } else if (message.startsWith('EVENT:')) {
         const event = JSON.parse(message.substring(6));
         this.emit('device-event', event);
       } else if (message.startsWith('RESPONSE:')) {
         const response = JSON.parse(message.substring(9));
+        if (response.type === 'framed' && this.framedBaud !== 0) {
+          if (response.success) {
+            this.switchToFramed().catch((error) => {
+              console.error('[SERIAL-SERVICE] Could not switch to framed protocol:', error);
+            });
+          } else {
+            console.warn('[SERIAL-SERVICE] Device declined framed protocol:', response.message);
+            this.framedBaud = 0;
+            this.sendCommand('STATUS');
+          }
+        }
         this.emit('device-response', response);
       }
     } catch (error) {
@@ -292,9 +461,11 @@ export class SerialService extends EventEmitter {
     }
   }
 
-  private transformConfigForArduino(configData: ConfigData): any {
+  // complete: every button and device setting is written out, so the result can be diffed against
+  // what a device reports (fleet sync). Otherwise defaults are left out to keep the upload small
+  transformConfigForArduino(configData: ConfigData, complete = false): any {
     console.log('[TRANSFORM] Starting transformConfigForArduino() with compatibility optimization');
-    console.log('[TRANSFORM] Input configData:', configData);
+    console.log('[TRANSFORM] Input configData:', this.redactForLog(configData));
     
     // Create optimized config maintaining Arduino firmware compatibility
     // Only include non-default values to reduce size
@@ -305,11 +476,29 @@ export class SerialService extends EventEmitter {
     if (configData?.device?.name && configData.device.name !== 'PATCOM') {
       deviceSection.name = configData.device.name;
     }
-    if (configData?.device?.brightness !== undefined && configData.device.brightness !== 255) {
+    if (configData?.device?.brightness !== undefined && (complete || configData.device.brightness !== 255)) {
       deviceSection.brightness = configData.device.brightness;
     }
-    if (configData?.device?.discoverable === false) {
-      deviceSection.discoverable = false;
+    if (configData?.device?.discoverable === false || complete) {
+      deviceSection.discoverable = configData?.device?.discoverable !== false;
+    }
+    if (configData?.device?.persistRetries !== undefined) {
+      deviceSection.persistRetries = !!configData.device.persistRetries;
+    }
+    if (configData?.device?.sleepTimeout !== undefined) {
+      deviceSection.sleepTimeout = configData.device.sleepTimeout;
+    }
+    if (configData?.device?.deepSleep !== undefined) {
+      deviceSection.deepSleep = !!configData.device.deepSleep;
+    }
+    if (configData?.device?.longPressMs !== undefined) {
+      deviceSection.longPressMs = configData.device.longPressMs;
+    }
+    if (configData?.device?.doubleTapMs !== undefined) {
+      deviceSection.doubleTapMs = configData.device.doubleTapMs;
+    }
+    if (configData?.device?.chordWindowMs !== undefined) {
+      deviceSection.chordWindowMs = configData.device.chordWindowMs;
     }
     
     // Only include device section if it has properties
@@ -349,19 +538,19 @@ export class SerialService extends EventEmitter {
         const hasActionConfig = Object.keys(actionConfig).length > 0;
         
         // Only include button if it has non-default configuration
-        if (hasCustomName || hasAction || isDisabled || hasActionConfig) {
+        if (complete || hasCustomName || hasAction || isDisabled || hasActionConfig) {
           const btnConfig: any = { id: button.id };
           
-          if (hasCustomName) {
+          if (complete || hasCustomName) {
             btnConfig.name = button.name;
           }
-          if (hasAction) {
+          if (complete || hasAction) {
             btnConfig.action = actionType;
           }
-          if (isDisabled) {
-            btnConfig.enabled = false;
+          if (complete || isDisabled) {
+            btnConfig.enabled = !isDisabled;
           }
-          if (hasActionConfig) {
+          if (complete || hasActionConfig) {
             btnConfig.config = actionConfig;
           }
           
@@ -375,7 +564,20 @@ export class SerialService extends EventEmitter {
       optimizedConfig.buttons = buttonsArray;
     }
 
-    console.log('[TRANSFORM] Generated Arduino-compatible optimized config:', optimizedConfig);
+    // Gestures section - sent whole, since an omitted slot would keep its old binding
+    if (configData?.gestures) {
+      optimizedConfig.gestures = configData.gestures.map(gesture => ({
+        id: gesture.id,
+        type: gesture.type,
+        buttons: gesture.buttons,
+        name: gesture.name,
+        action: this.getArduinoActionType(gesture.action),
+        enabled: gesture.enabled !== false,
+        config: this.transformActionConfig(gesture.action, gesture.config)
+      }));
+    }
+
+    console.log('[TRANSFORM] Generated Arduino-compatible optimized config:', this.redactForLog(optimizedConfig));
     const optimizedJson = JSON.stringify(optimizedConfig);
     console.log('[TRANSFORM] Optimized JSON length:', optimizedJson.length);
     console.log('[TRANSFORM] Original would be ~683 chars, optimized is:', optimizedJson.length, 'chars');
@@ -385,16 +587,36 @@ export class SerialService extends EventEmitter {
     } else {
       console.log('[TRANSFORM] Size increased by:', Math.round((optimizedJson.length / 683 - 1) * 100) + '%');
     }
+
+    // The device only stores API keys; {{key:NAME}} in an action resolves against this set
+    if (configData?.apiKeys && Object.keys(configData.apiKeys).length > 0) {
+      optimizedConfig.apiKeys = configData.apiKeys;
+    }
     
     return optimizedConfig;
   }
 
+  // A copy safe to print: the WiFi password and API key values are masked, key names are kept
+  private redactForLog(config: any): any {
+    if (!config) return config;
+    const redacted = { ...config };
+    if (config.network?.password) {
+      redacted.network = { ...config.network, password: '***' };
+    }
+    if (config.apiKeys) {
+      redacted.apiKeys = Object.fromEntries(Object.keys(config.apiKeys).map(name => [name, '***']));
+    }
+    return redacted;
+  }
+
   private getArduinoActionType(electronAction: string): number {
     console.log('[ACTION-MAP] Mapping electron action:', electronAction);
     const actionMap: Record<string, number> = {
       'none': 0,      // ACTION_NONE
       'http': 1,      // ACTION_HTTP
       'webhook': 2,   // ACTION_WEBHOOK
+      'mqtt': 3,      // ACTION_MQTT
+      'udp': 4,       // ACTION_UDP
     };
     const mappedValue = actionMap[electronAction] || 0;
     console.log('[ACTION-MAP] Mapped to Arduino action type:', mappedValue);
@@ -402,13 +624,64 @@ export class SerialService extends EventEmitter {
   }
 
   private transformActionConfig(actionType: string, config: any): Record<string, any> {
+    const transformed = this.transformActionTarget(actionType, config);
+    if (actionType !== 'none' && config.feedback !== undefined) {
+      transformed.feedback = config.feedback;
+    }
+    return transformed;
+  }
+
+  // The device verifies https:// and mqtts:// certificates by default; only an explicit
+  // tls.verify false without a fingerprint turns that off
+  private warnUnverifiedTls(action: Record<string, any>): void {
+    const secure = /^(https|mqtts):\/\//i.test(action.url || '');
+    if (secure && action.tls?.verify === false && !action.tls?.fingerprint) {
+      console.warn('[SERIAL-SERVICE] Certificate verification disabled for', action.url);
+    }
+  }
+
+  private transformActionTarget(actionType: string, config: any): Record<string, any> {
     if (actionType === 'http' || actionType === 'webhook') {
-      return {
+      if (Array.isArray(config.actions)) {
+        return {
+          actions: config.actions,
+          stop_on_error: !!config.stop_on_error
+        };
+      }
+      const action: Record<string, any> = {
         url: config.url || '',
         method: config.method || 'POST',
         body: config.body || '',
         secret: config.secret || ''
       };
+      if (actionType === 'webhook' && config.batch) {
+        action.batch = config.batch;
+      }
+      if (config.tls) {
+        action.tls = config.tls;
+      }
+      this.warnUnverifiedTls(action);
+      return action;
+    }
+    if (actionType === 'mqtt') {
+      const action: Record<string, any> = {
+        url: config.url || '',
+        topic: config.topic || '',
+        payload: config.payload || '',
+        qos: Number(config.qos) > 0 ? 1 : 0,
+        retain: config.retain === true || config.retain === 'true',
+        username: config.username || '',
+        password: config.password || '',
+        ...(config.tls ? { tls: config.tls } : {})
+      };
+      this.warnUnverifiedTls(action);
+      return action;
+    }
+    if (actionType === 'udp') {
+      return {
+        url: config.url || '',
+        payload: config.payload || ''
+      };
     }
     return {};
   }
@@ -24,24 +24,86 @@ export interface DeviceConfig {
   deviceType: number;
   discoverable: boolean;
   autoSync: boolean;
+  persistRetries?: boolean;
+  sleepTimeout?: number;
+  deepSleep?: boolean;
+  longPressMs?: number;
+  doubleTapMs?: number;
+  chordWindowMs?: number;
   configServerUrl: string;
 }
 
+export type GestureType = 'none' | 'long' | 'double' | 'chord';
+
+export interface GestureConfig {
+  id: number;
+  type: GestureType;
+  buttons: number[];
+  name: string;
+  action: ActionType;
+  config: ActionConfig;
+  enabled?: boolean;
+}
+
 export interface ConfigData {
   buttons: ButtonConfig[];
+  gestures?: GestureConfig[];
   network: NetworkConfig;
   device: DeviceConfig;
   apiKeys: Record<string, string>;
   customConfig: string;
 }
 
-export type ActionType = 'none' | 'http' | 'webhook';
+export type ActionType = 'none' | 'http' | 'webhook' | 'mqtt' | 'udp';
 
 export interface ActionConfig {
   url?: string;
   method?: string;
   body?: string;
   secret?: string;
+  headers?: Record<string, string>;
+  topic?: string;
+  payload?: string;
+  qos?: number;
+  retain?: boolean;
+  username?: string;
+  password?: string;
+  batch?: WebhookBatchOptions;
+  tls?: TlsOptions;
+  actions?: ChainedAction[];
+  stop_on_error?: boolean;
+  feedback?: boolean | FeedbackOptions;
+}
+
+export interface FeedbackOptions {
+  slow_ms?: number;
+  sync_state?: boolean;
+}
+
+export interface WebhookBatchOptions {
+  max_events?: number;
+  max_age?: number;
+  max_bytes?: number;
+}
+
+export interface TlsOptions {
+  verify?: boolean;             // Chain checked against the device's CA bundle unless false
+  fingerprint?: string;
+}
+
+export interface ChainedAction {
+  type?: ActionType;
+  url: string;
+  method?: string;
+  body?: string;
+  secret?: string;
+  headers?: Record<string, string>;
+  topic?: string;
+  payload?: string;
+  qos?: number;
+  retain?: boolean;
+  tls?: TlsOptions;
+  stage?: number;
 }
 
 export interface SerialPortInfo {
@@ -58,6 +120,8 @@ export interface DeviceInfo {
   version: string;
   device_type: string;
   connection: string;
+  protocol?: 'text' | 'framed';  // Serial protocol in use; framed is negotiated with FRAMED
+  framed_baud?: number;
 }
 
 export interface DiscoveredDevice {
@@ -71,9 +135,61 @@ export interface DiscoveredDevice {
   uptime?: number;
   configHash?: string;
   rssi?: number;
+  bssid?: string;               // Access point the device is associated with
+  otaState?: string;            // State of the running firmware image: valid, pending_verify, factory...
   lastSeen: number;
 }
 
+export type FleetTransport = 'auto' | 'http' | 'udp';
+
+export interface FleetSyncOptions {
+  transport?: FleetTransport;   // auto: read over HTTP, write over UDP when the delta fits one datagram
+  concurrency?: number;         // Devices updated at once
+  timeoutMs?: number;           // Per request
+}
+
+export interface FleetSyncResult {
+  deviceId: string;
+  deviceName: string;
+  ip: string;
+  status: 'updated' | 'unchanged' | 'conflict' | 'failed';
+  transport?: 'http' | 'udp';
+  sections: string[];           // Parts of the config that were sent
+  restarting: boolean;          // Network settings changed - the device is rebooting to apply them
+  etag?: string;
+  message?: string;
+  elapsedMs: number;
+}
+
+export interface FirmwareRolloutOptions {
+  concurrency?: number;         // Devices flashed at once across the fleet
+  perAccessPoint?: number;      // Devices flashed at once behind one access point
+  canary?: number;              // Flashed and confirmed first; the rollout stops if any of them fails
+  token?: string;               // X-OTA-Token - the devices' OTA_TOKEN API key, without which they refuse uploads
+  verifyTimeoutMs?: number;     // How long a device gets to come back and confirm the new image
+}
+
+export interface FirmwareRolloutResult {
+  deviceId: string;
+  deviceName: string;
+  ip: string;
+  status: 'updated' | 'rolled_back' | 'failed' | 'skipped';
+  partition?: string;           // Partition the image was written to
+  version?: string;             // Version reported after the restart
+  message?: string;
+  elapsedMs: number;
+}
+
+export interface ConfigUpdateAck {
+  deviceId: string;
+  success: boolean;
+  message: string;
+  configHash?: string;
+  etag?: string;
+  conflict?: boolean;
+  restart?: boolean;
+}
+
 export interface DeviceMessage {
   type: string;
   success?: boolean;
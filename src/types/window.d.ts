@@ -21,8 +21,9 @@ interface ElectronAPI {
   // Network discovery operations
   discoverDevices: () => Promise<void>;
   getDiscoveredDevices: () => Promise<any[]>;
-  syncAllDevices: () => Promise<void>;
-  syncToDevice: (deviceId: string) => Promise<void>;
+  syncAllDevices: (options?: any) => Promise<any[]>;
+  syncToDevice: (deviceId: string, options?: any) => Promise<any>;
+  rolloutFirmware: (imagePath: string, deviceIds?: string[], options?: any) => Promise<any[]>;
   getDeviceConfig: (deviceId: string) => Promise<any>;
   onDeviceDiscovered: (callback: (event: any, device: any) => void) => void;
   onConfigUpdateAck: (callback: (event: any, ack: any) => void) => void;
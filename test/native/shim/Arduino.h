@@ -0,0 +1,264 @@
+// Host build of the Arduino core subset patcom.cpp uses. Time comes from the harness clock
+// (native.h), Serial goes to stdout when PATCOM_NATIVE_VERBOSE is set.
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cmath>
+#include <cctype>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <strings.h>
+
+extern "C" size_t strlcpy(char*, const char*, size_t);
+extern "C" size_t strlcat(char*, const char*, size_t);
+
+typedef uint8_t byte;
+typedef bool boolean;
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+#define HEX 16
+#define DEC 10
+#define IRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define DRAM_ATTR
+#define PROGMEM
+#define F(x) x
+
+// Arduino Nano ESP32 "by Arduino pin" numbering: D0-D13 and A0-A7 map onto these GPIOs
+static const uint8_t D0 = 0, D1 = 1, D2 = 2, D3 = 3, D4 = 4, D5 = 5, D6 = 6, D7 = 7, D8 = 8, D9 = 9,
+                     D10 = 10, D11 = 11, D12 = 12, D13 = 13;
+static const uint8_t A0 = 14, A1 = 15, A2 = 16, A3 = 17, A4 = 18, A5 = 19, A6 = 20, A7 = 21;
+int8_t digitalPinToGPIONumber(int8_t pin);
+
+class String {
+ public:
+  std::string s;
+  String() {}
+  String(const char* c) : s(c ? c : "") {}
+  String(const std::string& x) : s(x) {}
+  explicit String(char c) : s(1, c) {}
+  String(int v, unsigned char base = 10) : s(format(v, base)) {}
+  String(unsigned int v, unsigned char base = 10) : s(format(v, base)) {}
+  String(long v, unsigned char base = 10) : s(format(v, base)) {}
+  String(unsigned long v, unsigned char base = 10) : s(format(v, base)) {}
+  String(long long v, unsigned char base = 10) : s(format(v, base)) {}
+  String(unsigned long long v, unsigned char base = 10) : s(format(v, base)) {}
+  String(float v, unsigned int d = 2) : s(formatFloat(v, d)) {}
+  String(double v, unsigned int d = 2) : s(formatFloat(v, d)) {}
+  unsigned int length() const { return s.size(); }
+  const char* c_str() const { return s.c_str(); }
+  bool reserve(unsigned int n) { s.reserve(n); return true; }
+  char* begin() { return &s[0]; }
+  char* end() { return &s[0] + s.size(); }
+  void trim() {
+    size_t a = s.find_first_not_of(" \t\r\n");
+    size_t b = s.find_last_not_of(" \t\r\n");
+    s = a == std::string::npos ? std::string() : s.substr(a, b - a + 1);
+  }
+  void toUpperCase() { for (auto& c : s) c = toupper((unsigned char)c); }
+  void toLowerCase() { for (auto& c : s) c = tolower((unsigned char)c); }
+  bool startsWith(const String& p) const { return s.rfind(p.s, 0) == 0; }
+  bool endsWith(const String& p) const { return s.size() >= p.s.size() && s.compare(s.size() - p.s.size(), p.s.size(), p.s) == 0; }
+  String substring(unsigned int a) const { return a >= s.size() ? String() : String(s.substr(a)); }
+  String substring(unsigned int a, unsigned int b) const { return a >= s.size() || b <= a ? String() : String(s.substr(a, b - a)); }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  int indexOf(char c, unsigned int from = 0) const { size_t p = s.find(c, from); return p == std::string::npos ? -1 : (int)p; }
+  int indexOf(const String& c, unsigned int from = 0) const { size_t p = s.find(c.s, from); return p == std::string::npos ? -1 : (int)p; }
+  int lastIndexOf(char c) const { size_t p = s.rfind(c); return p == std::string::npos ? -1 : (int)p; }
+  bool concat(const String& o) { s += o.s; return true; }
+  bool concat(const char* o) { s += o; return true; }
+  bool concat(const char* o, unsigned int n) { s.append(o, n); return true; }
+  bool concat(char c) { s += c; return true; }
+  bool concat(int v) { s += std::to_string(v); return true; }
+  bool concat(unsigned long v) { s += std::to_string(v); return true; }
+  String& operator+=(const String& o) { s += o.s; return *this; }
+  String& operator+=(const char* o) { s += o; return *this; }
+  String& operator+=(char o) { s += o; return *this; }
+  String& operator+=(int o) { s += std::to_string(o); return *this; }
+  String& operator+=(unsigned int o) { s += std::to_string(o); return *this; }
+  String& operator+=(long o) { s += std::to_string(o); return *this; }
+  String& operator+=(unsigned long o) { s += std::to_string(o); return *this; }
+  bool operator==(const String& o) const { return s == o.s; }
+  bool operator==(const char* o) const { return s == (o ? o : ""); }
+  bool operator!=(const String& o) const { return s != o.s; }
+  bool operator!=(const char* o) const { return s != (o ? o : ""); }
+  bool operator<(const String& o) const { return s < o.s; }
+  bool equals(const String& o) const { return s == o.s; }
+  bool equalsIgnoreCase(const String& o) const { return strcasecmp(s.c_str(), o.s.c_str()) == 0; }
+  char operator[](unsigned int i) const { return i < s.size() ? s[i] : '\0'; }
+  char& operator[](unsigned int i) { return s[i]; }
+  char charAt(unsigned int i) const { return (*this)[i]; }
+  void setCharAt(unsigned int i, char c) { if (i < s.size()) s[i] = c; }
+  void clear() { s.clear(); }
+  bool isEmpty() const { return s.empty(); }
+  void replace(const String& from, const String& to) {
+    if (from.s.empty()) return;
+    for (size_t p = s.find(from.s); p != std::string::npos; p = s.find(from.s, p + to.s.size())) s.replace(p, from.s.size(), to.s);
+  }
+  void remove(unsigned int index, unsigned int count = (unsigned int)-1) { if (index < s.size()) s.erase(index, count); }
+  void toCharArray(char* b, unsigned int n) const { if (n == 0) return; strncpy(b, s.c_str(), n - 1); b[n - 1] = '\0'; }
+  void getBytes(unsigned char* b, unsigned int n) const { toCharArray((char*)b, n); }
+
+ private:
+  template <typename T> static std::string format(T v, unsigned char base) {
+    if (base == 10) return std::to_string(v);
+    char buffer[72];
+    char* p = buffer + sizeof(buffer);
+    *--p = '\0';
+    unsigned long long u = (unsigned long long)v;
+    do { *--p = "0123456789abcdef"[u % base]; u /= base; } while (u);
+    return p;
+  }
+  static std::string formatFloat(double v, unsigned int d) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", (int)d, v);
+    return buffer;
+  }
+};
+inline String operator+(const String& a, const String& b) { return String(a.s + b.s); }
+inline String operator+(const char* a, const String& b) { return String(std::string(a) + b.s); }
+inline String operator+(const String& a, const char* b) { return String(a.s + b); }
+inline String operator+(const String& a, char b) { return String(a.s + b); }
+inline String operator+(const String& a, int b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, unsigned int b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, long b) { return String(a.s + std::to_string(b)); }
+inline String operator+(const String& a, unsigned long b) { return String(a.s + std::to_string(b)); }
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* b, size_t n) {
+    size_t written = 0;
+    while (n--) written += write(*b++);
+    return written;
+  }
+  size_t write(const char* b, size_t n) { return write((const uint8_t*)b, n); }
+  size_t write(const char* s) { return s ? write((const uint8_t*)s, strlen(s)) : 0; }
+  size_t print(const char* s) { return write(s); }
+  size_t print(char* s) { return write(s); }
+  size_t print(const String& s) { return write(s.c_str(), s.length()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(double v, int digits = 2) { return print(String(v, digits)); }
+  template <typename T> size_t println(const T& v) { return print(v) + println(); }
+  template <typename T> size_t println(const T& v, int f) { return print(v, f) + println(); }
+  size_t println() { return write("\r\n"); }
+  size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[512];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (length < 0) return 0;
+    if ((size_t)length < sizeof(buffer)) return write((const uint8_t*)buffer, length);
+    std::string large(length + 1, '\0');
+    va_start(args, fmt);
+    vsnprintf(&large[0], large.size(), fmt, args);
+    va_end(args);
+    return write((const uint8_t*)large.data(), length);
+  }
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+  size_t readBytes(char* b, size_t n) {
+    size_t count = 0;
+    for (int c; count < n && (c = read()) >= 0;) b[count++] = (char)c;
+    return count;
+  }
+  size_t readBytes(uint8_t* b, size_t n) { return readBytes((char*)b, n); }
+  String readStringUntil(char terminator) {
+    String result;
+    for (int c; (c = read()) >= 0 && c != terminator;) result += (char)c;
+    return result;
+  }
+  void setTimeout(unsigned long) {}
+};
+
+// Serial: input is fed by the harness (native.h), output goes to stdout when verbose
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long baud, uint32_t config = 0, int8_t rx = -1, int8_t tx = -1) {}
+  void end() {}
+  void updateBaudRate(unsigned long) {}
+  size_t setRxBufferSize(size_t n) { return n; }
+  size_t setTxBufferSize(size_t n) { return n; }
+  int availableForWrite() { return 4096; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* b, size_t n) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  operator bool() const { return true; }
+};
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+void yield();
+void pinMode(uint8_t, uint8_t);
+int digitalRead(uint8_t);
+void digitalWrite(uint8_t, uint8_t);
+void analogWrite(uint8_t, int);
+uint16_t analogRead(uint8_t);
+uint32_t analogReadMilliVolts(uint8_t);
+void analogReadResolution(uint8_t);
+void analogSetPinAttenuation(uint8_t, int);
+enum { ADC_0db, ADC_2_5db, ADC_6db, ADC_11db };
+void attachInterruptArg(uint8_t, void (*)(void*), void*, int);
+void detachInterrupt(uint8_t);
+inline uint8_t digitalPinToInterrupt(uint8_t p) { return p; }
+long random(long);
+long random(long, long);
+template <class T, class A, class B> T constrain(T x, A a, B b) { return x < (T)a ? (T)a : (x > (T)b ? (T)b : x); }
+using std::min;
+using std::max;
+bool setCpuFrequencyMhz(uint32_t);
+uint32_t getCpuFrequencyMhz();
+uint32_t getXtalFrequencyMhz();
+
+// LEDC
+bool ledcAttach(uint8_t pin, uint32_t freq, uint8_t res);
+bool ledcWrite(uint8_t pin, uint32_t duty);
+bool ledcFade(uint8_t pin, uint32_t start, uint32_t target, int ms);
+bool ledcDetach(uint8_t pin);
+
+class EspClass {
+ public:
+  uint64_t getEfuseMac() { return 0x0000A1B2C3D4E5F6ULL; }
+  void restart();
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+  uint32_t getMaxAllocHeap();
+  uint32_t getHeapSize() { return 320 * 1024; }
+};
+extern EspClass ESP;
+
+#include "freertos/FreeRTOS.h"
+#include "IPAddress.h"
@@ -0,0 +1,290 @@
+// Parser and serializer for the ArduinoJson shim. Like the library, deserializeJson() stops after
+// the first value and ignores what follows, and floats print with the shortest round-trip form.
+#include "ArduinoJson.h"
+#include <cerrno>
+
+namespace {
+
+using native_json::Node;
+using native_json::NodePtr;
+
+struct Parser {
+  const char* p;
+  const char* end;
+  int depthLeft;
+  DeserializationError::Code error = DeserializationError::Ok;
+
+  bool fail(DeserializationError::Code code) {
+    if (error == DeserializationError::Ok) error = code;
+    return false;
+  }
+  void skipSpace() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  }
+  bool literal(const char* word) {
+    size_t length = strlen(word);
+    if ((size_t)(end - p) < length) {
+      return fail(strncmp(p, word, end - p) == 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput);
+    }
+    if (strncmp(p, word, length) != 0) return fail(DeserializationError::InvalidInput);
+    p += length;
+    return true;
+  }
+
+  static void appendUtf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+      out += (char)code;
+    } else if (code < 0x800) {
+      out += (char)(0xC0 | code >> 6);
+      out += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      out += (char)(0xE0 | code >> 12);
+      out += (char)(0x80 | (code >> 6 & 0x3F));
+      out += (char)(0x80 | (code & 0x3F));
+    } else {
+      out += (char)(0xF0 | code >> 18);
+      out += (char)(0x80 | (code >> 12 & 0x3F));
+      out += (char)(0x80 | (code >> 6 & 0x3F));
+      out += (char)(0x80 | (code & 0x3F));
+    }
+  }
+  bool hex4(uint32_t& value) {
+    if (end - p < 4) return fail(DeserializationError::IncompleteInput);
+    value = 0;
+    for (int i = 0; i < 4; i++, p++) {
+      int digit = isdigit((unsigned char)*p) ? *p - '0' : isxdigit((unsigned char)*p) ? (tolower(*p) - 'a' + 10) : -1;
+      if (digit < 0) return fail(DeserializationError::InvalidInput);
+      value = value << 4 | digit;
+    }
+    return true;
+  }
+  bool string(std::string& out) {
+    p++;  // Opening quote
+    for (;;) {
+      if (p >= end) return fail(DeserializationError::IncompleteInput);
+      char c = *p++;
+      if (c == '"') return true;
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (p >= end) return fail(DeserializationError::IncompleteInput);
+      char escape = *p++;
+      switch (escape) {
+        case '"': case '\\': case '/': out += escape; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+          uint32_t code;
+          if (!hex4(code)) return false;
+          if (code >= 0xD800 && code < 0xDC00 && end - p >= 2 && p[0] == '\\' && p[1] == 'u') {
+            p += 2;
+            uint32_t low;
+            if (!hex4(low)) return false;
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          }
+          appendUtf8(out, code);
+          break;
+        }
+        default: return fail(DeserializationError::InvalidInput);
+      }
+    }
+  }
+  bool number(Node& node) {
+    const char* start = p;
+    bool real = false;
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    while (p < end && (isdigit((unsigned char)*p) || *p == '.' || *p == 'e' || *p == 'E' ||
+                       ((*p == '-' || *p == '+') && (p[-1] == 'e' || p[-1] == 'E')))) {
+      if (!isdigit((unsigned char)*p)) real = true;
+      p++;
+    }
+    std::string text(start, p);
+    if (text.empty() || text == "-" || text == "+") return fail(p >= end ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput);
+    char* parsed;
+    if (!real) {
+      errno = 0;
+      long long value = strtoll(text.c_str(), &parsed, 10);
+      if (errno == 0 && *parsed == '\0') {
+        node.type = Node::Int;
+        node.integer = value;
+        return true;
+      }
+    }
+    double value = strtod(text.c_str(), &parsed);
+    if (*parsed != '\0') return fail(DeserializationError::InvalidInput);
+    node.type = Node::Float;
+    node.real = value;
+    return true;
+  }
+  bool value(Node& node) {
+    skipSpace();
+    if (p >= end) return fail(DeserializationError::IncompleteInput);
+    switch (*p) {
+      case '{': {
+        if (depthLeft-- <= 0) return fail(DeserializationError::TooDeep);
+        node.type = Node::Object;
+        p++;
+        skipSpace();
+        if (p < end && *p == '}') { p++; depthLeft++; return true; }
+        for (;;) {
+          skipSpace();
+          if (p >= end) return fail(DeserializationError::IncompleteInput);
+          if (*p != '"') return fail(DeserializationError::InvalidInput);
+          std::string key;
+          if (!string(key)) return false;
+          skipSpace();
+          if (p >= end) return fail(DeserializationError::IncompleteInput);
+          if (*p++ != ':') return fail(DeserializationError::InvalidInput);
+          NodePtr child = std::make_shared<Node>();
+          if (!value(*child)) return false;
+          // Duplicate keys: the last one wins, as in the library
+          bool replaced = false;
+          for (auto& member : node.members) {
+            if (member.first == key) { member.second = child; replaced = true; }
+          }
+          if (!replaced) node.members.emplace_back(key, child);
+          skipSpace();
+          if (p >= end) return fail(DeserializationError::IncompleteInput);
+          char c = *p++;
+          if (c == '}') break;
+          if (c != ',') return fail(DeserializationError::InvalidInput);
+        }
+        depthLeft++;
+        return true;
+      }
+      case '[': {
+        if (depthLeft-- <= 0) return fail(DeserializationError::TooDeep);
+        node.type = Node::Array;
+        p++;
+        skipSpace();
+        if (p < end && *p == ']') { p++; depthLeft++; return true; }
+        for (;;) {
+          NodePtr child = std::make_shared<Node>();
+          if (!value(*child)) return false;
+          node.items.push_back(child);
+          skipSpace();
+          if (p >= end) return fail(DeserializationError::IncompleteInput);
+          char c = *p++;
+          if (c == ']') break;
+          if (c != ',') return fail(DeserializationError::InvalidInput);
+        }
+        depthLeft++;
+        return true;
+      }
+      case '"':
+        node.type = Node::String;
+        return string(node.text);
+      case 't':
+        node.type = Node::Bool;
+        node.boolean = true;
+        return literal("true");
+      case 'f':
+        node.type = Node::Bool;
+        node.boolean = false;
+        return literal("false");
+      case 'n':
+        node.type = Node::Null;
+        return literal("null");
+      default:
+        if (*p == '-' || *p == '+' || isdigit((unsigned char)*p)) return number(node);
+        return fail(DeserializationError::InvalidInput);
+    }
+  }
+};
+
+void writeString(std::string& out, const std::string& text) {
+  out += '"';
+  for (unsigned char c : text) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\b': out += "\\b"; break;
+      case '\f': out += "\\f"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char escape[8];
+          snprintf(escape, sizeof(escape), "\\u%04x", c);
+          out += escape;
+        } else {
+          out += (char)c;
+        }
+    }
+  }
+  out += '"';
+}
+
+void write(std::string& out, const NodePtr& node) {
+  if (!node) {
+    out += "null";
+    return;
+  }
+  switch (node->type) {
+    case Node::Null: out += "null"; break;
+    case Node::Bool: out += node->boolean ? "true" : "false"; break;
+    case Node::Int: out += std::to_string(node->integer); break;
+    case Node::Float: {
+      if (std::isnan(node->real) || std::isinf(node->real)) {
+        out += "null";
+        break;
+      }
+      char text[32];
+      for (int precision = 1; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*g", precision, node->real);
+        if (strtod(text, nullptr) == node->real) break;
+      }
+      out += text;
+      break;
+    }
+    case Node::String: writeString(out, node->text); break;
+    case Node::Raw: out += node->text; break;
+    case Node::Object: {
+      out += '{';
+      for (size_t i = 0; i < node->members.size(); i++) {
+        if (i > 0) out += ',';
+        writeString(out, node->members[i].first);
+        out += ':';
+        write(out, node->members[i].second);
+      }
+      out += '}';
+      break;
+    }
+    case Node::Array: {
+      out += '[';
+      for (size_t i = 0; i < node->items.size(); i++) {
+        if (i > 0) out += ',';
+        write(out, node->items[i]);
+      }
+      out += ']';
+      break;
+    }
+  }
+}
+
+}  // namespace
+
+DeserializationError deserializeJson(JsonDocument& doc, const char* input, size_t length,
+                                     DeserializationOption::NestingLimit nesting) {
+  doc.clear();
+  if (!input) return DeserializationError::EmptyInput;
+  Parser parser{input, input + length, nesting.limit};
+  parser.skipSpace();
+  if (parser.p >= parser.end || *parser.p == '\0') return DeserializationError::EmptyInput;
+  if (!parser.value(*doc.get())) {
+    doc.clear();
+    return parser.error;
+  }
+  return DeserializationError::Ok;
+}
+
+std::string toJson(const JsonVariant& value) {
+  std::string out;
+  write(out, value.get());
+  return out;
+}
@@ -0,0 +1,483 @@
+// The part of the ArduinoJson 6 API patcom.cpp uses, as a small tree-of-nodes implementation.
+// Values behave like the library's (member proxies create on write, `|` falls back when the
+// type does not match, strings are copied). Document capacity is not enforced.
+#pragma once
+#include "Arduino.h"
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace native_json {
+
+struct Node;
+typedef std::shared_ptr<Node> NodePtr;
+
+struct Node {
+  enum Type { Null, Bool, Int, Float, String, Raw, Object, Array } type = Null;
+  bool boolean = false;
+  long long integer = 0;
+  double real = 0;
+  std::string text;  // String and Raw
+  std::vector<std::pair<std::string, NodePtr>> members;
+  std::vector<NodePtr> items;
+
+  void clear() { type = Null; text.clear(); members.clear(); items.clear(); }
+  NodePtr find(const char* key) const {
+    for (const auto& member : members) {
+      if (member.first == key) return member.second;
+    }
+    return nullptr;
+  }
+  void copyFrom(const Node& other) {
+    type = other.type;
+    boolean = other.boolean;
+    integer = other.integer;
+    real = other.real;
+    text = other.text;
+    members.clear();
+    items.clear();
+    for (const auto& member : other.members) {
+      NodePtr copy = std::make_shared<Node>();
+      copy->copyFrom(*member.second);
+      members.emplace_back(member.first, copy);
+    }
+    for (const auto& item : other.items) {
+      NodePtr copy = std::make_shared<Node>();
+      copy->copyFrom(*item);
+      items.push_back(copy);
+    }
+  }
+};
+
+template <typename T> struct IsInteger {
+  static const bool value = std::is_integral<T>::value && !std::is_same<T, bool>::value;
+};
+
+}  // namespace native_json
+
+struct SerializedValue { std::string raw; };
+inline SerializedValue serialized(const char* p) { return SerializedValue{p ? p : ""}; }
+inline SerializedValue serialized(const char* p, size_t n) { return SerializedValue{std::string(p, n)}; }
+inline SerializedValue serialized(const String& p) { return SerializedValue{p.s}; }
+
+class JsonObject;
+class JsonArray;
+
+class JsonString {
+ public:
+  JsonString() {}
+  explicit JsonString(const std::string& value) : value(value) {}
+  const char* c_str() const { return value.c_str(); }
+  size_t size() const { return value.size(); }
+  bool operator==(const char* other) const { return value == other; }
+
+ private:
+  std::string value;
+};
+
+// A value in a document, or a member/element of one that may not exist yet: reading a missing
+// member gives null, writing creates it (and any missing parents)
+class JsonVariant {
+ public:
+  JsonVariant() {}
+  explicit JsonVariant(native_json::NodePtr node) : node(node) {}
+
+  // Copying binds to the same value; assigning a variant copies the value, like the library
+  JsonVariant(const JsonVariant& other) = default;
+  JsonVariant& operator=(const JsonVariant& other) { set(other); return *this; }
+
+  template <typename K> typename std::enable_if<!std::is_integral<K>::value, JsonVariant>::type
+  operator[](const K& key) const { return member(key); }
+  template <typename K> typename std::enable_if<std::is_integral<K>::value, JsonVariant>::type
+  operator[](K position) const { return element(position); }
+
+  bool isNull() const { native_json::NodePtr n = get(); return !n || n->type == native_json::Node::Null; }
+  size_t size() const {
+    native_json::NodePtr n = get();
+    if (!n) return 0;
+    return n->type == native_json::Node::Object ? n->members.size() : n->type == native_json::Node::Array ? n->items.size() : 0;
+  }
+  bool containsKey(const char* key) const {
+    native_json::NodePtr n = get();
+    return n && n->type == native_json::Node::Object && n->find(key) != nullptr;
+  }
+  bool containsKey(const String& key) const { return containsKey(key.c_str()); }
+  void remove(const char* key) {
+    native_json::NodePtr n = get();
+    if (!n || n->type != native_json::Node::Object) return;
+    for (auto it = n->members.begin(); it != n->members.end(); ++it) {
+      if (it->first == key) { n->members.erase(it); return; }
+    }
+  }
+
+  template <typename T> T as() const { return convert((T*)nullptr); }
+  template <typename T> bool is() const { return check((T*)nullptr); }
+  template <typename T> operator T() const { return as<T>(); }
+
+  template <typename T> T operator|(const T& fallback) const { return is<T>() ? as<T>() : fallback; }
+  const char* operator|(const char* fallback) const { return is<const char*>() ? as<const char*>() : fallback; }
+
+  bool set(const JsonVariant& other) {
+    native_json::NodePtr source = other.get();
+    native_json::NodePtr n = resolve();
+    if (!n) return false;
+    if (source && source != n) {
+      n->copyFrom(*source);
+    } else if (!source) {
+      n->clear();
+    }
+    return true;
+  }
+  template <typename T> bool set(const T& value) { *this = value; return true; }
+
+  JsonVariant& operator=(bool value) { setScalar(native_json::Node::Bool)->boolean = value; return *this; }
+  JsonVariant& operator=(signed char value) { return setInteger(value); }
+  JsonVariant& operator=(unsigned char value) { return setInteger(value); }
+  JsonVariant& operator=(short value) { return setInteger(value); }
+  JsonVariant& operator=(unsigned short value) { return setInteger(value); }
+  JsonVariant& operator=(int value) { return setInteger(value); }
+  JsonVariant& operator=(unsigned int value) { return setInteger(value); }
+  JsonVariant& operator=(long value) { return setInteger(value); }
+  JsonVariant& operator=(unsigned long value) { return setInteger(value); }
+  JsonVariant& operator=(long long value) { return setInteger(value); }
+  JsonVariant& operator=(unsigned long long value) { return setInteger(value); }
+  JsonVariant& operator=(float value) { setScalar(native_json::Node::Float)->real = value; return *this; }
+  JsonVariant& operator=(double value) { setScalar(native_json::Node::Float)->real = value; return *this; }
+  JsonVariant& operator=(const char* value) {
+    if (!value) { setScalar(native_json::Node::Null); return *this; }
+    setScalar(native_json::Node::String)->text = value;
+    return *this;
+  }
+  JsonVariant& operator=(const String& value) { setScalar(native_json::Node::String)->text = value.s; return *this; }
+  JsonVariant& operator=(const std::string& value) { setScalar(native_json::Node::String)->text = value; return *this; }
+  JsonVariant& operator=(const SerializedValue& value) { setScalar(native_json::Node::Raw)->text = value.raw; return *this; }
+  JsonVariant& operator=(std::nullptr_t) { setScalar(native_json::Node::Null); return *this; }
+
+  JsonObject createNestedObject() const;
+  JsonArray createNestedArray() const;
+  JsonObject createNestedObject(const char* key) const;
+  JsonArray createNestedArray(const char* key) const;
+  template <typename T> bool add(const T& value) const {
+    native_json::NodePtr n = resolve();
+    if (!n) return false;
+    if (n->type == native_json::Node::Null) n->type = native_json::Node::Array;
+    if (n->type != native_json::Node::Array) return false;
+    n->items.push_back(std::make_shared<native_json::Node>());
+    JsonVariant(n->items.back()) = value;
+    return true;
+  }
+  template <typename T> T to() const;
+
+  // Existing node, or null when the value (or a parent) is missing
+  native_json::NodePtr get() const {
+    if (node) return node;
+    if (!parent) return nullptr;
+    native_json::NodePtr p = parent->get();
+    if (!p) return nullptr;
+    if (index >= 0) {
+      return p->type == native_json::Node::Array && (size_t)index < p->items.size() ? p->items[index] : nullptr;
+    }
+    return p->type == native_json::Node::Object ? p->find(key.c_str()) : nullptr;
+  }
+
+  // Existing node, created (with the parents) when missing
+  native_json::NodePtr resolve() const {
+    if (node) return node;
+    if (!parent) return nullptr;
+    native_json::NodePtr p = parent->resolve();
+    if (!p) return nullptr;
+    if (index >= 0) {
+      if (p->type != native_json::Node::Array || (size_t)index >= p->items.size()) return nullptr;
+      return p->items[index];
+    }
+    if (p->type == native_json::Node::Null) p->type = native_json::Node::Object;
+    if (p->type != native_json::Node::Object) return nullptr;
+    native_json::NodePtr existing = p->find(key.c_str());
+    if (existing) return existing;
+    p->members.emplace_back(key, std::make_shared<native_json::Node>());
+    return p->members.back().second;
+  }
+
+ protected:
+  native_json::NodePtr node;
+  std::shared_ptr<JsonVariant> parent;
+  std::string key;
+  long index = -1;
+
+ private:
+  JsonVariant member(const char* name) const {
+    JsonVariant child;
+    child.parent = std::make_shared<JsonVariant>(*this);
+    child.key = name ? name : "";
+    return child;
+  }
+  JsonVariant member(const String& name) const { return member(name.c_str()); }
+  JsonVariant member(const std::string& name) const { return member(name.c_str()); }
+  JsonVariant element(size_t position) const {
+    JsonVariant child;
+    child.parent = std::make_shared<JsonVariant>(*this);
+    child.index = position;
+    return child;
+  }
+
+  native_json::Node* setScalar(native_json::Node::Type type) {
+    static native_json::Node discard;
+    native_json::NodePtr n = resolve();
+    if (!n) { discard.clear(); return &discard; }
+    n->clear();
+    n->type = type;
+    return n.get();
+  }
+  template <typename T> JsonVariant& setInteger(T value) {
+    setScalar(native_json::Node::Int)->integer = (long long)value;
+    return *this;
+  }
+
+  // as<T>()
+  bool convert(bool*) const {
+    native_json::NodePtr n = get();
+    if (!n) return false;
+    if (n->type == native_json::Node::Bool) return n->boolean;
+    if (n->type == native_json::Node::Int) return n->integer != 0;
+    if (n->type == native_json::Node::Float) return n->real != 0;
+    return false;
+  }
+  template <typename T> typename std::enable_if<native_json::IsInteger<T>::value || std::is_floating_point<T>::value, T>::type
+  convert(T*) const {
+    native_json::NodePtr n = get();
+    if (!n) return 0;
+    if (n->type == native_json::Node::Int) return (T)n->integer;
+    if (n->type == native_json::Node::Float) return (T)n->real;
+    if (n->type == native_json::Node::Bool) return (T)n->boolean;
+    return 0;
+  }
+  template <typename T> typename std::enable_if<std::is_enum<T>::value, T>::type convert(T*) const {
+    return (T)convert((long long*)nullptr);
+  }
+  const char* convert(const char**) const {
+    native_json::NodePtr n = get();
+    return n && n->type == native_json::Node::String ? n->text.c_str() : nullptr;
+  }
+  const char* convert(char**) const { return convert((const char**)nullptr); }
+  String convert(String*) const {
+    const char* text = convert((const char**)nullptr);
+    return text ? String(text) : String("null");
+  }
+  JsonVariant convert(JsonVariant*) const { return *this; }
+  JsonObject convert(JsonObject*) const;
+  JsonArray convert(JsonArray*) const;
+
+  // is<T>()
+  bool check(bool*) const { native_json::NodePtr n = get(); return n && n->type == native_json::Node::Bool; }
+  template <typename T> typename std::enable_if<native_json::IsInteger<T>::value || std::is_enum<T>::value, bool>::type
+  check(T*) const {
+    native_json::NodePtr n = get();
+    if (!n || n->type != native_json::Node::Int) return false;
+    long long value = n->integer;
+    typedef typename std::conditional<std::is_enum<T>::value, int, T>::type Limits;
+    return value >= (long long)std::numeric_limits<Limits>::min() &&
+           (value < 0 || (unsigned long long)value <= (unsigned long long)std::numeric_limits<Limits>::max());
+  }
+  template <typename T> typename std::enable_if<std::is_floating_point<T>::value, bool>::type check(T*) const {
+    native_json::NodePtr n = get();
+    return n && (n->type == native_json::Node::Int || n->type == native_json::Node::Float);
+  }
+  bool check(const char**) const { native_json::NodePtr n = get(); return n && n->type == native_json::Node::String; }
+  bool check(char**) const { return check((const char**)nullptr); }
+  bool check(String*) const { return check((const char**)nullptr); }
+  bool check(JsonVariant*) const { return true; }
+  bool check(JsonObject*) const { native_json::NodePtr n = get(); return n && n->type == native_json::Node::Object; }
+  bool check(JsonArray*) const { native_json::NodePtr n = get(); return n && n->type == native_json::Node::Array; }
+};
+
+class JsonPair {
+ public:
+  JsonPair(const std::string& name, native_json::NodePtr node) : name(name), node(node) {}
+  JsonString key() const { return JsonString(name); }
+  JsonVariant value() const { return JsonVariant(node); }
+
+ private:
+  std::string name;
+  native_json::NodePtr node;
+};
+
+class JsonObject : public JsonVariant {
+ public:
+  JsonObject() {}
+  explicit JsonObject(native_json::NodePtr node) : JsonVariant(node) {}
+  JsonObject(const JsonObject& other) = default;
+  JsonObject& operator=(const JsonObject& other) { node = other.get(); parent.reset(); key.clear(); index = -1; return *this; }
+  using JsonVariant::operator=;
+  operator bool() const { return !isNull(); }
+
+  struct iterator {
+    native_json::NodePtr owner;
+    size_t position;
+    JsonPair operator*() const { return JsonPair(owner->members[position].first, owner->members[position].second); }
+    iterator& operator++() { position++; return *this; }
+    bool operator!=(const iterator& other) const { return position != other.position; }
+  };
+  iterator begin() const { native_json::NodePtr n = get(); return iterator{n, 0}; }
+  iterator end() const {
+    native_json::NodePtr n = get();
+    return iterator{n, n && n->type == native_json::Node::Object ? n->members.size() : 0};
+  }
+};
+
+class JsonArray : public JsonVariant {
+ public:
+  JsonArray() {}
+  explicit JsonArray(native_json::NodePtr node) : JsonVariant(node) {}
+  JsonArray(const JsonArray& other) = default;
+  JsonArray& operator=(const JsonArray& other) { node = other.get(); parent.reset(); key.clear(); index = -1; return *this; }
+  using JsonVariant::operator=;
+  operator bool() const { return !isNull(); }
+
+  struct iterator {
+    native_json::NodePtr owner;
+    size_t position;
+    JsonVariant operator*() const { return JsonVariant(owner->items[position]); }
+    iterator& operator++() { position++; return *this; }
+    bool operator!=(const iterator& other) const { return position != other.position; }
+  };
+  iterator begin() const { native_json::NodePtr n = get(); return iterator{n, 0}; }
+  iterator end() const {
+    native_json::NodePtr n = get();
+    return iterator{n, n && n->type == native_json::Node::Array ? n->items.size() : 0};
+  }
+};
+
+typedef JsonObject JsonObjectConst;
+typedef JsonArray JsonArrayConst;
+typedef JsonVariant JsonVariantConst;
+
+inline JsonObject JsonVariant::convert(JsonObject*) const {
+  native_json::NodePtr n = get();
+  return n && n->type == native_json::Node::Object ? JsonObject(n) : JsonObject();
+}
+inline JsonArray JsonVariant::convert(JsonArray*) const {
+  native_json::NodePtr n = get();
+  return n && n->type == native_json::Node::Array ? JsonArray(n) : JsonArray();
+}
+template <typename T> T JsonVariant::to() const {
+  native_json::NodePtr n = resolve();
+  if (!n) return T();
+  n->clear();
+  n->type = std::is_same<T, JsonArray>::value ? native_json::Node::Array : native_json::Node::Object;
+  return T(n);
+}
+inline JsonObject JsonVariant::createNestedObject() const {
+  native_json::NodePtr n = resolve();
+  if (!n) return JsonObject();
+  if (n->type == native_json::Node::Null) n->type = native_json::Node::Array;
+  if (n->type != native_json::Node::Array) return JsonObject();
+  n->items.push_back(std::make_shared<native_json::Node>());
+  n->items.back()->type = native_json::Node::Object;
+  return JsonObject(n->items.back());
+}
+inline JsonArray JsonVariant::createNestedArray() const {
+  native_json::NodePtr n = resolve();
+  if (!n) return JsonArray();
+  if (n->type == native_json::Node::Null) n->type = native_json::Node::Array;
+  if (n->type != native_json::Node::Array) return JsonArray();
+  n->items.push_back(std::make_shared<native_json::Node>());
+  n->items.back()->type = native_json::Node::Array;
+  return JsonArray(n->items.back());
+}
+inline JsonObject JsonVariant::createNestedObject(const char* name) const { return (*this)[name].to<JsonObject>(); }
+inline JsonArray JsonVariant::createNestedArray(const char* name) const { return (*this)[name].to<JsonArray>(); }
+
+class JsonDocument : public JsonVariant {
+ public:
+  explicit JsonDocument(size_t capacity) : JsonVariant(std::make_shared<native_json::Node>()), limit(capacity) {}
+  JsonDocument(const JsonDocument& other) : JsonVariant(std::make_shared<native_json::Node>()), limit(other.limit) {
+    node->copyFrom(*other.node);
+  }
+  JsonDocument& operator=(const JsonDocument& other) { node->copyFrom(*other.node); return *this; }
+  using JsonVariant::operator=;
+  void clear() { node->clear(); }
+  size_t capacity() const { return limit; }
+  size_t memoryUsage() const { return 0; }
+  bool overflowed() const { return false; }
+
+ private:
+  size_t limit;
+};
+
+template <size_t N> class StaticJsonDocument : public JsonDocument {
+ public:
+  StaticJsonDocument() : JsonDocument(N) {}
+  using JsonDocument::operator=;
+};
+
+class DynamicJsonDocument : public JsonDocument {
+ public:
+  explicit DynamicJsonDocument(size_t capacity) : JsonDocument(capacity) {}
+  using JsonDocument::operator=;
+};
+
+class DeserializationError {
+ public:
+  enum Code { Ok, EmptyInput, IncompleteInput, InvalidInput, NoMemory, TooDeep };
+  DeserializationError(Code code = Ok) : value(code) {}
+  Code code() const { return value; }
+  explicit operator bool() const { return value != Ok; }
+  bool operator==(Code other) const { return value == other; }
+  bool operator!=(Code other) const { return value != other; }
+  const char* c_str() const {
+    static const char* names[] = {"Ok", "EmptyInput", "IncompleteInput", "InvalidInput", "NoMemory", "TooDeep"};
+    return names[value];
+  }
+
+ private:
+  Code value;
+};
+
+namespace DeserializationOption {
+struct NestingLimit {
+  explicit NestingLimit(int limit) : limit(limit) {}
+  int limit;
+};
+}  // namespace DeserializationOption
+
+DeserializationError deserializeJson(JsonDocument& doc, const char* input, size_t length,
+                                     DeserializationOption::NestingLimit nesting = DeserializationOption::NestingLimit(10));
+inline DeserializationError deserializeJson(JsonDocument& doc, const char* input,
+                                            DeserializationOption::NestingLimit nesting = DeserializationOption::NestingLimit(10)) {
+  return deserializeJson(doc, input, input ? strlen(input) : 0, nesting);
+}
+inline DeserializationError deserializeJson(JsonDocument& doc, char* input) { return deserializeJson(doc, (const char*)input); }
+inline DeserializationError deserializeJson(JsonDocument& doc, const uint8_t* input, size_t length) {
+  return deserializeJson(doc, (const char*)input, length);
+}
+inline DeserializationError deserializeJson(JsonDocument& doc, const String& input) {
+  return deserializeJson(doc, input.c_str(), input.length());
+}
+
+std::string toJson(const JsonVariant& value);
+inline size_t measureJson(const JsonVariant& value) { return toJson(value).size(); }
+inline size_t serializeJson(const JsonVariant& value, String& output) {
+  output.s = toJson(value);
+  return output.length();
+}
+inline size_t serializeJson(const JsonVariant& value, char* output, size_t size) {
+  // Like the library: truncated to fit, always terminated, returns the bytes written
+  if (size == 0) return 0;
+  std::string text = toJson(value);
+  size_t length = std::min(text.size(), size - 1);
+  memcpy(output, text.data(), length);
+  output[length] = '\0';
+  return length;
+}
+inline size_t serializeJson(const JsonVariant& value, uint8_t* output, size_t size) {
+  return serializeJson(value, (char*)output, size);
+}
+inline size_t serializeJson(const JsonVariant& value, Print& output) {
+  std::string text = toJson(value);
+  return output.write((const uint8_t*)text.data(), text.size());
+}
+
+#define JSON_OBJECT_SIZE(n) ((n) * 16)
+#define JSON_ARRAY_SIZE(n) ((n) * 16)
@@ -0,0 +1,170 @@
+// ESPAsyncWebServer for the host build: routes are accepted and never served. A test builds an
+// AsyncWebServerRequest by hand (headers, params) and calls the handler; the reply is recorded.
+#pragma once
+#include "WiFi.h"
+#include <functional>
+#include <map>
+
+typedef enum {
+  HTTP_GET = 0b00000001, HTTP_POST = 0b00000010, HTTP_DELETE = 0b00000100, HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000, HTTP_HEAD = 0b00100000, HTTP_OPTIONS = 0b01000000, HTTP_ANY = 0b01111111
+} WebRequestMethod;
+typedef uint8_t WebRequestMethodComposite;
+
+class AsyncWebParameter {
+ public:
+  explicit AsyncWebParameter(const String& value) : text(value) {}
+  const String& value() const { return text;  }
+
+ private:
+  String text;
+};
+
+class AsyncWebHeader {
+ public:
+  explicit AsyncWebHeader(const String& value) : text(value) {}
+  const String& value() const { return text; }
+
+ private:
+  String text;
+};
+
+class AsyncWebServerResponse {
+ public:
+  virtual ~AsyncWebServerResponse() {}
+  void addHeader(const String& name, const String& value) { headers[name.s] = value.s; }
+  void setCode(int value) { code = value; }
+  int code = 200;
+  std::string contentType;
+  std::string body;
+  std::map<std::string, std::string> headers;
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+ public:
+  size_t write(const uint8_t* b, size_t n) override { body.append((const char*)b, n); return n; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  using Print::write;
+};
+
+typedef std::function<String(const String&)> AwsTemplateProcessor;
+class AsyncClient { public: IPAddress remoteIP() { return IPAddress(10, 0, 0, 9); } };
+
+class AsyncWebServerRequest {
+ public:
+  ~AsyncWebServerRequest() {
+    if (onClose) onClose();
+    delete response;
+  }
+  void* _tempObject = nullptr;
+  AsyncClient* client() { static AsyncClient c; return &c; }
+  bool hasParam(const String& name, bool = false, bool = false) const { return params.count(name.s) > 0; }
+  AsyncWebParameter* getParam(const String& name, bool = false, bool = false) {
+    auto it = params.find(name.s);
+    return it == params.end() ? nullptr : &it->second;
+  }
+  bool hasHeader(const String& name) const { return headers.count(name.s) > 0; }
+  AsyncWebHeader* getHeader(const String& name) {
+    auto it = headers.find(name.s);
+    return it == headers.end() ? nullptr : &it->second;
+  }
+  WebRequestMethodComposite method() const { return requestMethod; }
+  size_t contentLength() const { return length; }
+  void send(int code, const String& type = String(), const String& content = String()) {
+    AsyncWebServerResponse* reply = beginResponse(code, type, content);
+    send(reply);
+  }
+  void send(AsyncWebServerResponse* reply) {
+    delete response;
+    response = reply;
+  }
+  AsyncWebServerResponse* beginResponse(int code, const String& type = String(), const String& content = String()) {
+    AsyncWebServerResponse* reply = new AsyncWebServerResponse();
+    reply->code = code;
+    reply->contentType = type.s;
+    reply->body = content.s;
+    return reply;
+  }
+  AsyncWebServerResponse* beginResponse_P(int code, const String& type, const uint8_t* content, size_t length,
+                                          AwsTemplateProcessor = nullptr) {
+    return beginResponse(code, type, String(std::string((const char*)content, length)));
+  }
+  // Chunked bodies are drained at once, in the chunk sizes the server would ask for
+  AsyncWebServerResponse* beginResponse(const String& type, size_t length,
+                                        std::function<size_t(uint8_t*, size_t, size_t)> filler) {
+    AsyncWebServerResponse* reply = beginResponse(200, type);
+    uint8_t chunk[1024];
+    for (size_t index = 0; index < length;) {
+      size_t n = filler(chunk, sizeof(chunk), index);
+      if (n == 0) break;
+      reply->body.append((const char*)chunk, n);
+      index += n;
+    }
+    return reply;
+  }
+  AsyncResponseStream* beginResponseStream(const String& type, size_t = 1460) {
+    AsyncResponseStream* reply = new AsyncResponseStream();
+    reply->contentType = type.s;
+    return reply;
+  }
+  void onDisconnect(std::function<void()> handler) { onClose = handler; }
+
+  // Set up by the test
+  void addHeader(const std::string& name, const std::string& value) { headers.emplace(name, AsyncWebHeader(String(value))); }
+  void addParam(const std::string& name, const std::string& value) { params.emplace(name, AsyncWebParameter(String(value))); }
+  WebRequestMethodComposite requestMethod = HTTP_GET;
+  size_t length = 0;
+  AsyncWebServerResponse* response = nullptr;  // Last reply sent
+
+ private:
+  std::map<std::string, AsyncWebHeader> headers;
+  std::map<std::string, AsyncWebParameter> params;
+  std::function<void()> onClose;
+};
+
+typedef std::function<void(AsyncWebServerRequest*)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest*, const String&, size_t, uint8_t*, size_t, bool)> ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest*, uint8_t*, size_t, size_t, size_t)> ArBodyHandlerFunction;
+
+class AsyncWebHandler {};
+class AsyncCallbackWebHandler : public AsyncWebHandler {};
+
+class AsyncEventSourceClient {
+ public:
+  void send(const char*, const char* = nullptr, uint32_t = 0, uint32_t = 0) {}
+  uint32_t lastId() const { return 0; }
+};
+typedef std::function<void(AsyncEventSourceClient*)> ArEventHandlerFunction;
+
+class AsyncEventSource : public AsyncWebHandler {
+ public:
+  AsyncEventSource(const String&) {}
+  void onConnect(ArEventHandlerFunction) {}
+  void setFilter(std::function<bool(AsyncWebServerRequest*)>) {}
+  void send(const char*, const char* = nullptr, uint32_t = 0, uint32_t = 0) {}
+  size_t count() const { return 0; }
+  size_t avgPacketsWaiting() const { return 0; }
+};
+
+class AsyncWebServer {
+ public:
+  AsyncWebServer(uint16_t) {}
+  void begin() {}
+  void end() {}
+  AsyncCallbackWebHandler& on(const char*, ArRequestHandlerFunction) { return handler; }
+  AsyncCallbackWebHandler& on(const char*, WebRequestMethodComposite, ArRequestHandlerFunction) { return handler; }
+  AsyncCallbackWebHandler& on(const char*, WebRequestMethodComposite, ArRequestHandlerFunction, ArUploadHandlerFunction) { return handler; }
+  AsyncCallbackWebHandler& on(const char*, WebRequestMethodComposite, ArRequestHandlerFunction, ArUploadHandlerFunction,
+                              ArBodyHandlerFunction) { return handler; }
+  AsyncWebHandler& addHandler(AsyncWebHandler* h) { return *h; }
+  void onNotFound(ArRequestHandlerFunction) {}
+
+ private:
+  AsyncCallbackWebHandler handler;
+};
+
+class DefaultHeaders {
+ public:
+  static DefaultHeaders& Instance() { static DefaultHeaders d; return d; }
+  void addHeader(const String&, const String&) {}
+};
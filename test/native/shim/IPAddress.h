@@ -0,0 +1,31 @@
+#pragma once
+#include "Arduino.h"
+
+class IPAddress {
+ public:
+  uint8_t b[4] = {0};
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t c, uint8_t d, uint8_t e) { b[0] = a; b[1] = c; b[2] = d; b[3] = e; }
+  IPAddress(uint32_t v) { memcpy(b, &v, 4); }
+  bool fromString(const char* text) {
+    unsigned parts[4];
+    char tail;
+    if (sscanf(text, "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &tail) != 4) return false;
+    for (int i = 0; i < 4; i++) {
+      if (parts[i] > 255) return false;
+      b[i] = parts[i];
+    }
+    return true;
+  }
+  bool fromString(const String& text) { return fromString(text.c_str()); }
+  String toString() const {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+    return String(text);
+  }
+  operator uint32_t() const { uint32_t v; memcpy(&v, b, 4); return v; }
+  uint8_t operator[](int i) const { return b[i]; }
+  uint8_t& operator[](int i) { return b[i]; }
+  bool operator==(const IPAddress& o) const { return memcmp(b, o.b, 4) == 0; }
+  bool operator!=(const IPAddress& o) const { return !(*this == o); }
+};
@@ -0,0 +1,69 @@
+// NVS for the host build, kept in native::nvs() so it survives end()/begin() like flash
+#pragma once
+#include "Arduino.h"
+#include "native.h"
+
+class Preferences {
+ public:
+  bool begin(const char* name, bool readOnly = false, const char* = nullptr) {
+    space = name;
+    writable = !readOnly;
+    open = true;
+    return true;
+  }
+  void end() { open = false; }
+  bool clear() { return writable && (native::nvs()[space].clear(), true); }
+  bool remove(const char* key) { return writable && native::nvs()[space].erase(key) > 0; }
+  bool isKey(const char* key) { return open && native::nvs()[space].count(key) > 0; }
+
+  size_t putBytes(const char* key, const void* value, size_t length);
+  size_t putString(const char* key, const char* value) { return putBytes(key, value, strlen(value) + 1); }
+  size_t putString(const char* key, const String& value) { return putString(key, value.c_str()); }
+  size_t putInt(const char* key, int32_t value) { return putBytes(key, &value, sizeof(value)); }
+  size_t putUInt(const char* key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+  size_t putBool(const char* key, bool value) { uint8_t v = value; return putBytes(key, &v, 1); }
+
+  size_t getBytesLength(const char* key) {
+    const std::vector<uint8_t>* value = find(key);
+    return value ? value->size() : 0;
+  }
+  size_t getBytes(const char* key, void* buffer, size_t length) {
+    native::nvsBlobReads()++;
+    const std::vector<uint8_t>* value = find(key);
+    if (!value || value->size() > length) return 0;
+    memcpy(buffer, value->data(), value->size());
+    return value->size();
+  }
+  String getString(const char* key, const String& fallback = String()) {
+    const std::vector<uint8_t>* value = find(key);
+    return value && !value->empty() ? String(std::string((const char*)value->data(), value->size() - 1)) : fallback;
+  }
+  size_t getString(const char* key, char* buffer, size_t length) {
+    const std::vector<uint8_t>* value = find(key);
+    if (!value || value->empty() || value->size() > length) return 0;
+    memcpy(buffer, value->data(), value->size());
+    return value->size();
+  }
+  int32_t getInt(const char* key, int32_t fallback = 0) { return get(key, fallback); }
+  uint32_t getUInt(const char* key, uint32_t fallback = 0) { return get(key, fallback); }
+  bool getBool(const char* key, bool fallback = false) { return get<uint8_t>(key, fallback) != 0; }
+
+ private:
+  const std::vector<uint8_t>* find(const char* key) {
+    if (!open) return nullptr;
+    auto& entries = native::nvs()[space];
+    auto it = entries.find(key);
+    return it == entries.end() ? nullptr : &it->second;
+  }
+  template <typename T> T get(const char* key, T fallback) {
+    const std::vector<uint8_t>* value = find(key);
+    if (!value || value->size() != sizeof(T)) return fallback;
+    T result;
+    memcpy(&result, value->data(), sizeof(T));
+    return result;
+  }
+
+  std::string space;
+  bool writable = false;
+  bool open = false;
+};
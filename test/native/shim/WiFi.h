@@ -0,0 +1,108 @@
+// WiFi for the host build: no radio. Name lookups and TCP connects reach the mock endpoints of
+// native.h, UDP datagrams are recorded there.
+#pragma once
+#include "Arduino.h"
+#include "IPAddress.h"
+#include <memory>
+
+typedef enum { WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL, WL_SCAN_COMPLETED, WL_CONNECTED, WL_CONNECT_FAILED, WL_CONNECTION_LOST, WL_DISCONNECTED } wl_status_t;
+typedef enum { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+typedef enum { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM } wifi_ps_type_t;
+typedef enum {
+  ARDUINO_EVENT_WIFI_READY, ARDUINO_EVENT_WIFI_STA_START, ARDUINO_EVENT_WIFI_STA_STOP,
+  ARDUINO_EVENT_WIFI_STA_CONNECTED, ARDUINO_EVENT_WIFI_STA_DISCONNECTED, ARDUINO_EVENT_WIFI_STA_GOT_IP,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP, ARDUINO_EVENT_WIFI_AP_START, ARDUINO_EVENT_WIFI_AP_STACONNECTED
+} arduino_event_id_t;
+struct wifi_event_sta_connected_t { uint8_t ssid[32]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t channel; uint8_t authmode; };
+struct wifi_event_sta_disconnected_t { uint8_t ssid[32]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t reason; int8_t rssi; };
+struct ip_event_got_ip_t { struct { struct { uint32_t addr; } ip; } ip_info; };
+union arduino_event_info_t { wifi_event_sta_connected_t wifi_sta_connected; wifi_event_sta_disconnected_t wifi_sta_disconnected; ip_event_got_ip_t got_ip; };
+typedef int wifi_event_id_t;
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+namespace native { struct Socket; }
+
+class WiFiClient : public Stream {
+ public:
+  virtual ~WiFiClient() {}
+  int connect(IPAddress address, uint16_t port, int32_t timeout);
+  int connect(IPAddress address, uint16_t port) { return connect(address, port, 0); }
+  virtual uint8_t connected();
+  virtual void stop();
+  void setTimeout(uint32_t) {}
+  int setNoDelay(bool) { return 0; }
+  int fd() const { return socket ? 3 : -1; }
+  size_t write(const uint8_t* b, size_t n) override;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  using Print::write;
+  int available() override;
+  int read() override;
+  virtual int read(uint8_t* buffer, size_t size);
+  int peek() override;
+
+ private:
+  std::shared_ptr<native::Socket> socket;
+};
+
+class WiFiUDP : public Stream {
+ public:
+  uint8_t begin(uint16_t port) { localPort = port; return 1; }
+  void stop() {}
+  int beginPacket(IPAddress address, uint16_t port);
+  int beginPacket(const char* host, uint16_t port);
+  int endPacket();
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* b, size_t n) override;
+  using Print::write;
+  int parsePacket();
+  int available() override { return incoming.size() - readPos; }
+  int read() override { return readPos < incoming.size() ? (uint8_t)incoming[readPos++] : -1; }
+  int read(unsigned char* buffer, size_t size);
+  int read(char* buffer, size_t size) { return read((unsigned char*)buffer, size); }
+  IPAddress remoteIP() { return sender; }
+  uint16_t remotePort() { return 0; }
+  void flush() override {}
+  // Host tests: the next packet the sketch reads
+  void receive(const std::string& packet, IPAddress from) { incoming = packet; readPos = 0; sender = from; }
+
+ private:
+  uint16_t localPort = 0;
+  std::string destination;
+  uint16_t destinationPort = 0;
+  std::string outgoing;
+  std::string incoming;
+  size_t readPos = 0;
+  IPAddress sender;
+};
+
+class WiFiClass {
+ public:
+  bool mode(wifi_mode_t m) { currentMode = m; return true; }
+  wifi_mode_t getMode() { return currentMode; }
+  bool softAP(const char*, const char* = nullptr) { return true; }
+  IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+  wl_status_t begin(const char*, const char* = nullptr, int32_t = 0, const uint8_t* = nullptr, bool = true) { return WL_DISCONNECTED; }
+  bool config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress(), IPAddress = IPAddress()) { return true; }
+  wl_status_t status() { return WL_DISCONNECTED; }
+  IPAddress localIP() { return IPAddress(10, 0, 0, 2); }
+  IPAddress broadcastIP() { return IPAddress(10, 0, 0, 255); }
+  int8_t RSSI() { return -50; }
+  int8_t RSSI(uint8_t) { return -50; }
+  String SSID(uint8_t) { return String(); }
+  uint8_t* macAddress(uint8_t* mac) { static const uint8_t fixed[6] = {0xA1, 0xB2, 0xC3, 0xD4, 0xE5, 0xF6}; memcpy(mac, fixed, 6); return mac; }
+  int16_t scanNetworks(bool = false) { return WIFI_SCAN_RUNNING; }
+  int16_t scanComplete() { return 0; }
+  void scanDelete() {}
+  bool disconnect(bool = false, bool = false) { return true; }
+  bool setAutoReconnect(bool) { return true; }
+  bool setSleep(bool) { return true; }
+  bool setSleep(wifi_ps_type_t) { return true; }
+  bool persistent(bool) { return true; }
+  wifi_event_id_t onEvent(std::function<void(arduino_event_id_t, arduino_event_info_t)>, arduino_event_id_t = ARDUINO_EVENT_WIFI_READY) { return 0; }
+  int hostByName(const char* host, IPAddress& address);
+
+ private:
+  wifi_mode_t currentMode = WIFI_OFF;
+};
+extern WiFiClass WiFi;
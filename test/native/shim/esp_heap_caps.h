@@ -0,0 +1,10 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+typedef void (*esp_alloc_failed_hook_t)(size_t size, uint32_t caps, const char* function_name);
+int heap_caps_register_failed_alloc_callback(esp_alloc_failed_hook_t callback);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "esp_err.h"
+#define ESP_ERR_OTA_VALIDATE_FAILED 0x1503
+#define OTA_SIZE_UNKNOWN 0xffffffff
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+typedef uint32_t esp_ota_handle_t;
+typedef struct { int type; int subtype; uint32_t address; uint32_t size; char label[17]; bool encrypted; } esp_partition_t;
+typedef enum { ESP_OTA_IMG_NEW = 0, ESP_OTA_IMG_PENDING_VERIFY = 1, ESP_OTA_IMG_VALID = 2, ESP_OTA_IMG_INVALID = 3, ESP_OTA_IMG_ABORTED = 4, ESP_OTA_IMG_UNDEFINED = -1 } esp_ota_img_states_t;
+typedef struct { uint32_t magic_word; uint32_t secure_version; uint32_t reserv1[2]; char version[32]; char project_name[32]; char time[16]; char date[16]; char idf_ver[32]; uint8_t app_elf_sha256[32]; } esp_app_desc_t;
+const esp_partition_t* esp_ota_get_running_partition();
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t*);
+const esp_partition_t* esp_ota_get_last_invalid_partition();
+esp_err_t esp_ota_begin(const esp_partition_t*, size_t, esp_ota_handle_t*);
+esp_err_t esp_ota_write(esp_ota_handle_t, const void*, size_t);
+esp_err_t esp_ota_end(esp_ota_handle_t);
+esp_err_t esp_ota_abort(esp_ota_handle_t);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t*);
+esp_err_t esp_ota_get_state_partition(const esp_partition_t*, esp_ota_img_states_t*);
+esp_err_t esp_ota_mark_app_valid_cancel_rollback();
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot();
+esp_err_t esp_ota_get_partition_description(const esp_partition_t*, esp_app_desc_t*);
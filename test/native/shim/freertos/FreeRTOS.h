@@ -0,0 +1,52 @@
+// FreeRTOS for the host build: queues and semaphores work, tasks are recorded but never run
+// (tests call the worker's functions directly), critical sections are no-ops on one thread.
+#pragma once
+#include <cstdint>
+typedef void* QueueHandle_t;
+typedef void* TaskHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xffffffff
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define portTICK_PERIOD_MS 1
+#define portYIELD_FROM_ISR(...)
+typedef struct { int x; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(m) (void)(m)
+#define portEXIT_CRITICAL(m) (void)(m)
+#define portENTER_CRITICAL_ISR(m) (void)(m)
+#define portEXIT_CRITICAL_ISR(m) (void)(m)
+#define portENTER_CRITICAL_SAFE(m) (void)(m)
+#define portEXIT_CRITICAL_SAFE(m) (void)(m)
+#define ARDUINO_RUNNING_CORE 1
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t);
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t);
+void vQueueDelete(QueueHandle_t);
+
+BaseType_t xTaskCreatePinnedToCore(void (*)(void*), const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*, BaseType_t);
+BaseType_t xTaskCreate(void (*)(void*), const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*);
+void vTaskDelay(TickType_t);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+BaseType_t xTaskNotifyGive(TaskHandle_t);
+void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*);
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t);
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t);
+
+// Lock bookkeeping for tests: who holds a mutex, and the longest it was held
+int semaphoreDepth(SemaphoreHandle_t);
+int64_t semaphoreLongestHoldUs(SemaphoreHandle_t);
@@ -0,0 +1,6 @@
+#pragma once
+#include <cstddef>
+struct mbedtls_entropy_context { int x; };
+void mbedtls_entropy_init(mbedtls_entropy_context*);
+void mbedtls_entropy_free(mbedtls_entropy_context*);
+int mbedtls_entropy_func(void*, unsigned char*, size_t);
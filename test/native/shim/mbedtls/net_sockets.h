@@ -0,0 +1,3 @@
+#pragma once
+#define MBEDTLS_ERR_NET_CONN_RESET -0x0050
+#define MBEDTLS_ERR_NET_SEND_FAILED -0x004E
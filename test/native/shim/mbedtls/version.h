@@ -0,0 +1,2 @@
+#pragma once
+#define MBEDTLS_VERSION_MAJOR 3
@@ -0,0 +1,698 @@
+// Host implementations behind the shim headers: clock, pins, serial, NVS, FreeRTOS queues and
+// mutexes, the mock network, SHA-256 and the ESP-IDF calls patcom.cpp makes directly.
+#include "native.h"
+#include "Arduino.h"
+#include "Preferences.h"
+#include "WiFi.h"
+#include "esp_crt_bundle.h"
+#include "esp_heap_caps.h"
+#include "esp_ota_ops.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/ssl.h"
+#include <chrono>
+#include <deque>
+#include <memory>
+
+namespace {
+
+// Clock
+
+bool realClock = false;
+int64_t manualUs = 0;
+const auto bootTime = std::chrono::steady_clock::now();
+
+int64_t nowUs() {
+  if (!realClock) return manualUs;
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+void sleepUs(int64_t us) {
+  if (!realClock) manualUs += us;
+}
+
+// Pins, by Arduino pin number; inputs idle high like a pulled-up button
+
+const int PIN_COUNT = 64;
+int pinLevels[PIN_COUNT];
+
+void resetPins() {
+  for (int i = 0; i < PIN_COUNT; i++) pinLevels[i] = HIGH;
+}
+
+// Serial
+
+std::string serialIn;
+size_t serialInPos = 0;
+std::string serialOut;
+
+// NVS
+
+native::NvsContents nvsContents;
+bool nvsWritesFail = false;
+int blobReads = 0;
+
+// FreeRTOS
+
+struct Queue {
+  size_t capacity;
+  size_t itemSize;
+  std::deque<std::vector<uint8_t>> items;
+};
+
+struct Mutex {
+  bool recursive;
+  int depth = 0;
+  int64_t takenAt = 0;
+  int64_t longestHold = 0;
+};
+
+uint32_t pendingNotifications = 0;
+int dummyTask;
+
+// Network
+
+std::deque<native::Endpoint> endpoints;
+std::vector<native::Datagram> sentDatagrams;
+
+IPAddress endpointAddress(size_t index) {
+  return IPAddress(10, 0, 1, (uint8_t)(index + 1));
+}
+
+native::Endpoint* findEndpoint(IPAddress address, uint16_t port) {
+  for (size_t i = 0; i < endpoints.size(); i++) {
+    IPAddress literal;
+    bool matches = literal.fromString(endpoints[i].host.c_str()) ? literal == address : endpointAddress(i) == address;
+    if (matches && endpoints[i].port == port) return &endpoints[i];
+  }
+  return nullptr;
+}
+
+// Hands every complete request (head plus Content-Length body) to the endpoint
+void deliverRequests(native::Socket& socket) {
+  if (socket.endpoint->raw && !socket.pending.empty()) {
+    std::string request;
+    request.swap(socket.pending);
+    socket.endpoint->requests.push_back(request);
+    socket.received += socket.endpoint->handler(request);
+    if (socket.endpoint->closeAfterResponse) socket.open = false;
+    return;
+  }
+  for (;;) {
+    size_t headEnd = socket.pending.find("\r\n\r\n");
+    if (headEnd == std::string::npos) return;
+    size_t bodyLength = 0;
+    std::string head = socket.pending.substr(0, headEnd);
+    for (size_t line = 0; line < head.size();) {
+      size_t next = head.find("\r\n", line);
+      if (next == std::string::npos) next = head.size();
+      if (strncasecmp(head.c_str() + line, "Content-Length:", 15) == 0) bodyLength = atol(head.c_str() + line + 15);
+      line = next + 2;
+    }
+    size_t total = headEnd + 4 + bodyLength;
+    if (socket.pending.size() < total) return;
+
+    std::string request = socket.pending.substr(0, total);
+    socket.pending.erase(0, total);
+    socket.endpoint->requests.push_back(request);
+    std::string response = socket.endpoint->handler(request);
+    if (response.empty() || socket.endpoint->closeAfterResponse) socket.open = false;
+    socket.received += response;
+    if (!socket.open) return;
+  }
+}
+
+// Device state
+
+int restarts = 0;
+const esp_partition_t otaPartitions[2] = {
+  {0, 0x10, 0x10000, 0x300000, "app0", false},
+  {0, 0x11, 0x310000, 0x300000, "app1", false},
+};
+const esp_partition_t* bootPartition = &otaPartitions[0];
+const esp_partition_t* invalidPartition = nullptr;
+uint64_t wakeStatus = 0;      // EXT1 pins that woke the last deep sleep, 0 = power-on
+uint64_t ext1Armed = 0;
+uint64_t rtcPullups = 0;
+uint64_t gpioWakeArmed = 0;   // Every GPIO given a light-sleep wake level since reset  // Rolled back from, until it is flashed again
+uint64_t gpioIntrMasked = 0;  // GPIOs whose interrupt is disabled right now
+bool levelWakeUnmasked = false;  // A wake level was armed on a GPIO that could still interrupt
+esp_app_desc_t otaDescriptions[2];
+// The image being written: its esp_app_desc_t sits after the image and first segment headers
+const size_t APP_DESC_OFFSET = 32;
+const esp_partition_t* writingPartition = nullptr;
+size_t writtenBytes = 0;
+esp_app_desc_t writingDescription;
+uint32_t cpuMhz = 240;
+uint32_t randomState = 12345;
+
+}  // namespace
+
+// Harness controls
+
+namespace native {
+
+void setClockUs(int64_t us) { manualUs = us; }
+void advanceMs(unsigned long ms) { manualUs += (int64_t)ms * 1000; }
+void useRealClock(bool real) { realClock = real; }
+
+void setPin(uint8_t pin, int level) { if (pin < PIN_COUNT) pinLevels[pin] = level; }
+int pinLevel(uint8_t pin) { return pin < PIN_COUNT ? pinLevels[pin] : LOW; }
+
+void feedSerial(const std::string& input) { serialIn += input; }
+std::string takeSerialOutput() {
+  std::string output;
+  output.swap(serialOut);
+  return output;
+}
+bool verbose() {
+  static const bool enabled = getenv("PATCOM_NATIVE_VERBOSE") != nullptr;
+  return enabled;
+}
+
+NvsContents& nvs() { return nvsContents; }
+void failNvsWrites(bool fail) { nvsWritesFail = fail; }
+int& nvsBlobReads() { return blobReads; }
+
+Endpoint& serveHttp(const std::string& host, uint16_t port, HttpHandler handler) {
+  endpoints.emplace_back();
+  Endpoint& endpoint = endpoints.back();
+  endpoint.host = host;
+  endpoint.port = port;
+  endpoint.handler = handler;
+  return endpoint;
+}
+std::vector<Datagram>& datagrams() { return sentDatagrams; }
+void resetNetwork() {
+  endpoints.clear();
+  sentDatagrams.clear();
+}
+
+int restartCount() { return restarts; }
+
+void setDeepSleepWake(uint64_t ext1Gpios) { wakeStatus = ext1Gpios; }
+uint64_t ext1WakeGpios() { return ext1Armed; }
+uint64_t rtcPullupGpios() { return rtcPullups; }
+uint64_t lightSleepWakeGpios() { return gpioWakeArmed; }
+uint64_t maskedInterruptGpios() { return gpioIntrMasked; }
+bool wakeArmedUnmasked() { return levelWakeUnmasked; }
+
+void reset() {
+  realClock = false;
+  manualUs = 0;
+  resetPins();
+  serialIn.clear();
+  serialInPos = 0;
+  serialOut.clear();
+  nvsContents.clear();
+  nvsWritesFail = false;
+  blobReads = 0;
+  pendingNotifications = 0;
+  resetNetwork();
+  restarts = 0;
+  bootPartition = &otaPartitions[0];
+  invalidPartition = nullptr;
+  wakeStatus = ext1Armed = rtcPullups = gpioWakeArmed = gpioIntrMasked = 0;
+  levelWakeUnmasked = false;
+  for (esp_app_desc_t& description : otaDescriptions) {
+    memset(&description, 0, sizeof(description));
+    strcpy(description.version, "native");
+    strcpy(description.project_name, "patcom");
+  }
+}
+
+}  // namespace native
+
+// Arduino core
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+size_t HardwareSerial::write(const uint8_t* b, size_t n) {
+  serialOut.append((const char*)b, n);
+  if (native::verbose()) fwrite(b, 1, n, stdout);
+  return n;
+}
+int HardwareSerial::available() { return serialIn.size() - serialInPos; }
+int HardwareSerial::read() {
+  if (serialInPos >= serialIn.size()) return -1;
+  int c = (uint8_t)serialIn[serialInPos++];
+  if (serialInPos == serialIn.size()) {
+    serialIn.clear();
+    serialInPos = 0;
+  }
+  return c;
+}
+int HardwareSerial::peek() { return serialInPos < serialIn.size() ? (uint8_t)serialIn[serialInPos] : -1; }
+
+unsigned long millis() { return (unsigned long)(nowUs() / 1000); }
+unsigned long micros() { return (unsigned long)nowUs(); }
+void delay(unsigned long ms) { sleepUs((int64_t)ms * 1000); }
+void delayMicroseconds(unsigned int us) { sleepUs(us); }
+void yield() {}
+int64_t esp_timer_get_time() { return nowUs(); }
+
+void pinMode(uint8_t, uint8_t) {}
+int digitalRead(uint8_t pin) { return native::pinLevel(pin); }
+void digitalWrite(uint8_t pin, uint8_t level) { native::setPin(pin, level); }
+void analogWrite(uint8_t, int) {}
+uint16_t analogRead(uint8_t) { return 2048; }
+uint32_t analogReadMilliVolts(uint8_t) { return 1900; }
+void analogReadResolution(uint8_t) {}
+void analogSetPinAttenuation(uint8_t, int) {}
+void attachInterruptArg(uint8_t, void (*)(void*), void*, int) {}
+void detachInterrupt(uint8_t) {}
+
+int8_t digitalPinToGPIONumber(int8_t pin) {
+  static const int8_t gpios[] = {44, 43, 5, 6, 7, 8, 9, 10, 17, 18, 21, 38, 47, 48,  // D0-D13
+                                 1, 2, 3, 4, 11, 12, 13, 14};                        // A0-A7
+  return pin >= 0 && pin < (int8_t)sizeof(gpios) ? gpios[pin] : -1;
+}
+
+long random(long limit) { return limit > 0 ? (long)((randomState = randomState * 1103515245 + 12345) >> 8) % limit : 0; }
+long random(long low, long high) { return high > low ? low + random(high - low) : low; }
+
+bool setCpuFrequencyMhz(uint32_t mhz) { cpuMhz = mhz; return true; }
+uint32_t getCpuFrequencyMhz() { return cpuMhz; }
+uint32_t getXtalFrequencyMhz() { return 40; }
+
+bool ledcAttach(uint8_t, uint32_t, uint8_t) { return true; }
+bool ledcWrite(uint8_t, uint32_t) { return true; }
+bool ledcFade(uint8_t, uint32_t, uint32_t, int) { return true; }
+bool ledcDetach(uint8_t) { return true; }
+
+void EspClass::restart() { restarts++; }
+uint32_t EspClass::getFreeHeap() { return 200 * 1024; }
+uint32_t EspClass::getMinFreeHeap() { return 180 * 1024; }
+uint32_t EspClass::getMaxAllocHeap() { return 100 * 1024; }
+
+extern "C" size_t strlcpy(char* dst, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size > 0) {
+    size_t n = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return length;
+}
+extern "C" size_t strlcat(char* dst, const char* src, size_t size) {
+  size_t used = strnlen(dst, size);
+  return used == size ? size + strlen(src) : used + strlcpy(dst + used, src, size - used);
+}
+
+// Preferences
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t length) {
+  if (!open || !writable || nvsWritesFail) return 0;
+  nvsContents[space][key].assign((const uint8_t*)value, (const uint8_t*)value + length);
+  return length;
+}
+
+// FreeRTOS
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) { return new Queue{length, itemSize, {}}; }
+BaseType_t xQueueSend(QueueHandle_t handle, const void* item, TickType_t) {
+  Queue* queue = (Queue*)handle;
+  if (queue->items.size() >= queue->capacity) return pdFALSE;
+  queue->items.emplace_back((const uint8_t*)item, (const uint8_t*)item + queue->itemSize);
+  return pdTRUE;
+}
+BaseType_t xQueueReceive(QueueHandle_t handle, void* item, TickType_t) {
+  Queue* queue = (Queue*)handle;
+  if (queue->items.empty()) return pdFALSE;
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  return pdTRUE;
+}
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle) { return ((Queue*)handle)->items.size(); }
+void vQueueDelete(QueueHandle_t handle) { delete (Queue*)handle; }
+
+BaseType_t xTaskCreatePinnedToCore(void (*)(void*), const char*, uint32_t, void*, UBaseType_t, TaskHandle_t* handle,
+                                   BaseType_t) {
+  if (handle) *handle = &dummyTask;
+  return pdPASS;
+}
+BaseType_t xTaskCreate(void (*task)(void*), const char* name, uint32_t stack, void* parameter, UBaseType_t priority,
+                       TaskHandle_t* handle) {
+  return xTaskCreatePinnedToCore(task, name, stack, parameter, priority, handle, 0);
+}
+void vTaskDelay(TickType_t ticks) { sleepUs((int64_t)ticks * 1000); }
+TaskHandle_t xTaskGetCurrentTaskHandle() { return &dummyTask; }
+BaseType_t xTaskNotifyGive(TaskHandle_t) { pendingNotifications++; return pdPASS; }
+void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*) { pendingNotifications++; }
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  if (pendingNotifications == 0) {
+    if (ticks != portMAX_DELAY) sleepUs((int64_t)ticks * 1000);
+    return 0;
+  }
+  uint32_t count = pendingNotifications;
+  pendingNotifications = clear ? 0 : count - 1;
+  return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return new Mutex{false}; }
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new Mutex{true}; }
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t handle, TickType_t) {
+  Mutex* mutex = (Mutex*)handle;
+  // One thread: a second take of a plain mutex would block forever on the device
+  if (mutex->depth > 0 && !mutex->recursive) return pdFALSE;
+  if (mutex->depth++ == 0) mutex->takenAt = nowUs();
+  return pdTRUE;
+}
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t handle) {
+  Mutex* mutex = (Mutex*)handle;
+  if (mutex->depth == 0) return pdFALSE;
+  if (--mutex->depth == 0) mutex->longestHold = std::max(mutex->longestHold, nowUs() - mutex->takenAt);
+  return pdTRUE;
+}
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) { return xSemaphoreTakeRecursive(handle, ticks); }
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) { return xSemaphoreGiveRecursive(handle); }
+int semaphoreDepth(SemaphoreHandle_t handle) { return ((Mutex*)handle)->depth; }
+int64_t semaphoreLongestHoldUs(SemaphoreHandle_t handle) {
+  Mutex* mutex = (Mutex*)handle;
+  int64_t longest = mutex->longestHold;
+  mutex->longestHold = 0;
+  return longest;
+}
+
+// WiFi
+
+int WiFiClass::hostByName(const char* host, IPAddress& address) {
+  if (address.fromString(host)) return 1;
+  for (size_t i = 0; i < endpoints.size(); i++) {
+    if (endpoints[i].host == host) {
+      address = endpointAddress(i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int WiFiClient::connect(IPAddress address, uint16_t port, int32_t) {
+  native::Endpoint* endpoint = findEndpoint(address, port);
+  socket.reset();
+  if (!endpoint) return 0;
+  endpoint->connects++;
+  socket = std::make_shared<native::Socket>();
+  socket->endpoint = endpoint;
+  socket->open = true;
+  return 1;
+}
+uint8_t WiFiClient::connected() { return socket && (socket->open || available() > 0); }
+void WiFiClient::stop() { socket.reset(); }
+size_t WiFiClient::write(const uint8_t* b, size_t n) {
+  if (!socket || !socket->open) return 0;
+  socket->pending.append((const char*)b, n);
+  deliverRequests(*socket);
+  return n;
+}
+int WiFiClient::available() { return socket ? socket->received.size() - socket->readPos : 0; }
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+  size_t n = std::min(size, (size_t)available());
+  if (n == 0) return -1;
+  memcpy(buffer, socket->received.data() + socket->readPos, n);
+  socket->readPos += n;
+  return n;
+}
+int WiFiClient::peek() { return available() > 0 ? (uint8_t)socket->received[socket->readPos] : -1; }
+
+int WiFiUDP::beginPacket(IPAddress address, uint16_t port) {
+  destination = address.toString().s;
+  destinationPort = port;
+  outgoing.clear();
+  return 1;
+}
+int WiFiUDP::beginPacket(const char* host, uint16_t port) {
+  destination = host;
+  destinationPort = port;
+  outgoing.clear();
+  return 1;
+}
+// Like the Arduino-ESP32 driver, a full 1460-byte buffer goes out as a datagram of its own
+size_t WiFiUDP::write(const uint8_t* b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    outgoing += (char)b[i];
+    if (outgoing.size() == 1460) endPacket();
+  }
+  return n;
+}
+int WiFiUDP::endPacket() {
+  sentDatagrams.push_back({destination, destinationPort, outgoing});
+  outgoing.clear();
+  return 1;
+}
+int WiFiUDP::parsePacket() { return 0; }
+int WiFiUDP::read(unsigned char* buffer, size_t size) {
+  size_t n = std::min(size, incoming.size() - readPos);
+  memcpy(buffer, incoming.data() + readPos, n);
+  readPos += n;
+  return n;
+}
+
+// ESP-IDF
+
+const char* esp_err_to_name(esp_err_t code) {
+  switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_OTA_VALIDATE_FAILED: return "ESP_ERR_OTA_VALIDATE_FAILED";
+    default: return "UNKNOWN_ERROR";
+  }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+int heap_caps_register_failed_alloc_callback(esp_alloc_failed_hook_t) { return ESP_OK; }
+size_t heap_caps_get_largest_free_block(uint32_t) { return 100 * 1024; }
+size_t heap_caps_get_free_size(uint32_t) { return 200 * 1024; }
+size_t heap_caps_get_minimum_free_size(uint32_t) { return 180 * 1024; }
+
+const esp_partition_t* esp_ota_get_running_partition() { return bootPartition; }
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t*) {
+  return bootPartition == &otaPartitions[0] ? &otaPartitions[1] : &otaPartitions[0];
+}
+const esp_partition_t* esp_ota_get_last_invalid_partition() { return invalidPartition; }
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t, esp_ota_handle_t* handle) {
+  writingPartition = partition;
+  writtenBytes = 0;
+  memset(&writingDescription, 0, sizeof(writingDescription));
+  *handle = 1;
+  return ESP_OK;
+}
+esp_err_t esp_ota_write(esp_ota_handle_t, const void* data, size_t size) {
+  for (size_t i = 0; i < size; i++, writtenBytes++) {
+    if (writtenBytes >= APP_DESC_OFFSET && writtenBytes < APP_DESC_OFFSET + sizeof(writingDescription)) {
+      ((uint8_t*)&writingDescription)[writtenBytes - APP_DESC_OFFSET] = ((const uint8_t*)data)[i];
+    }
+  }
+  return ESP_OK;
+}
+// Images without an app description (test filler) keep the partition's old one
+esp_err_t esp_ota_end(esp_ota_handle_t) {
+  if (writingDescription.magic_word == 0xABCD5432) {
+    otaDescriptions[writingPartition - otaPartitions] = writingDescription;
+  }
+  return ESP_OK;
+}
+esp_err_t esp_ota_abort(esp_ota_handle_t) { return ESP_OK; }
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition) {
+  if (partition == invalidPartition) invalidPartition = nullptr;
+  bootPartition = partition;
+  return ESP_OK;
+}
+esp_err_t esp_ota_get_state_partition(const esp_partition_t* partition, esp_ota_img_states_t* state) {
+  *state = partition == invalidPartition ? ESP_OTA_IMG_INVALID : ESP_OTA_IMG_VALID;
+  return ESP_OK;
+}
+esp_err_t esp_ota_mark_app_valid_cancel_rollback() { return ESP_OK; }
+// The reboot into the previous image happens at once: the caller carries on as that image's boot
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot() {
+  invalidPartition = bootPartition;
+  bootPartition = bootPartition == &otaPartitions[0] ? &otaPartitions[1] : &otaPartitions[0];
+  restarts++;
+  return ESP_OK;
+}
+esp_err_t esp_ota_get_partition_description(const esp_partition_t* partition, esp_app_desc_t* desc) {
+  *desc = otaDescriptions[partition - otaPartitions];
+  return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() {
+  return wakeStatus != 0 ? ESP_SLEEP_WAKEUP_EXT1 : ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+uint64_t esp_sleep_get_ext1_wakeup_status() { return wakeStatus; }
+esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t) {
+  ext1Armed = mask;
+  return ESP_OK;
+}
+esp_err_t esp_sleep_enable_gpio_wakeup() { return ESP_OK; }
+esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t) { return ESP_OK; }
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t, esp_sleep_pd_option_t) { return ESP_OK; }
+esp_err_t esp_light_sleep_start() { return ESP_OK; }
+void esp_deep_sleep_start() { restarts++; }
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio, gpio_int_type_t) {
+  gpioWakeArmed |= 1ULL << gpio;
+  if (!(gpioIntrMasked & (1ULL << gpio))) levelWakeUnmasked = true;
+  return ESP_OK;
+}
+esp_err_t gpio_wakeup_disable(gpio_num_t) { return ESP_OK; }
+esp_err_t gpio_set_intr_type(gpio_num_t, gpio_int_type_t) { return ESP_OK; }
+esp_err_t gpio_intr_enable(gpio_num_t gpio) {
+  gpioIntrMasked &= ~(1ULL << gpio);
+  return ESP_OK;
+}
+esp_err_t gpio_intr_disable(gpio_num_t gpio) {
+  gpioIntrMasked |= 1ULL << gpio;
+  return ESP_OK;
+}
+esp_err_t rtc_gpio_pullup_en(gpio_num_t gpio) {
+  rtcPullups |= 1ULL << gpio;
+  return ESP_OK;
+}
+esp_err_t rtc_gpio_pulldown_dis(gpio_num_t) { return ESP_OK; }
+esp_err_t rtc_gpio_deinit(gpio_num_t) { return ESP_OK; }
+
+// mbedTLS: SHA-256 is real, TLS is not available on the host and every handshake fails
+
+namespace {
+
+const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void sha256Block(uint32_t* state, const unsigned char* block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t v[8];
+  memcpy(v, state, sizeof(v));
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = v[7] + (rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256K[i] + w[i];
+    uint32_t t2 = (rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+  for (int i = 0; i < 8; i++) state[i] += v[i];
+}
+
+}  // namespace
+
+void mbedtls_sha256_init(mbedtls_sha256_context* ctx) { memset(ctx, 0, sizeof(*ctx)); }
+void mbedtls_sha256_free(mbedtls_sha256_context* ctx) { memset(ctx, 0, sizeof(*ctx)); }
+int mbedtls_sha256_starts(mbedtls_sha256_context* ctx, int) {
+  static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, initial, sizeof(initial));
+  ctx->length = 0;
+  ctx->used = 0;
+  return 0;
+}
+int mbedtls_sha256_update(mbedtls_sha256_context* ctx, const unsigned char* input, size_t length) {
+  ctx->length += length;
+  while (length > 0) {
+    size_t n = std::min(length, sizeof(ctx->buffer) - ctx->used);
+    memcpy(ctx->buffer + ctx->used, input, n);
+    ctx->used += n;
+    input += n;
+    length -= n;
+    if (ctx->used == sizeof(ctx->buffer)) {
+      sha256Block(ctx->state, ctx->buffer);
+      ctx->used = 0;
+    }
+  }
+  return 0;
+}
+int mbedtls_sha256_finish(mbedtls_sha256_context* ctx, unsigned char* output) {
+  uint64_t bits = ctx->length * 8;
+  unsigned char pad = 0x80;
+  mbedtls_sha256_update(ctx, &pad, 1);
+  pad = 0;
+  while (ctx->used != 56) mbedtls_sha256_update(ctx, &pad, 1);
+  unsigned char lengthBytes[8];
+  for (int i = 0; i < 8; i++) lengthBytes[i] = (unsigned char)(bits >> (56 - 8 * i));
+  mbedtls_sha256_update(ctx, lengthBytes, 8);
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 4; j++) output[i * 4 + j] = (unsigned char)(ctx->state[i] >> (24 - 8 * j));
+  }
+  return 0;
+}
+int mbedtls_sha256(const unsigned char* input, size_t length, unsigned char* output, int is224) {
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, is224);
+  mbedtls_sha256_update(&ctx, input, length);
+  mbedtls_sha256_finish(&ctx, output);
+  return 0;
+}
+
+const int NO_TLS = -0x7080;  // MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE-like: there is no TLS stack here
+
+void mbedtls_ssl_init(mbedtls_ssl_context*) {}
+void mbedtls_ssl_free(mbedtls_ssl_context*) {}
+void mbedtls_ssl_config_init(mbedtls_ssl_config*) {}
+void mbedtls_ssl_config_free(mbedtls_ssl_config*) {}
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config*, int, int, int) { return 0; }
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config*, int) {}
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config*, int (*)(void*, unsigned char*, size_t), void*) {}
+void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config*, int) {}
+int mbedtls_ssl_setup(mbedtls_ssl_context*, const mbedtls_ssl_config*) { return 0; }
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context*, const char*) { return 0; }
+void mbedtls_ssl_set_bio(mbedtls_ssl_context*, void*, mbedtls_ssl_send_t*, mbedtls_ssl_recv_t*, mbedtls_ssl_recv_timeout_t*) {}
+int mbedtls_ssl_set_session(mbedtls_ssl_context*, const mbedtls_ssl_session*) { return 0; }
+int mbedtls_ssl_get_session(const mbedtls_ssl_context*, mbedtls_ssl_session*) { return NO_TLS; }
+void mbedtls_ssl_session_init(mbedtls_ssl_session*) {}
+void mbedtls_ssl_session_free(mbedtls_ssl_session*) {}
+int mbedtls_ssl_handshake(mbedtls_ssl_context*) { return NO_TLS; }
+int mbedtls_ssl_read(mbedtls_ssl_context*, unsigned char*, size_t) { return NO_TLS; }
+int mbedtls_ssl_write(mbedtls_ssl_context*, const unsigned char*, size_t) { return NO_TLS; }
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context*) { return 0; }
+int mbedtls_ssl_close_notify(mbedtls_ssl_context*) { return 0; }
+uint32_t mbedtls_ssl_get_verify_result(const mbedtls_ssl_context*) { return 0; }
+const mbedtls_x509_crt* mbedtls_ssl_get_peer_cert(const mbedtls_ssl_context*) { return nullptr; }
+void mbedtls_entropy_init(mbedtls_entropy_context*) {}
+void mbedtls_entropy_free(mbedtls_entropy_context*) {}
+int mbedtls_entropy_func(void*, unsigned char*, size_t) { return 0; }
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context*) {}
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context*) {}
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context*, int (*)(void*, unsigned char*, size_t), void*, const unsigned char*,
+                          size_t) { return 0; }
+int mbedtls_ctr_drbg_random(void*, unsigned char*, size_t) { return 0; }
+esp_err_t esp_crt_bundle_attach(void*) { return ESP_OK; }
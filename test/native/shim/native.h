@@ -0,0 +1,78 @@
+// Controls for the host build: the clock, pin levels, serial in/out, NVS contents and the mock
+// network the shims run against. Tests and benchmarks drive the firmware through these.
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace native {
+
+// Clock: manual by default so timing tests are exact; benchmarks switch to the real clock
+void setClockUs(int64_t us);
+void advanceMs(unsigned long ms);
+void useRealClock(bool real);
+
+// Button and other input levels, by Arduino pin number
+void setPin(uint8_t pin, int level);
+int pinLevel(uint8_t pin);
+
+// Serial: input is read by handleSerialCommands(), output is kept for assertions
+void feedSerial(const std::string& input);
+std::string takeSerialOutput();
+bool verbose();
+
+// Preferences (NVS), shared by every Preferences instance like the real partition
+typedef std::map<std::string, std::map<std::string, std::vector<uint8_t>>> NvsContents;
+NvsContents& nvs();
+void failNvsWrites(bool fail);
+int& nvsBlobReads();  // getBytes() calls since reset
+
+// Mock HTTP endpoint: gets each complete request (head and Content-Length body) and returns the
+// raw response; an empty response closes the connection without answering. A raw endpoint (MQTT)
+// gets each write as it arrives instead, and an empty response just sends nothing
+typedef std::function<std::string(const std::string& request)> HttpHandler;
+struct Endpoint {
+  std::string host;
+  uint16_t port;
+  HttpHandler handler;
+  bool closeAfterResponse = false;
+  bool raw = false;
+  int connects = 0;
+  std::vector<std::string> requests;
+};
+Endpoint& serveHttp(const std::string& host, uint16_t port, HttpHandler handler);
+
+struct Datagram {
+  std::string host;
+  uint16_t port;
+  std::string payload;
+};
+std::vector<Datagram>& datagrams();
+void resetNetwork();
+
+// ESP.restart() and esp_deep_sleep_start() do not return on the device; here they are counted
+int restartCount();
+
+// Sleep: the wake cause the next setup() sees, and the GPIOs the firmware armed (bit = GPIO number)
+void setDeepSleepWake(uint64_t ext1Gpios);
+uint64_t ext1WakeGpios();
+uint64_t rtcPullupGpios();
+uint64_t lightSleepWakeGpios();
+// Button interrupts must be masked while a wake level is armed, and unmasked again after waking
+uint64_t maskedInterruptGpios();
+bool wakeArmedUnmasked();
+
+// Everything above back to power-on state
+void reset();
+
+struct Socket {
+  Endpoint* endpoint = nullptr;
+  bool open = false;
+  std::string received;   // Response bytes not read yet
+  size_t readPos = 0;
+  std::string pending;    // Request bytes not yet handed to the endpoint
+};
+
+}  // namespace native
@@ -0,0 +1,979 @@
+// Host tests for the firmware: patcom.cpp is compiled as-is against the shims in shim/, setup()
+// runs like a power-on, and each test drives one path (config upload, blob storage, action
+// compile, button state machine, dispatch) on the manual clock. `--bench N` runs BENCH instead.
+#include "../../firmware/patcom.cpp"
+#include "native.h"
+
+#include <map>
+#include <string>
+#include <type_traits>
+
+static int failures = 0;
+
+#define CHECK(condition)                                                              \
+  do {                                                                                \
+    if (!(condition)) {                                                               \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition);   \
+      failures++;                                                                     \
+    }                                                                                 \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                                    \
+  do {                                                                                \
+    auto actualValue = (actual);                                                      \
+    auto expectedValue = (expected);                                                  \
+    if (!(actualValue == expectedValue)) {                                            \
+      fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %s (got %s, expected %s)\n", __FILE__, __LINE__, \
+              #actual, #expected, describe(actualValue).c_str(), describe(expectedValue).c_str());    \
+      failures++;                                                                     \
+    }                                                                                 \
+  } while (0)
+
+static std::string describe(const std::string& value) { return "\"" + value + "\""; }
+static std::string describe(const char* value) { return value ? describe(std::string(value)) : "NULL"; }
+template <typename T> static std::string describe(T value) {
+  if constexpr (std::is_same_v<T, bool>) return value ? "true" : "false";
+  return std::to_string((long long)value);
+}
+
+static bool contains(const std::string& text, const std::string& part) { return text.find(part) != std::string::npos; }
+
+// Power-on with whatever is in NVS; ends with the clock well past the boot delays
+static void boot() {
+  setup();
+  native::advanceMs(1000);
+  native::takeSerialOutput();
+}
+
+static bool upload(const std::string& json) {
+  std::string copy = json;  // Parsed in place
+  char message[STATUS_MESSAGE_MAX];
+  return handleConfigUpload(&copy[0], message, sizeof(message));
+}
+
+// Slots the presses so far handed to the worker, in order
+static std::vector<int> queuedSlots() {
+  std::vector<int> slots;
+  ActionEvent event;
+  while (xQueueReceive(actionQueue, &event, 0) == pdTRUE) {
+    if (event.buttonIndex != ACTION_EVENT_POOL_WARMUP) slots.push_back(event.buttonIndex);
+  }
+  return slots;
+}
+
+// A pin change as the hardware sees it: level on the pin, then the edge interrupt
+static void edge(int button, int level) {
+  native::setPin(buttonPins[button], level);
+  buttonEdgeISR((void*)(intptr_t)button);
+}
+
+// Runs loop()'s button work for `ms`, a millisecond at a time
+static void run(unsigned long ms) {
+  for (unsigned long i = 0; i < ms; i++) {
+    native::advanceMs(1);
+    processButtonEdges();
+  }
+  processButtonEdges();
+}
+
+static void press(int button, unsigned long holdMs) {
+  edge(button, LOW);
+  run(holdMs);
+  edge(button, HIGH);
+  processButtonEdges();
+}
+
+static const char* HTTP_BUTTON_CONFIG = R"({
+  "device": {"name": "Bench Rig"},
+  "apiKeys": {"TOKEN": "s3cret"},
+  "buttons": [
+    {"id": 0, "name": "Lamp", "action": 1, "enabled": true,
+     "config": {"url": "http://hooks.test:8080/press?room=1", "method": "GET",
+                "headers": {"Authorization": "Bearer {{key:TOKEN}}"}, "feedback": false}}
+  ]
+})";
+
+// Config upload
+
+static void testConfigUpload() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  CHECK(!contains(native::takeSerialOutput(), "s3cret"));  // Keys stay out of the log
+  CHECK_EQ(std::string(deviceConfig.deviceName), "Bench Rig");
+  CHECK_EQ(std::string(buttonConfigs[0].name), "Lamp");
+  CHECK_EQ((int)buttonConfigs[0].action, (int)ACTION_HTTP);
+  CHECK_EQ(std::string(getApiKey("TOKEN")), "s3cret");
+  CHECK_EQ(configDirty, 0u);
+  CHECK_EQ(compiledButtons[0].count, 1);
+
+  // Saved to the first blob slot on the way out
+  CHECK_EQ(configSlot, 0);
+  CHECK(native::nvs()["patcom"].count(CONFIG_BLOB_KEYS[0]) == 1);
+
+  // Uploading the same document again changes nothing and writes nothing
+  uint32_t sequence = configSequence;
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  CHECK_EQ(configSequence, sequence);
+
+  // A malformed document is refused without touching the config
+  std::string broken = "{\"device\": {\"name\": \"Broken\"";
+  char message[STATUS_MESSAGE_MAX];
+  CHECK(!handleConfigUpload(&broken[0], message, sizeof(message)));
+  CHECK_EQ(std::string(message), "Invalid JSON");
+  CHECK_EQ(std::string(deviceConfig.deviceName), "Bench Rig");
+
+  // An action config too large to store refuses the whole button, not just its config
+  std::string body = R"({"url": "http://hooks.test/", "body": ")" + std::string(600, 'b') + "\"}";
+  std::string oversized = R"({"buttons": [{"id": 1, "name": "Big", "action": 1, "config": )" + body + "}]}";
+  CHECK(!handleConfigUpload(&oversized[0], message, sizeof(message)));
+  CHECK(contains(message, "Button 1 config too large"));
+  CHECK(std::string(buttonConfigs[1].name) != "Big");
+  CHECK_EQ((int)buttonConfigs[1].action, (int)ACTION_NONE);
+  CHECK(!handleButtonPatch(1, (R"({"action": 1, "config": )" + body + "}").c_str(), message, sizeof(message)));
+  CHECK_EQ((int)buttonConfigs[1].action, (int)ACTION_NONE);
+}
+
+static void testSaveFailure() {
+  boot();
+  native::failNvsWrites(true);
+  std::string config = HTTP_BUTTON_CONFIG;
+  char message[STATUS_MESSAGE_MAX];
+  CHECK(!handleConfigUpload(&config[0], message, sizeof(message)));
+  CHECK(contains(message, "could not be saved"));
+  CHECK(configDirty != 0);
+  // Still live, just not on flash yet
+  CHECK_EQ(compiledButtons[0].count, 1);
+  CHECK(!handleButtonPatch(0, R"({"name": "Desk"})", message, sizeof(message)));
+
+  // The next commit saves everything still pending
+  native::failNvsWrites(false);
+  CHECK(handleButtonPatch(0, R"({"name": "Hall"})", message, sizeof(message)));
+  CHECK_EQ(configDirty, (uint32_t)0);
+  boot();
+  CHECK_EQ(std::string(buttonConfigs[0].name), "Hall");
+  CHECK_EQ(std::string(getApiKey("TOKEN")), "s3cret");
+  CHECK_EQ(compiledButtons[0].count, 1);
+}
+
+// get_config over UDP: every reply is one datagram of valid JSON
+static DynamicJsonDocument getConfigOverUdp() {
+  native::datagrams().clear();
+  std::string request = R"({"type": "get_config"})";
+  configUdp.receive(request, IPAddress(10, 0, 0, 9));
+  handleConfigPacket(request.size());
+  DynamicJsonDocument reply(4096);
+  CHECK_EQ(native::datagrams().size(), (size_t)1);
+  if (!native::datagrams().empty()) {
+    CHECK(!deserializeJson(reply, native::datagrams()[0].payload));
+    CHECK_EQ(native::datagrams()[0].port, CONFIG_PORT);
+  }
+  return reply;
+}
+
+static void testConfigUdp() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  DynamicJsonDocument reply = getConfigOverUdp();
+  CHECK_EQ(std::string(reply["type"] | ""), "config_response");
+  CHECK(!reply.containsKey("too_large"));
+  CHECK(reply["buttons"].size() > 0);
+
+  // Eight real targets do not fit a datagram: the reply says so and points at HTTP
+  std::string buttons;
+  for (int id = 0; id < 8; id++) {
+    buttons += std::string(id ? "," : "") + R"({"id": )" + std::to_string(id) +
+               R"(, "action": 1, "enabled": true, "config": {"url": "http://hooks.test:8080/api/services/light/toggle?entity=)" +
+               std::string(120, 'a' + id) + R"(", "method": "POST"}})";
+  }
+  CHECK(upload(R"({"buttons": [)" + buttons + "]}"));
+  reply = getConfigOverUdp();
+  CHECK_EQ(std::string(reply["type"] | ""), "config_response");
+  CHECK(reply["too_large"] | false);
+  CHECK(reply["use_http"] | false);
+  CHECK((reply["size"] | 0) > (int)UDP_PACKET_MAX);
+  char etag[32];
+  formatConfigETag(etag, sizeof(etag));
+  CHECK_EQ(std::string(reply["etag"] | ""), etag);
+  CHECK(!reply.containsKey("buttons"));
+}
+
+// Blob encode/decode
+
+static void testBlobRoundTrip() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  CHECK(upload(R"({"device": {"longPressMs": 900},
+                   "gestures": [{"id": 2, "type": "double", "buttons": [3], "action": 4, "enabled": true,
+                                 "config": {"url": "udp://10.0.0.5:9000", "payload": "{{button}}"}}]})"));
+
+  static uint8_t blob[CONFIG_BLOB_MAX_SIZE];
+  size_t length = encodeConfigBlob(blob, sizeof(blob), 7);
+  CHECK(length > sizeof(ConfigBlobHeader));
+  ConfigBlobHeader header;
+  memcpy(&header, blob, sizeof(header));
+  CHECK_EQ(header.magic, CONFIG_BLOB_MAGIC);
+  CHECK_EQ(header.sequence, 7u);
+  CHECK_EQ((size_t)header.length, length - sizeof(header));
+  CHECK_EQ(header.crc, esp_rom_crc32_le(0, blob + sizeof(header), header.length));
+
+  // Wipe what the blob carries, then decode it back
+  std::string actionData = buttonConfigs[0].actionData;
+  std::string gestureData = buttonConfigs[10].actionData;
+  strcpy(deviceConfig.deviceName, "wiped");
+  strcpy(buttonConfigs[0].name, "wiped");
+  resetConfigStore();
+  resetGestureSlots();
+  CHECK(decodeConfigBlob(blob + sizeof(header), header.length));
+  CHECK_EQ(std::string(deviceConfig.deviceName), "Bench Rig");
+  CHECK_EQ(std::string(buttonConfigs[0].name), "Lamp");
+  CHECK_EQ(std::string(buttonConfigs[0].actionData), actionData);
+  CHECK_EQ(std::string(getApiKey("TOKEN")), "s3cret");
+  CHECK_EQ(deviceConfig.longPressMs, 900);
+  CHECK_EQ((int)gestureBindings[2].type, (int)GESTURE_DOUBLE);
+  CHECK_EQ(gestureBindings[2].buttons, 1 << 3);
+  CHECK_EQ(std::string(buttonConfigs[10].actionData), gestureData);
+
+  // A truncated payload is an error, not a partial config
+  CHECK(!decodeConfigBlob(blob + sizeof(header), header.length / 2));
+
+  // Too small a buffer refuses to encode rather than writing a cut-off blob
+  CHECK_EQ(encodeConfigBlob(blob, 64, 1), (size_t)0);
+}
+
+static void testBlobSlots() {
+  boot();
+  CHECK(upload(R"({"device": {"name": "First"}})"));
+  CHECK(upload(R"({"device": {"name": "Second"}})"));
+  CHECK_EQ(configSlot, 1);
+  uint32_t sequence = configSequence;
+
+  // Power-on loads the newest slot, reading each slot once
+  strcpy(deviceConfig.deviceName, "wiped");
+  native::nvsBlobReads() = 0;
+  loadConfiguration();
+  CHECK_EQ(std::string(deviceConfig.deviceName), "Second");
+  CHECK_EQ(configSequence, sequence);
+  CHECK_EQ(native::nvsBlobReads(), 2);
+
+  // A corrupt newest slot falls back to the older copy
+  native::nvs()["patcom"][CONFIG_BLOB_KEYS[1]].back() ^= 0xFF;
+  loadConfiguration();
+  CHECK_EQ(std::string(deviceConfig.deviceName), "First");
+  CHECK_EQ(configSlot, 0);
+
+  // The next save goes over the corrupt slot, not the good one
+  CHECK(upload(R"({"device": {"name": "Third"}})"));
+  CHECK_EQ(configSlot, 1);
+  loadConfiguration();
+  CHECK_EQ(std::string(deviceConfig.deviceName), "Third");
+
+  // A newer slot that passes CRC but is cut short is never half-applied over the older copy
+  CHECK(upload(R"({"device": {"name": "Fourth"}, "network": {"ssid": "home"}})"));
+  CHECK_EQ(configSlot, 0);
+  sequence = configSequence;
+  strcpy(deviceConfig.deviceName, "Bogus");
+  strcpy(networkConfig.ssid, "bogus");
+  static uint8_t blob[CONFIG_BLOB_MAX_SIZE];
+  encodeConfigBlob(blob, sizeof(blob), sequence + 1);
+  ConfigBlobHeader header;
+  memcpy(&header, blob, sizeof(header));
+  header.length = 40;  // Through the network strings, short of the button table
+  header.crc = esp_rom_crc32_le(0, blob + sizeof(header), header.length);
+  memcpy(blob, &header, sizeof(header));
+  native::nvs()["patcom"][CONFIG_BLOB_KEYS[1]].assign(blob, blob + sizeof(header) + header.length);
+  native::takeSerialOutput();
+  loadConfiguration();
+  CHECK(contains(native::takeSerialOutput(), "did not decode"));
+  CHECK_EQ(configSlot, 0);
+  CHECK_EQ(configSequence, sequence);
+  CHECK_EQ(std::string(deviceConfig.deviceName), "Fourth");
+  CHECK_EQ(std::string(networkConfig.ssid), "home");
+
+  // Neither slot usable: defaults, nothing left over from the bad one
+  native::nvs()["patcom"][CONFIG_BLOB_KEYS[0]] = native::nvs()["patcom"][CONFIG_BLOB_KEYS[1]];
+  loadConfiguration();
+  CHECK_EQ(configSlot, -1);
+  CHECK(std::string(networkConfig.ssid) != "bogus");
+}
+
+// Action compile
+
+static void testCompileHttp() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  const CompiledAction& action = *compiledButtons[0].actions[0];
+  CHECK(action.valid);
+  CHECK_EQ(std::string(action.host), "hooks.test");
+  CHECK_EQ(action.port, 8080);
+  CHECK(!action.secure);
+  CHECK_EQ((int)action.method, (int)METHOD_GET);
+  std::string head(action.requestHead, action.requestHeadLength);
+  CHECK(head.rfind("GET /press?room=1 HTTP/1.1\r\nHost: hooks.test:8080\r\n", 0) == 0);
+  CHECK(contains(head, "Authorization: Bearer s3cret\r\n"));
+  CHECK(!contains(head, "Content-Length"));  // Added per send
+  CHECK_EQ(std::string(action.url), "http://hooks.test:8080/press?room=1");  // Keeps the template, never the key
+
+  // Changing the key recompiles the target that uses it
+  CHECK(upload(R"({"apiKeys": {"TOKEN": "rotated"}})"));
+  head.assign(compiledButtons[0].actions[0]->requestHead, compiledButtons[0].actions[0]->requestHeadLength);
+  CHECK(contains(head, "Authorization: Bearer rotated\r\n"));
+
+  // A reference to a missing key leaves the target invalid
+  CHECK(upload(R"({"apiKeys": {"TOKEN": ""}})"));
+  CHECK(!compiledButtons[0].actions[0]->valid);
+  CHECK(compiledButtons[0].actions[0]->keyMissing);
+
+  // A query right after the host still gets an absolute path
+  CHECK(upload(R"({"buttons": [{"id": 1, "action": 1, "enabled": true, "config": {"url": "http://hooks.test?room=2"}}]})"));
+  head.assign(compiledButtons[1].actions[0]->requestHead, compiledButtons[1].actions[0]->requestHeadLength);
+  CHECK(head.rfind("POST /?room=2 HTTP/1.1\r\nHost: hooks.test\r\n", 0) == 0);
+
+  UrlParts parts;
+  CHECK(parseUrl("http://hooks.test:8080?a=1", parts));
+  CHECK_EQ(parts.port, 8080);
+  CHECK_EQ(std::string(parts.pathPrefix) + parts.path, "/?a=1");
+  CHECK(parseUrl("mqtt://broker.test:1884", parts));
+  CHECK_EQ(std::string(parts.path), "/");
+  CHECK(!parseUrl("http://hooks.test:80abc/x", parts));
+  CHECK(!parseUrl("http://hooks.test:+80/x", parts));
+  CHECK(!parseUrl("http://hooks.test:/x", parts));
+  CHECK(!parseUrl("udp://10.0.0.5:9000x", parts));
+}
+
+static void testCompileWebhookAndChain() {
+  boot();
+  CHECK(upload(R"({"buttons": [
+    {"id": 1, "name": "Door", "action": 2, "enabled": true,
+     "config": {"url": "https://hooks.test/door", "secret": "abc"}},
+    {"id": 3, "name": "Lab", "action": 1, "enabled": true,
+     "config": {"url": "https://lab.test/go", "tls": {"verify": false}}},
+    {"id": 2, "name": "Scene", "action": 1, "enabled": true,
+     "config": {"stop_on_error": true, "actions": [
+       {"type": "http", "url": "http://hooks.test/a", "stage": 0},
+       {"type": "mqtt", "url": "mqtt://broker.test", "topic": "home/scene", "payload": "{{button}}", "qos": 2, "stage": 1},
+       {"type": "udp", "url": "udp://10.0.0.5:9000", "payload": "go", "stage": 1}]}}
+  ]})"));
+
+  const CompiledAction& webhook = *compiledButtons[1].actions[0];
+  CHECK(webhook.valid);
+  CHECK(webhook.secure);
+  CHECK_EQ(webhook.port, 443);
+  CHECK(webhook.tls.verifyChain);  // On unless turned off
+  CHECK(!compiledButtons[3].actions[0]->tls.verifyChain);
+  CHECK(contains(native::takeSerialOutput(), "lab.test is encrypted but not verified"));
+  std::string head(webhook.requestHead, webhook.requestHeadLength);
+  CHECK(head.rfind("POST /door HTTP/1.1\r\nHost: hooks.test\r\n", 0) == 0);
+  CHECK(contains(head, "X-Webhook-Secret: abc\r\n"));
+  // Static payload prefix, closed per press
+  CHECK(contains(std::string(webhook.body, webhook.bodyLength), "\"button_name\":\"Door\""));
+  CHECK(webhook.body[webhook.bodyLength - 1] != '}');
+
+  const CompiledButton& chain = compiledButtons[2];
+  CHECK_EQ(chain.count, 3);
+  CHECK(chain.stopOnError);
+  CHECK(chain.actions[0]->valid);
+  CHECK_EQ((int)chain.actions[1]->type, (int)ACTION_MQTT);
+  CHECK(chain.actions[1]->valid);
+  CHECK_EQ(chain.actions[1]->port, 1883);
+  CHECK_EQ(chain.actions[1]->qos, 1);  // QoS 2 is capped at 1
+  CHECK_EQ(std::string(chain.actions[1]->requestHead), "home/scene");
+  CHECK_EQ(chain.actions[1]->stage, 1);
+  CHECK_EQ((int)chain.actions[2]->type, (int)ACTION_UDP);
+  CHECK(chain.actions[2]->valid);
+  CHECK_EQ(chain.actions[2]->port, 9000);
+
+  // Scheme and type have to agree, and UDP needs a port
+  CHECK(upload(R"({"buttons": [{"id": 3, "action": 3, "config": {"url": "http://hooks.test/x", "topic": "t"}},
+                               {"id": 4, "action": 4, "config": {"url": "udp://10.0.0.5"}}]})"));
+  CHECK(!compiledButtons[3].actions[0]->valid);
+  CHECK(!compiledButtons[4].actions[0]->valid);
+}
+
+static std::string udpButton(int id, int targets) {
+  std::string actions;
+  for (int i = 0; i < targets; i++) {
+    actions += std::string(i ? "," : "") + R"({"type": "udp", "url": "udp://10.0.0.5:9000", "payload": "go"})";
+  }
+  return R"({"id": )" + std::to_string(id) + R"(, "action": 4, "enabled": true, "config": {"actions": [)" + actions + "]}}";
+}
+
+static void testCompilePool() {
+  boot();
+  std::string buttons;
+  for (int id = 0; id < 8; id++) buttons += std::string(id ? "," : "") + udpButton(id, id < 6 ? MAX_CHAIN_ACTIONS : 0);
+  CHECK(upload(R"({"buttons": [)" + buttons + "]}"));
+  CHECK_EQ(compiledButtons[5].count, MAX_CHAIN_ACTIONS);
+
+  // One more target than the pool holds: the whole upload is refused, nothing is half-compiled
+  std::string json = R"({"device": {"name": "Overflow"}, "buttons": [)" + udpButton(6, 1) + "]}";
+  char message[STATUS_MESSAGE_MAX];
+  CHECK(!handleConfigUpload(&json[0], message, sizeof(message)));
+  CHECK(contains(message, "Too many action targets"));
+  CHECK(std::string(deviceConfig.deviceName) != "Overflow");
+  CHECK_EQ(compiledButtons[6].count, 0);
+  CHECK_EQ(compiledButtons[5].count, MAX_CHAIN_ACTIONS);
+
+  // A single-button PATCH and a gesture are counted the same way
+  std::string patch = R"({"action": 4, "config": {"url": "udp://10.0.0.5:9000"}})";
+  CHECK(!handleButtonPatch(7, patch.c_str(), message, sizeof(message)));
+  CHECK(!upload(R"({"gestures": [{"id": 0, "type": "long", "buttons": [0], "action": 4,
+                                  "config": {"url": "udp://10.0.0.5:9000"}}]})"));
+
+  // So is a set_config over UDP, the path a fleet sync takes
+  native::datagrams().clear();
+  std::string request = R"({"type": "set_config", "buttons": [)" + udpButton(6, 1) + "]}";
+  configUdp.receive(request, IPAddress(10, 0, 0, 9));
+  handleConfigPacket(request.size());
+  CHECK_EQ(native::datagrams().size(), (size_t)1);
+  if (!native::datagrams().empty()) {
+    DynamicJsonDocument reply(512);
+    CHECK(!deserializeJson(reply, native::datagrams()[0].payload));
+    CHECK(!(reply["success"] | true));
+    CHECK(contains(reply["message"] | "", "Too many action targets"));
+  }
+  CHECK(!contains(buttonConfigs[6].actionData, "udp:"));
+  CHECK_EQ(compiledButtons[6].count, 0);
+
+  // Freeing targets in the same upload makes room
+  CHECK(upload(R"({"buttons": [)" + udpButton(0, 1) + "," + udpButton(6, 2) + "]}"));
+  CHECK_EQ(compiledButtons[0].count, 1);
+  CHECK_EQ(compiledButtons[6].count, 2);
+  CHECK(handleButtonPatch(7, patch.c_str(), message, sizeof(message)));
+  CHECK_EQ(compiledButtons[7].count, 1);
+}
+
+// Button state machine
+
+static void testDebounce() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  queuedSlots();
+
+  // Contact bounce shorter than the hold time never fires
+  for (int i = 0; i < 10; i++) {
+    edge(0, LOW);
+    run(2);
+    edge(0, HIGH);
+    run(2);
+  }
+  CHECK(queuedSlots().empty());
+
+  // A bouncy press that then settles fires exactly once, on the hold threshold
+  edge(0, LOW);
+  edge(0, HIGH);
+  edge(0, LOW);
+  run(BUTTON_HOLD_TIME - 1);
+  CHECK(queuedSlots().empty());
+  run(1);
+  CHECK(queuedSlots() == std::vector<int>{0});
+  run(500);
+  edge(0, HIGH);
+  edge(0, LOW);  // Release bounce
+  edge(0, HIGH);
+  run(20);
+  CHECK(queuedSlots().empty());
+
+  // Lost edges resync from the pin levels
+  native::setPin(buttonPins[1], LOW);
+  buttonEdgeOverflow = true;
+  run(BUTTON_HOLD_TIME + 1);
+  CHECK(queuedSlots() == std::vector<int>{1});
+  native::setPin(buttonPins[1], HIGH);
+  buttonEdgeOverflow = true;
+  run(1);
+  CHECK(!buttonPressed[1]);
+}
+
+static void testEdgeLatency() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  queuedSlots();
+
+  // Off a millisecond boundary: ms timestamps used to put up to 1ms of rounding into this stage
+  int64_t pressUs = 5000700;
+  native::setClockUs(pressUs);
+  edge(0, LOW);
+  uint64_t sumBefore = stageMetrics[METRIC_EDGE].sumUs;
+  uint32_t countBefore = stageMetrics[METRIC_EDGE].count;
+  native::setClockUs(pressUs + BUTTON_HOLD_TIME * 1000 + 250);
+  processButtonEdges();
+  CHECK(queuedSlots() == std::vector<int>{0});
+  CHECK_EQ(stageMetrics[METRIC_EDGE].count, countBefore + 1);
+  CHECK_EQ(stageMetrics[METRIC_EDGE].sumUs - sumBefore, (uint64_t)250);
+}
+
+static void testLongPress() {
+  boot();
+  CHECK(upload(R"({"device": {"longPressMs": 600}, "buttons": [{"id": 0, "action": 4, "enabled": true,
+                    "config": {"url": "udp://10.0.0.5:9000", "payload": "short"}}],
+                   "gestures": [{"id": 0, "type": "long", "buttons": [0], "action": 4, "enabled": true,
+                                 "config": {"url": "udp://10.0.0.5:9000", "payload": "long"}}]})"));
+  queuedSlots();
+
+  // Released before the long-press time: the plain press, on release
+  edge(0, LOW);
+  run(300);
+  CHECK(queuedSlots().empty());
+  edge(0, HIGH);
+  processButtonEdges();
+  CHECK(queuedSlots() == std::vector<int>{0});
+  run(100);
+
+  // Held: the long press fires while still down, and the release adds nothing
+  edge(0, LOW);
+  run(599);
+  CHECK(queuedSlots().empty());
+  run(1);
+  CHECK(queuedSlots() == std::vector<int>{8});
+  run(200);
+  edge(0, HIGH);
+  run(50);
+  CHECK(queuedSlots().empty());
+}
+
+static void testDoubleTap() {
+  boot();
+  CHECK(upload(R"({"device": {"doubleTapMs": 300}, "buttons": [{"id": 2, "action": 4, "enabled": true,
+                    "config": {"url": "udp://10.0.0.5:9000", "payload": "single"}}],
+                   "gestures": [{"id": 1, "type": "double", "buttons": [2], "action": 4, "enabled": true,
+                                 "config": {"url": "udp://10.0.0.5:9000", "payload": "double"}}]})"));
+  queuedSlots();
+
+  // Two taps inside the window: only the double
+  press(2, 150);
+  run(100);
+  press(2, 150);
+  CHECK(queuedSlots() == std::vector<int>{9});
+  run(400);
+  CHECK(queuedSlots().empty());
+
+  // One tap: the single press once the window, counted from the hold threshold, has run out
+  press(2, 150);
+  run(BUTTON_HOLD_TIME + 300 - 150 - 1);
+  CHECK(queuedSlots().empty());
+  run(1);
+  CHECK(queuedSlots() == std::vector<int>{2});
+}
+
+static void testChord() {
+  boot();
+  CHECK(upload(R"({"device": {"chordWindowMs": 80},
+                   "buttons": [{"id": 4, "action": 4, "enabled": true, "config": {"url": "udp://10.0.0.5:9000", "payload": "4"}},
+                               {"id": 5, "action": 4, "enabled": true, "config": {"url": "udp://10.0.0.5:9000", "payload": "5"}}],
+                   "gestures": [{"id": 3, "type": "chord", "buttons": [4, 5], "action": 4, "enabled": true,
+                                 "config": {"url": "udp://10.0.0.5:9000", "payload": "chord"}}]})"));
+  queuedSlots();
+
+  // Both down within the window: the chord alone, as soon as the second one is held
+  edge(4, LOW);
+  run(30);
+  edge(5, LOW);
+  run(BUTTON_HOLD_TIME + 10);
+  CHECK(queuedSlots() == std::vector<int>{11});
+  edge(4, HIGH);
+  edge(5, HIGH);
+  run(300);
+  CHECK(queuedSlots().empty());
+
+  // One button alone: its own press once the window closes
+  edge(4, LOW);
+  run(BUTTON_HOLD_TIME + 79);
+  CHECK(queuedSlots().empty());
+  run(1);
+  CHECK(queuedSlots() == std::vector<int>{4});
+  edge(4, HIGH);
+  run(50);
+  CHECK(queuedSlots().empty());
+}
+
+// Dispatch
+
+static void testHttpDispatch() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  native::Endpoint& endpoint = native::serveHttp("hooks.test", 8080, [](const std::string&) {
+    return std::string("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+  });
+  wifiConnected = true;
+
+  int8_t remoteState;
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+  CHECK_EQ(endpoint.requests.size(), (size_t)1);
+  CHECK(endpoint.requests[0].rfind("GET /press?room=1 HTTP/1.1\r\n", 0) == 0);
+  CHECK(contains(endpoint.requests[0], "Authorization: Bearer s3cret\r\n"));
+  CHECK(contains(endpoint.requests[0], "Content-Length: 0\r\n\r\n"));
+
+  // The second press rides the pooled keep-alive socket
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+  CHECK_EQ(endpoint.requests.size(), (size_t)2);
+  CHECK_EQ(endpoint.connects, 1);
+
+  // UDP goes straight out with the placeholders filled in
+  CHECK(upload(R"({"buttons": [{"id": 1, "action": 4, "enabled": true,
+                    "config": {"url": "udp://10.0.0.5:9000", "payload": "button={{button}}"}}]})"));
+  CHECK(executeButtonActions(1, compiledButtons[1], remoteState));
+  CHECK_EQ(native::datagrams().size(), (size_t)1);
+  CHECK_EQ(native::datagrams()[0].host, "10.0.0.5");
+  CHECK_EQ(native::datagrams()[0].port, 9000);
+  CHECK_EQ(native::datagrams()[0].payload, "button=1");
+}
+
+static void testHttpErrors() {
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  int status = 503;
+  native::serveHttp("hooks.test", 8080, [&status](const std::string&) {
+    return "HTTP/1.1 " + std::to_string(status) + " X\r\nContent-Length: 0\r\n\r\n";
+  });
+  wifiConnected = true;
+
+  int8_t remoteState;
+  CHECK(!executeButtonActions(0, compiledButtons[0], remoteState));
+  status = 200;
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+
+  // Interim responses are skipped, and a 204 keeps the socket even without a length
+  native::resetNetwork();
+  native::Endpoint& interim = native::serveHttp("hooks.test", 8080, [](const std::string&) {
+    return std::string("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a>\r\n\r\n"
+                       "HTTP/1.1 204 No Content\r\n\r\n");
+  });
+  closePooledConnection(&httpPool[0]);
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+  CHECK_EQ(interim.requests.size(), (size_t)2);
+  CHECK_EQ(interim.connects, 1);
+
+  // Nobody listening
+  native::resetNetwork();
+  closePooledConnection(&httpPool[0]);
+  CHECK(!executeButtonActions(0, compiledButtons[0], remoteState));
+}
+
+static void testBatchFeedback() {
+  boot();
+  CHECK(upload(R"({"buttons": [{"id": 0, "action": 2, "enabled": true,
+                    "config": {"url": "http://hooks.test/events", "batch": {"max_events": 2, "max_age": 60}}}]})"));
+  native::Endpoint& endpoint = native::serveHttp("hooks.test", 80, [](const std::string&) {
+    return std::string("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+  });
+  wifiConnected = true;
+
+  // A buffered press is neither landed nor failed: it keeps breathing
+  int8_t remoteState;
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+  CHECK(webhookBatchPending(0));
+  native::takeSerialOutput();
+  CHECK(executeButtonActions(0, compiledButtons[0], remoteState));
+  CHECK(contains(native::takeSerialOutput(), "\"success\":false,\"batched\":true"));
+  CHECK(endpoint.requests.empty());
+  CHECK_EQ(ledPatternRequests[0], -1);
+
+  // The flush reports once for the whole batch
+  processWebhookBatches();
+  CHECK_EQ(endpoint.requests.size(), (size_t)1);
+  CHECK(!webhookBatchPending(0));
+  CHECK_EQ(ledPatternRequests[0], (int8_t)LED_PATTERN_SUCCESS);
+}
+
+static void testMqttSessions() {
+  boot();
+  native::Endpoint& broker = native::serveHttp("broker.test", 1883, [](const std::string& packet) {
+    return packet[0] == 0x10 ? std::string("\x20\x02\x00\x00", 4) : std::string();
+  });
+  broker.raw = true;
+  wifiConnected = true;
+
+  // One broker, two accounts: each session needs its own client id or the broker drops the other
+  CHECK(upload(R"({"buttons": [
+    {"id": 0, "action": 3, "enabled": true, "config": {"url": "mqtt://broker.test", "topic": "a", "username": "alice"}},
+    {"id": 1, "action": 3, "enabled": true, "config": {"url": "mqtt://broker.test", "topic": "b", "username": "bob"}}]})"));
+  warmMqttSessions();
+  CHECK_EQ(broker.connects, 2);
+  CHECK_EQ(broker.requests.size(), (size_t)2);
+  std::string id = deviceConfig.deviceId;
+  CHECK(contains(broker.requests[0], id + "-0") != contains(broker.requests[1], id + "-0"));
+  CHECK(contains(broker.requests[0], id + "-1") != contains(broker.requests[1], id + "-1"));
+
+  // Removing a target closes its session instead of leaving it to be reconnected forever
+  CHECK(upload(R"({"buttons": [{"id": 1, "action": 0}]})"));
+  warmMqttSessions();
+  int assigned = 0;
+  for (int i = 0; i < MQTT_MAX_SESSIONS; i++) {
+    if (mqttSessions[i].assigned) {
+      assigned++;
+      CHECK_EQ(std::string(mqttSessions[i].username), "alice");
+    }
+  }
+  CHECK_EQ(assigned, 1);
+  maintainMqttSessions();
+  CHECK_EQ(broker.connects, 2);
+
+  // A changed password is a different session: the stale one closes and the new credentials connect
+  CHECK(upload(R"({"buttons": [{"id": 0, "action": 3, "enabled": true,
+                    "config": {"url": "mqtt://broker.test", "topic": "a", "username": "alice", "password": "rotated"}}]})"));
+  warmMqttSessions();
+  CHECK_EQ(broker.connects, 3);
+  CHECK(contains(broker.requests.back(), "rotated"));
+  assigned = 0;
+  for (int i = 0; i < MQTT_MAX_SESSIONS; i++) {
+    if (mqttSessions[i].assigned) {
+      assigned++;
+      CHECK_EQ(std::string(mqttSessions[i].password), "rotated");
+    }
+  }
+  CHECK_EQ(assigned, 1);
+}
+
+// Power
+
+static BatteryLevel batteryAt(uint8_t percent) {
+  batteryVoltage = 3.7f;
+  batteryPercent = percent;
+  updateBatteryPolicy();
+  return batteryLevel;
+}
+
+static void testBatteryHysteresis() {
+  boot();
+  CHECK_EQ(batteryAt(50), BATTERY_OK);
+  CHECK_EQ(batteryAt(20), BATTERY_LOW);
+  CHECK_EQ(batteryAt(24), BATTERY_LOW);
+  CHECK_EQ(batteryAt(5), BATTERY_CRITICAL);
+  CHECK_EQ(batteryAt(10), BATTERY_CRITICAL);
+  CHECK_EQ(batteryAt(11), BATTERY_LOW);
+
+  // A jump straight out of critical (charger plugged in, fresh reading) still steps through the bands
+  CHECK_EQ(batteryAt(5), BATTERY_CRITICAL);
+  CHECK_EQ(batteryAt(23), BATTERY_LOW);
+  CHECK_EQ(ledPowerScale, 50);
+  CHECK_EQ(batteryAt(26), BATTERY_OK);
+  CHECK_EQ(batteryAt(5), BATTERY_CRITICAL);
+  CHECK_EQ(batteryAt(90), BATTERY_OK);
+}
+
+// Sleep
+
+static void testSleepPins() {
+  // Wake masks and RTC calls take GPIO numbers, which the Arduino pin numbers of buttonPins are not
+  uint64_t gpios = 0;
+  for (int i = 0; i < 8; i++) gpios |= 1ULL << digitalPinToGPIONumber(buttonPins[i]);
+  CHECK(gpios != 0x3FCULL);  // Pins 2-9 as GPIOs would be this
+
+  native::setDeepSleepWake(1ULL << digitalPinToGPIONumber(buttonPins[3]));
+  boot();
+  CHECK_EQ(wakeButtonMask, 1 << 3);
+
+  enterSleep(true);
+  CHECK_EQ(native::ext1WakeGpios(), gpios);
+  CHECK_EQ(native::rtcPullupGpios(), gpios);
+  enterSleep(false);
+  CHECK_EQ(native::lightSleepWakeGpios(), gpios);
+  CHECK(!native::wakeArmedUnmasked());
+  CHECK_EQ(native::maskedInterruptGpios(), 0ULL);
+
+  // Let go while the interrupts were masked: the wake resyncs from the pin instead of leaving it held
+  applyButtonEdge(2, LOW, esp_timer_get_time());
+  native::setPin(buttonPins[2], HIGH);
+  enterSleep(false);
+  CHECK(!buttonPressed[2]);
+  CHECK_EQ(buttonStates[2], HIGH);
+}
+
+static void testLightSleepKeepsWiFi() {
+  boot();
+  WiFi.mode(WIFI_STA);
+  wifiConnected = true;
+  native::takeSerialOutput();
+
+  // Still associated after a light sleep: no reconnect, the network is there for the wake press
+  enterSleep(false);
+  CHECK_EQ(WiFi.getMode(), WIFI_STA);
+  CHECK(wifiConnected);
+  CHECK(!contains(native::takeSerialOutput(), "Connecting to WiFi"));
+
+  // Dropped by the AP while asleep: the station reconnects
+  wifiConnected = false;
+  enterSleep(false);
+  CHECK(contains(native::takeSerialOutput(), "Connecting to WiFi"));
+}
+
+// Firmware updates
+
+// POST /api/ota with `image` as the body, in one chunk; returns the status code of the reply
+static int postFirmware(const std::string& image, const char* token) {
+  uint8_t digest[OTA_SHA256_SIZE];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, (const uint8_t*)image.data(), image.size());
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  char hex[OTA_SHA256_SIZE * 2 + 1];
+  for (size_t i = 0; i < OTA_SHA256_SIZE; i++) snprintf(hex + i * 2, 3, "%02x", digest[i]);
+
+  AsyncWebServerRequest request;
+  request.requestMethod = HTTP_POST;
+  request.length = image.size();
+  request.addHeader("X-Firmware-SHA256", hex);
+  if (token) request.addHeader("X-OTA-Token", token);
+  std::string body = image;
+  handleOtaBody(&request, (uint8_t*)&body[0], body.size(), 0, body.size());
+  handleOtaRequest(&request);
+  return request.response ? request.response->code : 0;
+}
+
+static void testOtaToken() {
+  boot();
+  std::string image(4096, '\xE9');
+
+  // No OTA_TOKEN key: nobody gets to flash, token or not
+  CHECK_EQ(postFirmware(image, NULL), 403);
+  CHECK_EQ(postFirmware(image, "anything"), 403);
+  CHECK_EQ(postFirmware(image, ""), 403);
+
+  CHECK(upload(R"({"apiKeys": {"OTA_TOKEN": "fl4sh-me"}})"));
+  CHECK_EQ(postFirmware(image, NULL), 403);
+  CHECK_EQ(postFirmware(image, "fl4sh-m"), 403);
+  CHECK_EQ(postFirmware(image, "fl4sh-me!"), 403);
+  CHECK_EQ(postFirmware(image, "Fl4sh-me"), 403);
+  CHECK_EQ(postFirmware(image, "fl4sh-me"), 200);
+  CHECK(otaSession.done);
+  CHECK_EQ(std::string(otaSession.partition->label), "app1");
+}
+
+// An image with an esp_app_desc_t where the real ones have it, after the image and segment headers
+static std::string firmwareImage(const char* version, uint8_t elfShaByte) {
+  std::string image(4096, '\0');
+  esp_app_desc_t description = {};
+  description.magic_word = 0xABCD5432;
+  strlcpy(description.version, version, sizeof(description.version));
+  memset(description.app_elf_sha256, elfShaByte, sizeof(description.app_elf_sha256));
+  memcpy(&image[32], &description, sizeof(description));
+  return image;
+}
+
+static std::string otaStatus() {
+  AsyncWebServerRequest request;
+  handleOtaStatusRequest(&request);
+  return request.response ? request.response->body : "";
+}
+
+static void testOtaRollback() {
+  boot();
+  CHECK(upload(R"({"apiKeys": {"OTA_TOKEN": "fl4sh-me"}})"));
+  CHECK_EQ(postFirmware(firmwareImage("2.0", 0x11), "fl4sh-me"), 200);
+
+  // The new image never gets healthy and the bootloader goes back to app0
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  restartAt = 0;  // Rebooted
+  checkOtaBoot();
+  CHECK(otaRolledBack);
+  std::string status = otaStatus();
+  CHECK(contains(status, "\"rolled_back\":true"));
+  CHECK(contains(status, "\"rejected\":{\"partition\":\"app1\",\"version\":\"2.0\",\"elf_sha256\":\"1111"));
+
+  // The next upload replaces the rejected image: no longer a rollback, before or after it boots
+  CHECK_EQ(postFirmware(firmwareImage("2.1", 0x22), "fl4sh-me"), 200);
+  CHECK(!otaRolledBack);
+  checkOtaBoot();
+  CHECK(!otaRolledBack);
+  CHECK(contains(otaStatus(), "\"rolled_back\":false"));
+
+  // An invalid mark on an image this device has no record of is not reported as this upload's rollback
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  native::nvs()["patcom"].erase(OTA_IMAGE_KEY);
+  checkOtaBoot();
+  CHECK(!otaRolledBack);
+}
+
+// Benchmarks
+
+static void testBenchLock() {
+  native::useRealClock(true);
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  static uint8_t before[CONFIG_BLOB_MAX_SIZE];
+  static uint8_t after[CONFIG_BLOB_MAX_SIZE];
+  size_t length = encodeConfigBlob(before, sizeof(before), configSequence);
+
+  // Each run takes the lock on its own, so no single hold comes near the length of the benchmark
+  semaphoreLongestHoldUs(configMutex);
+  int64_t start = esp_timer_get_time();
+  runBenchmarks(200);
+  int64_t elapsed = esp_timer_get_time() - start;
+  CHECK(semaphoreLongestHoldUs(configMutex) * 10 < elapsed);
+  CHECK_EQ(semaphoreDepth(configMutex), 0);
+
+  // And the live config comes out as it went in
+  CHECK_EQ(encodeConfigBlob(after, sizeof(after), configSequence), length);
+  CHECK(memcmp(before, after, length) == 0);
+  CHECK_EQ(std::string(getApiKey("TOKEN")), "s3cret");
+  CHECK_EQ(compiledButtons[0].count, 1);
+}
+
+// Runner
+
+static const std::map<std::string, void (*)()> tests = {
+  {"config_upload", testConfigUpload},
+  {"save_failure", testSaveFailure},
+  {"config_udp", testConfigUdp},
+  {"blob_round_trip", testBlobRoundTrip},
+  {"blob_slots", testBlobSlots},
+  {"compile_http", testCompileHttp},
+  {"compile_webhook_chain", testCompileWebhookAndChain},
+  {"compile_pool", testCompilePool},
+  {"debounce", testDebounce},
+  {"edge_latency", testEdgeLatency},
+  {"long_press", testLongPress},
+  {"double_tap", testDoubleTap},
+  {"chord", testChord},
+  {"http_dispatch", testHttpDispatch},
+  {"http_errors", testHttpErrors},
+  {"batch_feedback", testBatchFeedback},
+  {"mqtt_sessions", testMqttSessions},
+  {"battery_hysteresis", testBatteryHysteresis},
+  {"sleep_pins", testSleepPins},
+  {"light_sleep_wifi", testLightSleepKeepsWiFi},
+  {"ota_token", testOtaToken},
+  {"ota_rollback", testOtaRollback},
+  {"bench_lock", testBenchLock},
+};
+
+static int bench(int runs) {
+  native::useRealClock(true);
+  boot();
+  CHECK(upload(HTTP_BUTTON_CONFIG));
+  CHECK(upload(R"({"buttons": [
+    {"id": 1, "action": 2, "enabled": true, "config": {"url": "http://hooks.test/door", "secret": "abc"}},
+    {"id": 2, "action": 3, "enabled": true, "config": {"url": "mqtt://broker.test", "topic": "home/b2", "payload": "{{button}}"}},
+    {"id": 3, "action": 4, "enabled": true, "config": {"url": "udp://10.0.0.5:9000", "payload": "{{name}}"}}]})"));
+  native::takeSerialOutput();
+  runBenchmarks(runs);
+  std::string output = native::takeSerialOutput();
+  if (!native::verbose()) fputs(output.c_str(), stdout);
+  CHECK(contains(output, "EVENT:{\"type\":\"bench\""));
+  return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+  native::reset();
+  if (argc == 3 && strcmp(argv[1], "--bench") == 0) {
+    return bench(atoi(argv[2]));
+  }
+
+  int ran = 0;
+  for (const auto& test : tests) {
+    if (argc > 1 && test.first != argv[1]) continue;
+    int before = failures;
+    native::reset();
+    test.second();
+    printf("%s %s\n", failures == before ? "PASS" : "FAIL", test.first.c_str());
+    ran++;
+  }
+  if (ran == 0) {
+    fprintf(stderr, "unknown test: %s\n", argc > 1 ? argv[1] : "");
+    return 2;
+  }
+  return failures == 0 ? 0 : 1;
+}